@@ -0,0 +1,713 @@
+/*!
+    @file       ControlInterface.hpp
+
+    @brief      Interface between the SimpleSvm driver and user mode.
+
+    @details    This file defines IOCTLs of the control device and the layout of
+                the statistics region the driver maps into the calling process,
+                together with the functions to read it consistently.
+
+                This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+//
+// Names of the control device.
+//
+#define SV_CONTROL_DEVICE_NAME          L"\\Device\\SimpleSvm"
+#define SV_CONTROL_DOS_DEVICE_NAME      L"\\DosDevices\\SimpleSvm"
+#define SV_CONTROL_USER_DEVICE_NAME     L"\\\\.\\SimpleSvm"
+
+//
+// CTL_CODE(FILE_DEVICE_UNKNOWN, Function, METHOD_BUFFERED, Access), spelled out
+// so that this file does not depend on winioctl.h or wdm.h.
+//
+#define SV_CTL_CODE(Function, Access) \
+    ((0x22UL << 16) | ((Access) << 14) | ((Function) << 2))
+#define SV_FILE_READ_ACCESS             0x1UL
+#define SV_FILE_WRITE_ACCESS            0x2UL
+
+//
+// Maps the statistics region into the calling process as read-only, and returns
+// SV_MAP_STATISTICS_OUTPUT. The mapping is valid until the handle is closed.
+// Mapping it again with the same handle returns the existing mapping.
+//
+#define IOCTL_SV_MAP_STATISTICS         SV_CTL_CODE(0x800, SV_FILE_READ_ACCESS)
+
+//
+// Traps accesses to the MMIO range specified with SV_REGISTER_MMIO_RANGE_INPUT,
+// and passes them through to the device while counting them. The range is no
+// longer trapped once the system goes through sleep and resume.
+//
+#define IOCTL_SV_REGISTER_MMIO_RANGE    SV_CTL_CODE(0x801, SV_FILE_WRITE_ACCESS)
+
+//
+// Runs micro benchmarks of the hypervisor components on the calling thread, and
+// returns SV_BENCHMARK_OUTPUT. Only available when the driver is built with
+// SV_ENABLE_BENCHMARKS; otherwise, fails with STATUS_INVALID_DEVICE_REQUEST.
+//
+#define IOCTL_SV_RUN_BENCHMARKS         SV_CTL_CODE(0x802, SV_FILE_READ_ACCESS)
+
+//
+// Replaces what is intercepted with SV_SET_INTERCEPT_POLICY_INPUT without
+// de-virtualizing processors, and returns SV_SET_INTERCEPT_POLICY_OUTPUT once
+// all processors use it. The policy is reset to the built-in one when the
+// system goes through sleep and resume.
+//
+#define IOCTL_SV_SET_INTERCEPT_POLICY   SV_CTL_CODE(0x803, SV_FILE_WRITE_ACCESS)
+
+//
+// Creates an NPT view, and returns SV_CREATE_NPT_VIEW_OUTPUT. A new view maps
+// all memory as the identity view (view 0) does, until pages are protected in
+// it with IOCTL_SV_PROTECT_NPT_VIEW, which returns once all processors use the
+// new protection. Views are destroyed when the system goes through sleep and
+// resume.
+//
+#define IOCTL_SV_CREATE_NPT_VIEW        SV_CTL_CODE(0x804, SV_FILE_WRITE_ACCESS)
+#define IOCTL_SV_PROTECT_NPT_VIEW       SV_CTL_CODE(0x805, SV_FILE_WRITE_ACCESS)
+
+//
+// Each processor runs the guest in one NPT view at a time, and starts in view
+// 0. Kernel mode code switches the view of the processor it runs on with the
+// hypercall, which is CPUID, or VMMCALL with SV_EXIT_FREE_CPUID, with:
+//   EAX = SV_SWITCH_NPT_VIEW_FUNCTION
+//   ECX = The index of the view to switch to
+// and returns EAX = SV_SWITCH_NPT_VIEW_SUCCESS, or SV_SWITCH_NPT_VIEW_INVALID
+// if the view does not exist. An access denied by the view switches the
+// processor back to view 0 and is retried there.
+//
+// Each view is tagged with its own ASID, so switching back to a view the
+// processor recently ran in does not flush the TLB, unless the guest has
+// invalidated translations (eg, with INVLPG or MOV CR3) or the view has been
+// modified since then.
+//
+#define SV_MAX_NPT_VIEWS                4
+#define SV_SWITCH_NPT_VIEW_FUNCTION     0x41414143
+#define SV_SWITCH_NPT_VIEW_SUCCESS      0
+#define SV_SWITCH_NPT_VIEW_INVALID      1
+
+typedef struct _SV_MAP_STATISTICS_OUTPUT
+{
+    UINT64 BaseAddress;
+    UINT64 Size;
+} SV_MAP_STATISTICS_OUTPUT, *PSV_MAP_STATISTICS_OUTPUT;
+
+typedef struct _SV_REGISTER_MMIO_RANGE_INPUT
+{
+    UINT64 GuestPa;
+    UINT64 Size;
+} SV_REGISTER_MMIO_RANGE_INPUT, *PSV_REGISTER_MMIO_RANGE_INPUT;
+
+//
+// The intercept words are those of the VMCB. They must include the intercepts
+// the driver requires, and may only include ones of the policy the driver is
+// built with. Only fault-type exceptions other than #DB, #DF and #MC may be
+// intercepted; they are counted and re-injected. Intercepted MSRs must be in
+// the ranges the MSRPM covers, and be implemented by the processor. Any
+// violation fails the request with STATUS_INVALID_PARAMETER.
+//
+#define SV_MAX_POLICY_MSRS              32
+
+typedef struct _SV_SET_INTERCEPT_POLICY_INPUT
+{
+    UINT32 InterceptMisc1;
+    UINT32 InterceptMisc2;
+    UINT32 InterceptException;      // Bitmap of exception vectors
+    UINT32 NumberOfReadInterceptedMsrs;
+    UINT32 NumberOfWriteInterceptedMsrs;
+    UINT32 ReadInterceptedMsrs[SV_MAX_POLICY_MSRS];
+    UINT32 WriteInterceptedMsrs[SV_MAX_POLICY_MSRS];
+} SV_SET_INTERCEPT_POLICY_INPUT, *PSV_SET_INTERCEPT_POLICY_INPUT;
+
+typedef struct _SV_SET_INTERCEPT_POLICY_OUTPUT
+{
+    UINT64 Generation;              // The generation of the policy set
+    UINT64 ConvergenceCycles;       // TSC cycles until all processors used it
+    UINT32 Forced;                  // Non-zero if #VMEXIT had to be forced
+    UINT32 Reserved1;
+} SV_SET_INTERCEPT_POLICY_OUTPUT, *PSV_SET_INTERCEPT_POLICY_OUTPUT;
+
+typedef struct _SV_CREATE_NPT_VIEW_OUTPUT
+{
+    UINT32 ViewIndex;
+    UINT32 Reserved1;
+} SV_CREATE_NPT_VIEW_OUTPUT, *PSV_CREATE_NPT_VIEW_OUTPUT;
+
+//
+// Access denied to the range by the view, or zero to allow any access again.
+// The range must be page aligned, and in a view other than view 0. Pages of
+// registered MMIO ranges are left as they are. Each view can protect up to
+// 32MB of 2MB regions, as 4KB page tables split from them are limited.
+//
+#define SV_NPT_VIEW_DENY_WRITE          0x1UL
+#define SV_NPT_VIEW_DENY_EXECUTE        0x2UL
+#define SV_NPT_VIEW_DENY_ALL            0x4UL
+
+typedef struct _SV_PROTECT_NPT_VIEW_INPUT
+{
+    UINT32 ViewIndex;
+    UINT32 DeniedAccess;            // SV_NPT_VIEW_DENY_*
+    UINT64 GuestPa;
+    UINT64 Size;
+} SV_PROTECT_NPT_VIEW_INPUT, *PSV_PROTECT_NPT_VIEW_INPUT;
+
+//
+// Results of IOCTL_SV_RUN_BENCHMARKS. Each result is identified by its name,
+// which stays stable across versions so results can be compared with ones
+// saved from an earlier build. Cycles are TSC cycles per iteration.
+//
+#define SV_BENCHMARK_VERSION            1
+#define SV_BENCHMARK_NAME_LENGTH        32
+#define SV_MAX_BENCHMARK_RESULTS        16
+
+typedef struct _SV_BENCHMARK_RESULT
+{
+    char Name[SV_BENCHMARK_NAME_LENGTH];    // NUL-terminated
+    UINT64 Iterations;
+    UINT64 TotalCycles;
+    UINT64 MinCycles;
+    UINT64 MaxCycles;
+} SV_BENCHMARK_RESULT, *PSV_BENCHMARK_RESULT;
+
+typedef struct _SV_BENCHMARK_OUTPUT
+{
+    UINT32 Version;                 // SV_BENCHMARK_VERSION
+    UINT32 NumberOfResults;
+    SV_BENCHMARK_RESULT Results[SV_MAX_BENCHMARK_RESULTS];
+} SV_BENCHMARK_OUTPUT, *PSV_BENCHMARK_OUTPUT;
+
+//
+// The statistics region consists of SV_STATISTICS_HEADER in the first page,
+// SV_VP_STATISTICS in each following page, one page per processor index, and
+// then SV_CR3_STATISTICS in each following page, again one page per processor
+// index.
+//
+#define SV_STATISTICS_MAGIC             0x54535653  // 'SVST'
+#define SV_STATISTICS_VERSION           12
+#define SV_STATISTICS_PAGE_SIZE         0x1000
+
+//
+// #VMEXIT codes are counted in buckets. Codes from 0 to 0xaf map to the bucket
+// with the same number, codes from 0x400 to 0x403 (#NPF and later) map to the
+// buckets following them, and everything else (eg, VMEXIT_INVALID) to the last
+// bucket.
+//
+#define SV_STATISTICS_DIRECT_EXIT_CODES 0xb0
+#define SV_STATISTICS_HIGH_EXIT_CODE    0x400
+#define SV_STATISTICS_HIGH_EXIT_CODES   4
+#define SV_STATISTICS_OTHER_BUCKET      (SV_STATISTICS_DIRECT_EXIT_CODES + SV_STATISTICS_HIGH_EXIT_CODES)
+#define SV_STATISTICS_EXIT_BUCKETS      (SV_STATISTICS_OTHER_BUCKET + 1)
+
+//
+// Interrupt latency is counted in buckets of powers of two. Bucket n counts
+// delays of [2^n, 2^(n+1)) TSC cycles, except that the first bucket also counts
+// zero, and the last one everything larger.
+//
+#define SV_INTERRUPT_LATENCY_BUCKETS    32
+
+//
+// Idle residency is counted in the same way as interrupt latency. The idle
+// period ends with the first #VMEXIT after the guest went idle, and is counted
+// by what caused it: a physical interrupt, another HLT or MWAIT (ie, the guest
+// woke without #VMEXIT, for example, by a write to the monitored address or by
+// NMI), or anything else.
+//
+#define SV_IDLE_RESIDENCY_BUCKETS       32
+#define SV_IDLE_WAKE_INTERRUPT          0
+#define SV_IDLE_WAKE_IDLE               1
+#define SV_IDLE_WAKE_OTHER              2
+#define SV_IDLE_WAKE_REASONS            3
+
+//
+// #VMEXITs of optional intercepts are counted per class when exit budgets are
+// enforced. When a class exceeds its budget in a window, its intercepts are
+// removed from the processor for a back-off period. Mandatory intercepts, such
+// as VMRUN, write to EFER and the hypercall, are never removed.
+//
+#define SV_EXIT_BUDGET_IOIO             0   // Ports of the IOPM
+#define SV_EXIT_BUDGET_MSR              1   // MSRs added by the policy set at run time
+#define SV_EXIT_BUDGET_EXCEPTION        2   // Exceptions of the policy set at run time
+#define SV_EXIT_BUDGET_CLASSES          3
+
+//
+// Run time per guest address space is accounted in an open-addressed table of
+// SV_CR3_STATISTICS_ENTRIES entries per processor, keyed by the page frame of
+// CR3. See SvLookupCr3Statistics.
+//
+#define SV_CR3_STATISTICS_ENTRIES       128
+#define SV_CR3_ADDRESS_MASK             0x000ffffffffff000ULL
+
+//
+// Each structure is protected by its Sequence field with the seqlock protocol.
+// The single writer makes Sequence odd before updating the structure and even
+// after that. Readers retry when Sequence is odd or changed while they copy
+// the structure. See SvReadSeqlockProtected.
+//
+typedef struct _SV_STATISTICS_HEADER
+{
+    volatile UINT32 Sequence;
+    UINT32 Magic;                   // SV_STATISTICS_MAGIC
+    UINT32 Version;                 // SV_STATISTICS_VERSION
+    UINT32 NumberOfProcessors;      // Number of SV_VP_STATISTICS pages
+    UINT64 BringUpCycles;           // TSC cycles to virtualize all processors
+    UINT64 SharedFootprint;         // Bytes allocated for shared data
+    UINT64 PerProcessorFootprint;   // Bytes allocated for each processor
+    UINT64 StatisticsFootprint;     // Bytes of the statistics region
+
+    //
+    // The same memory by allocation type. Nested page tables are contiguous
+    // memory, except for 4KB page tables split from them and page directories
+    // copied by NPT views, which are part of the 'MVSS' pool, as are shared
+    // data, per processor data and this region.
+    //
+    UINT64 PoolFootprint;           // Bytes of 'MVSS' pool
+    UINT64 ContiguousFootprint;     // Bytes of contiguous memory (NPT, MSRPM, IOPM)
+    UINT64 NptFootprint;            // Bytes of nested page tables
+    UINT64 HostStackSize;           // Bytes of the host stack of each processor
+
+    //
+    // CR3 accounting is enabled when Cr3SamplingPeriod is not zero. Address
+    // space switches are then accounted in one of every Cr3SamplingPeriod
+    // windows of Cr3SamplingWindowCycles TSC cycles.
+    //
+    UINT32 Cr3SamplingPeriod;
+    UINT32 Reserved1;
+    UINT64 Cr3SamplingWindowCycles;
+
+    //
+    // The intercept policy set with IOCTL_SV_SET_INTERCEPT_POLICY, or zero for
+    // the built-in one, and how long it took for all processors to use it.
+    //
+    UINT64 PolicyGeneration;
+    UINT64 PolicyConvergenceCycles;
+
+    //
+    // The number of NPT views, including view 0. NptFootprint covers all of
+    // them.
+    //
+    UINT32 NumberOfNptViews;
+    UINT32 Reserved2;
+
+    //
+    // Table pages each NPT view translates through. Shared ones are page
+    // directories also used by other views. Private ones are the rest of page
+    // directories, page tables the view split or copied, and the PML4 and PDP
+    // of the view.
+    //
+    UINT32 NptViewSharedPages[SV_MAX_NPT_VIEWS];
+    UINT32 NptViewPrivatePages[SV_MAX_NPT_VIEWS];
+
+    //
+    // Processors virtualized when brought online after all others were, ones
+    // that failed to, and TSC cycles it took for the last of them from the
+    // notification of the new processor. Not reset across virtualization
+    // cycles.
+    //
+    UINT32 HotAddedProcessors;
+    UINT32 HotAddFailures;
+    UINT64 HotAddCycles;
+
+    //
+    // Interrupt latency is measured when InterruptSamplingPeriod is not zero.
+    // Physical interrupts are then intercepted in one of every
+    // InterruptSamplingPeriod windows of InterruptSamplingWindowCycles TSC
+    // cycles.
+    //
+    UINT32 InterruptSamplingPeriod;
+    UINT32 Reserved3;
+    UINT64 InterruptSamplingWindowCycles;
+
+    //
+    // Non zero when HLT and MWAIT are intercepted to account idle residency.
+    //
+    UINT32 IdleAccounting;
+    UINT32 Reserved4;
+
+    //
+    // Exit budgets are enforced when ExitBudgetWindowCycles is not zero. Each
+    // class may cause ExitBudgets #VMEXITs in a window of ExitBudgetWindowCycles
+    // TSC cycles before backing off for ExitBackoffCycles TSC cycles.
+    //
+    UINT32 ExitBudgets[SV_EXIT_BUDGET_CLASSES];
+    UINT32 Reserved5;
+    UINT64 ExitBudgetWindowCycles;
+    UINT64 ExitBackoffCycles;
+
+    //
+    // Bytes of the XSAVE area of each processor, or zero when the processor
+    // does not support XSAVE and host handlers cannot use SIMD registers other
+    // than XMM0-5.
+    //
+    UINT32 ExtendedStateSize;
+    UINT32 XsaveoptSupported;
+} SV_STATISTICS_HEADER, *PSV_STATISTICS_HEADER;
+static_assert(sizeof(SV_STATISTICS_HEADER) <= SV_STATISTICS_PAGE_SIZE,
+              "SV_STATISTICS_HEADER Size Mismatch");
+
+typedef struct _SV_NPT_VIEW_STATISTICS
+{
+    UINT64 Switches;                // Number of switches to the view
+    UINT64 FlushedSwitches;         // Switches that flushed the guest TLB
+    UINT64 Cycles;                  // TSC cycles run in the view, as of the
+                                    // last switch from it
+    UINT64 Faults;                  // Accesses denied by the view
+} SV_NPT_VIEW_STATISTICS, *PSV_NPT_VIEW_STATISTICS;
+
+typedef struct _SV_VP_STATISTICS
+{
+    volatile UINT32 Sequence;
+    UINT32 ProcessorIndex;
+    UINT64 BringUpCycles;           // TSC cycles to virtualize the processor
+    UINT64 ExitCount;               // Total number of #VMEXIT
+    UINT64 HostCycles;              // Total TSC cycles spent in SvHandleVmExit
+    UINT64 ExitCounts[SV_STATISTICS_EXIT_BUCKETS];
+    UINT64 ExitCycles[SV_STATISTICS_EXIT_BUCKETS];
+    UINT64 HostStateLoads;          // #VMEXITs that switched to the host state
+    UINT64 HostStateLoadCycles;     // TSC cycles spent in VMSAVE and VMLOAD for them
+    UINT64 HostStackHighWater;      // Bytes of the host stack ever used, as of
+                                    // the last de-virtualization
+    SV_NPT_VIEW_STATISTICS NptViews[SV_MAX_NPT_VIEWS];
+
+    //
+    // Physical interrupts intercepted in sampled windows, ones that arrived
+    // while the host was handling the previous #VMEXIT, and how long the guest
+    // was delayed by the host before receiving them.
+    //
+    UINT64 Interrupts;
+    UINT64 HeldInterrupts;
+    UINT64 InterruptDelayCycles;
+    UINT64 InterruptLatency[SV_INTERRUPT_LATENCY_BUCKETS];
+
+    //
+    // HLT and MWAIT the guest went idle with, TSC cycles it stayed idle, and
+    // ones the host spent on #VMEXITs caused only by accounting them.
+    //
+    UINT64 Halts;
+    UINT64 Mwaits;
+    UINT64 IdleCycles;
+    UINT64 IdleExitCycles;
+    UINT64 IdleResidency[SV_IDLE_RESIDENCY_BUCKETS];
+    UINT64 IdleWakeReasons[SV_IDLE_WAKE_REASONS];
+
+    //
+    // Times each class of optional intercepts exceeded its budget and backed
+    // off, and the TSC of the last time.
+    //
+    UINT64 ExitBackoffs[SV_EXIT_BUDGET_CLASSES];
+    UINT64 LastExitBackoffTime[SV_EXIT_BUDGET_CLASSES];
+
+    //
+    // #VMEXITs whose handlers saved and restored guest's extended state to use
+    // SIMD registers, and TSC cycles it took. Other #VMEXITs cost nothing for
+    // this.
+    //
+    UINT64 ExtendedStateSaves;
+    UINT64 ExtendedStateCycles;
+} SV_VP_STATISTICS, *PSV_VP_STATISTICS;
+static_assert(sizeof(SV_VP_STATISTICS) <= SV_STATISTICS_PAGE_SIZE,
+              "SV_VP_STATISTICS Size Mismatch");
+
+typedef struct _SV_CR3_STATISTICS_ENTRY
+{
+    UINT64 Cr3;                     // Bits 51:12 of CR3, or zero if unused
+    UINT64 Switches;                // Number of switches to the address space
+    UINT64 Cycles;                  // TSC cycles run in the address space
+} SV_CR3_STATISTICS_ENTRY, *PSV_CR3_STATISTICS_ENTRY;
+
+typedef struct _SV_CR3_STATISTICS
+{
+    volatile UINT32 Sequence;
+    UINT32 ProcessorIndex;
+    UINT64 Switches;                // Total number of accounted switches
+    UINT64 Cycles;                  // Total TSC cycles accounted
+    UINT64 UntrackedCycles;         // TSC cycles not in Entries as it was full
+    UINT64 SampledWindows;          // Number of windows accounted, and
+    UINT64 SkippedWindows;          // not, when Cr3SamplingPeriod is above 1
+    SV_CR3_STATISTICS_ENTRY Entries[SV_CR3_STATISTICS_ENTRIES];
+} SV_CR3_STATISTICS, *PSV_CR3_STATISTICS;
+static_assert(sizeof(SV_CR3_STATISTICS) <= SV_STATISTICS_PAGE_SIZE,
+              "SV_CR3_STATISTICS Size Mismatch");
+static_assert((SV_CR3_STATISTICS_ENTRIES & (SV_CR3_STATISTICS_ENTRIES - 1)) == 0,
+              "SV_CR3_STATISTICS_ENTRIES must be a power of two");
+static_assert(sizeof(SV_STATISTICS_HEADER) % sizeof(UINT64) == 0 &&
+              sizeof(SV_VP_STATISTICS) % sizeof(UINT64) == 0 &&
+              sizeof(SV_CR3_STATISTICS) % sizeof(UINT64) == 0,
+              "Statistics must be copied in UINT64");
+
+//
+// Prevents the compiler and the processor from reordering accesses across it.
+// On x64, a compiler barrier is sufficient as the processor does not reorder
+// loads with other loads, nor stores with other stores.
+//
+#if defined(_MSC_VER)
+#define SV_SEQLOCK_BARRIER()    _ReadWriteBarrier()
+#else
+#define SV_SEQLOCK_BARRIER()    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/*!
+    @brief      Returns the bucket a #VMEXIT code is counted in.
+
+    @param[in]  ExitCode - The #VMEXIT code.
+
+    @result     The bucket number.
+ */
+inline
+UINT32
+SvGetExitCodeBucket (
+    _In_ UINT64 ExitCode
+    )
+{
+    if (ExitCode < SV_STATISTICS_DIRECT_EXIT_CODES)
+    {
+        return static_cast<UINT32>(ExitCode);
+    }
+    if ((ExitCode >= SV_STATISTICS_HIGH_EXIT_CODE) &&
+        (ExitCode < SV_STATISTICS_HIGH_EXIT_CODE + SV_STATISTICS_HIGH_EXIT_CODES))
+    {
+        return static_cast<UINT32>(ExitCode - SV_STATISTICS_HIGH_EXIT_CODE +
+                                   SV_STATISTICS_DIRECT_EXIT_CODES);
+    }
+    return SV_STATISTICS_OTHER_BUCKET;
+}
+
+/*!
+    @brief      Returns the #VMEXIT code a bucket counts.
+
+    @param[in]  Bucket - The bucket number.
+
+    @result     The #VMEXIT code, or MAXUINT64 for the last bucket.
+ */
+inline
+UINT64
+SvGetBucketExitCode (
+    _In_ UINT32 Bucket
+    )
+{
+    if (Bucket < SV_STATISTICS_DIRECT_EXIT_CODES)
+    {
+        return Bucket;
+    }
+    if (Bucket < SV_STATISTICS_OTHER_BUCKET)
+    {
+        return Bucket - SV_STATISTICS_DIRECT_EXIT_CODES + SV_STATISTICS_HIGH_EXIT_CODE;
+    }
+    return ~0ULL;
+}
+
+/*!
+    @brief          Starts updating a seqlock protected structure.
+
+    @param[in,out]  Sequence - The sequence field of the structure.
+ */
+inline
+VOID
+SvBeginSeqlockWrite (
+    _Inout_ volatile UINT32* Sequence
+    )
+{
+    *Sequence = *Sequence + 1;
+    SV_SEQLOCK_BARRIER();
+}
+
+/*!
+    @brief          Ends updating a seqlock protected structure.
+
+    @param[in,out]  Sequence - The sequence field of the structure.
+ */
+inline
+VOID
+SvEndSeqlockWrite (
+    _Inout_ volatile UINT32* Sequence
+    )
+{
+    SV_SEQLOCK_BARRIER();
+    *Sequence = *Sequence + 1;
+}
+
+/*!
+    @brief      Copies a seqlock protected structure consistently.
+
+    @details    The structure must start with the UINT32 sequence field and its
+                size must be a multiple of 8 bytes.
+
+    @param[in]  Source - The structure to copy.
+    @param[out] Destination - Receives the copy of the structure.
+    @param[in]  Size - The size of the structure in bytes.
+    @param[in]  MaxRetries - The maximum number of retries.
+
+    @result     TRUE when a consistent copy is taken; otherwise, FALSE, when the
+                writer kept updating the structure.
+ */
+inline
+BOOLEAN
+SvReadSeqlockProtected (
+    _In_reads_bytes_(Size) const volatile VOID* Source,
+    _Out_writes_bytes_all_(Size) VOID* Destination,
+    _In_ UINT32 Size,
+    _In_ UINT32 MaxRetries
+    )
+{
+    const volatile UINT64* source;
+    UINT64* destination;
+    const volatile UINT32* sequence;
+    UINT32 before;
+
+    source = static_cast<const volatile UINT64*>(Source);
+    destination = static_cast<UINT64*>(Destination);
+    sequence = static_cast<const volatile UINT32*>(Source);
+
+    for (UINT32 retry = 0; retry <= MaxRetries; retry++)
+    {
+        before = *sequence;
+        if ((before & 1) != 0)
+        {
+            continue;
+        }
+        SV_SEQLOCK_BARRIER();
+
+        for (UINT32 i = 0; i < Size / sizeof(UINT64); i++)
+        {
+            destination[i] = source[i];
+        }
+
+        SV_SEQLOCK_BARRIER();
+        if (*sequence == before)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*!
+    @brief      Validates the statistics region mapped into the process.
+
+    @param[in]  Base - The base address of the region.
+    @param[in]  Size - The size of the region in bytes.
+
+    @result     TRUE when the region has the expected layout; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvValidateStatistics (
+    _In_reads_bytes_(Size) const VOID* Base,
+    _In_ UINT64 Size
+    )
+{
+    const SV_STATISTICS_HEADER* header;
+
+    if (Size < SV_STATISTICS_PAGE_SIZE)
+    {
+        return FALSE;
+    }
+
+    header = static_cast<const SV_STATISTICS_HEADER*>(Base);
+    return ((header->Magic == SV_STATISTICS_MAGIC) &&
+            (header->Version == SV_STATISTICS_VERSION) &&
+            (Size >= (1ULL + header->NumberOfProcessors * 2ULL) * SV_STATISTICS_PAGE_SIZE));
+}
+
+/*!
+    @brief      Returns the statistics of the processor in the region.
+
+    @param[in]  Base - The base address of the region.
+    @param[in]  ProcessorIndex - The index of the processor.
+
+    @result     The statistics of the processor. The caller must validate the
+                index against NumberOfProcessors of the header.
+ */
+inline
+const SV_VP_STATISTICS*
+SvGetVpStatistics (
+    _In_ const VOID* Base,
+    _In_ UINT32 ProcessorIndex
+    )
+{
+    return reinterpret_cast<const SV_VP_STATISTICS*>(
+                static_cast<const UINT8*>(Base) +
+                (1ULL + ProcessorIndex) * SV_STATISTICS_PAGE_SIZE);
+}
+
+/*!
+    @brief      Returns the CR3 statistics of the processor in the region.
+
+    @param[in]  Base - The base address of the region.
+    @param[in]  ProcessorIndex - The index of the processor.
+
+    @result     The CR3 statistics of the processor. The caller must validate
+                the index against NumberOfProcessors of the header.
+ */
+inline
+const SV_CR3_STATISTICS*
+SvGetCr3Statistics (
+    _In_ const VOID* Base,
+    _In_ UINT32 ProcessorIndex
+    )
+{
+    const SV_STATISTICS_HEADER* header;
+
+    header = static_cast<const SV_STATISTICS_HEADER*>(Base);
+    return reinterpret_cast<const SV_CR3_STATISTICS*>(
+                static_cast<const UINT8*>(Base) +
+                (1ULL + header->NumberOfProcessors + ProcessorIndex) * SV_STATISTICS_PAGE_SIZE);
+}
+
+/*!
+    @brief      Finds the entry of the address space in the CR3 statistics.
+
+    @details    Entries are open-addressed with linear probing, starting at the
+                hash of the page frame of CR3. Entries are never removed, so the
+                lookup stops at the first unused entry.
+
+    @param[in]  Statistics - The CR3 statistics to search.
+    @param[in]  Cr3 - The CR3 value. Bits other than 51:12 are ignored.
+    @param[in]  Insert - TRUE to use the first unused entry when not found.
+
+    @result     The entry, or nullptr if not found and, when Insert is TRUE,
+                the table is full.
+ */
+inline
+SV_CR3_STATISTICS_ENTRY*
+SvLookupCr3Statistics (
+    _In_ SV_CR3_STATISTICS* Statistics,
+    _In_ UINT64 Cr3,
+    _In_ BOOLEAN Insert
+    )
+{
+    UINT64 key;
+    UINT32 index;
+    SV_CR3_STATISTICS_ENTRY* entry;
+
+    key = Cr3 & SV_CR3_ADDRESS_MASK;
+    index = static_cast<UINT32>((key >> 12) * 0x9e3779b97f4a7c15ULL >> 32);
+    for (UINT32 i = 0; i < SV_CR3_STATISTICS_ENTRIES; i++)
+    {
+        entry = &Statistics->Entries[(index + i) & (SV_CR3_STATISTICS_ENTRIES - 1)];
+        if (entry->Cr3 == key)
+        {
+            return entry;
+        }
+        if (entry->Cr3 == 0)
+        {
+            if (Insert == FALSE)
+            {
+                return nullptr;
+            }
+            entry->Cr3 = key;
+            return entry;
+        }
+    }
+    return nullptr;
+}
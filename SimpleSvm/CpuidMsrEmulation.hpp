@@ -0,0 +1,237 @@
+/*!
+    @file       CpuidMsrEmulation.hpp
+
+    @brief      Emulation of CPUID and of MSRs virtualized by SimpleSvm.
+
+    @details    Only what depends on the results of CPUID and the VMCB is here,
+                so that it can be exercised on a mocked VMCB. Executing CPUID,
+                RDMSR and WRMSR, and injecting exceptions are left to the
+                #VMEXIT handlers.
+
+                This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+#include "SimpleSvm.hpp"
+
+#define IA32_MSR_EFER   0xc0000080
+
+#define EFER_SVME       (1UL << 12)
+
+#define CPUID_FN8000_0001_ECX_SVM                   (1UL << 2)
+#define CPUID_FN0000_0001_ECX_XSAVE                 (1UL << 26)
+#define CPUID_FN0000_0001_ECX_OSXSAVE               (1UL << 27)
+#define CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT    (1UL << 31)
+#define CPUID_FN0000_000D_EAX_XSAVEOPT              (1UL << 0)
+#define CPUID_FN8000_000A_EDX_NP                    (1UL << 0)
+#define CPUID_FN8000_000A_EDX_LBR_VIRTUALIZATION    (1UL << 1)
+#define CPUID_FN8000_000A_EDX_NRIPS                 (1UL << 3)
+#define CPUID_FN8000_000A_EDX_VMCB_CLEAN            (1UL << 5)
+#define CPUID_FN8000_000A_EDX_FLUSH_BY_ASID         (1UL << 6)
+#define CPUID_FN8000_000A_EDX_DECODE_ASSISTS        (1UL << 7)
+#define CPUID_FN8000_000A_EDX_PAUSE_FILTER          (1UL << 10)
+#define CPUID_FN8000_000A_EDX_PAUSE_FILTER_THRESHOLD    (1UL << 12)
+#define CPUID_FN8000_000A_EDX_VIRTUAL_VMLOAD_VMSAVE (1UL << 15)
+#define CPUID_FN8000_000A_EDX_VGIF                  (1UL << 16)
+
+//
+// SVM features exposed to the nested hypervisor. Others, such as AVIC and
+// vGIF, are not virtualized.
+//
+#define SV_NESTED_SVM_FEATURES  (CPUID_FN8000_000A_EDX_NP | \
+                                 CPUID_FN8000_000A_EDX_NRIPS | \
+                                 CPUID_FN8000_000A_EDX_VMCB_CLEAN | \
+                                 CPUID_FN8000_000A_EDX_FLUSH_BY_ASID | \
+                                 CPUID_FN8000_000A_EDX_DECODE_ASSISTS | \
+                                 CPUID_FN8000_000A_EDX_PAUSE_FILTER | \
+                                 CPUID_FN8000_000A_EDX_PAUSE_FILTER_THRESHOLD)
+
+#define CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING          0x00000000
+#define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS       0x00000001
+#define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX    0x80000001
+#define CPUID_SVM_FEATURES                                      0x8000000a
+#define CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION              0x0000000d
+//
+// The Microsoft Hypervisor interface defined constants.
+//
+#define CPUID_HV_VENDOR_AND_MAX_FUNCTIONS   0x40000000
+#define CPUID_HV_INTERFACE                  0x40000001
+#define CPUID_HV_MAX                        CPUID_HV_INTERFACE
+
+//
+// What the #VMEXIT handler has to do after SvEmulateMsrAccess.
+//
+typedef enum _SV_MSR_ACCESS_RESULT
+{
+    SvMsrAccessEmulated,        // Completed; advance RIP.
+    SvMsrAccessPassThrough,     // Not virtualized; execute RDMSR or WRMSR.
+    SvMsrAccessInjectGp,        // Inject #GP without completing the access.
+} SV_MSR_ACCESS_RESULT;
+
+/*!
+    @brief          Modifies results of the CPUID instruction as SimpleSvm
+                    presents them to the guest.
+
+    @details        Results are unmodified, except for few leaves to indicate
+                    presence of the hypervisor and to hide SVM features that are
+                    not virtualized for the nested hypervisor.
+
+                    CPUID leaf 0x40000000 and 0x40000001 return modified values
+                    to conform to the hypervisor interface to some extent. See
+                    "Requirements for implementing the Microsoft Hypervisor interface"
+                    https://msdn.microsoft.com/en-us/library/windows/hardware/Dn613994(v=vs.85).aspx
+                    for details of the interface.
+
+    @param[in]      Leaf - The CPUID leaf the guest queried.
+    @param[in]      NestedSvmAvailable - Whether nested virtualization is
+                    available.
+    @param[in,out]  Registers - EAX, EBX, ECX and EDX the processor returned.
+                    Receives the results for the guest.
+ */
+inline
+VOID
+SvAdjustCpuidResult (
+    _In_ UINT32 Leaf,
+    _In_ BOOLEAN NestedSvmAvailable,
+    _Inout_updates_(4) int Registers[4]
+    )
+{
+    switch (Leaf)
+    {
+    case CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS:
+        //
+        // Indicate presence of a hypervisor by setting the bit that are
+        // reserved for use by hypervisor to indicate guest status. See "CPUID
+        // Fn0000_0001_ECX Feature Identifiers".
+        //
+        Registers[2] |= CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT;
+        break;
+    case CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX:
+        //
+        // Hide SVM when nested virtualization is unavailable.
+        //
+        if (NestedSvmAvailable == FALSE)
+        {
+            Registers[2] &= ~CPUID_FN8000_0001_ECX_SVM;
+        }
+        break;
+    case CPUID_SVM_FEATURES:
+        //
+        // Report only SVM features that are virtualized for the nested
+        // hypervisor.
+        //
+        Registers[3] &= SV_NESTED_SVM_FEATURES;
+        break;
+    case CPUID_HV_VENDOR_AND_MAX_FUNCTIONS:
+        //
+        // Return a maximum supported hypervisor CPUID leaf range and a vendor
+        // ID signature as required by the spec.
+        //
+        Registers[0] = CPUID_HV_MAX;
+        Registers[1] = 'pmiS';  // "SimpleSvm   "
+        Registers[2] = 'vSel';
+        Registers[3] = '   m';
+        break;
+    case CPUID_HV_INTERFACE:
+        //
+        // Return non Hv#1 value. This indicate that the SimpleSvm does NOT
+        // conform to the Microsoft hypervisor interface.
+        //
+        Registers[0] = '0#vH';  // Hv#0
+        Registers[1] = Registers[2] = Registers[3] = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+/*!
+    @brief          Emulates access to MSRs SimpleSvm virtualizes.
+
+    @details        Clearing EFER.SVME is refused with #GP, as doing so while
+                    the guest is running leads to undefined behavior. L2 runs
+                    without SVM, and is free to clear it. Otherwise, EFER is
+                    updated as requested. Important to note that the value
+                    should be checked not to allow any illegal values, and
+                    inject #GP as needed. Otherwise, the hypervisor attempts to
+                    resume the guest with an illegal EFER and immediately
+                    receives #VMEXIT due to VMEXIT_INVALID, which in our case,
+                    results in a bug check. See "Extended Feature Enable
+                    Register (EFER)" for what values are allowed. This code does
+                    not implement the check intentionally, for simplicity.
+
+                    IA32_MSR_VM_HSAVE_PA is virtualized for the nested
+                    hypervisor, as the physical one points to the host
+                    state-save area of SimpleSvm. The value is only validated
+                    and kept, because VMRUN of the nested hypervisor is
+                    emulated without using the area. L2 cannot run a hypervisor.
+
+    @param[in,out]  Vmcb - The VMCB of the guest accessing the MSR.
+    @param[in,out]  HostSavePa - The virtualized IA32_MSR_VM_HSAVE_PA.
+    @param[in]      InL2 - Whether the guest is L2.
+    @param[in]      Msr - The MSR being accessed.
+    @param[in]      IsWrite - TRUE for WRMSR; FALSE for RDMSR.
+    @param[in,out]  Value - The value to write, or receives the value read.
+
+    @result         What the caller has to do to complete the access.
+ */
+inline
+SV_MSR_ACCESS_RESULT
+SvEmulateMsrAccess (
+    _Inout_ PVMCB Vmcb,
+    _Inout_ PUINT64 HostSavePa,
+    _In_ BOOLEAN InL2,
+    _In_ UINT32 Msr,
+    _In_ BOOLEAN IsWrite,
+    _Inout_ PUINT64 Value
+    )
+{
+    if (Msr == IA32_MSR_EFER)
+    {
+        if (IsWrite == FALSE)
+        {
+            *Value = Vmcb->StateSaveArea.Efer;
+            return SvMsrAccessEmulated;
+        }
+        if (((*Value & EFER_SVME) == 0) && (InL2 == FALSE))
+        {
+            return SvMsrAccessInjectGp;
+        }
+
+        //
+        // EFER is cached by the processor unless the CRx clean bit is cleared.
+        // This matters only for NestedVmcb, as GuestVmcb never sets clean bits.
+        //
+        Vmcb->StateSaveArea.Efer = *Value;
+        Vmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_CRX;
+        return SvMsrAccessEmulated;
+    }
+
+    if (Msr == SVM_MSR_VM_HSAVE_PA)
+    {
+        if (InL2 != FALSE)
+        {
+            return SvMsrAccessInjectGp;
+        }
+        if (IsWrite == FALSE)
+        {
+            *Value = *HostSavePa;
+            return SvMsrAccessEmulated;
+        }
+        if ((*Value & 0xfff) != 0)
+        {
+            return SvMsrAccessInjectGp;
+        }
+        *HostSavePa = *Value;
+        return SvMsrAccessEmulated;
+    }
+
+    return SvMsrAccessPassThrough;
+}
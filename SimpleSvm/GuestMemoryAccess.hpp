@@ -0,0 +1,319 @@
+/*!
+    @file       GuestMemoryAccess.hpp
+
+    @brief      Batched guest physical memory access through the hypercall.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN. Guest physical memory is accessed through
+                callbacks, so descriptor lists can be processed against
+                synthetic memory, eg, to fuzz them.
+
+                The hypercall is CPUID, or VMMCALL with SV_EXIT_FREE_CPUID, with
+                the following registers, and is only available to kernel mode:
+                  EAX = SV_MEMORY_ACCESS_FUNCTION
+                  RCX = The number of descriptors in the list
+                  RDX = The 8-byte aligned guest physical address of the list
+                  RBX = The index of the first descriptor to process; zero for
+                        a new call
+                The hypervisor processes descriptors up to
+                SV_MEMORY_ACCESS_BUDGET bytes per #VMEXIT. When descriptors
+                remain, RBX is updated and RIP is left at the instruction, so
+                the guest executes it again and remains interruptible between
+                batches. When all descriptors have been processed, or the list
+                cannot be processed, the instruction completes with:
+                  EAX = SV_MEMORY_ACCESS_LIST_STATUS
+                  RBX = The index of the first descriptor not processed
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+
+#define SV_MEMORY_ACCESS_FUNCTION           0x41414142
+
+//
+// A descriptor may access up to one page, and a list may have up to 64K
+// descriptors. Descriptors are processed until they exceed the budget, with
+// at least one descriptor per #VMEXIT. Each descriptor costs its size in
+// addition to the bytes it accesses, so that the budget also bounds the number
+// of descriptors processed at once.
+//
+#define SV_MEMORY_ACCESS_PAGE_SIZE          0x1000
+#define SV_MAX_MEMORY_ACCESS_LENGTH         SV_MEMORY_ACCESS_PAGE_SIZE
+#define SV_MAX_MEMORY_ACCESS_DESCRIPTORS    0x10000
+#define SV_MEMORY_ACCESS_BUDGET             0x10000
+
+#define SV_MEMORY_ACCESS_READ               0   // Copy GuestPa to BufferPa
+#define SV_MEMORY_ACCESS_WRITE              1   // Copy BufferPa to GuestPa
+
+typedef enum _SV_MEMORY_ACCESS_STATUS
+{
+    SvMemoryAccessSuccess,
+    SvMemoryAccessInvalidDescriptor,    // Bad direction or length
+    SvMemoryAccessInaccessible,         // Either region could not be accessed
+} SV_MEMORY_ACCESS_STATUS;
+
+typedef enum _SV_MEMORY_ACCESS_LIST_STATUS
+{
+    SvMemoryAccessListSuccess,
+    SvMemoryAccessListInvalid,          // Bad count or start index
+    SvMemoryAccessListInaccessible,     // A descriptor could not be accessed
+} SV_MEMORY_ACCESS_LIST_STATUS;
+
+//
+// The hypervisor writes Status of each descriptor it processes, and does not
+// modify anything else.
+//
+typedef struct _SV_MEMORY_ACCESS_DESCRIPTOR
+{
+    UINT64 GuestPa;                 // The region to read or write
+    UINT64 BufferPa;                // The caller's buffer of Length bytes
+    UINT32 Length;                  // Up to SV_MAX_MEMORY_ACCESS_LENGTH
+    UINT16 Direction;               // SV_MEMORY_ACCESS_READ or _WRITE
+    UINT16 Status;                  // SV_MEMORY_ACCESS_STATUS; must be last
+} SV_MEMORY_ACCESS_DESCRIPTOR, *PSV_MEMORY_ACCESS_DESCRIPTOR;
+static_assert(sizeof(SV_MEMORY_ACCESS_DESCRIPTOR) == 24,
+              "SV_MEMORY_ACCESS_DESCRIPTOR Size Mismatch");
+
+/*!
+    @brief      Copies bytes between a buffer and guest physical memory.
+
+    @details    The range never crosses a page boundary.
+
+    @param[in]  Context - The context passed to SvProcessMemoryAccessList.
+    @param[in]  GuestPa - The guest physical address to access.
+    @param[in,out] Buffer - The contents to write, or receives the contents read.
+    @param[in]  Size - The number of bytes to copy.
+    @param[in]  IsWrite - TRUE to write Buffer into guest memory.
+
+    @result     TRUE on success; otherwise, FALSE.
+ */
+typedef
+BOOLEAN
+SV_ACCESS_GUEST_PHYSICAL (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Inout_updates_bytes_(Size) PVOID Buffer,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsWrite
+    );
+typedef SV_ACCESS_GUEST_PHYSICAL *PSV_ACCESS_GUEST_PHYSICAL;
+
+/*!
+    @brief      Copies bytes from a guest physical address to another.
+
+    @details    Neither range crosses a page boundary. The ranges may overlap,
+                in which case the result is undefined, as with memcpy.
+
+    @param[in]  Context - The context passed to SvProcessMemoryAccessList.
+    @param[in]  DestinationPa - The guest physical address to copy to.
+    @param[in]  SourcePa - The guest physical address to copy from.
+    @param[in]  Size - The number of bytes to copy.
+
+    @result     TRUE on success; otherwise, FALSE.
+ */
+typedef
+BOOLEAN
+SV_COPY_GUEST_PHYSICAL (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 DestinationPa,
+    _In_ UINT64 SourcePa,
+    _In_ UINT32 Size
+    );
+typedef SV_COPY_GUEST_PHYSICAL *PSV_COPY_GUEST_PHYSICAL;
+
+/*!
+    @brief      Returns the number of bytes from the address to the end of its
+                page.
+
+    @param[in]  GuestPa - The guest physical address.
+
+    @result     The number of bytes, from 1 to SV_MEMORY_ACCESS_PAGE_SIZE.
+ */
+inline
+UINT32
+SvBytesToPageEnd (
+    _In_ UINT64 GuestPa
+    )
+{
+    return SV_MEMORY_ACCESS_PAGE_SIZE -
+           static_cast<UINT32>(GuestPa & (SV_MEMORY_ACCESS_PAGE_SIZE - 1));
+}
+
+/*!
+    @brief      Reads or writes guest physical memory as a descriptor describes.
+
+    @details    The region and the buffer may each cross one page boundary, so
+                the access is split into up to three copies, none of which
+                crosses a page boundary on either side.
+
+    @param[in]  Descriptor - The descriptor to execute.
+    @param[in]  CopyMemory - A callback to copy guest physical memory.
+    @param[in]  Context - A parameter passed to CopyMemory.
+
+    @result     The status to write into the descriptor.
+ */
+inline
+SV_MEMORY_ACCESS_STATUS
+SvExecuteMemoryAccessDescriptor (
+    _In_ const SV_MEMORY_ACCESS_DESCRIPTOR* Descriptor,
+    _In_ PSV_COPY_GUEST_PHYSICAL CopyMemory,
+    _In_opt_ PVOID Context
+    )
+{
+    UINT64 sourcePa, destinationPa;
+    UINT32 copied, chunkSize;
+
+    if (((Descriptor->Direction != SV_MEMORY_ACCESS_READ) &&
+         (Descriptor->Direction != SV_MEMORY_ACCESS_WRITE)) ||
+        (Descriptor->Length == 0) ||
+        (Descriptor->Length > SV_MAX_MEMORY_ACCESS_LENGTH) ||
+        (Descriptor->GuestPa + Descriptor->Length < Descriptor->GuestPa) ||
+        (Descriptor->BufferPa + Descriptor->Length < Descriptor->BufferPa))
+    {
+        return SvMemoryAccessInvalidDescriptor;
+    }
+
+    if (Descriptor->Direction == SV_MEMORY_ACCESS_READ)
+    {
+        sourcePa = Descriptor->GuestPa;
+        destinationPa = Descriptor->BufferPa;
+    }
+    else
+    {
+        sourcePa = Descriptor->BufferPa;
+        destinationPa = Descriptor->GuestPa;
+    }
+
+    for (copied = 0; copied < Descriptor->Length; copied += chunkSize)
+    {
+        chunkSize = Descriptor->Length - copied;
+        if (chunkSize > SvBytesToPageEnd(sourcePa + copied))
+        {
+            chunkSize = SvBytesToPageEnd(sourcePa + copied);
+        }
+        if (chunkSize > SvBytesToPageEnd(destinationPa + copied))
+        {
+            chunkSize = SvBytesToPageEnd(destinationPa + copied);
+        }
+        if (CopyMemory(Context, destinationPa + copied, sourcePa + copied, chunkSize) == FALSE)
+        {
+            return SvMemoryAccessInaccessible;
+        }
+    }
+    return SvMemoryAccessSuccess;
+}
+
+/*!
+    @brief          Processes descriptors of a list within the budget.
+
+    @details        Each descriptor is read, executed, and has its status
+                    written back. Descriptors are processed from *NextDescriptor
+                    until all are processed, or until the bytes accessed would
+                    exceed SV_MEMORY_ACCESS_BUDGET. At least one descriptor is
+                    processed for each call, so a call always makes progress.
+
+                    A descriptor may cross a page boundary of the list.
+
+    @param[in]      ListPa - The guest physical address of the list.
+    @param[in]      NumberOfDescriptors - The number of descriptors in the list.
+    @param[in,out]  NextDescriptor - The index of the first descriptor to
+                    process, and receives the index of the first descriptor
+                    not processed.
+    @param[in]      AccessMemory - A callback to read and write descriptors.
+    @param[in]      CopyMemory - A callback to execute descriptors.
+    @param[in]      Context - A parameter passed to the callbacks.
+    @param[out]     Completed - Receives TRUE when no more descriptors need to
+                    be processed, either because all have been, or because
+                    the list cannot be processed further.
+
+    @result         SvMemoryAccessListSuccess, unless the list is invalid or
+                    inaccessible.
+ */
+inline
+SV_MEMORY_ACCESS_LIST_STATUS
+SvProcessMemoryAccessList (
+    _In_ UINT64 ListPa,
+    _In_ UINT64 NumberOfDescriptors,
+    _Inout_ PUINT64 NextDescriptor,
+    _In_ PSV_ACCESS_GUEST_PHYSICAL AccessMemory,
+    _In_ PSV_COPY_GUEST_PHYSICAL CopyMemory,
+    _In_opt_ PVOID Context,
+    _Out_ PBOOLEAN Completed
+    )
+{
+    SV_MEMORY_ACCESS_DESCRIPTOR descriptor;
+    UINT64 descriptorPa, cost, budgetUsed;
+    UINT32 firstSize;
+    UINT16 status;
+
+    *Completed = TRUE;
+
+    if ((NumberOfDescriptors > SV_MAX_MEMORY_ACCESS_DESCRIPTORS) ||
+        (*NextDescriptor > NumberOfDescriptors) ||
+        ((ListPa % sizeof(UINT64)) != 0) ||
+        (ListPa + NumberOfDescriptors * sizeof(descriptor) < ListPa))
+    {
+        return SvMemoryAccessListInvalid;
+    }
+
+    budgetUsed = 0;
+    for (; *NextDescriptor < NumberOfDescriptors; (*NextDescriptor)++)
+    {
+        descriptorPa = ListPa + *NextDescriptor * sizeof(descriptor);
+
+        //
+        // Read the descriptor in up to two pieces, as it may cross a page
+        // boundary.
+        //
+        firstSize = SvBytesToPageEnd(descriptorPa);
+        if (firstSize > sizeof(descriptor))
+        {
+            firstSize = sizeof(descriptor);
+        }
+        if ((AccessMemory(Context, descriptorPa, &descriptor, firstSize, FALSE) == FALSE) ||
+            ((firstSize < sizeof(descriptor)) &&
+             (AccessMemory(Context,
+                           descriptorPa + firstSize,
+                           reinterpret_cast<PUCHAR>(&descriptor) + firstSize,
+                           sizeof(descriptor) - firstSize,
+                           FALSE) == FALSE)))
+        {
+            return SvMemoryAccessListInaccessible;
+        }
+
+        //
+        // Stop when the budget would be exceeded, unless this is the first
+        // descriptor of the batch.
+        //
+        cost = sizeof(descriptor) + descriptor.Length;
+        if ((budgetUsed != 0) && (budgetUsed + cost > SV_MEMORY_ACCESS_BUDGET))
+        {
+            *Completed = FALSE;
+            break;
+        }
+        budgetUsed += cost;
+
+        status = static_cast<UINT16>(SvExecuteMemoryAccessDescriptor(&descriptor,
+                                                                     CopyMemory,
+                                                                     Context));
+
+        //
+        // Status is the last 2 bytes of the 8-byte aligned descriptor, and is
+        // never split across pages.
+        //
+        if (AccessMemory(Context,
+                         descriptorPa + sizeof(descriptor) - sizeof(status),
+                         &status,
+                         sizeof(status),
+                         TRUE) == FALSE)
+        {
+            return SvMemoryAccessListInaccessible;
+        }
+    }
+    return SvMemoryAccessListSuccess;
+}
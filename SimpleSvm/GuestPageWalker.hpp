@@ -0,0 +1,298 @@
+/*!
+    @file       GuestPageWalker.hpp
+
+    @brief      Guest virtual to guest physical address translation.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN. Guest physical memory is read through a
+                callback, so the walker can run against synthetic page tables.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+
+//
+// See "Page-Translation-Table Entry Fields".
+//
+#define SV_PTE_PRESENT          (1ULL << 0)
+#define SV_PTE_WRITE            (1ULL << 1)
+#define SV_PTE_USER             (1ULL << 2)
+#define SV_PTE_ACCESSED         (1ULL << 5)
+#define SV_PTE_DIRTY            (1ULL << 6)
+#define SV_PTE_LARGE_PAGE       (1ULL << 7)
+#define SV_PTE_NO_EXECUTE       (1ULL << 63)
+#define SV_PTE_PFN_MASK         0x000ffffffffff000ULL
+
+#define SV_CR0_PG               (1ULL << 31)
+#define SV_CR4_LA57             (1ULL << 12)
+#define SV_EFER_LMA             (1ULL << 10)
+#define SV_EFER_NXE             (1ULL << 11)
+
+//
+// The number of entries in the software TLB. Must be a power of two.
+//
+#define SV_SOFT_TLB_SIZE        64
+
+typedef enum _SV_TRANSLATION_STATUS
+{
+    SvTranslationSuccess,
+    SvTranslationNotPresent,        // A paging structure entry is not present
+    SvTranslationNonCanonical,      // The address is not canonical
+    SvTranslationUnsupportedMode,   // Legacy or compatibility paging mode
+    SvTranslationReadFailure,       // The callback failed to read an entry
+} SV_TRANSLATION_STATUS;
+
+//
+// Paging state of the guest, as found in the VMCB state save area.
+//
+typedef struct _SV_GUEST_PAGING_STATE
+{
+    UINT64 Cr0;
+    UINT64 Cr3;
+    UINT64 Cr4;
+    UINT64 Efer;
+} SV_GUEST_PAGING_STATE, *PSV_GUEST_PAGING_STATE;
+
+typedef struct _SV_GUEST_TRANSLATION
+{
+    UINT64 GuestPa;
+    BOOLEAN Writable;
+    BOOLEAN User;
+    BOOLEAN Executable;
+} SV_GUEST_TRANSLATION, *PSV_GUEST_TRANSLATION;
+
+/*!
+    @brief      Reads an 8-byte paging structure entry from guest physical memory.
+
+    @param[in]  Context - The context passed to SvWalkGuestPageTables.
+    @param[in]  GuestPa - The 8-byte aligned guest physical address to read.
+    @param[out] Value - Receives the entry.
+
+    @result     TRUE on success; otherwise, FALSE.
+ */
+typedef
+BOOLEAN
+SV_READ_GUEST_PHYSICAL64 (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Out_ PUINT64 Value
+    );
+typedef SV_READ_GUEST_PHYSICAL64 *PSV_READ_GUEST_PHYSICAL64;
+
+/*!
+    @brief      Translates a guest virtual address to a guest physical address.
+
+    @details    This function walks 4-level or 5-level guest page tables in the
+                same way as the processor does, including 1GB and 2MB pages.
+                Access rights are accumulated from all levels. Accessed and
+                dirty bits are not updated.
+
+                When paging is disabled, the address is returned as is. Legacy
+                and PAE paging modes are not supported.
+
+    @param[in]  State - Paging state of the guest.
+    @param[in]  GuestVa - The guest virtual address to translate.
+    @param[in]  ReadEntry - A callback to read paging structure entries.
+    @param[in]  Context - A parameter passed to ReadEntry.
+    @param[out] Translation - Receives the result of translation.
+
+    @result     SvTranslationSuccess on success; otherwise, the reason of the
+                failure.
+ */
+inline
+SV_TRANSLATION_STATUS
+SvWalkGuestPageTables (
+    _In_ const SV_GUEST_PAGING_STATE* State,
+    _In_ UINT64 GuestVa,
+    _In_ PSV_READ_GUEST_PHYSICAL64 ReadEntry,
+    _In_opt_ PVOID Context,
+    _Out_ PSV_GUEST_TRANSLATION Translation
+    )
+{
+    UINT32 levels, shift;
+    UINT64 tableBase, entry, index, pageMask;
+    BOOLEAN writable, user, executable;
+
+    *Translation = SV_GUEST_TRANSLATION{};
+
+    if ((State->Cr0 & SV_CR0_PG) == 0)
+    {
+        Translation->GuestPa = GuestVa;
+        Translation->Writable = Translation->User = Translation->Executable = TRUE;
+        return SvTranslationSuccess;
+    }
+
+    if ((State->Efer & SV_EFER_LMA) == 0)
+    {
+        return SvTranslationUnsupportedMode;
+    }
+
+    //
+    // The address must be canonical, ie, bits 63 to 47 (or 56 with 5-level
+    // paging) must be copies of the highest implemented bit.
+    //
+    levels = ((State->Cr4 & SV_CR4_LA57) != 0) ? 5 : 4;
+    shift = 12 + 9 * levels;
+    if ((static_cast<UINT64>(static_cast<INT64>(GuestVa << (64 - shift)) >> (64 - shift))) != GuestVa)
+    {
+        return SvTranslationNonCanonical;
+    }
+
+    writable = user = executable = TRUE;
+    tableBase = State->Cr3 & SV_PTE_PFN_MASK;
+    for (UINT32 level = levels; level > 0; level--)
+    {
+        shift = 12 + 9 * (level - 1);
+        index = (GuestVa >> shift) & 0x1ff;
+        if (ReadEntry(Context, tableBase + index * sizeof(UINT64), &entry) == FALSE)
+        {
+            return SvTranslationReadFailure;
+        }
+        if ((entry & SV_PTE_PRESENT) == 0)
+        {
+            return SvTranslationNotPresent;
+        }
+
+        writable &= ((entry & SV_PTE_WRITE) != 0);
+        user &= ((entry & SV_PTE_USER) != 0);
+        if ((State->Efer & SV_EFER_NXE) != 0)
+        {
+            executable &= ((entry & SV_PTE_NO_EXECUTE) == 0);
+        }
+
+        //
+        // PDPE and PDE may map 1GB and 2MB pages respectively. PML5E and PML4E
+        // cannot, and PTE always maps a page.
+        //
+        if ((level == 1) ||
+            (((level == 2) || (level == 3)) && ((entry & SV_PTE_LARGE_PAGE) != 0)))
+        {
+            pageMask = (1ULL << shift) - 1;
+            Translation->GuestPa = ((entry & SV_PTE_PFN_MASK) & ~pageMask) |
+                                   (GuestVa & pageMask);
+            Translation->Writable = writable;
+            Translation->User = user;
+            Translation->Executable = executable;
+            return SvTranslationSuccess;
+        }
+        tableBase = entry & SV_PTE_PFN_MASK;
+    }
+
+    //
+    // Never reached; the loop always returns at level 1.
+    //
+    return SvTranslationNotPresent;
+}
+
+//
+// A direct-mapped software TLB keyed by (CR3, virtual page). Translations are
+// cached at 4KB granularity regardless of the size of the guest page. An entry
+// is valid only while its generation equals that of the TLB, so flushing the
+// TLB does not touch entries.
+//
+// The guest may edit its page tables, or execute INVLPG, without #VMEXIT, and
+// nothing tells the TLB. SimpleSvm therefore flushes it on every #VMEXIT, and
+// an entry lives only for the rest of the #VMEXIT that filled it. Within that
+// lifetime CR3 does not change, so the CR3 in the key only matters to users
+// that flush less often.
+//
+typedef struct _SV_SOFT_TLB_ENTRY
+{
+    UINT64 Generation;
+    UINT64 Cr3;
+    UINT64 VirtualPage;             // GuestVa >> 12
+    UINT64 PhysicalPage;            // GuestPa >> 12
+    BOOLEAN Writable;
+    BOOLEAN User;
+    BOOLEAN Executable;
+} SV_SOFT_TLB_ENTRY, *PSV_SOFT_TLB_ENTRY;
+
+typedef struct _SV_SOFT_TLB
+{
+    UINT64 Generation;              // Never zero once flushed
+    UINT64 Hits;
+    UINT64 Misses;
+    SV_SOFT_TLB_ENTRY Entries[SV_SOFT_TLB_SIZE];
+} SV_SOFT_TLB, *PSV_SOFT_TLB;
+
+/*!
+    @brief      Invalidates all entries of the software TLB.
+
+    @details    A zero-initialized TLB must be flushed once before use.
+
+    @param[in,out]  Tlb - The software TLB.
+ */
+inline
+VOID
+SvFlushSoftTlb (
+    _Inout_ PSV_SOFT_TLB Tlb
+    )
+{
+    Tlb->Generation++;
+}
+
+/*!
+    @brief      Translates a guest virtual address using the software TLB.
+
+    @details    This function looks up the software TLB first, and walks guest
+                page tables with SvWalkGuestPageTables only on a miss. The
+                result of a successful walk is inserted into the TLB.
+
+    @param[in,out]  Tlb - The software TLB.
+    @param[in]      State - Paging state of the guest.
+    @param[in]      GuestVa - The guest virtual address to translate.
+    @param[in]      ReadEntry - A callback to read paging structure entries.
+    @param[in]      Context - A parameter passed to ReadEntry.
+    @param[out]     Translation - Receives the result of translation.
+
+    @result     SvTranslationSuccess on success; otherwise, the reason of the
+                failure.
+ */
+inline
+SV_TRANSLATION_STATUS
+SvTranslateWithSoftTlb (
+    _Inout_ PSV_SOFT_TLB Tlb,
+    _In_ const SV_GUEST_PAGING_STATE* State,
+    _In_ UINT64 GuestVa,
+    _In_ PSV_READ_GUEST_PHYSICAL64 ReadEntry,
+    _In_opt_ PVOID Context,
+    _Out_ PSV_GUEST_TRANSLATION Translation
+    )
+{
+    SV_TRANSLATION_STATUS status;
+    PSV_SOFT_TLB_ENTRY entry;
+    UINT64 virtualPage;
+
+    virtualPage = GuestVa >> 12;
+    entry = &Tlb->Entries[(virtualPage ^ (State->Cr3 >> 12)) & (SV_SOFT_TLB_SIZE - 1)];
+    if ((entry->Generation == Tlb->Generation) &&
+        (entry->VirtualPage == virtualPage) &&
+        (entry->Cr3 == State->Cr3))
+    {
+        Tlb->Hits++;
+        Translation->GuestPa = (entry->PhysicalPage << 12) | (GuestVa & 0xfff);
+        Translation->Writable = entry->Writable;
+        Translation->User = entry->User;
+        Translation->Executable = entry->Executable;
+        return SvTranslationSuccess;
+    }
+
+    Tlb->Misses++;
+    status = SvWalkGuestPageTables(State, GuestVa, ReadEntry, Context, Translation);
+    if (status == SvTranslationSuccess)
+    {
+        entry->Generation = Tlb->Generation;
+        entry->Cr3 = State->Cr3;
+        entry->VirtualPage = virtualPage;
+        entry->PhysicalPage = Translation->GuestPa >> 12;
+        entry->Writable = Translation->Writable;
+        entry->User = Translation->User;
+        entry->Executable = Translation->Executable;
+    }
+    return status;
+}
@@ -0,0 +1,192 @@
+/*!
+    @file       IoPermissionsMap.hpp
+
+    @brief      I/O permissions map (IOPM) and IOIO intercept information.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+
+//
+// The IOPM is 12KB of physically contiguous memory. Only the first 65536 + 7
+// bits are used; see "I/O Permissions Map".
+//
+#define SV_IO_PERMISSIONS_MAP_SIZE  (0x1000 * 3)
+
+//
+// See "IOIO Intercept Information".
+//
+#define SV_IOIO_TYPE_IN             (1ULL << 0)
+#define SV_IOIO_STRING              (1ULL << 2)
+#define SV_IOIO_REP                 (1ULL << 3)
+#define SV_IOIO_SIZE8               (1ULL << 4)
+#define SV_IOIO_SIZE16              (1ULL << 5)
+#define SV_IOIO_SIZE32              (1ULL << 6)
+#define SV_IOIO_ADDRESS16           (1ULL << 7)
+#define SV_IOIO_ADDRESS32           (1ULL << 8)
+#define SV_IOIO_ADDRESS64           (1ULL << 9)
+#define SV_IOIO_SEGMENT_SHIFT       10
+#define SV_IOIO_SEGMENT_MASK        0x7ULL
+#define SV_IOIO_PORT_SHIFT          16
+#define SV_IOIO_PORT_MASK           0xffffULL
+
+//
+// The decoded form of EXITINFO1 of #VMEXIT due to IOIO.
+//
+typedef struct _SV_IOIO_EXIT_INFO
+{
+    UINT16 Port;
+    UINT8 Size;             // Size of the operand in bytes: 1, 2 or 4
+    UINT8 AddressSize;      // Size of the address in bytes: 2, 4 or 8 (INS/OUTS)
+    UINT8 Segment;          // Effective segment of OUTS; 0 is ES, 1 is CS, ...
+    BOOLEAN IsIn;           // IN or INS
+    BOOLEAN IsString;       // INS or OUTS
+    BOOLEAN Rep;            // Has the REP prefix
+} SV_IOIO_EXIT_INFO, *PSV_IOIO_EXIT_INFO;
+
+/*!
+    @brief      Clears the IOPM, so that no I/O port access is intercepted.
+
+    @param[out] IoPermissionsMap - The IOPM of SV_IO_PERMISSIONS_MAP_SIZE bytes.
+ */
+inline
+VOID
+SvInitializeIoPermissionsMap (
+    _Out_writes_bytes_all_(SV_IO_PERMISSIONS_MAP_SIZE) PVOID IoPermissionsMap
+    )
+{
+    PUINT8 map;
+
+    map = static_cast<PUINT8>(IoPermissionsMap);
+    for (UINT32 i = 0; i < SV_IO_PERMISSIONS_MAP_SIZE; i++)
+    {
+        map[i] = 0;
+    }
+}
+
+/*!
+    @brief          Sets the IOPM to intercept accesses to the range of ports.
+
+    @details        Each port is controlled by one bit; the processor checks the
+                    bits of all ports an access touches, so a 4-byte access to
+                    port 0x7e is intercepted when port 0x80 is.
+
+    @param[in,out]  IoPermissionsMap - The IOPM.
+    @param[in]      FirstPort - The first port to intercept.
+    @param[in]      LastPort - The last port to intercept, inclusive.
+ */
+inline
+VOID
+SvInterceptIoPorts (
+    _Inout_updates_bytes_all_(SV_IO_PERMISSIONS_MAP_SIZE) PVOID IoPermissionsMap,
+    _In_ UINT16 FirstPort,
+    _In_ UINT16 LastPort
+    )
+{
+    PUINT8 map;
+
+    map = static_cast<PUINT8>(IoPermissionsMap);
+    for (UINT32 port = FirstPort; port <= LastPort; port++)
+    {
+        map[port / 8] |= static_cast<UINT8>(1 << (port % 8));
+    }
+}
+
+/*!
+    @brief      Tests whether an access to the port is intercepted.
+
+    @param[in]  IoPermissionsMap - The IOPM.
+    @param[in]  Port - The port to test.
+    @param[in]  Size - The size of the access in bytes.
+
+    @result     TRUE when the access is intercepted; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvIsIoPortIntercepted (
+    _In_reads_bytes_(SV_IO_PERMISSIONS_MAP_SIZE) const VOID* IoPermissionsMap,
+    _In_ UINT16 Port,
+    _In_ UINT32 Size
+    )
+{
+    const UINT8* map;
+
+    map = static_cast<const UINT8*>(IoPermissionsMap);
+    for (UINT32 port = Port; port < Port + Size; port++)
+    {
+        if ((map[port / 8] & (1 << (port % 8))) != 0)
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*!
+    @brief      Decodes EXITINFO1 of #VMEXIT due to IOIO.
+
+    @param[in]  ExitInfo1 - EXITINFO1 in the VMCB.
+    @param[out] ExitInfo - Receives the decoded information.
+
+    @result     TRUE when EXITINFO1 is well-formed, ie, exactly one operand
+                size is indicated and, for INS and OUTS, exactly one address
+                size is; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvDecodeIoioExitInfo (
+    _In_ UINT64 ExitInfo1,
+    _Out_ PSV_IOIO_EXIT_INFO ExitInfo
+    )
+{
+    *ExitInfo = SV_IOIO_EXIT_INFO{};
+
+    ExitInfo->Port = static_cast<UINT16>((ExitInfo1 >> SV_IOIO_PORT_SHIFT) & SV_IOIO_PORT_MASK);
+    ExitInfo->Segment = static_cast<UINT8>((ExitInfo1 >> SV_IOIO_SEGMENT_SHIFT) & SV_IOIO_SEGMENT_MASK);
+    ExitInfo->IsIn = ((ExitInfo1 & SV_IOIO_TYPE_IN) != 0);
+    ExitInfo->IsString = ((ExitInfo1 & SV_IOIO_STRING) != 0);
+    ExitInfo->Rep = ((ExitInfo1 & SV_IOIO_REP) != 0);
+
+    switch (ExitInfo1 & (SV_IOIO_SIZE8 | SV_IOIO_SIZE16 | SV_IOIO_SIZE32))
+    {
+    case SV_IOIO_SIZE8:
+        ExitInfo->Size = 1;
+        break;
+    case SV_IOIO_SIZE16:
+        ExitInfo->Size = 2;
+        break;
+    case SV_IOIO_SIZE32:
+        ExitInfo->Size = 4;
+        break;
+    default:
+        return FALSE;
+    }
+
+    switch (ExitInfo1 & (SV_IOIO_ADDRESS16 | SV_IOIO_ADDRESS32 | SV_IOIO_ADDRESS64))
+    {
+    case SV_IOIO_ADDRESS16:
+        ExitInfo->AddressSize = 2;
+        break;
+    case SV_IOIO_ADDRESS32:
+        ExitInfo->AddressSize = 4;
+        break;
+    case SV_IOIO_ADDRESS64:
+        ExitInfo->AddressSize = 8;
+        break;
+    default:
+        if (ExitInfo->IsString != FALSE)
+        {
+            return FALSE;
+        }
+        break;
+    }
+    return TRUE;
+}
@@ -0,0 +1,369 @@
+/*!
+    @file       MmioDecoder.hpp
+
+    @brief      Decoder of instructions that access MMIO.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT8 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+
+//
+// The maximum length of an x86 instruction.
+//
+#define SV_MAX_INSTRUCTION_LENGTH   15
+
+//
+// Forms of instructions SvDecodeMmioInstruction understands.
+//
+typedef enum _SV_MMIO_INSTRUCTION_KIND
+{
+    SvMmioMov,              // MOV r/m, r or MOV r, r/m (88, 89, 8A, 8B, A0-A3)
+    SvMmioMovImmediate,     // MOV r/m, imm (C6 /0, C7 /0)
+    SvMmioMovZx,            // MOVZX r, r/m (0F B6, 0F B7)
+    SvMmioMovSx,            // MOVSX r, r/m (0F BE, 0F BF) and MOVSXD r, r/m (63)
+    SvMmioStos,             // STOS (AA, AB) with or without REP
+} SV_MMIO_INSTRUCTION_KIND;
+
+//
+// The result of decoding an instruction. Register numbers follow the encoding
+// in the ModRM byte extended with REX.R; 0 is RAX, 1 is RCX, ..., 15 is R15.
+//
+typedef struct _SV_MMIO_INSTRUCTION
+{
+    UINT64 Immediate;           // Sign-extended to RegisterSize if SvMmioMovImmediate
+    UINT8 Kind;                 // SV_MMIO_INSTRUCTION_KIND
+    UINT8 Length;               // Length of the instruction in bytes
+    UINT8 AccessSize;           // Size of the memory access in bytes
+    UINT8 RegisterSize;         // Size of the register operand in bytes
+    UINT8 Register;             // Register operand, if any
+    BOOLEAN HighByteRegister;   // Register is AH, CH, DH or BH
+    BOOLEAN IsWrite;            // Memory is the destination
+    BOOLEAN Rep;                // Has the REP prefix (SvMmioStos only)
+    BOOLEAN AddressSize32;      // Has the address-size override prefix
+} SV_MMIO_INSTRUCTION, *PSV_MMIO_INSTRUCTION;
+
+/*!
+    @brief      Returns the number of bytes of the ModRM byte and what follows
+                it, excluding an immediate operand.
+
+    @param[in]  Bytes - The instruction bytes starting at the ModRM byte.
+    @param[in]  Length - The number of bytes available at Bytes.
+    @param[out] ModRmLength - Receives the number of bytes.
+
+    @result     TRUE when the ModRM byte encodes a memory operand and all bytes
+                are available; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvDecodeModRmLength (
+    _In_reads_(Length) const UINT8* Bytes,
+    _In_ UINT32 Length,
+    _Out_ UINT32* ModRmLength
+    )
+{
+    UINT8 mod, rm, base;
+    UINT32 length;
+
+    *ModRmLength = 0;
+
+    if (Length < 1)
+    {
+        return FALSE;
+    }
+
+    mod = (Bytes[0] >> 6) & 3;
+    rm = Bytes[0] & 7;
+    length = 1;
+
+    //
+    // A register operand is never MMIO access.
+    //
+    if (mod == 3)
+    {
+        return FALSE;
+    }
+
+    //
+    // See "ModRM and SIB Bytes" in the volume 3.
+    //
+    if (rm == 4)
+    {
+        if (Length < 2)
+        {
+            return FALSE;
+        }
+        base = Bytes[1] & 7;
+        length += 1;
+        if ((mod == 0) && (base == 5))
+        {
+            length += 4;
+        }
+    }
+    else if ((mod == 0) && (rm == 5))
+    {
+        length += 4;    // RIP-relative
+    }
+
+    if (mod == 1)
+    {
+        length += 1;
+    }
+    else if (mod == 2)
+    {
+        length += 4;
+    }
+
+    if (length > Length)
+    {
+        return FALSE;
+    }
+    *ModRmLength = length;
+    return TRUE;
+}
+
+/*!
+    @brief      Decodes a 64-bit mode instruction that accesses memory.
+
+    @details    This function decodes the common forms of MOV, MOVZX, MOVSX and
+                STOS that drivers use to access MMIO. Any other instruction,
+                including ones that access memory through a register operand
+                form of ModRM, is rejected.
+
+                The address of the memory operand is not computed as it is
+                provided by the processor (eg, EXITINFO2 of #VMEXIT due to
+                #NPF).
+
+    @param[in]  Bytes - The instruction bytes, starting at the first prefix.
+    @param[in]  Length - The number of bytes available at Bytes.
+    @param[out] Instruction - Receives the decoded instruction.
+
+    @result     TRUE when the instruction is decoded; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvDecodeMmioInstruction (
+    _In_reads_(Length) const UINT8* Bytes,
+    _In_ UINT32 Length,
+    _Out_ PSV_MMIO_INSTRUCTION Instruction
+    )
+{
+    UINT32 offset, modRmLength, immediateSize;
+    UINT8 rex, opcode, operandSize;
+    BOOLEAN operandSize16, rep;
+
+    *Instruction = SV_MMIO_INSTRUCTION{};
+
+    if (Length > SV_MAX_INSTRUCTION_LENGTH)
+    {
+        Length = SV_MAX_INSTRUCTION_LENGTH;
+    }
+
+    //
+    // Consume legacy prefixes. Segment overrides and LOCK do not change how
+    // the instruction is emulated, and REPNE is treated like REP as STOS
+    // ignores the difference.
+    //
+    operandSize16 = FALSE;
+    rep = FALSE;
+    for (offset = 0; offset < Length; offset++)
+    {
+        switch (Bytes[offset])
+        {
+        case 0x66:
+            operandSize16 = TRUE;
+            continue;
+        case 0x67:
+            Instruction->AddressSize32 = TRUE;
+            continue;
+        case 0xf2:
+        case 0xf3:
+            rep = TRUE;
+            continue;
+        case 0x26:
+        case 0x2e:
+        case 0x36:
+        case 0x3e:
+        case 0x64:
+        case 0x65:
+        case 0xf0:
+            continue;
+        default:
+            break;
+        }
+        break;
+    }
+
+    //
+    // REX is only meaningful when it immediately precedes the opcode.
+    //
+    rex = 0;
+    if ((offset < Length) && ((Bytes[offset] & 0xf0) == 0x40))
+    {
+        rex = Bytes[offset];
+        offset++;
+    }
+
+    if (offset >= Length)
+    {
+        return FALSE;
+    }
+
+    if ((rex & 0x08) != 0)
+    {
+        operandSize = 8;
+    }
+    else if (operandSize16 != FALSE)
+    {
+        operandSize = 2;
+    }
+    else
+    {
+        operandSize = 4;
+    }
+
+    opcode = Bytes[offset++];
+    immediateSize = 0;
+    switch (opcode)
+    {
+    case 0x88:  // MOV r/m8, r8
+    case 0x8a:  // MOV r8, r/m8
+        Instruction->Kind = SvMmioMov;
+        Instruction->AccessSize = Instruction->RegisterSize = 1;
+        Instruction->IsWrite = (opcode == 0x88);
+        break;
+    case 0x89:  // MOV r/m, r
+    case 0x8b:  // MOV r, r/m
+        Instruction->Kind = SvMmioMov;
+        Instruction->AccessSize = Instruction->RegisterSize = operandSize;
+        Instruction->IsWrite = (opcode == 0x89);
+        break;
+    case 0xc6:  // MOV r/m8, imm8
+        Instruction->Kind = SvMmioMovImmediate;
+        Instruction->AccessSize = Instruction->RegisterSize = 1;
+        Instruction->IsWrite = TRUE;
+        immediateSize = 1;
+        break;
+    case 0xc7:  // MOV r/m, imm16/imm32
+        Instruction->Kind = SvMmioMovImmediate;
+        Instruction->AccessSize = Instruction->RegisterSize = operandSize;
+        Instruction->IsWrite = TRUE;
+        immediateSize = (operandSize == 2) ? 2 : 4;
+        break;
+    case 0x63:  // MOVSXD r64, r/m32
+        if (operandSize != 8)
+        {
+            return FALSE;
+        }
+        Instruction->Kind = SvMmioMovSx;
+        Instruction->AccessSize = 4;
+        Instruction->RegisterSize = 8;
+        break;
+    case 0xa0:  // MOV AL, moffs8
+    case 0xa1:  // MOV rAX, moffs
+    case 0xa2:  // MOV moffs8, AL
+    case 0xa3:  // MOV moffs, rAX
+        Instruction->Kind = SvMmioMov;
+        Instruction->AccessSize = Instruction->RegisterSize =
+                                        ((opcode & 1) == 0) ? 1 : operandSize;
+        Instruction->IsWrite = (opcode >= 0xa2);
+        Instruction->Register = 0;
+        Instruction->Length = static_cast<UINT8>(
+                        offset + ((Instruction->AddressSize32 != FALSE) ? 4 : 8));
+        return (Instruction->Length <= Length);
+    case 0xaa:  // STOSB
+    case 0xab:  // STOSW/STOSD/STOSQ
+        Instruction->Kind = SvMmioStos;
+        Instruction->AccessSize = Instruction->RegisterSize =
+                                        (opcode == 0xaa) ? 1 : operandSize;
+        Instruction->IsWrite = TRUE;
+        Instruction->Rep = rep;
+        Instruction->Register = 0;
+        Instruction->Length = static_cast<UINT8>(offset);
+        return TRUE;
+    case 0x0f:
+        if (offset >= Length)
+        {
+            return FALSE;
+        }
+        opcode = Bytes[offset++];
+        switch (opcode)
+        {
+        case 0xb6:  // MOVZX r, r/m8
+        case 0xb7:  // MOVZX r, r/m16
+            Instruction->Kind = SvMmioMovZx;
+            break;
+        case 0xbe:  // MOVSX r, r/m8
+        case 0xbf:  // MOVSX r, r/m16
+            Instruction->Kind = SvMmioMovSx;
+            break;
+        default:
+            return FALSE;
+        }
+        Instruction->AccessSize = ((opcode & 1) == 0) ? 1 : 2;
+        Instruction->RegisterSize = operandSize;
+        break;
+    default:
+        return FALSE;
+    }
+
+    //
+    // All remaining forms have ModRM encoding a memory operand. The reg field
+    // selects the register operand, except for MOV with an immediate that
+    // requires /0.
+    //
+    if (SvDecodeModRmLength(&Bytes[offset],
+                            Length - offset,
+                            &modRmLength) == FALSE)
+    {
+        return FALSE;
+    }
+
+    Instruction->Register = ((Bytes[offset] >> 3) & 7) |
+                            (((rex & 0x04) != 0) ? 8 : 0);
+    if (Instruction->Kind == SvMmioMovImmediate)
+    {
+        if (Instruction->Register != 0)
+        {
+            return FALSE;
+        }
+    }
+    else if ((Instruction->AccessSize == 1) &&
+             (Instruction->RegisterSize == 1) &&
+             (rex == 0) &&
+             (Instruction->Register >= 4))
+    {
+        //
+        // Without REX, register numbers 4-7 of byte operands are AH, CH, DH
+        // and BH, ie, bits 15:8 of register numbers 0-3.
+        //
+        Instruction->HighByteRegister = TRUE;
+        Instruction->Register -= 4;
+    }
+    offset += modRmLength;
+
+    if (offset + immediateSize > Length)
+    {
+        return FALSE;
+    }
+    for (UINT32 i = 0; i < immediateSize; i++)
+    {
+        Instruction->Immediate |= static_cast<UINT64>(Bytes[offset + i]) << (i * 8);
+    }
+    if ((immediateSize == 4) && (Instruction->RegisterSize == 8))
+    {
+        Instruction->Immediate = static_cast<UINT64>(static_cast<INT64>(
+                                    static_cast<INT32>(Instruction->Immediate)));
+    }
+    offset += immediateSize;
+
+    Instruction->Length = static_cast<UINT8>(offset);
+    return TRUE;
+}
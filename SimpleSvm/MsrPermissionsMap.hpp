@@ -0,0 +1,193 @@
+/*!
+    @file       MsrPermissionsMap.hpp
+
+    @brief      MSR permissions map (MSRPM).
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+#include "SimpleSvm.hpp"
+
+/*!
+    @brief      Returns the bit in the MSRPM that controls read access to the MSR.
+
+    @details    The MSRPM covers three ranges of MSRs, each in 2KB of the map.
+                The bit that controls write access to the MSR immediately
+                follows the returned bit. Access to MSRs outside the ranges is
+                always intercepted. See "MSR Intercepts".
+
+    @param[in]  Msr - The MSR to locate.
+    @param[out] BitOffset - Receives the offset of the bit from the start of
+                the MSRPM.
+
+    @result     TRUE when the MSR is covered by the MSRPM; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvGetMsrPermissionsMapOffset (
+    _In_ UINT32 Msr,
+    _Out_ PUINT32 BitOffset
+    )
+{
+    static const UINT32 BITS_PER_MSR = 2;
+    static const UINT32 MSR_RANGE_SIZE = 0x2000;
+    static const UINT32 MSR_RANGE_BASES[] = { 0x00000000, 0xc0000000, 0xc0010000, };
+
+    for (UINT32 i = 0; i < sizeof(MSR_RANGE_BASES) / sizeof(MSR_RANGE_BASES[0]); i++)
+    {
+        if ((Msr - MSR_RANGE_BASES[i]) < MSR_RANGE_SIZE)
+        {
+            *BitOffset = (i * 0x800 * 8) +
+                         (Msr - MSR_RANGE_BASES[i]) * BITS_PER_MSR;
+            return TRUE;
+        }
+    }
+    *BitOffset = 0;
+    return FALSE;
+}
+
+/*!
+    @brief      Clears the MSRPM, so that no MSR access is intercepted.
+
+    @param[out] MsrPermissionsMap - The MSRPM of SVM_MSR_PERMISSIONS_MAP_SIZE
+                bytes.
+ */
+inline
+VOID
+SvInitializeMsrPermissionsMap (
+    _Out_writes_bytes_all_(SVM_MSR_PERMISSIONS_MAP_SIZE) PVOID MsrPermissionsMap
+    )
+{
+    PUINT8 map;
+
+    map = static_cast<PUINT8>(MsrPermissionsMap);
+    for (UINT32 i = 0; i < SVM_MSR_PERMISSIONS_MAP_SIZE; i++)
+    {
+        map[i] = 0;
+    }
+}
+
+/*!
+    @brief          Sets the MSRPM to intercept read or write access to the MSR.
+
+    @param[in,out]  MsrPermissionsMap - The MSRPM.
+    @param[in]      Msr - The MSR to intercept.
+    @param[in]      IsWrite - TRUE to intercept write access; FALSE to intercept
+                    read access.
+
+    @result         TRUE when the MSR is covered by the MSRPM; otherwise, FALSE,
+                    and the MSRPM is unchanged. Access to such MSRs is always
+                    intercepted.
+ */
+inline
+BOOLEAN
+SvInterceptMsr (
+    _Inout_updates_bytes_all_(SVM_MSR_PERMISSIONS_MAP_SIZE) PVOID MsrPermissionsMap,
+    _In_ UINT32 Msr,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    PUINT8 map;
+    UINT32 offset;
+
+    if (SvGetMsrPermissionsMapOffset(Msr, &offset) == FALSE)
+    {
+        return FALSE;
+    }
+
+    offset += (IsWrite != FALSE) ? 1 : 0;
+    map = static_cast<PUINT8>(MsrPermissionsMap);
+    map[offset / 8] |= static_cast<UINT8>(1 << (offset % 8));
+    return TRUE;
+}
+
+/*!
+    @brief      Tests whether read or write access to the MSR is intercepted.
+
+    @param[in]  MsrPermissionsMap - The MSRPM.
+    @param[in]  Msr - The MSR to test.
+    @param[in]  IsWrite - TRUE to test write access; FALSE to test read access.
+
+    @result     TRUE when the access is intercepted; otherwise, FALSE.
+ */
+inline
+BOOLEAN
+SvIsMsrIntercepted (
+    _In_reads_bytes_(SVM_MSR_PERMISSIONS_MAP_SIZE) const VOID* MsrPermissionsMap,
+    _In_ UINT32 Msr,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    const UINT8* map;
+    UINT32 offset;
+
+    if (SvGetMsrPermissionsMapOffset(Msr, &offset) == FALSE)
+    {
+        return TRUE;
+    }
+
+    offset += (IsWrite != FALSE) ? 1 : 0;
+    map = static_cast<const UINT8*>(MsrPermissionsMap);
+    return ((map[offset / 8] & (1 << (offset % 8))) != 0);
+}
+
+/*!
+    @brief      Build the MSR permissions map (MSRPM).
+
+    @details    This function sets up MSRPM to intercept to IA32_MSR_EFER,
+                as suggested in "Extended Feature Enable Register (EFER)"
+                ----
+                Secure Virtual Machine Enable (SVME) Bit
+                Bit 12, read/write. Enables the SVM extensions. (...) The
+                effect of turning off EFER.SVME while a guest is running is
+                undefined; therefore, the VMM should always prevent guests
+                from writing EFER.
+                ----
+
+                Each MSR is controlled by two bits in the MSRPM. The LSB of
+                the two bits controls read access to the MSR and the MSB
+                controls write access. A value of 1 indicates that the
+                operation is intercepted. This function sets the LSB or MSB
+                bit of each MSR listed in Policy, which always includes
+                IA32_MSR_EFER. All listed MSRs must be covered by the MSRPM.
+                For details of logic, see "MSR Intercepts".
+
+    @param[out] MsrPermissionsMap - The MSRPM to set up.
+ */
+template<typename Policy>
+inline
+VOID
+SvBuildMsrPermissionsMap (
+    _Out_writes_bytes_all_(SVM_MSR_PERMISSIONS_MAP_SIZE) PVOID MsrPermissionsMap
+    )
+{
+    //
+    // Clear all bits, indicating no MSR access should be intercepted.
+    //
+    SvInitializeMsrPermissionsMap(MsrPermissionsMap);
+
+    //
+    // Set the LSB bit indicating read accesses to the MSR should be intercepted.
+    //
+    for (UINT32 msr : Policy::ReadInterceptedMsrs)
+    {
+        SvInterceptMsr(MsrPermissionsMap, msr, FALSE);
+    }
+
+    //
+    // Set the MSB bit indicating write accesses to the MSR should be
+    // intercepted.
+    //
+    for (UINT32 msr : Policy::WriteInterceptedMsrs)
+    {
+        SvInterceptMsr(MsrPermissionsMap, msr, TRUE);
+    }
+}
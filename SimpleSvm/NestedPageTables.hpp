@@ -0,0 +1,337 @@
+/*!
+    @file       NestedPageTables.hpp
+
+    @brief      Identity nested page tables translating up to 512GB.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN, and SSE2.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+#include <stddef.h>
+#include <emmintrin.h>
+
+#define SV_NPT_PAGE_SHIFT           12
+#define SV_NPT_PAGE_SIZE            (1ULL << SV_NPT_PAGE_SHIFT)
+#define SV_NPT_ENTRIES_PER_TABLE    512
+
+//
+// See "2-Mbyte PML4E-Long Mode" and "2-Mbyte PDPE-Long Mode".
+//
+typedef struct _PML4_ENTRY_2MB
+{
+    union
+    {
+        UINT64 AsUInt64;
+        struct
+        {
+            UINT64 Valid : 1;               // [0]
+            UINT64 Write : 1;               // [1]
+            UINT64 User : 1;                // [2]
+            UINT64 WriteThrough : 1;        // [3]
+            UINT64 CacheDisable : 1;        // [4]
+            UINT64 Accessed : 1;            // [5]
+            UINT64 Reserved1 : 3;           // [6:8]
+            UINT64 Avl : 3;                 // [9:11]
+            UINT64 PageFrameNumber : 40;    // [12:51]
+            UINT64 Reserved2 : 11;          // [52:62]
+            UINT64 NoExecute : 1;           // [63]
+        } Fields;
+    };
+} PML4_ENTRY_2MB, *PPML4_ENTRY_2MB,
+  PDP_ENTRY_2MB, *PPDP_ENTRY_2MB,
+  PD_ENTRY_4KB, *PPD_ENTRY_4KB;
+static_assert(sizeof(PML4_ENTRY_2MB) == 8,
+              "PML4_ENTRY_1GB Size Mismatch");
+
+//
+// See "2-Mbyte PDE-Long Mode".
+//
+typedef struct _PD_ENTRY_2MB
+{
+    union
+    {
+        UINT64 AsUInt64;
+        struct
+        {
+            UINT64 Valid : 1;               // [0]
+            UINT64 Write : 1;               // [1]
+            UINT64 User : 1;                // [2]
+            UINT64 WriteThrough : 1;        // [3]
+            UINT64 CacheDisable : 1;        // [4]
+            UINT64 Accessed : 1;            // [5]
+            UINT64 Dirty : 1;               // [6]
+            UINT64 LargePage : 1;           // [7]
+            UINT64 Global : 1;              // [8]
+            UINT64 Avl : 3;                 // [9:11]
+            UINT64 Pat : 1;                 // [12]
+            UINT64 Reserved1 : 8;           // [13:20]
+            UINT64 PageFrameNumber : 31;    // [21:51]
+            UINT64 Reserved2 : 11;          // [52:62]
+            UINT64 NoExecute : 1;           // [63]
+        } Fields;
+    };
+} PD_ENTRY_2MB, *PPD_ENTRY_2MB;
+static_assert(sizeof(PD_ENTRY_2MB) == 8,
+              "PDE_ENTRY_2MB Size Mismatch");
+
+//
+// See "4-Kbyte PTE-Long Mode".
+//
+typedef struct _PT_ENTRY_4KB
+{
+    union
+    {
+        UINT64 AsUInt64;
+        struct
+        {
+            UINT64 Valid : 1;               // [0]
+            UINT64 Write : 1;               // [1]
+            UINT64 User : 1;                // [2]
+            UINT64 WriteThrough : 1;        // [3]
+            UINT64 CacheDisable : 1;        // [4]
+            UINT64 Accessed : 1;            // [5]
+            UINT64 Dirty : 1;               // [6]
+            UINT64 Pat : 1;                 // [7]
+            UINT64 Global : 1;              // [8]
+            UINT64 Avl : 3;                 // [9:11]
+            UINT64 PageFrameNumber : 40;    // [12:51]
+            UINT64 Reserved1 : 11;          // [52:62]
+            UINT64 NoExecute : 1;           // [63]
+        } Fields;
+    };
+} PT_ENTRY_4KB, *PPT_ENTRY_4KB;
+static_assert(sizeof(PT_ENTRY_4KB) == 8,
+              "PT_ENTRY_4KB Size Mismatch");
+
+//
+// Nested page tables translating up to 512GB with 2MB pages. They are
+// allocated on contiguous physical memory, so that physical addresses of the
+// tables are computed from their offsets. See SvBuildNestedPageTables.
+//
+#define SV_LARGE_PAGE_SIZE          (1ULL << 21)
+
+typedef struct _SV_NPT_ROOT
+{
+    alignas(SV_NPT_PAGE_SIZE) PML4_ENTRY_2MB Pml4Entries[1];    // Just for 512 GB
+    alignas(SV_NPT_PAGE_SIZE) PDP_ENTRY_2MB PdpEntries[SV_NPT_ENTRIES_PER_TABLE];
+} SV_NPT_ROOT, *PSV_NPT_ROOT;
+
+typedef struct _SV_NESTED_PAGE_TABLES
+{
+    SV_NPT_ROOT Root;
+    alignas(SV_NPT_PAGE_SIZE)
+    PD_ENTRY_2MB PdeEntries[SV_NPT_ENTRIES_PER_TABLE][SV_NPT_ENTRIES_PER_TABLE];
+} SV_NESTED_PAGE_TABLES, *PSV_NESTED_PAGE_TABLES;
+
+/*!
+    @brief      Build pass-through style page tables used in nested paging.
+
+    @details    This function build page tables used in Nested Page Tables. The
+                page tables are used to translate from a guest physical address
+                to a system physical address and pointed by the NCr3 field of
+                VMCB, like the traditional page tables are pointed by CR3.
+
+                The nested page tables built in this function are set to
+                translate a guest physical address to the same system physical
+                address. For example, guest physical address 0x1000 is
+                translated into system physical address 0x1000.
+
+                In order to save memory to build nested page tables, 2MB large
+                pages are used (as opposed to the standard pages that describe
+                translation only for 4K granularity. Also, only up to 512 GB of
+                translation is built. 1GB huge pages are not used due to VMware
+                not supporting this feature.
+
+                The tables are on contiguous physical memory, so physical
+                addresses of page directories are computed from NptBasePa
+                instead of being looked up for each. Entries are written as raw
+                64-bit values from a template, two at a time with SSE2 stores.
+
+                NPT views share page directories of these tables. See
+                SvShareNptDirectories.
+
+    @param[out]     Npt - The nested page tables to build.
+    @param[in]      NptBasePa - The physical address of Npt.
+ */
+inline
+VOID
+SvBuildNestedPageTables (
+    _Out_ PSV_NESTED_PAGE_TABLES Npt,
+    _In_ UINT64 NptBasePa
+    )
+{
+    PML4_ENTRY_2MB pml4Entry;
+    PDP_ENTRY_2MB pdpEntry;
+    PD_ENTRY_2MB pdEntry;
+    __m128i entries, increment;
+    __m128i* destination;
+
+    //
+    // Build only one PML4 entry. This entry has subtables that control up to
+    // 512GB physical memory. PFN points to a base physical address of the page
+    // directory pointer table.
+    //
+    // The US (User) bit of all nested page table entries to be translated
+    // without #VMEXIT, as all guest accesses are treated as user accesses at
+    // the nested level. Also, the RW (Write) bit of nested page table entries
+    // that corresponds to guest page tables must be 1 since all guest page
+    // table accesses are threated as write access. See "Nested versus Guest
+    // Page Faults, Fault Ordering" for more details.
+    //
+    // Nested page tables built here set 1 to those bits for all entries, so
+    // that all translation can complete without triggering #VMEXIT. This does
+    // not lower security since security checks are done twice independently:
+    // based on guest page tables, and nested page tables. See "Nested versus
+    // Guest Page Faults, Fault Ordering" for more details.
+    //
+    pml4Entry.AsUInt64 = 0;
+    pml4Entry.Fields.PageFrameNumber = (NptBasePa +
+                        offsetof(SV_NESTED_PAGE_TABLES, Root.PdpEntries)) >> SV_NPT_PAGE_SHIFT;
+    pml4Entry.Fields.Valid = 1;
+    pml4Entry.Fields.Write = 1;
+    pml4Entry.Fields.User = 1;
+    Npt->Root.Pml4Entries[0] = pml4Entry;
+
+    //
+    // One PML4 entry controls 512 page directory pointer entires. PFN points to
+    // a base physical address of the page directory table, which are laid out
+    // one page after another.
+    //
+    pdpEntry.AsUInt64 = 0;
+    pdpEntry.Fields.PageFrameNumber = (NptBasePa +
+                        offsetof(SV_NESTED_PAGE_TABLES, PdeEntries)) >> SV_NPT_PAGE_SHIFT;
+    pdpEntry.Fields.Valid = 1;
+    pdpEntry.Fields.Write = 1;
+    pdpEntry.Fields.User = 1;
+    for (UINT64 i = 0; i < SV_NPT_ENTRIES_PER_TABLE; i++)
+    {
+        Npt->Root.PdpEntries[i].AsUInt64 = pdpEntry.AsUInt64 + (i << SV_NPT_PAGE_SHIFT);
+    }
+
+    //
+    // Each page directory pointer entry controls 512 page directory entries.
+    //
+    // We do not explicitly configure PAT in the NPT entry. The consequences
+    // of this are: 1) pages whose PAT (Page Attribute Table) type is the
+    // Write-Combining (WC) memory type could be treated as the
+    // Write-Combining Plus (WC+) while it should be WC when the MTRR type is
+    // either Write Protect (WP), Writethrough (WT) or Writeback (WB), and
+    // 2) pages whose PAT type is Uncacheable Minus (UC-) could be treated
+    // as Cache Disabled (CD) while it should be WC, when MTRR type is WC.
+    //
+    // While those are not desirable, this is acceptable given that 1) only
+    // introduces additional cache snooping and associated performance
+    // penalty, which would not be significant since WC+ still lets
+    // processors combine multiple writes into one and avoid large
+    // performance penalty due to frequent writes to memory without caching.
+    // 2) might be worse but I have not seen MTRR ranges configured as WC
+    // on testing, hence the unintentional UC- will just results in the same
+    // effective memory type as what would be with UC.
+    //
+    // See "Memory Types" (7.4), for details of memory types,
+    // "PAT-Register PA-Field Indexing", "Combining Guest and Host PAT Types",
+    // and "Combining PAT and MTRR Types" for how the effective memory type
+    // is determined based on Guest PAT type, Host PAT type, and the MTRR
+    // type.
+    //
+    // The correct approach may be to look up the guest PTE and copy the
+    // caching related bits (PAT, PCD, and PWT) when constructing NTP
+    // entries for non RAM regions, so the combined PAT will always be the
+    // same as the guest PAT type. This may be done when any issue manifests
+    // with the current implementation.
+    //
+    //
+    // PFN points to a base physical address of system physical address to be
+    // translated from a guest physical address. Set the PS (LargePage) bit to
+    // indicate that this is a large page and no subtable exists.
+    //
+    // As all page directories are contiguous, the n-th entry of them translates
+    // n * 2MB. Entries are written with non-temporal stores, since 2MB of them
+    // would otherwise evict most of the cache only to be written back later.
+    // The stores are made globally visible with SFENCE before the tables are
+    // used.
+    //
+    pdEntry.AsUInt64 = 0;
+    pdEntry.Fields.Valid = 1;
+    pdEntry.Fields.Write = 1;
+    pdEntry.Fields.User = 1;
+    pdEntry.Fields.LargePage = 1;
+
+    static_assert((sizeof(Npt->PdeEntries) % (sizeof(__m128i) * 4)) == 0,
+                  "PdeEntries must be a multiple of the unrolled stores");
+    entries = _mm_set_epi64x(static_cast<INT64>(pdEntry.AsUInt64 + SV_LARGE_PAGE_SIZE),
+                             static_cast<INT64>(pdEntry.AsUInt64));
+    increment = _mm_set1_epi64x(SV_LARGE_PAGE_SIZE * 2);
+    destination = reinterpret_cast<__m128i*>(Npt->PdeEntries);
+    for (UINT64 i = 0; i < sizeof(Npt->PdeEntries) / sizeof(__m128i); i += 4)
+    {
+        _mm_stream_si128(&destination[i + 0], entries);
+        entries = _mm_add_epi64(entries, increment);
+        _mm_stream_si128(&destination[i + 1], entries);
+        entries = _mm_add_epi64(entries, increment);
+        _mm_stream_si128(&destination[i + 2], entries);
+        entries = _mm_add_epi64(entries, increment);
+        _mm_stream_si128(&destination[i + 3], entries);
+        entries = _mm_add_epi64(entries, increment);
+    }
+    _mm_sfence();
+}
+
+/*!
+    @brief          Builds the same nested page tables as SvBuildNestedPageTables
+                    one bit field at a time.
+
+    @details        This is how the tables used to be built, kept as a baseline
+                    for benchmarks. The original also looked up the physical
+                    address of each page directory with MmGetPhysicalAddress;
+                    this computes them from NptBasePa instead, so that the
+                    comparison is of how entries are written.
+
+    @param[out]     Npt - The nested page tables to build.
+    @param[in]      NptBasePa - The physical address of Npt.
+ */
+inline
+VOID
+SvBuildNestedPageTablesWithBitFields (
+    _Out_ PSV_NESTED_PAGE_TABLES Npt,
+    _In_ UINT64 NptBasePa
+    )
+{
+    UINT64 pdpBasePa, pdeBasePa, translationPa;
+
+    pdpBasePa = NptBasePa + offsetof(SV_NESTED_PAGE_TABLES, Root.PdpEntries);
+    Npt->Root.Pml4Entries[0].AsUInt64 = 0;
+    Npt->Root.Pml4Entries[0].Fields.PageFrameNumber = pdpBasePa >> SV_NPT_PAGE_SHIFT;
+    Npt->Root.Pml4Entries[0].Fields.Valid = 1;
+    Npt->Root.Pml4Entries[0].Fields.Write = 1;
+    Npt->Root.Pml4Entries[0].Fields.User = 1;
+
+    for (UINT64 i = 0; i < SV_NPT_ENTRIES_PER_TABLE; i++)
+    {
+        pdeBasePa = NptBasePa + offsetof(SV_NESTED_PAGE_TABLES, PdeEntries) +
+                    i * sizeof(Npt->PdeEntries[0]);
+        Npt->Root.PdpEntries[i].AsUInt64 = 0;
+        Npt->Root.PdpEntries[i].Fields.PageFrameNumber = pdeBasePa >> SV_NPT_PAGE_SHIFT;
+        Npt->Root.PdpEntries[i].Fields.Valid = 1;
+        Npt->Root.PdpEntries[i].Fields.Write = 1;
+        Npt->Root.PdpEntries[i].Fields.User = 1;
+
+        for (UINT64 j = 0; j < SV_NPT_ENTRIES_PER_TABLE; j++)
+        {
+            translationPa = (i * SV_NPT_ENTRIES_PER_TABLE) + j;
+            Npt->PdeEntries[i][j].AsUInt64 = 0;
+            Npt->PdeEntries[i][j].Fields.PageFrameNumber = translationPa;
+            Npt->PdeEntries[i][j].Fields.Valid = 1;
+            Npt->PdeEntries[i][j].Fields.Write = 1;
+            Npt->PdeEntries[i][j].Fields.User = 1;
+            Npt->PdeEntries[i][j].Fields.LargePage = 1;
+        }
+    }
+}
@@ -0,0 +1,127 @@
+/*!
+    @file       SegmentDescriptor.hpp
+
+    @brief      Segment descriptors and attributes of segments in the VMCB.
+
+    @details    This file has no dependency on the kernel and can be compiled
+                for any environment that provides the Windows base types, such
+                as UINT64 and BOOLEAN.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <basetsd.h>
+
+#define RPL_MASK        3
+#define DPL_SYSTEM      0
+
+//
+// See "Long-Mode Segment Descriptors" and some of definitions
+// (eg, "Code-Segment Descriptor-Long Mode")
+//
+typedef struct _SEGMENT_DESCRIPTOR
+{
+    union
+    {
+        UINT64 AsUInt64;
+        struct
+        {
+            UINT16 LimitLow;        // [0:15]
+            UINT16 BaseLow;         // [16:31]
+            UINT32 BaseMiddle : 8;  // [32:39]
+            UINT32 Type : 4;        // [40:43]
+            UINT32 System : 1;      // [44]
+            UINT32 Dpl : 2;         // [45:46]
+            UINT32 Present : 1;     // [47]
+            UINT32 LimitHigh : 4;   // [48:51]
+            UINT32 Avl : 1;         // [52]
+            UINT32 LongMode : 1;    // [53]
+            UINT32 DefaultBit : 1;  // [54]
+            UINT32 Granularity : 1; // [55]
+            UINT32 BaseHigh : 8;    // [56:63]
+        } Fields;
+    };
+} SEGMENT_DESCRIPTOR, *PSEGMENT_DESCRIPTOR;
+static_assert(sizeof(SEGMENT_DESCRIPTOR) == 8,
+              "SEGMENT_DESCRIPTOR Size Mismatch");
+
+typedef struct _SEGMENT_ATTRIBUTE
+{
+    union
+    {
+        UINT16 AsUInt16;
+        struct
+        {
+            UINT16 Type : 4;        // [0:3]
+            UINT16 System : 1;      // [4]
+            UINT16 Dpl : 2;         // [5:6]
+            UINT16 Present : 1;     // [7]
+            UINT16 Avl : 1;         // [8]
+            UINT16 LongMode : 1;    // [9]
+            UINT16 DefaultBit : 1;  // [10]
+            UINT16 Granularity : 1; // [11]
+            UINT16 Reserved1 : 4;   // [12:15]
+        } Fields;
+    };
+} SEGMENT_ATTRIBUTE, *PSEGMENT_ATTRIBUTE;
+static_assert(sizeof(SEGMENT_ATTRIBUTE) == 2,
+              "SEGMENT_ATTRIBUTE Size Mismatch");
+
+/*!
+    @brief      Returns attributes of a segment specified by the segment selector.
+
+    @details    This function locates a segment descriptor from the segment
+                selector and the GDT base, extracts attributes of the segment,
+                and returns it. The returned value is the same as what the "dg"
+                command of Windbg shows as "Flags". Here is an example output
+                with 0x18 of the selector:
+                ----
+                0: kd> dg 18
+                P Si Gr Pr Lo
+                Sel        Base              Limit          Type    l ze an es ng Flags
+                ---- ----------------- ----------------- ---------- - -- -- -- -- --------
+                0018 00000000`00000000 00000000`00000000 Data RW Ac 0 Bg By P  Nl 00000493
+                ----
+
+    @param[in]  SegmentSelector - A segment selector to get attributes of a
+                corresponding descriptor.
+    @param[in]  GdtBase - A base address of GDT.
+
+    @result     Attributes of the segment.
+ */
+inline
+UINT16
+SvGetSegmentAccessRight (
+    _In_ UINT16 SegmentSelector,
+    _In_ ULONG_PTR GdtBase
+    )
+{
+    PSEGMENT_DESCRIPTOR descriptor;
+    SEGMENT_ATTRIBUTE attribute;
+
+    //
+    // Get a segment descriptor corresponds to the specified segment selector.
+    //
+    descriptor = reinterpret_cast<PSEGMENT_DESCRIPTOR>(
+                                        GdtBase + (SegmentSelector & ~RPL_MASK));
+
+    //
+    // Extract all attribute fields in the segment descriptor to a structure
+    // that describes only attributes (as opposed to the segment descriptor
+    // consists of multiple other fields).
+    //
+    attribute.Fields.Type = descriptor->Fields.Type;
+    attribute.Fields.System = descriptor->Fields.System;
+    attribute.Fields.Dpl = descriptor->Fields.Dpl;
+    attribute.Fields.Present = descriptor->Fields.Present;
+    attribute.Fields.Avl = descriptor->Fields.Avl;
+    attribute.Fields.LongMode = descriptor->Fields.LongMode;
+    attribute.Fields.DefaultBit = descriptor->Fields.DefaultBit;
+    attribute.Fields.Granularity = descriptor->Fields.Granularity;
+    attribute.Fields.Reserved1 = 0;
+
+    return attribute.AsUInt16;
+}
@@ -13,10 +13,30 @@
 #include <intrin.h>
 #include <ntifs.h>
 #include <stdarg.h>
+#include <aux_klib.h>
+#include <wdmsec.h>
+
+#include "MmioDecoder.hpp"
+#include "GuestPageWalker.hpp"
+#include "IoPermissionsMap.hpp"
+#include "GuestMemoryAccess.hpp"
+#include "ControlInterface.hpp"
+#include "CpuidMsrEmulation.hpp"
+#include "MsrPermissionsMap.hpp"
+#include "NestedPageTables.hpp"
+#include "SegmentDescriptor.hpp"
 
 EXTERN_C DRIVER_INITIALIZE DriverEntry;
 static DRIVER_UNLOAD SvDriverUnload;
 static CALLBACK_FUNCTION SvPowerCallbackRoutine;
+static PROCESSOR_CALLBACK_FUNCTION SvProcessorChangeCallback;
+_Dispatch_type_(IRP_MJ_CREATE)
+_Dispatch_type_(IRP_MJ_CLOSE)
+static DRIVER_DISPATCH SvDispatchCreateClose;
+_Dispatch_type_(IRP_MJ_CLEANUP)
+static DRIVER_DISPATCH SvDispatchCleanup;
+_Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
+static DRIVER_DISPATCH SvDispatchDeviceControl;
 
 EXTERN_C
 VOID
@@ -35,68 +55,17 @@ SvLaunchVm (
     _In_ PVOID HostRsp
     );
 
-//
-// x86-64 defined structures.
-//
-
-//
-// See "2-Mbyte PML4E-Long Mode" and "2-Mbyte PDPE-Long Mode".
-//
-typedef struct _PML4_ENTRY_2MB
-{
-    union
-    {
-        UINT64 AsUInt64;
-        struct
-        {
-            UINT64 Valid : 1;               // [0]
-            UINT64 Write : 1;               // [1]
-            UINT64 User : 1;                // [2]
-            UINT64 WriteThrough : 1;        // [3]
-            UINT64 CacheDisable : 1;        // [4]
-            UINT64 Accessed : 1;            // [5]
-            UINT64 Reserved1 : 3;           // [6:8]
-            UINT64 Avl : 3;                 // [9:11]
-            UINT64 PageFrameNumber : 40;    // [12:51]
-            UINT64 Reserved2 : 11;          // [52:62]
-            UINT64 NoExecute : 1;           // [63]
-        } Fields;
-    };
-} PML4_ENTRY_2MB, *PPML4_ENTRY_2MB,
-  PDP_ENTRY_2MB, *PPDP_ENTRY_2MB;
-static_assert(sizeof(PML4_ENTRY_2MB) == 8,
-              "PML4_ENTRY_1GB Size Mismatch");
+EXTERN_C
+VOID
+NTAPI
+SvVmmcall (
+    _Out_writes_(4) int Registers[4],
+    _In_ int Function
+    );
 
 //
-// See "2-Mbyte PDE-Long Mode".
+// x86-64 defined structures.
 //
-typedef struct _PD_ENTRY_2MB
-{
-    union
-    {
-        UINT64 AsUInt64;
-        struct
-        {
-            UINT64 Valid : 1;               // [0]
-            UINT64 Write : 1;               // [1]
-            UINT64 User : 1;                // [2]
-            UINT64 WriteThrough : 1;        // [3]
-            UINT64 CacheDisable : 1;        // [4]
-            UINT64 Accessed : 1;            // [5]
-            UINT64 Dirty : 1;               // [6]
-            UINT64 LargePage : 1;           // [7]
-            UINT64 Global : 1;              // [8]
-            UINT64 Avl : 3;                 // [9:11]
-            UINT64 Pat : 1;                 // [12]
-            UINT64 Reserved1 : 8;           // [13:20]
-            UINT64 PageFrameNumber : 31;    // [21:51]
-            UINT64 Reserved2 : 11;          // [52:62]
-            UINT64 NoExecute : 1;           // [63]
-        } Fields;
-    };
-} PD_ENTRY_2MB, *PPD_ENTRY_2MB;
-static_assert(sizeof(PD_ENTRY_2MB) == 8,
-              "PDE_ENTRY_2MB Size Mismatch");
 
 //
 // See "GDTR and IDTR Format-Long Mode"
@@ -112,69 +81,499 @@ static_assert(sizeof(DESCRIPTOR_TABLE_REGISTER) == 10,
 #include <poppack.h>
 
 //
-// See "Long-Mode Segment Descriptors" and some of definitions
-// (eg, "Code-Segment Descriptor-Long Mode")
+// SimpleSVM specific structures.
+//
+
+//
+// TLB flush requests to be carried out on the next VMRUN. Values are ordered by
+// strength so that the strongest pending request can be taken with a simple
+// comparison.
 //
-typedef struct _SEGMENT_DESCRIPTOR
+typedef enum _SV_TLB_FLUSH_TYPE
 {
-    union
-    {
-        UINT64 AsUInt64;
-        struct
-        {
-            UINT16 LimitLow;        // [0:15]
-            UINT16 BaseLow;         // [16:31]
-            UINT32 BaseMiddle : 8;  // [32:39]
-            UINT32 Type : 4;        // [40:43]
-            UINT32 System : 1;      // [44]
-            UINT32 Dpl : 2;         // [45:46]
-            UINT32 Present : 1;     // [47]
-            UINT32 LimitHigh : 4;   // [48:51]
-            UINT32 Avl : 1;         // [52]
-            UINT32 LongMode : 1;    // [53]
-            UINT32 DefaultBit : 1;  // [54]
-            UINT32 Granularity : 1; // [55]
-            UINT32 BaseHigh : 8;    // [56:63]
-        } Fields;
-    };
-} SEGMENT_DESCRIPTOR, *PSEGMENT_DESCRIPTOR;
-static_assert(sizeof(SEGMENT_DESCRIPTOR) == 8,
-              "SEGMENT_DESCRIPTOR Size Mismatch");
+    SvTlbFlushNone = 0,             // Nothing changed.
+    SvTlbFlushGuestNonGlobal,       // Guest non-global translations changed.
+    SvTlbFlushGuest,                // Nested translations changed.
+} SV_TLB_FLUSH_TYPE;
 
-typedef struct _SEGMENT_ATTRIBUTE
+//
+// The maximum number of MMIO ranges that can be trapped, and the maximum number
+// of 2MB large pages that can be split to trap them at 4KB granularity.
+//
+#define SV_MAX_MMIO_RANGES          8
+#define SV_MAX_SPLIT_PAGE_TABLES    16
+
+//
+// How long SvSetInterceptPolicy waits for processors to pick up a new policy
+// at their own #VMEXIT before forcing it.
+//
+#define SV_POLICY_CONVERGENCE_TIMEOUT_MS    10
+
+//
+// The number of instructions cached per processor for MMIO emulation.
+//
+#define SV_MMIO_DECODE_CACHE_SIZE   16
+
+typedef struct _SV_MMIO_RANGE SV_MMIO_RANGE, *PSV_MMIO_RANGE;
+
+/*!
+    @brief      Performs an access to a trapped MMIO range on behalf of the guest.
+
+    @details    This callback is called from the host context and must follow
+                the same restrictions as any other #VMEXIT handler.
+
+    @param[in]      Range - The MMIO range being accessed.
+    @param[in]      Offset - The offset from the base of the range.
+    @param[in]      AccessSize - The size of the access in bytes (1, 2, 4 or 8).
+    @param[in]      IsWrite - TRUE for a write access.
+    @param[in,out]  Value - The value to write, or receives the value read.
+ */
+typedef
+_IRQL_requires_same_
+VOID
+SV_MMIO_HANDLER (
+    _In_ PSV_MMIO_RANGE Range,
+    _In_ UINT64 Offset,
+    _In_ UINT32 AccessSize,
+    _In_ BOOLEAN IsWrite,
+    _Inout_ PUINT64 Value
+    );
+typedef SV_MMIO_HANDLER *PSV_MMIO_HANDLER;
+
+typedef struct _SV_MMIO_RANGE
 {
-    union
-    {
-        UINT16 AsUInt16;
-        struct
-        {
-            UINT16 Type : 4;        // [0:3]
-            UINT16 System : 1;      // [4]
-            UINT16 Dpl : 2;         // [5:6]
-            UINT16 Present : 1;     // [7]
-            UINT16 Avl : 1;         // [8]
-            UINT16 LongMode : 1;    // [9]
-            UINT16 DefaultBit : 1;  // [10]
-            UINT16 Granularity : 1; // [11]
-            UINT16 Reserved1 : 4;   // [12:15]
-        } Fields;
-    };
-} SEGMENT_ATTRIBUTE, *PSEGMENT_ATTRIBUTE;
-static_assert(sizeof(SEGMENT_ATTRIBUTE) == 2,
-              "SEGMENT_ATTRIBUTE Size Mismatch");
+    UINT64 GuestPa;
+    UINT64 Size;
+    PVOID MappedVa;                 // Host mapping of the range
+    PSV_MMIO_HANDLER Handler;
+    volatile LONG64 ReadCount;
+    volatile LONG64 WriteCount;
+} SV_MMIO_RANGE, *PSV_MMIO_RANGE;
+
+typedef struct _SV_MMIO_DECODE_CACHE_ENTRY
+{
+    UINT64 Rip;
+    UINT8 Bytes[SV_MAX_INSTRUCTION_LENGTH];
+    SV_MMIO_INSTRUCTION Instruction;
+} SV_MMIO_DECODE_CACHE_ENTRY, *PSV_MMIO_DECODE_CACHE_ENTRY;
 
 //
-// SimpleSVM specific structures.
+// The maximum number of I/O port ranges that can be intercepted.
+//
+#define SV_MAX_IO_PORT_POLICIES     8
+
+/*!
+    @brief      Performs an access to an intercepted I/O port on behalf of the
+                guest.
+
+    @details    This callback is called from the host context and must follow
+                the same restrictions as any other #VMEXIT handler.
+
+    @param[in]      Port - The port being accessed.
+    @param[in]      Size - The size of the access in bytes (1, 2 or 4).
+    @param[in]      IsIn - TRUE for a read (IN or INS) access.
+    @param[in,out]  Value - The value to write, or receives the value read.
+ */
+typedef
+_IRQL_requires_same_
+VOID
+SV_IO_PORT_HANDLER (
+    _In_ UINT16 Port,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsIn,
+    _Inout_ PUINT32 Value
+    );
+typedef SV_IO_PORT_HANDLER *PSV_IO_PORT_HANDLER;
+
+/*!
+    @brief      Locates platform specific I/O ports at initialization.
+
+    @param[out] FirstPort - Receives the first port.
+    @param[out] LastPort - Receives the last port, inclusive.
+
+    @result     STATUS_SUCCESS when the ports are found; otherwise, an
+                appropriate error code, and the policy is not applied.
+ */
+typedef
+_IRQL_requires_max_(PASSIVE_LEVEL)
+NTSTATUS
+SV_IO_PORT_LOCATOR (
+    _Out_ PUINT16 FirstPort,
+    _Out_ PUINT16 LastPort
+    );
+typedef SV_IO_PORT_LOCATOR *PSV_IO_PORT_LOCATOR;
+
+//
+// A declarative description of I/O ports to intercept and how to handle them.
+// Locate is used instead of FirstPort and LastPort when it is not NULL.
+//
+typedef struct _SV_IO_PORT_POLICY
+{
+    PCSTR Name;
+    UINT16 FirstPort;
+    UINT16 LastPort;
+    PSV_IO_PORT_LOCATOR Locate;
+    PSV_IO_PORT_HANDLER Handler;
+} SV_IO_PORT_POLICY, *PSV_IO_PORT_POLICY;
+
+//
+// Per processor statistics of an I/O port policy. Latency is measured in TSC
+// cycles spent in the handler, ie, mostly in the access to the device.
+//
+typedef struct _SV_IO_PORT_STATISTICS
+{
+    UINT64 InCount;
+    UINT64 OutCount;
+    UINT64 TotalCycles;
+    UINT64 MaxCycles;
+} SV_IO_PORT_STATISTICS, *PSV_IO_PORT_STATISTICS;
+
+//
+// A mapping of the statistics region into a process, associated with the file
+// object the mapping was requested with.
+//
+typedef struct _SV_STATISTICS_MAPPING
+{
+    PEPROCESS Process;
+    PVOID UserVa;
+} SV_STATISTICS_MAPPING, *PSV_STATISTICS_MAPPING;
+
+#if defined(SV_ENABLE_BENCHMARKS)
+//
+// The number of #VMEXITs replayed per iteration of the dispatch benchmark.
+//
+#define SV_BENCHMARK_EXIT_MIX_LENGTH    64
+
+//
+// The guest virtual address the software TLB benchmarks translate, and the
+// number of synthetic page tables that map it (PML4, PDPT, PD and PT).
+//
+#define SV_BENCHMARK_GUEST_VA           0x00007ff612345000ULL
+#define SV_BENCHMARK_PAGE_TABLE_LEVELS  4
+
+//
+// State shared by benchmark routines. Everything is scratch memory, and nothing
+// is referenced by the processor.
+//
+typedef struct _SV_BENCHMARK_CONTEXT
+{
+    struct _SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData;
+    struct _VIRTUAL_PROCESSOR_DATA* VpData;
+    UINT64 GuestEfer;
+    UINT64 GdtBase;
+    UINT16 Selectors[4];
+    UINT64 Sink;                    // Keeps results from being optimized out
+    UINT32 ExitMix[SV_BENCHMARK_EXIT_MIX_LENGTH];
+    SV_VP_STATISTICS RecordedStatistics;
+    SV_GUEST_PAGING_STATE PagingState;
+    SV_SOFT_TLB SoftTlb;
+    UINT64 PageTables[SV_BENCHMARK_PAGE_TABLE_LEVELS][512];
+    CONTEXT ContextRecord;
+} SV_BENCHMARK_CONTEXT, *PSV_BENCHMARK_CONTEXT;
+
+/*!
+    @brief          Executes one iteration of a benchmark.
+
+    @param[in,out]  Context - The benchmark context.
+    @param[in]      Iteration - The zero-based iteration number.
+ */
+typedef
+VOID
+SV_BENCHMARK_ROUTINE (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    );
+typedef SV_BENCHMARK_ROUTINE *PSV_BENCHMARK_ROUTINE;
+#endif
+
+//
+// An intercept policy set at run time. It replaces the intercept words, the
+// exception bitmap and the MSRPM of GuestVmcb, and is never modified once
+// published. See SvSetInterceptPolicy and SvSynchronizeInterceptPolicy.
+//
+typedef struct _SV_POLICY_VERSION
+{
+    LONG64 Generation;
+    UINT32 InterceptMisc1;
+    UINT32 InterceptMisc2;
+    UINT32 InterceptException;
+    PVOID MsrPermissionsMap;
+    UINT64 MsrpmBasePa;
+} SV_POLICY_VERSION, *PSV_POLICY_VERSION;
+
+//
+// An NPT view: nested page tables, and the ASID that translations through them
+// are tagged with, so that processors switch views without flushing the TLB.
+// View 0 is the identity view every processor starts with. See SvCreateNptView.
 //
+// Each view has its own PML4 and PDP (Root), but its PDP entries point to page
+// directories of the identity nested page tables until the view modifies
+// them, when only the modified page directory is copied. Directories holds
+// the page directory each PDP entry points to. View 0's Root is the one of the
+// identity nested page tables, and view 0 never copies page directories, so
+// its modifications are seen by all views sharing them. See
+// SvSplitNptLargePage.
+//
+// Generation is bumped once per batch of modifications of the view. See
+// SvEndNptUpdate.
+//
+typedef struct _SV_NPT_VIEW
+{
+    PSV_NPT_ROOT Root;
+    UINT64 NptBasePa;
+    UINT32 Asid;
+    volatile LONG64 Generation;
+    ULONG NumberOfPrivateDirectories;
+    PPD_ENTRY_2MB Directories[512];
+    ULONG NumberOfSplitPageTables;
+    PPT_ENTRY_4KB SplitPageTables[SV_MAX_SPLIT_PAGE_TABLES];
+} SV_NPT_VIEW, *PSV_NPT_VIEW;
+static_assert(SV_MAX_NPT_VIEWS <= sizeof(ULONG) * CHAR_BIT,
+              "Views must fit in a ULONG bitmap");
 
 typedef struct _SHARED_VIRTUAL_PROCESSOR_DATA
 {
     PVOID MsrPermissionsMap;
-    DECLSPEC_ALIGN(PAGE_SIZE) PML4_ENTRY_2MB Pml4Entries[1];    // Just for 512 GB
-    DECLSPEC_ALIGN(PAGE_SIZE) PDP_ENTRY_2MB PdpEntries[512];
-    DECLSPEC_ALIGN(PAGE_SIZE) PD_ENTRY_2MB PdeEntries[512][512];
+    UINT32 NumberOfAsids;
+    volatile LONG LastAllocatedAsid;
+    BOOLEAN FlushByAsidSupported;
+
+    //
+    // The ASID used by all guests of the nested hypervisor, or zero when
+    // nested virtualization is unavailable. Optional features that let the
+    // nested hypervisor execute STGI, CLGI, VMLOAD and VMSAVE without #VMEXIT.
+    //
+    UINT32 NestedGuestAsid;
+    BOOLEAN VirtualGifSupported;
+    BOOLEAN VirtualVmloadVmsaveSupported;
+
+    //
+    // The processor switches DebugCtl and the last branch records between the
+    // host and the guest on VMRUN and #VMEXIT.
+    //
+    BOOLEAN LbrVirtualizationSupported;
+
+    //
+    // Bytes of the XSAVE area covering all extended state components the
+    // processor supports, or zero without XSAVE, and whether XSAVEOPT is
+    // supported. See SvSaveGuestExtendedState.
+    //
+    UINT32 ExtendedStateSize;
+    BOOLEAN XsaveoptSupported;
+
+    //
+    // Physical memory ranges as of when the hypervisor was loaded, terminated
+    // by an entry of zero size. Guest physical memory is accessed on behalf of
+    // the guest only within them. See SvMapGuestPhysical.
+    //
+    PPHYSICAL_MEMORY_RANGE PhysicalMemoryRanges;
+
+    //
+    // The intercept policy set at run time, or nullptr for SV_INTERCEPT_POLICY.
+    // Each processor compares its generation with its own copy before VMRUN,
+    // switches to it when they differ, and increments PolicyPickups.
+    //
+    PSV_POLICY_VERSION volatile PolicyVersion;
+    volatile LONG PolicyPickups;
+
+    //
+    // Nested page tables are modified only between SvBeginNptUpdate and
+    // SvEndNptUpdate, which serialize updates with NptUpdateLock and bump
+    // the generation of each view modified in the batch, as recorded in
+    // NptModified. Each processor compares the generation of the view it runs
+    // in with its own copy before VMRUN and flushes the guest TLB only when
+    // they differ.
+    //
+    FAST_MUTEX NptUpdateLock;
+    ULONG NptModified;
+
+    //
+    // MMIO ranges trapped by making them not-present in nested page tables.
+    // Entries are only appended, under NptUpdateLock, and published by
+    // incrementing NumberOfMmioRanges.
+    //
+    BOOLEAN DecodeAssistsSupported;
+    volatile LONG NumberOfMmioRanges;
+    SV_MMIO_RANGE MmioRanges[SV_MAX_MMIO_RANGES];
+
+    //
+    // The IOPM and the policies it was built from, with all ports located.
+    //
+    PVOID IoPermissionsMap;
+    ULONG NumberOfIoPortPolicies;
+    SV_IO_PORT_POLICY IoPortPolicies[SV_MAX_IO_PORT_POLICIES];
+
+    //
+    // The identity nested page tables built by SvBuildNestedPageTables, whose
+    // page directories are shared by NPT views. DirectoryReferences counts the
+    // views whose PDP entry points to each page directory, and NptReferences
+    // the views using the tables at all. See SvReleaseSharedNpt.
+    //
+    PSV_NESTED_PAGE_TABLES Npt;
+    UINT64 NptBasePa;
+    volatile LONG NptReferences;
+    volatile LONG DirectoryReferences[512];
+
+    //
+    // NPT views. Views are only appended, under NptUpdateLock, and published
+    // by incrementing NumberOfNptViews once fully built.
+    //
+    volatile LONG NumberOfNptViews;
+    SV_NPT_VIEW NptViews[SV_MAX_NPT_VIEWS];
 } SHARED_VIRTUAL_PROCESSOR_DATA, *PSHARED_VIRTUAL_PROCESSOR_DATA;
 
+//
+// State of nested virtualization. The guest may run its own hypervisor (L1),
+// which runs its guest (L2) with VMRUN. The processor runs L2 with NestedVmcb,
+// built from the VMCB L1 passed to VMRUN (the L1 VMCB), while GuestVmcb keeps
+// L1's state as of VMRUN, as the host state-save area does for a real VMRUN.
+// #VMEXIT from L2 is either reflected to L1 by writing it into the L1 VMCB and
+// switching back to GuestVmcb, or handled by SimpleSvm when L1 does not
+// intercept it.
+//
+typedef struct _SV_NESTED_STATE
+{
+    UINT64 HostSavePa;              // L1's IA32_MSR_VM_HSAVE_PA
+    UINT64 GuestVmcbPa;             // Physical address of GuestVmcb
+    UINT64 NestedVmcbPa;            // Physical address of NestedVmcb
+    BOOLEAN InL2;                   // NestedVmcb is being run
+    BOOLEAN Gif;                    // L1's GIF, when vGIF is not used
+    UINT64 L1VmcbPa;                // The L1 VMCB of the last VMRUN
+    PVMCB L1Vmcb;
+    UINT32 L1Asid;                  // The ASID the L1 VMCB specified
+    UINT64 NCr3;                    // NCr3 of NestedVmcb
+
+    //
+    // The MSRPM and IOPM of L1 merged with SimpleSvm's ones. Used by
+    // NestedVmcb when L1 intercepts MSR and I/O port accesses.
+    //
+    PVOID MsrPermissionsMap;
+    PVOID IoPermissionsMap;
+
+    //
+    // The number of #VMEXITs from L2 reflected to L1 and TSC cycles spent to
+    // reflect them, per #VMEXIT code bucket.
+    //
+    UINT64 ReflectedExitCounts[SV_STATISTICS_EXIT_BUCKETS];
+    UINT64 ReflectedExitCycles[SV_STATISTICS_EXIT_BUCKETS];
+} SV_NESTED_STATE, *PSV_NESTED_STATE;
+
+//
+// The size of the host stack of each processor. It can be reduced at build
+// time according to HostStackHighWater of the statistics, which is measured by
+// filling unused stack with SV_HOST_STACK_CANARY.
+//
+#if !defined(SV_HOST_STACK_SIZE)
+#define SV_HOST_STACK_SIZE      KERNEL_STACK_SIZE
+#endif
+static_assert((SV_HOST_STACK_SIZE % PAGE_SIZE == 0) && (SV_HOST_STACK_SIZE >= PAGE_SIZE * 2),
+              "SV_HOST_STACK_SIZE must be a multiple of PAGE_SIZE, and at least 2 pages");
+
+#define SV_HOST_STACK_CANARY    0x4b41545356535353ULL   // 'SSSVSTAK'
+
+//
+// The state of CR3 accounting of the processor: the address space the guest
+// runs in and since when, and the sampling window the processor is in. See
+// SvAccountCr3Switch and SvUpdateCr3SamplingWindow.
+//
+typedef struct _SV_CR3_ACCOUNTING
+{
+    BOOLEAN Enabled;                // CR3 writes are being intercepted
+    UINT64 Cr3;                     // The guest CR3 being accounted
+    UINT64 SwitchTime;              // TSC when the guest switched to Cr3
+    UINT64 WindowStartTime;         // TSC when the current window started
+    UINT64 WindowNumber;            // The number of the current window
+} SV_CR3_ACCOUNTING, *PSV_CR3_ACCOUNTING;
+
+//
+// The state of interrupt latency measurement of the processor: when the guest
+// was last resumed and how long the host had handled the #VMEXIT before that,
+// and the sampling window the processor is in. See SvAccountInterruptLatency
+// and SvUpdateInterruptSamplingWindow.
+//
+typedef struct _SV_INTERRUPT_ACCOUNTING
+{
+    BOOLEAN Enabled;                // Physical interrupts are being intercepted
+    UINT64 ResumeTime;              // TSC when the guest was last resumed
+    UINT64 HostCycles;              // TSC cycles the #VMEXIT before it took
+    UINT64 WindowStartTime;         // TSC when the current window started
+    UINT64 WindowNumber;            // The number of the current window
+} SV_INTERRUPT_ACCOUNTING, *PSV_INTERRUPT_ACCOUNTING;
+
+//
+// The state of idle accounting of the processor. See SvHandleIdleInstruction.
+//
+typedef struct _SV_IDLE_ACCOUNTING
+{
+    BOOLEAN Idle;                   // The guest was resumed to go idle
+    BOOLEAN Woken;                  // This #VMEXIT ended the idle period
+    UINT64 EntryTime;               // TSC when the guest was resumed to go idle
+} SV_IDLE_ACCOUNTING, *PSV_IDLE_ACCOUNTING;
+
+//
+// The state of exit budgets of the processor. See SvEnforceExitBudgets.
+//
+typedef struct _SV_EXIT_BUDGETS
+{
+    UINT64 WindowStartTime;                         // TSC when the current window started
+    UINT32 Exits[SV_EXIT_BUDGET_CLASSES];           // #VMEXITs in the current window
+    UINT32 BackedOff;                               // Bitmap of classes backing off
+    UINT64 BackoffEndTime[SV_EXIT_BUDGET_CLASSES];  // TSC when each back-off ends
+    UINT64 MsrpmBasePa;                             // The built-in MSRPM
+} SV_EXIT_BUDGETS, *PSV_EXIT_BUDGETS;
+
+//
+// Guest's extended state saved by a #VMEXIT handler that uses SIMD registers.
+// See SvSaveGuestExtendedState.
+//
+typedef struct _SV_EXTENDED_STATE
+{
+    PVOID Area;                     // The XSAVE area, or nullptr without XSAVE
+    BOOLEAN XsaveoptSupported;
+    UINT64 SavedMask;               // Components saved in Area, or zero
+    UINT64 SaveCycles;              // TSC cycles saving them took
+} SV_EXTENDED_STATE, *PSV_EXTENDED_STATE;
+
+#if defined(SV_CAPTURE_HOST_LBR)
+//
+// The number of the last branch records of the host kept per processor.
+//
+#define SV_HOST_LBR_RECORDS     32
+
+//
+// The last branch the host took while handling a #VMEXIT.
+//
+typedef struct _SV_HOST_LBR_RECORD
+{
+    UINT64 ExitCode;
+    UINT64 BranchFrom;
+    UINT64 BranchTo;
+} SV_HOST_LBR_RECORD, *PSV_HOST_LBR_RECORD;
+#endif
+
+//
+// Pages of virtual address space reserved per processor to map guest physical
+// memory into. A #VMEXIT handler maps a page into a slot by writing the PTE of
+// the slot, without calling any kernel API. A slot holds one page at a time,
+// so a pointer into a slot is valid only until the slot is mapped again. See
+// SvMapGuestPhysical.
+//
+typedef enum _SV_GUEST_MAPPING_SLOT
+{
+    SvGuestMappingData,             // Guest memory being accessed
+    SvGuestMappingPageTable,        // Guest paging structures being walked
+    SvGuestMappingL1Vmcb,           // The L1 VMCB, kept while L2 runs
+    SvGuestMappingCopySource,       // The source of SvCopyGuestPhysical
+    SvGuestMappingSlots,
+} SV_GUEST_MAPPING_SLOT;
+
+typedef struct _SV_GUEST_MAPPING
+{
+    PVOID BaseVa;                                   // nullptr if not reserved
+    volatile UINT64* Ptes[SvGuestMappingSlots];     // The PTE of each slot
+    UINT64 MappedPfns[SvGuestMappingSlots];         // MAXUINT64 if not mapped
+} SV_GUEST_MAPPING, *PSV_GUEST_MAPPING;
+
 typedef struct _VIRTUAL_PROCESSOR_DATA
 {
     union
@@ -182,19 +581,19 @@ typedef struct _VIRTUAL_PROCESSOR_DATA
         //
         //  Low     HostStackLimit[0]                        StackLimit
         //  ^       ...
-        //  ^       HostStackLimit[KERNEL_STACK_SIZE - 2]    StackBase
-        //  High    HostStackLimit[KERNEL_STACK_SIZE - 1]    StackBase
+        //  ^       HostStackLimit[SV_HOST_STACK_SIZE - 2]   StackBase
+        //  High    HostStackLimit[SV_HOST_STACK_SIZE - 1]   StackBase
         //
-        DECLSPEC_ALIGN(PAGE_SIZE) UINT8 HostStackLimit[KERNEL_STACK_SIZE];
+        DECLSPEC_ALIGN(PAGE_SIZE) UINT8 HostStackLimit[SV_HOST_STACK_SIZE];
         struct
         {
-            UINT8 StackContents[KERNEL_STACK_SIZE - (sizeof(PVOID) * 6) - sizeof(KTRAP_FRAME)];
+            UINT8 StackContents[SV_HOST_STACK_SIZE - (sizeof(PVOID) * 6) - sizeof(KTRAP_FRAME)];
             KTRAP_FRAME TrapFrame;
             UINT64 GuestVmcbPa;     // HostRsp
             UINT64 HostVmcbPa;
             struct _VIRTUAL_PROCESSOR_DATA* Self;
             PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData;
-            UINT64 Padding1;        // To keep HostRsp 16 bytes aligned
+            UINT64 HostStateLoaded; // Also keeps HostRsp 16 bytes aligned
             UINT64 Reserved1;
         } HostStackLayout;
     };
@@ -202,9 +601,47 @@ typedef struct _VIRTUAL_PROCESSOR_DATA
     DECLSPEC_ALIGN(PAGE_SIZE) VMCB GuestVmcb;
     DECLSPEC_ALIGN(PAGE_SIZE) VMCB HostVmcb;
     DECLSPEC_ALIGN(PAGE_SIZE) UINT8 HostStateArea[PAGE_SIZE];
+    DECLSPEC_ALIGN(PAGE_SIZE) VMCB NestedVmcb;
+
+    //
+    // Software-only state. Nothing below is referenced by the processor.
+    //
+    // Vmcb points to the VMCB being run, ie, GuestVmcb, or NestedVmcb while L2
+    // runs. #VMEXIT handlers operate on it.
+    //
+    SV_TLB_FLUSH_TYPE PendingTlbFlush;
+    PVMCB Vmcb;
+    SV_NESTED_STATE Nested;
+    LONG64 PolicyGeneration;
+
+    //
+    // The NPT view the guest runs in, and since when. Other views whose ASID
+    // still holds coherent translations are in WarmNptViews, with the
+    // generation of the view they were last flushed or run at. See
+    // SvSwitchNptView.
+    //
+    ULONG NptView;
+    ULONG WarmNptViews;
+    UINT64 NptViewSwitchTime;
+    LONG64 NptGenerations[SV_MAX_NPT_VIEWS];
+    SV_MMIO_DECODE_CACHE_ENTRY MmioDecodeCache[SV_MMIO_DECODE_CACHE_SIZE];
+    SV_SOFT_TLB SoftTlb;
+    SV_GUEST_MAPPING GuestMapping;
+    SV_IO_PORT_STATISTICS IoPortStatistics[SV_MAX_IO_PORT_POLICIES];
+    PSV_VP_STATISTICS Statistics;
+    PSV_CR3_STATISTICS Cr3Statistics;
+    SV_CR3_ACCOUNTING Cr3Accounting;
+    SV_INTERRUPT_ACCOUNTING InterruptAccounting;
+    SV_IDLE_ACCOUNTING IdleAccounting;
+    SV_EXIT_BUDGETS ExitBudgets;
+    SV_EXTENDED_STATE ExtendedState;
+#if defined(SV_CAPTURE_HOST_LBR)
+    ULONG NextHostLbrRecord;
+    SV_HOST_LBR_RECORD HostLbrRecords[SV_HOST_LBR_RECORDS];
+#endif
 } VIRTUAL_PROCESSOR_DATA, *PVIRTUAL_PROCESSOR_DATA;
-static_assert(sizeof(VIRTUAL_PROCESSOR_DATA) == KERNEL_STACK_SIZE + PAGE_SIZE * 3,
-              "VIRTUAL_PROCESSOR_DATA Size Mismatch");
+static_assert(FIELD_OFFSET(VIRTUAL_PROCESSOR_DATA, PendingTlbFlush) == SV_HOST_STACK_SIZE + PAGE_SIZE * 4,
+              "VIRTUAL_PROCESSOR_DATA Layout Mismatch");
 
 typedef struct _GUEST_REGISTERS
 {
@@ -236,33 +673,352 @@ typedef struct _GUEST_CONTEXT
 //
 // x86-64 defined constants.
 //
-#define IA32_MSR_PAT    0x00000277
-#define IA32_MSR_EFER   0xc0000080
+#define IA32_MSR_DEBUGCTL                   0x000001d9
+#define IA32_MSR_LAST_BRANCH_FROM_IP        0x000001db
+#define IA32_MSR_LAST_BRANCH_TO_IP          0x000001dc
+#define IA32_MSR_LAST_EXCEPTION_FROM_IP     0x000001dd
+#define IA32_MSR_LAST_EXCEPTION_TO_IP       0x000001de
+#define IA32_MSR_PAT                        0x00000277
 
-#define EFER_SVME       (1UL << 12)
+#define DEBUGCTL_LBR    (1UL << 0)
 
-#define RPL_MASK        3
-#define DPL_SYSTEM      0
+#define CR3_NO_FLUSH    (1ULL << 63)
+#define CR4_PCIDE       (1UL << 17)
 
-#define CPUID_FN8000_0001_ECX_SVM                   (1UL << 2)
-#define CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT    (1UL << 31)
-#define CPUID_FN8000_000A_EDX_NP                    (1UL << 0)
+#define RFLAGS_DF       (1UL << 10)
 
-#define CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING          0x00000000
-#define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS       0x00000001
-#define CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX    0x80000001
-#define CPUID_SVM_FEATURES                                      0x8000000a
 //
-// The Microsoft Hypervisor interface defined constants.
+// See "Page-Fault Error Code".
 //
-#define CPUID_HV_VENDOR_AND_MAX_FUNCTIONS   0x40000000
-#define CPUID_HV_INTERFACE                  0x40000001
+#define SV_PF_ERROR_PRESENT     (1UL << 0)
+#define SV_PF_ERROR_WRITE       (1UL << 1)
+#define SV_PF_ERROR_USER        (1UL << 2)
 
 //
 // SimpleSVM specific constants.
 //
 #define CPUID_UNLOAD_SIMPLE_SVM     0x41414141
-#define CPUID_HV_MAX                CPUID_HV_INTERFACE
+#define CPUID_ACCESS_GUEST_MEMORY   SV_MEMORY_ACCESS_FUNCTION
+#define CPUID_SWITCH_NPT_VIEW       SV_SWITCH_NPT_VIEW_FUNCTION
+
+//
+// Intercept policies. A policy is a compile-time description of what the
+// hypervisor intercepts: the intercept words in the VMCB, the MSRs whose read
+// and write are intercepted through the MSRPM, and whether each #VMEXIT is
+// accounted in the statistics region. SvPrepareForVirtualization,
+// SvBuildMsrPermissionsMap and SvHandleVmExit are specialized with
+// SV_INTERCEPT_POLICY, so handlers of #VMEXITs the policy never causes, and
+// accounting code when it is disabled, are not compiled in. Only the handler
+// of exceptions is always compiled in, as the policy set at run time may
+// intercept them with any policy. See SvDispatchVmExit.
+//
+// CPUID or VMMCALL, VMRUN, writes to IA32_MSR_EFER and accesses to
+// IA32_MSR_VM_HSAVE_PA must always be intercepted: CPUID or VMMCALL is the
+// interface to detect and unload the hypervisor, VMRUN is required by the
+// processor and emulated for nested virtualization, EFER.SVME must be
+// protected, and the host state-save area must not be changed by the guest.
+// #VMEXIT due to #NPF has no intercept bit and is caused by nested page tables.
+// Intercepts of other SVM instructions depend on the processor features and
+// are set up by SvPrepareForVirtualization.
+//
+// The minimal policy is for production use and only intercepts what is
+// required. The profiling policy, the default, also intercepts I/O ports
+// according to the IOPM and accounts every #VMEXIT. Define
+// SV_MINIMAL_INTERCEPTS to build with the minimal policy.
+//
+// Optional features are layered on either policy by the policy templates
+// below, each of which describes what it intercepts and how to build with it.
+//
+typedef struct _SV_MINIMAL_INTERCEPT_POLICY
+{
+    static constexpr UINT32 InterceptMisc1 = SVM_INTERCEPT_MISC1_CPUID |
+                                             SVM_INTERCEPT_MISC1_MSR_PROT;
+    static constexpr UINT32 InterceptMisc2 = SVM_INTERCEPT_MISC2_VMRUN;
+    static constexpr UINT32 ReadInterceptedMsrs[] = { SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT32 WriteInterceptedMsrs[] = { IA32_MSR_EFER, SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT16 InterceptCrWrite = 0;
+    static constexpr bool AccountExits = false;
+    static constexpr UINT32 Cr3SamplingPeriod = 0;
+    static constexpr UINT32 InterruptSamplingPeriod = 0;
+    static constexpr bool AccountIdle = false;
+    static constexpr bool EnforceExitBudgets = false;
+} SV_MINIMAL_INTERCEPT_POLICY;
+
+typedef struct _SV_PROFILING_INTERCEPT_POLICY
+{
+    static constexpr UINT32 InterceptMisc1 = SVM_INTERCEPT_MISC1_CPUID |
+                                             SVM_INTERCEPT_MISC1_MSR_PROT |
+                                             SVM_INTERCEPT_MISC1_IOIO_PROT;
+    static constexpr UINT32 InterceptMisc2 = SVM_INTERCEPT_MISC2_VMRUN;
+    static constexpr UINT32 ReadInterceptedMsrs[] = { SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT32 WriteInterceptedMsrs[] = { IA32_MSR_EFER, SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT16 InterceptCrWrite = 0;
+    static constexpr bool AccountExits = true;
+    static constexpr UINT32 Cr3SamplingPeriod = 0;
+    static constexpr UINT32 InterruptSamplingPeriod = 0;
+    static constexpr bool AccountIdle = false;
+    static constexpr bool EnforceExitBudgets = false;
+} SV_PROFILING_INTERCEPT_POLICY;
+
+//
+// Makes the policy CPUID exit-free by moving the interface to VMMCALL. The
+// guest then executes CPUID without #VMEXIT, but sees neither the hypervisor
+// present bit nor the SimpleSvm vendor leaves, and CPUID results are not
+// adjusted for nested virtualization. Define SV_EXIT_FREE_CPUID to build with
+// it.
+//
+template<typename Policy>
+struct SV_EXIT_FREE_CPUID_POLICY : Policy
+{
+    static constexpr UINT32 InterceptMisc1 = Policy::InterceptMisc1 & ~SVM_INTERCEPT_MISC1_CPUID;
+    static constexpr UINT32 InterceptMisc2 = Policy::InterceptMisc2 | SVM_INTERCEPT_MISC2_VMMCALL;
+};
+
+#if !defined(SV_CR3_SAMPLING_PERIOD)
+#define SV_CR3_SAMPLING_PERIOD          1
+#endif
+#if !defined(SV_CR3_SAMPLING_WINDOW_CYCLES)
+#define SV_CR3_SAMPLING_WINDOW_CYCLES   0x10000000ULL
+#endif
+static_assert(SV_CR3_SAMPLING_PERIOD >= 1, "SV_CR3_SAMPLING_PERIOD must be at least 1");
+
+//
+// Accounts guest run time per address space by intercepting writes to CR3 and
+// timestamping every switch. To bound the overhead, CR3 writes are intercepted
+// only in one of every SV_CR3_SAMPLING_PERIOD windows of
+// SV_CR3_SAMPLING_WINDOW_CYCLES TSC cycles. The window is advanced on any
+// #VMEXIT, so windows without CR3 intercepts end late when the guest causes
+// few #VMEXITs. Define SV_ACCOUNT_CR3 to build with it. Results are in
+// SV_CR3_STATISTICS of the statistics region. A period of zero means CR3 is
+// not accounted.
+//
+template<typename Policy>
+struct SV_CR3_ACCOUNTING_POLICY : Policy
+{
+    static constexpr UINT16 InterceptCrWrite = Policy::InterceptCrWrite | SVM_INTERCEPT_CR_WRITE_CR3;
+    static constexpr UINT32 Cr3SamplingPeriod = SV_CR3_SAMPLING_PERIOD;
+};
+
+#if !defined(SV_INTERRUPT_SAMPLING_PERIOD)
+#define SV_INTERRUPT_SAMPLING_PERIOD            16
+#endif
+#if !defined(SV_INTERRUPT_SAMPLING_WINDOW_CYCLES)
+#define SV_INTERRUPT_SAMPLING_WINDOW_CYCLES     0x10000000ULL
+#endif
+static_assert(SV_INTERRUPT_SAMPLING_PERIOD >= 1, "SV_INTERRUPT_SAMPLING_PERIOD must be at least 1");
+
+//
+// An interrupt is considered to have arrived while the host was handling the
+// previous #VMEXIT when it causes #VMEXIT within this many TSC cycles after
+// VMRUN, which is about how long VMRUN followed by #VMEXIT takes when the
+// interrupt is already pending. See SvAccountInterruptLatency.
+//
+#if !defined(SV_HELD_INTERRUPT_CYCLES)
+#define SV_HELD_INTERRUPT_CYCLES                0x1000ULL
+#endif
+
+//
+// Measures how long the host delays physical interrupts to the guest by
+// intercepting them in one of every SV_INTERRUPT_SAMPLING_PERIOD windows of
+// SV_INTERRUPT_SAMPLING_WINDOW_CYCLES TSC cycles, in the same way as CR3 is
+// accounted. Define SV_MEASURE_INTERRUPT_LATENCY to build with it. Results are
+// in SV_VP_STATISTICS. A period of zero means interrupts are not intercepted.
+//
+template<typename Policy>
+struct SV_INTERRUPT_LATENCY_POLICY : Policy
+{
+    static constexpr UINT32 InterruptSamplingPeriod = SV_INTERRUPT_SAMPLING_PERIOD;
+};
+
+//
+// Accounts how long the guest stays idle by intercepting HLT and MWAIT and
+// letting the guest execute them without intercepts. Define SV_ACCOUNT_IDLE to
+// build with it. Results are in SV_VP_STATISTICS.
+//
+template<typename Policy>
+struct SV_IDLE_ACCOUNTING_POLICY : Policy
+{
+    static constexpr bool AccountIdle = true;
+};
+
+#if !defined(SV_EXIT_BUDGET_WINDOW_CYCLES)
+#define SV_EXIT_BUDGET_WINDOW_CYCLES    0x10000000ULL
+#endif
+#if !defined(SV_EXIT_BACKOFF_CYCLES)
+#define SV_EXIT_BACKOFF_CYCLES          0x100000000ULL
+#endif
+#if !defined(SV_IOIO_EXIT_BUDGET)
+#define SV_IOIO_EXIT_BUDGET             20000
+#endif
+#if !defined(SV_MSR_EXIT_BUDGET)
+#define SV_MSR_EXIT_BUDGET              20000
+#endif
+#if !defined(SV_EXCEPTION_EXIT_BUDGET)
+#define SV_EXCEPTION_EXIT_BUDGET        20000
+#endif
+static_assert(SV_EXIT_BUDGET_WINDOW_CYCLES != 0, "SV_EXIT_BUDGET_WINDOW_CYCLES must not be zero");
+
+//
+// Budgets of classes of optional intercepts, indexed by SV_EXIT_BUDGET_*.
+//
+static constexpr UINT32 g_ExitBudgets[SV_EXIT_BUDGET_CLASSES] =
+{
+    SV_IOIO_EXIT_BUDGET,
+    SV_MSR_EXIT_BUDGET,
+    SV_EXCEPTION_EXIT_BUDGET,
+};
+
+//
+// Bounds the cost of optional intercepts by removing them from a processor for
+// SV_EXIT_BACKOFF_CYCLES TSC cycles once they cause more #VMEXITs in a window
+// of SV_EXIT_BUDGET_WINDOW_CYCLES TSC cycles than their budgets allow. Define
+// SV_ENFORCE_EXIT_BUDGETS to build with it. See SvEnforceExitBudgets.
+//
+template<typename Policy>
+struct SV_EXIT_BUDGET_POLICY : Policy
+{
+    static constexpr bool EnforceExitBudgets = true;
+};
+
+#if defined(SV_MINIMAL_INTERCEPTS)
+typedef SV_MINIMAL_INTERCEPT_POLICY SV_BASE_INTERCEPT_POLICY;
+#else
+typedef SV_PROFILING_INTERCEPT_POLICY SV_BASE_INTERCEPT_POLICY;
+#endif
+
+#if defined(SV_EXIT_FREE_CPUID)
+typedef SV_EXIT_FREE_CPUID_POLICY<SV_BASE_INTERCEPT_POLICY> SV_INTERFACE_INTERCEPT_POLICY;
+#else
+typedef SV_BASE_INTERCEPT_POLICY SV_INTERFACE_INTERCEPT_POLICY;
+#endif
+
+#if defined(SV_ACCOUNT_CR3)
+typedef SV_CR3_ACCOUNTING_POLICY<SV_INTERFACE_INTERCEPT_POLICY> SV_ACCOUNTING_INTERCEPT_POLICY;
+#else
+typedef SV_INTERFACE_INTERCEPT_POLICY SV_ACCOUNTING_INTERCEPT_POLICY;
+#endif
+
+#if defined(SV_MEASURE_INTERRUPT_LATENCY)
+typedef SV_INTERRUPT_LATENCY_POLICY<SV_ACCOUNTING_INTERCEPT_POLICY> SV_LATENCY_INTERCEPT_POLICY;
+#else
+typedef SV_ACCOUNTING_INTERCEPT_POLICY SV_LATENCY_INTERCEPT_POLICY;
+#endif
+
+#if defined(SV_ACCOUNT_IDLE)
+typedef SV_IDLE_ACCOUNTING_POLICY<SV_LATENCY_INTERCEPT_POLICY> SV_IDLE_INTERCEPT_POLICY;
+#else
+typedef SV_LATENCY_INTERCEPT_POLICY SV_IDLE_INTERCEPT_POLICY;
+#endif
+
+#if defined(SV_ENFORCE_EXIT_BUDGETS)
+typedef SV_EXIT_BUDGET_POLICY<SV_IDLE_INTERCEPT_POLICY> SV_INTERCEPT_POLICY;
+#else
+typedef SV_IDLE_INTERCEPT_POLICY SV_INTERCEPT_POLICY;
+#endif
+
+/*!
+    @brief      Validates an intercept policy at compile time.
+ */
+template<typename Policy>
+constexpr
+bool
+SvIsValidInterceptPolicy (
+    VOID
+    )
+{
+    bool efer = false, hsaveRead = false, hsaveWrite = false;
+
+    for (UINT32 msr : Policy::ReadInterceptedMsrs)
+    {
+        hsaveRead |= (msr == SVM_MSR_VM_HSAVE_PA);
+    }
+    for (UINT32 msr : Policy::WriteInterceptedMsrs)
+    {
+        efer |= (msr == IA32_MSR_EFER);
+        hsaveWrite |= (msr == SVM_MSR_VM_HSAVE_PA);
+    }
+    return (((Policy::InterceptMisc1 & SVM_INTERCEPT_MISC1_CPUID) != 0) ||
+            ((Policy::InterceptMisc2 & SVM_INTERCEPT_MISC2_VMMCALL) != 0)) &&
+           ((Policy::InterceptMisc1 & SVM_INTERCEPT_MISC1_MSR_PROT) != 0) &&
+           ((Policy::InterceptMisc2 & SVM_INTERCEPT_MISC2_VMRUN) != 0) &&
+           ((Policy::InterceptCrWrite & ~SVM_INTERCEPT_CR_WRITE_CR3) == 0) &&
+           (((Policy::InterceptCrWrite & SVM_INTERCEPT_CR_WRITE_CR3) != 0) ==
+            (Policy::Cr3SamplingPeriod != 0)) &&
+           efer && hsaveRead && hsaveWrite;
+}
+static_assert(SvIsValidInterceptPolicy<SV_MINIMAL_INTERCEPT_POLICY>(),
+              "SV_MINIMAL_INTERCEPT_POLICY misses required intercepts");
+static_assert(SvIsValidInterceptPolicy<SV_PROFILING_INTERCEPT_POLICY>(),
+              "SV_PROFILING_INTERCEPT_POLICY misses required intercepts");
+static_assert(SvIsValidInterceptPolicy<SV_INTERCEPT_POLICY>(),
+              "SV_INTERCEPT_POLICY misses required intercepts");
+
+//
+// Intercepts set up by SvPrepareForVirtualization according to the processor
+// features, rather than by the policy.
+//
+#define SV_FEATURE_DEPENDENT_INTERCEPTS_MISC2   (SVM_INTERCEPT_MISC2_VMLOAD | \
+                                                 SVM_INTERCEPT_MISC2_VMSAVE | \
+                                                 SVM_INTERCEPT_MISC2_STGI | \
+                                                 SVM_INTERCEPT_MISC2_CLGI)
+
+//
+// Intercepts set while other NPT views are warm, to notice the guest
+// invalidating translations. See SvUpdateNptViewTrackingIntercepts.
+//
+#define SV_NPT_VIEW_TRACKING_INTERCEPTS_CR_WRITE    (SVM_INTERCEPT_CR_WRITE_CR0 | \
+                                                     SVM_INTERCEPT_CR_WRITE_CR3 | \
+                                                     SVM_INTERCEPT_CR_WRITE_CR4)
+#define SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC1       SVM_INTERCEPT_MISC1_INVLPG
+#define SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC3       SVM_INTERCEPT_MISC3_INVPCID
+
+//
+// Intercepts set while interrupt latency is sampled. See
+// SvUpdateInterruptSamplingWindow.
+//
+#define SV_INTERRUPT_LATENCY_INTERCEPTS_MISC1       SVM_INTERCEPT_MISC1_INTR
+
+//
+// Intercepts set while the guest is not idle, when idle is accounted. See
+// SvHandleIdleInstruction.
+//
+#define SV_IDLE_ACCOUNTING_INTERCEPTS_MISC1         SVM_INTERCEPT_MISC1_HLT
+#define SV_IDLE_ACCOUNTING_INTERCEPTS_MISC2         (SVM_INTERCEPT_MISC2_MWAIT | \
+                                                     SVM_INTERCEPT_MISC2_MWAIT_CONDITIONAL)
+
+//
+// Intercepts of the policy that cannot be removed by the policy set at run
+// time. See SvSetInterceptPolicy.
+//
+#define SV_REQUIRED_INTERCEPTS_MISC1    (SV_INTERCEPT_POLICY::InterceptMisc1 & \
+                                         (SVM_INTERCEPT_MISC1_CPUID | \
+                                          SVM_INTERCEPT_MISC1_MSR_PROT))
+#define SV_REQUIRED_INTERCEPTS_MISC2    (SV_INTERCEPT_POLICY::InterceptMisc2 & \
+                                         (SVM_INTERCEPT_MISC2_VMRUN | \
+                                          SVM_INTERCEPT_MISC2_VMMCALL))
+
+//
+// Exceptions the policy set at run time may intercept. These are faults that
+// are re-injected as they are: #DE, #UD, #NM, #TS, #NP, #SS, #GP, #PF, #MF,
+// #AC and #XF. Of them, #TS, #NP, #SS, #GP, #PF and #AC push an error code.
+// See SvHandleExceptionIntercept.
+//
+#define SV_INTERCEPTABLE_EXCEPTIONS     ((1UL << 0) | (1UL << 6) | (1UL << 7) | \
+                                         (1UL << 10) | (1UL << 11) | (1UL << 12) | \
+                                         (1UL << 13) | (1UL << 14) | (1UL << 16) | \
+                                         (1UL << 17) | (1UL << 19))
+#define SV_EXCEPTIONS_WITH_ERROR_CODE   ((1UL << 10) | (1UL << 11) | (1UL << 12) | \
+                                         (1UL << 13) | (1UL << 14) | (1UL << 17))
+
+//
+// Intercepts removed while the I/O port class backs off. Other classes are
+// removed by switching to the built-in MSRPM and by clearing the exception
+// bitmap, which the policy set at run time alone populates with optional
+// intercepts. See SvApplyExitBackoffs.
+//
+#define SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1    SVM_INTERCEPT_MISC1_IOIO_PROT
+static_assert((SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1 & SV_REQUIRED_INTERCEPTS_MISC1) == 0,
+              "Mandatory intercepts must not be removed");
 
 /*!
     @brief      Breaks into a kernel debugger when it is present.
@@ -289,6 +1045,34 @@ typedef struct _GUEST_CONTEXT
 //
 static PVOID g_PowerCallbackRegistration;
 
+//
+// A processor change callback handle.
+//
+static PVOID g_ProcessorChangeCallbackRegistration;
+
+//
+// Serializes virtualization and de-virtualization of all processors with
+// requests to the control device. g_SharedVpData is valid while processors are
+// virtualized, and must only be used with the lock held.
+//
+static ERESOURCE g_VirtualizationLock;
+static PSHARED_VIRTUAL_PROCESSOR_DATA g_SharedVpData;
+
+//
+// The statistics region mapped into user mode, and the MDL describing it. The
+// region lives as long as the driver, so that it survives re-virtualization
+// on resume.
+//
+static PSV_STATISTICS_HEADER g_Statistics;
+static PMDL g_StatisticsMdl;
+
+//
+// The class GUID of the control device, required by IoCreateDeviceSecure.
+// {5B199E53-2320-4097-8263-ACE6E42F11CB}
+//
+static const GUID g_ControlDeviceClassGuid =
+    { 0x5b199e53, 0x2320, 0x4097, { 0x82, 0x63, 0xac, 0xe6, 0xe4, 0x2f, 0x11, 0xcb } };
+
 /*!
     @brief      Sends a message to the kernel debugger.
 
@@ -459,627 +1243,4363 @@ SvInjectGeneralProtectionException (
     event.Fields.Type = 3;
     event.Fields.ErrorCodeValid = 1;
     event.Fields.Valid = 1;
-    VpData->GuestVmcb.ControlArea.EventInj = event.AsUInt64;
+    VpData->Vmcb->ControlArea.EventInj = event.AsUInt64;
 }
 
 /*!
-    @brief          Handles #VMEXIT due to execution of the CPUID instructions.
-
-    @details        This function returns unmodified results of the CPUID
-                    instruction, except for few cases to indicate presence of
-                    the hypervisor, and to process an unload request.
-
-                    CPUID leaf 0x40000000 and 0x40000001 return modified values
-                    to conform to the hypervisor interface to some extent. See
-                    "Requirements for implementing the Microsoft Hypervisor interface"
-                    https://msdn.microsoft.com/en-us/library/windows/hardware/Dn613994(v=vs.85).aspx
-                    for details of the interface.
+    @brief          Injects #UD.
 
     @param[in,out]  VpData - Per processor data.
-    @param[in,out]  GuestContext - Guest's GPRs.
  */
 _IRQL_requires_same_
 static
 VOID
-SvHandleCpuid (
-    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
-    _Inout_ PGUEST_CONTEXT GuestContext
+SvInjectUndefinedOpcodeException (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
     )
 {
-    int registers[4];   // EAX, EBX, ECX, and EDX
-    int leaf, subLeaf;
-    SEGMENT_ATTRIBUTE attribute;
+    EVENTINJ event;
 
     //
-    // Execute CPUID as requested.
+    // Inject #UD(vector = 6, type = 3 = exception) without an error code. See
+    // "#UD-Invalid-Opcode Exception (Vector 6)".
     //
-    leaf = static_cast<int>(GuestContext->VpRegs->Rax);
-    subLeaf = static_cast<int>(GuestContext->VpRegs->Rcx);
-    __cpuidex(registers, leaf, subLeaf);
-
-    switch (leaf)
-    {
-    case CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS:
-        //
-        // Indicate presence of a hypervisor by setting the bit that are
-        // reserved for use by hypervisor to indicate guest status. See "CPUID
-        // Fn0000_0001_ECX Feature Identifiers".
-        //
-        registers[2] |= CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT;
-        break;
-    case CPUID_HV_VENDOR_AND_MAX_FUNCTIONS:
-        //
-        // Return a maximum supported hypervisor CPUID leaf range and a vendor
-        // ID signature as required by the spec.
-        //
-        registers[0] = CPUID_HV_MAX;
-        registers[1] = 'pmiS';  // "SimpleSvm   "
-        registers[2] = 'vSel';
-        registers[3] = '   m';
-        break;
-    case CPUID_HV_INTERFACE:
-        //
-        // Return non Hv#1 value. This indicate that the SimpleSvm does NOT
-        // conform to the Microsoft hypervisor interface.
-        //
-        registers[0] = '0#vH';  // Hv#0
-        registers[1] = registers[2] = registers[3] = 0;
-        break;
-    case CPUID_UNLOAD_SIMPLE_SVM:
-        if (subLeaf == CPUID_UNLOAD_SIMPLE_SVM)
-        {
-            //
-            // Unload itself if the request is from the kernel mode.
-            //
-            attribute.AsUInt16 = VpData->GuestVmcb.StateSaveArea.SsAttrib;
-            if (attribute.Fields.Dpl == DPL_SYSTEM)
-            {
-                GuestContext->ExitVm = TRUE;
-            }
-        }
-        break;
-    default:
-        break;
-    }
+    event.AsUInt64 = 0;
+    event.Fields.Vector = 6;
+    event.Fields.Type = 3;
+    event.Fields.Valid = 1;
+    VpData->Vmcb->ControlArea.EventInj = event.AsUInt64;
+}
 
-    //
-    // Update guest's GPRs with results.
-    //
-    GuestContext->VpRegs->Rax = registers[0];
-    GuestContext->VpRegs->Rbx = registers[1];
-    GuestContext->VpRegs->Rcx = registers[2];
-    GuestContext->VpRegs->Rdx = registers[3];
+/*!
+    @brief          Injects #PF.
 
-    //
-    // Debug prints results. Very important to note that any use of API from
-    // the host context is unsafe and absolutely avoided, unless the API is
-    // documented to be accessible on IRQL IPI_LEVEL+. This is because
-    // interrupts are disabled when host code is running, and IPI is not going
-    // to be delivered when it is issued.
-    //
-    // This code is not exception and violating this rule. The reasons for this
-    // code are to demonstrate a bad example, and simply show that the SimpleSvm
-    // is functioning for a test purpose.
-    //
-    if (KeGetCurrentIrql() <= DISPATCH_LEVEL)
-    {
-        SvDebugPrint("CPUID: %08x-%08x : %08x %08x %08x %08x\n",
-                     leaf,
-                     subLeaf,
-                     registers[0],
-                     registers[1],
-                     registers[2],
-                     registers[3]);
-    }
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      FaultAddress - The linear address that caused the fault,
+                    which is set to CR2.
+    @param[in]      ErrorCode - The error code. See SV_PF_ERROR_*.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvInjectPageFault (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 FaultAddress,
+    _In_ UINT32 ErrorCode
+    )
+{
+    EVENTINJ event;
 
     //
-    // Then, advance RIP to "complete" the instruction.
+    // Inject #PF(vector = 14, type = 3 = exception) with an error code. See
+    // "#PF-Page-Fault Exception (Vector 14)".
     //
-    VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip;
+    event.AsUInt64 = 0;
+    event.Fields.Vector = 14;
+    event.Fields.Type = 3;
+    event.Fields.ErrorCodeValid = 1;
+    event.Fields.ErrorCode = ErrorCode;
+    event.Fields.Valid = 1;
+    VpData->Vmcb->StateSaveArea.Cr2 = FaultAddress;
+    VpData->Vmcb->ControlArea.EventInj = event.AsUInt64;
 }
 
 /*!
-    @brief          Handles #VMEXIT due to execution of the WRMSR and RDMSR
-                    instructions.
+    @brief          Handles #VMEXIT due to an exception intercepted by the
+                    policy set at run time.
 
-    @details        This protects EFER.SVME from being cleared by the guest by
-                    injecting #GP when it is about to be cleared. For other MSR
-                    access, it passes-through.
+    @details        The exception is only counted as #VMEXIT, and re-injected
+                    with the error code and, for #PF, the faulting address the
+                    processor provided. RIP is left as it is, since only faults
+                    are intercepted. See SV_INTERCEPTABLE_EXCEPTIONS.
+
+                    When the exception occurred while delivering another event,
+                    the event is not re-injected, and is lost.
 
     @param[in,out]  VpData - Per processor data.
-    @param[in,out]  GuestContext - Guest's GPRs.
  */
 _IRQL_requires_same_
 static
 VOID
-SvHandleMsrAccess (
-    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
-    _Inout_ PGUEST_CONTEXT GuestContext
+SvHandleExceptionIntercept (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
     )
 {
-    ULARGE_INTEGER value;
-    UINT32 msr;
-    BOOLEAN writeAccess;
+    EVENTINJ event;
+    UINT32 vector;
 
-    msr = GuestContext->VpRegs->Rcx & MAXUINT32;
-    writeAccess = (VpData->GuestVmcb.ControlArea.ExitInfo1 != 0);
+    vector = static_cast<UINT32>(VpData->Vmcb->ControlArea.ExitCode - VMEXIT_EXCEPTION_DE);
+    NT_ASSERT((SV_INTERCEPTABLE_EXCEPTIONS & (1UL << vector)) != 0);
 
-    //
-    // If IA32_MSR_EFER is accessed for write, we must protect the EFER_SVME bit
-    // from being cleared.
-    //
-    if (msr == IA32_MSR_EFER)
+    event.AsUInt64 = 0;
+    event.Fields.Vector = vector;
+    event.Fields.Type = 3;
+    if ((SV_EXCEPTIONS_WITH_ERROR_CODE & (1UL << vector)) != 0)
     {
-        //
-        // #VMEXIT on IA32_MSR_EFER access should only occur on write access.
-        //
-        NT_ASSERT(writeAccess != FALSE);
-
-        value.LowPart = GuestContext->VpRegs->Rax & MAXUINT32;
-        value.HighPart = GuestContext->VpRegs->Rdx & MAXUINT32;
-        if ((value.QuadPart & EFER_SVME) == 0)
-        {
-            //
-            // Inject #GP if the guest attempts to clear the SVME bit. Protection of
-            // this bit is required because clearing the bit while guest is running
-            // leads to undefined behavior.
-            //
-            SvInjectGeneralProtectionException(VpData);
-        }
-
-        //
-        // Otherwise, update the MSR as requested. Important to note that the value
-        // should be checked not to allow any illegal values, and inject #GP as
-        // needed. Otherwise, the hypervisor attempts to resume the guest with an
-        // illegal EFER and immediately receives #VMEXIT due to VMEXIT_INVALID,
-        // which in our case, results in a bug check. See "Extended Feature Enable
-        // Register (EFER)" for what values are allowed.
-        //
-        // This code does not implement the check intentionally, for simplicity.
-        //
-        VpData->GuestVmcb.StateSaveArea.Efer = value.QuadPart;
+        event.Fields.ErrorCodeValid = 1;
+        event.Fields.ErrorCode = VpData->Vmcb->ControlArea.ExitInfo1 & MAXUINT32;
     }
-    else
+    event.Fields.Valid = 1;
+    if (VpData->Vmcb->ControlArea.ExitCode == VMEXIT_EXCEPTION_PF)
     {
-        //
-        // If the MSR being accessed is not IA32_MSR_EFER, assert that #VMEXIT
-        // can only occur on access to MSR outside the ranges controlled with
-        // the MSR permissions map. This is true because the map is configured
-        // not to intercept any MSR access but IA32_MSR_EFER. See
-        // "MSR Ranges Covered by MSRPM" in "MSR Intercepts" for the MSR ranges
-        // controlled by the map.
-        //
-        // Note that VMware Workstation has a bug that access to unimplemented
-        // MSRs unconditionally causes #VMEXIT ignoring bits in the MSR
-        // permissions map. This can be tested by reading MSR zero, for example.
-        //
-        NT_ASSERT(((msr > 0x00001fff) && (msr < 0xc0000000)) ||
-                  ((msr > 0xc0001fff) && (msr < 0xc0010000)) ||
-                   (msr > 0xc0011fff));
-
-        //
-        // Execute WRMSR or RDMSR on behalf of the guest. Important that this
-        // can cause bug check when the guest tries to access unimplemented MSR
-        // *even within the SEH block* because the below WRMSR or RDMSR raises
-        // #GP and are not protected by the SEH block (or cannot be protected
-        // either as this code run outside the thread stack region Windows
-        // requires to proceed SEH). Hypervisors typically handle this by noop-ing
-        // WRMSR and returning zero for RDMSR with non-architecturally defined
-        // MSRs. Alternatively, one can probe which MSRs should cause #GP prior
-        // to installation of a hypervisor and the hypervisor can emulate the
-        // results.
-        //
-        if (writeAccess != FALSE)
-        {
-            value.LowPart = GuestContext->VpRegs->Rax & MAXUINT32;
-            value.HighPart = GuestContext->VpRegs->Rdx & MAXUINT32;
-            __writemsr(msr, value.QuadPart);
-        }
-        else
-        {
-            value.QuadPart = __readmsr(msr);
-            GuestContext->VpRegs->Rax = value.LowPart;
-            GuestContext->VpRegs->Rdx = value.HighPart;
-        }
+        VpData->Vmcb->StateSaveArea.Cr2 = VpData->Vmcb->ControlArea.ExitInfo2;
     }
-
-    //
-    // Then, advance RIP to "complete" the instruction.
-    //
-    VpData->GuestVmcb.StateSaveArea.Rip = VpData->GuestVmcb.ControlArea.NRip;
+    VpData->Vmcb->ControlArea.EventInj = event.AsUInt64;
 }
 
 /*!
-    @brief          Handles #VMEXIT due to execution of the VMRUN instruction.
+    @brief          Requests the TLB to be flushed on the next VMRUN.
+
+    @details        Requests are accumulated until the next VMRUN, and only the
+                    strongest one is carried out. Callers should request the
+                    narrowest flush that covers what they changed: guest non-
+                    global translations when guest paging structures changed
+                    (eg, emulated CR3 write), and the entire guest ASID when
+                    nested page tables changed.
 
-    @details        This function always injects #GP to the guest.
+                    The software TLB used by SvTranslateGuestVirtualAddress is
+                    flushed on any request too, as it caches what the guest TLB
+                    would.
 
     @param[in,out]  VpData - Per processor data.
-    @param[in,out]  GuestContext - Guest's GPRs.
+    @param[in]      FlushType - The type of flush required.
  */
 _IRQL_requires_same_
 static
 VOID
-SvHandleVmrun (
+SvRequestTlbFlush (
     _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
-    _Inout_ PGUEST_CONTEXT GuestContext
+    _In_ SV_TLB_FLUSH_TYPE FlushType
     )
 {
-    UNREFERENCED_PARAMETER(GuestContext);
+    if (FlushType != SvTlbFlushNone)
+    {
+        SvFlushSoftTlb(&VpData->SoftTlb);
+    }
 
-    SvInjectGeneralProtectionException(VpData);
+    if (FlushType > VpData->PendingTlbFlush)
+    {
+        VpData->PendingTlbFlush = FlushType;
+    }
 }
 
 /*!
-    @brief          C-level entry point of the host code called from SvLaunchVm.
-
-    @details        This function loads save host state first, and then, handles
-                    #VMEXIT which may or may not change guest's state via VpData
-                    or GuestRegisters.
+    @brief          Updates the TlbControl field for the next VMRUN.
 
-                    Interrupts are disabled when this function is called due to
-                    the cleared GIF. Not all host state are loaded yet, so do it
-                    with the VMLOAD instruction.
+    @details        TlbControl is not cleared by the processor, so this function
+                    must be called right before every VMRUN; otherwise, a flush
+                    requested once would be repeated on every VMRUN afterwards.
 
-                    If the #VMEXIT handler detects a request to unload the
-                    hypervisor, this function loads guest state, disables SVM
-                    and returns to execution flow where the #VMEXIT triggered.
+                    When the processor does not support flush by ASID, any
+                    request is fulfilled by flushing the entire TLB, which is
+                    the only other value such processors accept. See "TLB
+                    Control" and "Flush By ASID" in "TLB Flush".
 
     @param[in,out]  VpData - Per processor data.
-    @param[in,out]  GuestRegisters - Guest's GPRs.
-
-    @result         TRUE when virtualization is terminated; otherwise FALSE.
  */
 _IRQL_requires_same_
-EXTERN_C
-BOOLEAN
-NTAPI
-SvHandleVmExit (
-    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
-    _Inout_ PGUEST_REGISTERS GuestRegisters
+static
+VOID
+SvApplyPendingTlbFlush (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
     )
 {
-    GUEST_CONTEXT guestContext;
-    KIRQL oldIrql;
+    UINT32 tlbControl;
 
-    guestContext.VpRegs = GuestRegisters;
-    guestContext.ExitVm = FALSE;
+    switch (VpData->PendingTlbFlush)
+    {
+    case SvTlbFlushGuestNonGlobal:
+        tlbControl = SVM_TLB_CONTROL_FLUSH_GUEST_NON_GLOBAL_TLB;
+        break;
+    case SvTlbFlushGuest:
+        tlbControl = SVM_TLB_CONTROL_FLUSH_GUEST_TLB;
+        break;
+    default:
+        NT_ASSERT(VpData->PendingTlbFlush == SvTlbFlushNone);
+        tlbControl = SVM_TLB_CONTROL_DO_NOTHING;
+        break;
+    }
 
     //
-    // Load some host state that are not loaded on #VMEXIT.
+    // Once L2 has run on this processor, translations are cached with both
+    // L1's and L2's ASIDs, and both need to be flushed. Flush them all.
     //
-    __svm_vmload(VpData->HostStackLayout.HostVmcbPa);
+    if ((tlbControl != SVM_TLB_CONTROL_DO_NOTHING) &&
+        ((VpData->HostStackLayout.SharedVpData->FlushByAsidSupported == FALSE) ||
+         (VpData->Nested.L1VmcbPa != 0)))
+    {
+        tlbControl = SVM_TLB_CONTROL_FLUSH_ENTIRE_TLB;
+    }
 
-    NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
+    VpData->Vmcb->ControlArea.TlbControl = tlbControl;
+    VpData->PendingTlbFlush = SvTlbFlushNone;
+}
 
-    //
-    // Raise the IRQL to the DISPATCH_LEVEL level. This has no actual effect since
-    // interrupts are disabled at #VMEXI but warrants bug check when some of
-    // kernel API that are not usable on this context is called with Driver
-    // Verifier. This protects developers from accidentally writing such #VMEXIT
-    // handling code. This should actually raise IRQL to HIGH_LEVEL to represent
-    // this running context better, but our Logger code is not designed to run at
-    // that level unfortunately. Finally, note that this API is a thin wrapper
-    // of mov-to-CR8 on x64 and safe to call on this context.
-    //
-    oldIrql = KeGetCurrentIrql();
-    if (oldIrql < DISPATCH_LEVEL)
+/*!
+    @brief          Picks up modifications of nested page tables.
+
+    @details        This function compares the generation of the NPT view the
+                    processor runs in with the one this processor last observed,
+                    and requests the guest TLB to be flushed only when nested
+                    page tables of the view have been modified since then. This
+                    lets modifications be propagated to all processors without
+                    IPIs, at the cost of a delay until each processor's next
+                    #VMEXIT. See SvEndNptUpdate for how synchronous completion
+                    is achieved when needed.
+
+                    Other views are checked when the processor switches to them.
+                    See SvSwitchNptView.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvSynchronizeNptGeneration (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    LONG64 generation;
+
+    generation = VpData->HostStackLayout.SharedVpData->NptViews[VpData->NptView].Generation;
+    if (generation != VpData->NptGenerations[VpData->NptView])
     {
-        KeRaiseIrqlToDpcLevel();
+        VpData->NptGenerations[VpData->NptView] = generation;
+        SvRequestTlbFlush(VpData, SvTlbFlushGuest);
     }
+}
 
-    //
-    // Guest's RAX is overwritten by the host's value on #VMEXIT and saved in
-    // the VMCB instead. Reflect the guest RAX to the context.
-    //
-    GuestRegisters->Rax = VpData->GuestVmcb.StateSaveArea.Rax;
+/*!
+    @brief          Updates intercepts of instructions that invalidate guest
+                    translations according to whether other NPT views are warm.
 
-    //
-    // Update the _KTRAP_FRAME structure values in hypervisor stack, so that
-    // Windbg can reconstruct call stack of the guest during debug session.
-    // This is optional but very useful thing to do for debugging.
-    //
-    VpData->HostStackLayout.TrapFrame.Rsp = VpData->GuestVmcb.StateSaveArea.Rsp;
-    VpData->HostStackLayout.TrapFrame.Rip = VpData->GuestVmcb.ControlArea.NRip;
+    @details        INVLPG, INVPCID and writes to CR0, CR3 and CR4 invalidate
+                    translations of the current ASID only, and leave ones cached
+                    with ASIDs of other views stale. They are intercepted while
+                    any view is warm, so that those views stop being warm before
+                    the guest executes any of them. See
+                    SvHandleNptViewInvalidation.
 
-    //
-    // Handle #VMEXIT according with its reason.
-    //
-    switch (VpData->GuestVmcb.ControlArea.ExitCode)
+                    CR3 writes are also intercepted while CR3 is accounted.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvUpdateNptViewTrackingIntercepts (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PVMCB guestVmcb;
+    UINT16 crWrite;
+    UINT32 misc1, misc3;
+
+    guestVmcb = &VpData->GuestVmcb;
+    crWrite = (VpData->Cr3Accounting.Enabled != FALSE) ?
+              static_cast<UINT16>(SVM_INTERCEPT_CR_WRITE_CR3) : 0;
+    misc1 = guestVmcb->ControlArea.InterceptMisc1 & ~SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC1;
+    misc3 = guestVmcb->ControlArea.InterceptMisc3 & ~SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC3;
+    if (VpData->WarmNptViews != 0)
     {
-    case VMEXIT_CPUID:
-        SvHandleCpuid(VpData, &guestContext);
-        break;
-    case VMEXIT_MSR:
-        SvHandleMsrAccess(VpData, &guestContext);
-        break;
-    case VMEXIT_VMRUN:
-        SvHandleVmrun(VpData, &guestContext);
-        break;
-    default:
-        SV_DEBUG_BREAK();
-#pragma prefast(disable : __WARNING_USE_OTHER_FUNCTION, "Unrecoverble path.")
-        KeBugCheck(MANUALLY_INITIATED_CRASH);
+        crWrite |= SV_NPT_VIEW_TRACKING_INTERCEPTS_CR_WRITE;
+        misc1 |= SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC1;
+        misc3 |= SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC3;
     }
 
-    //
-    // Again, no effect to change IRQL but restoring it here since a #VMEXIT
-    // handler where the developers most likely call the kernel API inadvertently
-    // is already executed.
-    //
-    if (oldIrql < DISPATCH_LEVEL)
+    if ((guestVmcb->ControlArea.InterceptCrWrite != crWrite) ||
+        (guestVmcb->ControlArea.InterceptMisc1 != misc1) ||
+        (guestVmcb->ControlArea.InterceptMisc3 != misc3))
     {
-        KeLowerIrql(oldIrql);
+        guestVmcb->ControlArea.InterceptCrWrite = crWrite;
+        guestVmcb->ControlArea.InterceptMisc1 = misc1;
+        guestVmcb->ControlArea.InterceptMisc3 = misc3;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
     }
+}
 
-    //
-    // Terminate the SimpleSvm hypervisor if requested.
-    //
-    if (guestContext.ExitVm != FALSE)
-    {
-        NT_ASSERT(VpData->GuestVmcb.ControlArea.ExitCode == VMEXIT_CPUID);
+/*!
+    @brief          Switches the NPT view the guest runs in.
 
-        //
-        // Set return values of CPUID instruction as follows:
-        //  RBX     = An address to return
-        //  RCX     = A stack pointer to restore
-        //  EDX:EAX = An address of per processor data to be freed by the caller
-        //
-        guestContext.VpRegs->Rax = reinterpret_cast<UINT64>(VpData) & MAXUINT32;
-        guestContext.VpRegs->Rbx = VpData->GuestVmcb.ControlArea.NRip;
-        guestContext.VpRegs->Rcx = VpData->GuestVmcb.StateSaveArea.Rsp;
-        guestContext.VpRegs->Rdx = reinterpret_cast<UINT64>(VpData) >> 32;
+    @details        NCr3 and the ASID of GuestVmcb are switched to those of the
+                    view. The ASID of a view keeps its translations while the
+                    processor runs in other views, so the guest TLB is flushed
+                    only when the view is not warm, or has been modified since
+                    the processor last observed it. The view being left becomes
+                    warm.
 
-        //
-        // Load guest state (currently host state is loaded).
-        //
-        __svm_vmload(MmGetPhysicalAddress(&VpData->GuestVmcb).QuadPart);
+                    Views apply to L1 only. L2 runs in view 0. See
+                    SvHandleVmrun.
 
-        //
-        // Set the global interrupt flag (GIF) but still disable interrupts by
-        // clearing IF. GIF must be set to return to the normal execution, but
-        // interruptions are not desirable until SVM is disabled as it would
-        // execute random kernel-code in the host context.
-        //
-        _disable();
-        __svm_stgi();
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ViewIndex - The index of the view to switch to.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvSwitchNptView (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ ULONG ViewIndex
+    )
+{
+    const SV_NPT_VIEW* view;
+    PSV_VP_STATISTICS statistics;
+    LONG64 generation;
+    UINT64 now;
+    BOOLEAN flush;
 
-        //
-        // Disable SVM, and restore the guest RFLAGS. This may enable interrupts.
-        // Some of arithmetic flags are destroyed by the subsequent code.
-        //
-        __writemsr(IA32_MSR_EFER, __readmsr(IA32_MSR_EFER) & ~EFER_SVME);
-        __writeeflags(VpData->GuestVmcb.StateSaveArea.Rflags);
-        goto Exit;
+    NT_ASSERT(VpData->Nested.InL2 == FALSE);
+    NT_ASSERT(ViewIndex < SV_MAX_NPT_VIEWS);
+
+    if (ViewIndex == VpData->NptView)
+    {
+        return;
     }
 
-    //
-    // Reflect potentially updated guest's RAX to VMCB. Again, unlike other GPRs,
-    // RAX is loaded from VMCB on VMRUN.
-    //
-    VpData->GuestVmcb.StateSaveArea.Rax = guestContext.VpRegs->Rax;
+    view = &VpData->HostStackLayout.SharedVpData->NptViews[ViewIndex];
+    generation = view->Generation;
+    flush = ((VpData->WarmNptViews & (1UL << ViewIndex)) == 0) ||
+            (VpData->NptGenerations[ViewIndex] != generation);
+
+    now = __rdtsc();
+    statistics = VpData->Statistics;
+    SvBeginSeqlockWrite(&statistics->Sequence);
+    statistics->NptViews[VpData->NptView].Cycles += now - VpData->NptViewSwitchTime;
+    statistics->NptViews[ViewIndex].Switches++;
+    if (flush != FALSE)
+    {
+        statistics->NptViews[ViewIndex].FlushedSwitches++;
+    }
+    SvEndSeqlockWrite(&statistics->Sequence);
 
-Exit:
-    NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
-    return guestContext.ExitVm;
+    VpData->WarmNptViews |= (1UL << VpData->NptView);
+    VpData->WarmNptViews &= ~(1UL << ViewIndex);
+    VpData->NptView = ViewIndex;
+    VpData->NptViewSwitchTime = now;
+
+    VpData->GuestVmcb.ControlArea.NCr3 = view->NptBasePa;
+    VpData->GuestVmcb.ControlArea.GuestAsid = view->Asid;
+    VpData->GuestVmcb.ControlArea.VmcbClean &= ~(SVM_VMCB_CLEAN_NP | SVM_VMCB_CLEAN_ASID);
+    if (flush != FALSE)
+    {
+        VpData->NptGenerations[ViewIndex] = generation;
+        SvRequestTlbFlush(VpData, SvTlbFlushGuest);
+    }
+    SvUpdateNptViewTrackingIntercepts(VpData);
 }
 
 /*!
-    @brief      Returns attributes of a segment specified by the segment selector.
+    @brief          Picks up the intercept policy set at run time.
 
-    @details    This function locates a segment descriptor from the segment
-                selector and the GDT base, extracts attributes of the segment,
-                and returns it. The returned value is the same as what the "dg"
-                command of Windbg shows as "Flags". Here is an example output
-                with 0x18 of the selector:
-                ----
-                0: kd> dg 18
-                P Si Gr Pr Lo
-                Sel        Base              Limit          Type    l ze an es ng Flags
-                ---- ----------------- ----------------- ---------- - -- -- -- -- --------
-                0018 00000000`00000000 00000000`00000000 Data RW Ac 0 Bg By P  Nl 00000493
-                ----
+    @details        Like SvSynchronizeNptGeneration, this function compares the
+                    generation of the published policy with the one this
+                    processor last used, and switches GuestVmcb to the policy
+                    only when they differ. Intercepts that depend on processor
+                    features are kept. See SvSetInterceptPolicy.
 
-    @param[in]  SegmentSelector - A segment selector to get attributes of a
-                corresponding descriptor.
-    @param[in]  GdtBase - A base address of GDT.
+                    NestedVmcb keeps intercepting what SV_INTERCEPT_POLICY does,
+                    so the policy applies to L1 only. It takes effect when L1
+                    resumes if L2 is running.
 
-    @result     Attributes of the segment.
+    @param[in,out]  VpData - Per processor data.
  */
 _IRQL_requires_same_
-_Check_return_
 static
-UINT16
-SvGetSegmentAccessRight (
-    _In_ UINT16 SegmentSelector,
-    _In_ ULONG_PTR GdtBase
+VOID
+SvSynchronizeInterceptPolicy (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
     )
 {
-    PSEGMENT_DESCRIPTOR descriptor;
-    SEGMENT_ATTRIBUTE attribute;
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+    const SV_POLICY_VERSION* policy;
+    PVMCB guestVmcb;
 
-    //
-    // Get a segment descriptor corresponds to the specified segment selector.
-    //
-    descriptor = reinterpret_cast<PSEGMENT_DESCRIPTOR>(
-                                        GdtBase + (SegmentSelector & ~RPL_MASK));
+    sharedVpData = VpData->HostStackLayout.SharedVpData;
+    policy = sharedVpData->PolicyVersion;
+    if ((policy == nullptr) || (policy->Generation == VpData->PolicyGeneration))
+    {
+        return;
+    }
 
-    //
-    // Extract all attribute fields in the segment descriptor to a structure
-    // that describes only attributes (as opposed to the segment descriptor
-    // consists of multiple other fields).
-    //
-    attribute.Fields.Type = descriptor->Fields.Type;
-    attribute.Fields.System = descriptor->Fields.System;
-    attribute.Fields.Dpl = descriptor->Fields.Dpl;
-    attribute.Fields.Present = descriptor->Fields.Present;
-    attribute.Fields.Avl = descriptor->Fields.Avl;
-    attribute.Fields.LongMode = descriptor->Fields.LongMode;
-    attribute.Fields.DefaultBit = descriptor->Fields.DefaultBit;
-    attribute.Fields.Granularity = descriptor->Fields.Granularity;
-    attribute.Fields.Reserved1 = 0;
+    guestVmcb = &VpData->GuestVmcb;
+    guestVmcb->ControlArea.InterceptMisc1 = policy->InterceptMisc1 |
+                (guestVmcb->ControlArea.InterceptMisc1 & (SV_NPT_VIEW_TRACKING_INTERCEPTS_MISC1 |
+                                                          SV_INTERRUPT_LATENCY_INTERCEPTS_MISC1 |
+                                                          SV_IDLE_ACCOUNTING_INTERCEPTS_MISC1));
+    guestVmcb->ControlArea.InterceptMisc2 = policy->InterceptMisc2 |
+                (guestVmcb->ControlArea.InterceptMisc2 & (SV_FEATURE_DEPENDENT_INTERCEPTS_MISC2 |
+                                                          SV_IDLE_ACCOUNTING_INTERCEPTS_MISC2));
+    guestVmcb->ControlArea.InterceptException = policy->InterceptException;
+    guestVmcb->ControlArea.MsrpmBasePa = policy->MsrpmBasePa;
+    guestVmcb->ControlArea.VmcbClean &= ~(SVM_VMCB_CLEAN_INTERCEPTS | SVM_VMCB_CLEAN_IOPM);
+
+    VpData->PolicyGeneration = policy->Generation;
+    InterlockedIncrement(&sharedVpData->PolicyPickups);
+}
 
-    return attribute.AsUInt16;
+/*!
+    @brief          Switches state not switched by #VMEXIT to the host's.
+
+    @details        #VMEXIT leaves FS, GS, TR, LDTR, KernelGsBase and the SYSCALL
+                    and SYSENTER MSRs of the guest in the processor. Those must be
+                    saved to the VMCB and the host's ones loaded before any kernel
+                    API is called or any of them is accessed. Handlers that need
+                    neither leave them as they are, which saves VMSAVE and VMLOAD
+                    here and another VMLOAD in SvLaunchVm. See "VMSAVE and VMLOAD
+                    Instructions".
+
+                    This function must be called before the VMCB being run is
+                    switched, so that the guest state is saved into the right
+                    VMCB.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvLoadHostState (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    UINT64 startTime;
+
+    if (VpData->HostStackLayout.HostStateLoaded != FALSE)
+    {
+        return;
+    }
+
+    startTime = 0;
+    if constexpr (SV_INTERCEPT_POLICY::AccountExits)
+    {
+        startTime = __rdtsc();
+    }
+
+    __svm_vmsave(VpData->HostStackLayout.GuestVmcbPa);
+    __svm_vmload(VpData->HostStackLayout.HostVmcbPa);
+    VpData->HostStackLayout.HostStateLoaded = TRUE;
+
+    if constexpr (SV_INTERCEPT_POLICY::AccountExits)
+    {
+        SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+        VpData->Statistics->HostStateLoads++;
+        VpData->Statistics->HostStateLoadCycles += __rdtsc() - startTime;
+        SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+    }
 }
 
 /*!
-    @brief      Tests whether the SimpleSvm hypervisor is installed.
+    @brief          Tests whether a physical address is in the physical memory
+                    ranges snapshotted at load time.
 
-    @details    This function checks a result of CPUID leaf 40000000h, which
-                should return a vendor name of the hypervisor if any of those
-                who implement the Microsoft Hypervisor interface is installed.
-                If the SimpleSvm hypervisor is installed, this should return
-                "SimpleSvm", and if no hypervisor is installed, it the result of
-                CPUID is undefined. For more details of the interface, see
-                "Requirements for implementing the Microsoft Hypervisor interface"
-                https://msdn.microsoft.com/en-us/library/windows/hardware/Dn613994(v=vs.85).aspx
+    @param[in]      SharedVpData - The shared data that owns the ranges.
+    @param[in]      PhysicalAddress - The physical address to test.
 
-    @result     TRUE when the SimpleSvm is installed; otherwise, FALSE.
+    @result         TRUE when the address is RAM; otherwise, FALSE.
  */
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
 _IRQL_requires_same_
 _Check_return_
 static
 BOOLEAN
-SvIsSimpleSvmHypervisorInstalled (
-    VOID
+SvIsPhysicalMemory (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ UINT64 PhysicalAddress
     )
 {
-    int registers[4];   // EAX, EBX, ECX, and EDX
-    char vendorId[13];
-
-    //
-    // When the SimpleSvm hypervisor is installed, CPUID leaf 40000000h will
-    // return "SimpleSvm   " as the vendor name.
-    //
-    __cpuid(registers, CPUID_HV_VENDOR_AND_MAX_FUNCTIONS);
-    RtlCopyMemory(vendorId + 0, &registers[1], sizeof(registers[1]));
-    RtlCopyMemory(vendorId + 4, &registers[2], sizeof(registers[2]));
-    RtlCopyMemory(vendorId + 8, &registers[3], sizeof(registers[3]));
-    vendorId[12] = ANSI_NULL;
+    const PHYSICAL_MEMORY_RANGE* range;
 
-    return (strcmp(vendorId, "SimpleSvm   ") == 0);
+    for (range = SharedVpData->PhysicalMemoryRanges;
+         range->NumberOfBytes.QuadPart != 0;
+         range++)
+    {
+        if ((PhysicalAddress >= static_cast<UINT64>(range->BaseAddress.QuadPart)) &&
+            (PhysicalAddress - range->BaseAddress.QuadPart <
+                static_cast<UINT64>(range->NumberOfBytes.QuadPart)))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
 }
 
 /*!
-    @brief      Virtualize the current processor.
+    @brief          Tests whether every page of a physical address range is in
+                    the physical memory ranges snapshotted at load time.
 
-    @details    This function enables SVM, initialize VMCB with the current
-                processor state, and enters the guest mode on the current
-                processor.
+    @param[in]      SharedVpData - The shared data that owns the ranges.
+    @param[in]      PhysicalAddress - The page aligned start of the range.
+    @param[in]      Size - The size of the range in bytes.
 
-    @param[in,out]  VpData - The address of per processor data.
-    @param[in]      SharedVpData - The address of share data.
-    @param[in]      ContextRecord - The address of CONETEXT to use as an initial
-                    context of the processor after it is virtualized.
+    @result         TRUE when the range is RAM; otherwise, FALSE.
  */
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
 _IRQL_requires_same_
+_Check_return_
 static
-VOID
-SvPrepareForVirtualization (
-    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
-    _In_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
-    _In_ const CONTEXT* ContextRecord
+BOOLEAN
+SvIsPhysicalMemoryRange (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ UINT64 PhysicalAddress,
+    _In_ SIZE_T Size
     )
 {
-    DESCRIPTOR_TABLE_REGISTER gdtr, idtr;
-    PHYSICAL_ADDRESS guestVmcbPa, hostVmcbPa, hostStateAreaPa, pml4BasePa, msrpmPa;
-
-    //
-    // Capture the current GDTR and IDTR to use as initial values of the guest
-    // mode.
-    //
-    _sgdt(&gdtr);
-    __sidt(&idtr);
+    for (SIZE_T offset = 0; offset < Size; offset += PAGE_SIZE)
+    {
+        if (SvIsPhysicalMemory(SharedVpData, PhysicalAddress + offset) == FALSE)
+        {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 
-    guestVmcbPa = MmGetPhysicalAddress(&VpData->GuestVmcb);
-    hostVmcbPa = MmGetPhysicalAddress(&VpData->HostVmcb);
-    hostStateAreaPa = MmGetPhysicalAddress(&VpData->HostStateArea);
-    pml4BasePa = MmGetPhysicalAddress(&SharedVpData->Pml4Entries);
-    msrpmPa = MmGetPhysicalAddress(SharedVpData->MsrPermissionsMap);
+/*!
+    @brief          Tests whether any part of a physical address range is in the
+                    physical memory ranges snapshotted at load time.
 
-    //
-    // Configure to trigger #VMEXIT with CPUID and VMRUN instructions. CPUID is
-    // intercepted to present existence of the SimpleSvm hypervisor and provide
-    // an interface to ask it to unload itself.
-    //
-    // VMRUN is intercepted because it is required by the processor to enter the
-    // guest mode; otherwise, #VMEXIT occurs due to VMEXIT_INVALID when a
-    // processor attempts to enter the guest mode. See "Canonicalization and
-    // Consistency Checks" on "VMRUN Instruction".
-    //
-    VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_CPUID;
-    VpData->GuestVmcb.ControlArea.InterceptMisc2 |= SVM_INTERCEPT_MISC2_VMRUN;
+    @param[in]      SharedVpData - The shared data that owns the ranges.
+    @param[in]      PhysicalAddress - The start of the range.
+    @param[in]      Size - The size of the range in bytes. The range must not
+                    wrap around.
 
-    //
-    // Also, configure to trigger #VMEXIT on MSR access as configured by the
-    // MSRPM. In our case, write to IA32_MSR_EFER is intercepted.
-    //
-    VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_MSR_PROT;
-    VpData->GuestVmcb.ControlArea.MsrpmBasePa = msrpmPa.QuadPart;
+    @result         TRUE when the range overlaps RAM; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvOverlapsPhysicalMemory (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ UINT64 PhysicalAddress,
+    _In_ UINT64 Size
+    )
+{
+    const PHYSICAL_MEMORY_RANGE* range;
+    UINT64 base;
 
-    //
-    // Specify guest's address space ID (ASID). TLB is maintained by the ID for
-    // guests. Use the same value for all processors since all of them run a
-    // single guest in our case. Use 1 as the most likely supported ASID by the
-    // processor. The actual the supported number of ASID can be obtained with
-    // CPUID. See "CPUID Fn8000_000A_EBX SVM Revision and Feature
-    // Identification". Zero of ASID is reserved and illegal.
-    //
-    VpData->GuestVmcb.ControlArea.GuestAsid = 1;
+    for (range = SharedVpData->PhysicalMemoryRanges;
+         range->NumberOfBytes.QuadPart != 0;
+         range++)
+    {
+        base = static_cast<UINT64>(range->BaseAddress.QuadPart);
+        if ((PhysicalAddress < base + range->NumberOfBytes.QuadPart) &&
+            (base < PhysicalAddress + Size))
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
 
-    //
-    // Enable Nested Page Tables. By enabling this, the processor performs the
-    // nested page walk, that involves with an additional page walk to translate
-    // a guest physical address to a system physical address. An address of
-    // nested page tables is specified by the NCr3 field of VMCB.
-    //
-    // We have already build the nested page tables with SvBuildNestedPageTables.
-    //
-    // Note that our hypervisor does not trigger any additional #VMEXIT due to
-    // the use of Nested Page Tables since all physical addresses from 0-512 GB
-    // are configured to be accessible from the guest.
-    //
-    VpData->GuestVmcb.ControlArea.NpEnable |= SVM_NP_ENABLE_NP_ENABLE;
-    VpData->GuestVmcb.ControlArea.NCr3 = pml4BasePa.QuadPart;
+/*!
+    @brief          Maps a page of guest physical memory into a slot reserved for
+                    the processor.
 
-    //
-    // Set up the initial guest state based on the current system state. Those
-    // values are loaded into the processor as guest state when the VMRUN
-    // instruction is executed.
-    //
-    VpData->GuestVmcb.StateSaveArea.GdtrBase = gdtr.Base;
-    VpData->GuestVmcb.StateSaveArea.GdtrLimit = gdtr.Limit;
-    VpData->GuestVmcb.StateSaveArea.IdtrBase = idtr.Base;
-    VpData->GuestVmcb.StateSaveArea.IdtrLimit = idtr.Limit;
+    @details        Guest physical addresses equal host physical addresses with
+                    the identity nested page tables. Addresses outside physical
+                    memory, such as MMIO or ones the guest made up, are never
+                    mapped. The page is mapped by writing the PTE of the slot
+                    and invalidating the previous translation on this processor
+                    only, as no other processor uses the slot. No kernel API is
+                    called, so this is usable from any #VMEXIT handler.
 
-    VpData->GuestVmcb.StateSaveArea.CsLimit = GetSegmentLimit(ContextRecord->SegCs);
-    VpData->GuestVmcb.StateSaveArea.DsLimit = GetSegmentLimit(ContextRecord->SegDs);
-    VpData->GuestVmcb.StateSaveArea.EsLimit = GetSegmentLimit(ContextRecord->SegEs);
-    VpData->GuestVmcb.StateSaveArea.SsLimit = GetSegmentLimit(ContextRecord->SegSs);
-    VpData->GuestVmcb.StateSaveArea.CsSelector = ContextRecord->SegCs;
-    VpData->GuestVmcb.StateSaveArea.DsSelector = ContextRecord->SegDs;
-    VpData->GuestVmcb.StateSaveArea.EsSelector = ContextRecord->SegEs;
-    VpData->GuestVmcb.StateSaveArea.SsSelector = ContextRecord->SegSs;
-    VpData->GuestVmcb.StateSaveArea.CsAttrib = SvGetSegmentAccessRight(ContextRecord->SegCs, gdtr.Base);
-    VpData->GuestVmcb.StateSaveArea.DsAttrib = SvGetSegmentAccessRight(ContextRecord->SegDs, gdtr.Base);
-    VpData->GuestVmcb.StateSaveArea.EsAttrib = SvGetSegmentAccessRight(ContextRecord->SegEs, gdtr.Base);
-    VpData->GuestVmcb.StateSaveArea.SsAttrib = SvGetSegmentAccessRight(ContextRecord->SegSs, gdtr.Base);
+                    The mapping covers only the page that contains GuestPa,
+                    and is valid until the slot is mapped again.
 
-    VpData->GuestVmcb.StateSaveArea.Efer = __readmsr(IA32_MSR_EFER);
-    VpData->GuestVmcb.StateSaveArea.Cr0 = __readcr0();
-    VpData->GuestVmcb.StateSaveArea.Cr2 = __readcr2();
-    VpData->GuestVmcb.StateSaveArea.Cr3 = __readcr3();
-    VpData->GuestVmcb.StateSaveArea.Cr4 = __readcr4();
-    VpData->GuestVmcb.StateSaveArea.Rflags = ContextRecord->EFlags;
-    VpData->GuestVmcb.StateSaveArea.Rsp = ContextRecord->Rsp;
-    VpData->GuestVmcb.StateSaveArea.Rip = ContextRecord->Rip;
-    VpData->GuestVmcb.StateSaveArea.GPat = __readmsr(IA32_MSR_PAT);
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      Slot - The slot to map the page into.
+    @param[in]      GuestPa - The guest physical address to map.
 
-    //
+    @result         The virtual address that maps GuestPa, or nullptr when
+                    GuestPa is not physical memory.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+PVOID
+SvMapGuestPhysical (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ SV_GUEST_MAPPING_SLOT Slot,
+    _In_ UINT64 GuestPa
+    )
+{
+    PSV_GUEST_MAPPING mapping;
+    PUCHAR slotVa;
+    UINT64 pfn;
+
+    if (SvIsPhysicalMemory(VpData->HostStackLayout.SharedVpData, GuestPa) == FALSE)
+    {
+        return nullptr;
+    }
+
+    mapping = &VpData->GuestMapping;
+    slotVa = static_cast<PUCHAR>(mapping->BaseVa) + static_cast<SIZE_T>(Slot) * PAGE_SIZE;
+    pfn = GuestPa >> PAGE_SHIFT;
+    if (mapping->MappedPfns[Slot] != pfn)
+    {
+        *mapping->Ptes[Slot] = (GuestPa & SV_PTE_PFN_MASK) |
+                               SV_PTE_PRESENT | SV_PTE_WRITE |
+                               SV_PTE_ACCESSED | SV_PTE_DIRTY | SV_PTE_NO_EXECUTE;
+        __invlpg(slotVa);
+        mapping->MappedPfns[Slot] = pfn;
+    }
+    return slotVa + BYTE_OFFSET(GuestPa);
+}
+
+/*!
+    @brief          Copies bytes between a buffer and guest physical memory for
+                    the memory access hypercall.
+
+    @details        The memory is accessed through SvMapGuestPhysical, so only
+                    physical memory can be accessed. The access list processor
+                    never lets an access cross a page boundary.
+
+    @param[in]      Context - Per processor data.
+    @param[in]      GuestPa - The guest physical address to access.
+    @param[in,out]  Buffer - The contents to write, or receives the contents
+                    read.
+    @param[in]      Size - The number of bytes to copy.
+    @param[in]      IsWrite - TRUE to write Buffer into guest memory.
+
+    @result         TRUE on success; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+static
+BOOLEAN
+SvAccessGuestPhysical (
+    PVOID Context,
+    UINT64 GuestPa,
+    PVOID Buffer,
+    UINT32 Size,
+    BOOLEAN IsWrite
+    )
+{
+    PVOID guestMemory;
+
+    guestMemory = SvMapGuestPhysical(static_cast<PVIRTUAL_PROCESSOR_DATA>(Context),
+                                     SvGuestMappingData,
+                                     GuestPa);
+    if (guestMemory == nullptr)
+    {
+        return FALSE;
+    }
+    if (IsWrite != FALSE)
+    {
+        RtlCopyMemory(guestMemory, Buffer, Size);
+    }
+    else
+    {
+        RtlCopyMemory(Buffer, guestMemory, Size);
+    }
+    return TRUE;
+}
+
+/*!
+    @brief          Copies bytes between guest physical addresses for the memory
+                    access hypercall.
+
+    @param[in]      Context - Per processor data.
+    @param[in]      DestinationPa - The guest physical address to copy to.
+    @param[in]      SourcePa - The guest physical address to copy from.
+    @param[in]      Size - The number of bytes to copy.
+
+    @result         TRUE on success; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+static
+BOOLEAN
+SvCopyGuestPhysical (
+    PVOID Context,
+    UINT64 DestinationPa,
+    UINT64 SourcePa,
+    UINT32 Size
+    )
+{
+    PVIRTUAL_PROCESSOR_DATA vpData;
+    PVOID destination;
+    PVOID source;
+
+    vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(Context);
+    destination = SvMapGuestPhysical(vpData, SvGuestMappingData, DestinationPa);
+    source = SvMapGuestPhysical(vpData, SvGuestMappingCopySource, SourcePa);
+    if ((destination == nullptr) || (source == nullptr))
+    {
+        return FALSE;
+    }
+    RtlCopyMemory(destination, source, Size);
+    return TRUE;
+}
+
+/*!
+    @brief          Handles the memory access hypercall.
+
+    @details        Descriptors are processed within the budget of a #VMEXIT.
+                    The instruction completes only when all descriptors have
+                    been processed or the list is found invalid; otherwise, RIP
+                    is left as it is, and the guest executes the instruction
+                    again to continue from RBX. See GuestMemoryAccess.hpp for
+                    the interface.
+
+                    The caller must be kernel mode, and not L2.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleMemoryAccessCall (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    SV_MEMORY_ACCESS_LIST_STATUS status;
+    UINT64 nextDescriptor;
+    BOOLEAN completed;
+
+    nextDescriptor = GuestContext->VpRegs->Rbx;
+    status = SvProcessMemoryAccessList(GuestContext->VpRegs->Rdx,
+                                       GuestContext->VpRegs->Rcx,
+                                       &nextDescriptor,
+                                       SvAccessGuestPhysical,
+                                       SvCopyGuestPhysical,
+                                       VpData,
+                                       &completed);
+    GuestContext->VpRegs->Rbx = nextDescriptor;
+    if (completed != FALSE)
+    {
+        GuestContext->VpRegs->Rax = static_cast<UINT64>(status);
+        VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+    }
+}
+
+/*!
+    @brief          Handles the NPT view switch hypercall.
+
+    @details        The caller must be kernel mode, and not L2. See
+                    ControlInterface.hpp for the interface.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleSwitchNptViewCall (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    ULONG viewIndex;
+
+    viewIndex = static_cast<ULONG>(GuestContext->VpRegs->Rcx);
+    if (viewIndex >= static_cast<ULONG>(VpData->HostStackLayout.SharedVpData->NumberOfNptViews))
+    {
+        GuestContext->VpRegs->Rax = SV_SWITCH_NPT_VIEW_INVALID;
+    }
+    else
+    {
+        SvSwitchNptView(VpData, viewIndex);
+        GuestContext->VpRegs->Rax = SV_SWITCH_NPT_VIEW_SUCCESS;
+    }
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the CPUID instructions.
+
+    @details        This function returns results of the CPUID instruction as
+                    modified by SvAdjustCpuidResult, and processes requests to
+                    SimpleSvm, such as an unload request.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleCpuid (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    int leaf, subLeaf;
+    SEGMENT_ATTRIBUTE attribute;
+
+    //
+    // Execute CPUID as requested.
+    //
+    leaf = static_cast<int>(GuestContext->VpRegs->Rax);
+    subLeaf = static_cast<int>(GuestContext->VpRegs->Rcx);
+    __cpuidex(registers, leaf, subLeaf);
+    SvAdjustCpuidResult(static_cast<UINT32>(leaf),
+                        (VpData->HostStackLayout.SharedVpData->NestedGuestAsid != 0),
+                        registers);
+
+    //
+    // Then, process requests to SimpleSvm.
+    //
+    switch (static_cast<UINT32>(leaf))
+    {
+    case CPUID_UNLOAD_SIMPLE_SVM:
+        if (subLeaf == CPUID_UNLOAD_SIMPLE_SVM)
+        {
+            //
+            // Unload itself if the request is from the kernel mode, and not
+            // from the guest of the nested hypervisor.
+            //
+            attribute.AsUInt16 = VpData->Vmcb->StateSaveArea.SsAttrib;
+            if ((attribute.Fields.Dpl == DPL_SYSTEM) &&
+                (VpData->Nested.InL2 == FALSE))
+            {
+                SvLoadHostState(VpData);
+                GuestContext->ExitVm = TRUE;
+            }
+        }
+        break;
+    case CPUID_ACCESS_GUEST_MEMORY:
+        //
+        // Process the request if it is from the kernel mode and not from the
+        // guest of the nested hypervisor. The handler updates GPRs and RIP by
+        // itself, as the request may continue over multiple #VMEXITs.
+        //
+        attribute.AsUInt16 = VpData->Vmcb->StateSaveArea.SsAttrib;
+        if ((attribute.Fields.Dpl == DPL_SYSTEM) &&
+            (VpData->Nested.InL2 == FALSE))
+        {
+            SvHandleMemoryAccessCall(VpData, GuestContext);
+            return;
+        }
+        break;
+    case CPUID_SWITCH_NPT_VIEW:
+        attribute.AsUInt16 = VpData->Vmcb->StateSaveArea.SsAttrib;
+        if ((attribute.Fields.Dpl == DPL_SYSTEM) &&
+            (VpData->Nested.InL2 == FALSE))
+        {
+            SvHandleSwitchNptViewCall(VpData, GuestContext);
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    //
+    // Update guest's GPRs with results.
+    //
+    GuestContext->VpRegs->Rax = registers[0];
+    GuestContext->VpRegs->Rbx = registers[1];
+    GuestContext->VpRegs->Rcx = registers[2];
+    GuestContext->VpRegs->Rdx = registers[3];
+
+    //
+    // Debug prints results. Very important to note that any use of API from
+    // the host context is unsafe and absolutely avoided, unless the API is
+    // documented to be accessible on IRQL IPI_LEVEL+. This is because
+    // interrupts are disabled when host code is running, and IPI is not going
+    // to be delivered when it is issued.
+    //
+    // This code is not exception and violating this rule. The reasons for this
+    // code are to demonstrate a bad example, and simply show that the SimpleSvm
+    // is functioning for a test purpose.
+    //
+    // Printing needs the host state. Print only while a kernel debugger is
+    // attached, so that CPUID does not load the host state otherwise.
+    //
+    if ((KD_DEBUGGER_NOT_PRESENT == FALSE) &&
+        (KeGetCurrentIrql() <= DISPATCH_LEVEL))
+    {
+        SvLoadHostState(VpData);
+        SvDebugPrint("CPUID: %08x-%08x : %08x %08x %08x %08x\n",
+                     leaf,
+                     subLeaf,
+                     registers[0],
+                     registers[1],
+                     registers[2],
+                     registers[3]);
+    }
+
+    //
+    // Then, advance RIP to "complete" the instruction.
+    //
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the VMMCALL instruction.
+
+    @details        VMMCALL is intercepted only when CPUID is not, and provides
+                    the subset of the CPUID interface SimpleSvm itself uses: RAX
+                    and RCX hold the leaf and the subleaf, and results are
+                    returned in RAX, RBX, RCX and RDX. CPUID_HV_VENDOR_AND_MAX_FUNCTIONS
+                    tells presence of the hypervisor, and CPUID_UNLOAD_SIMPLE_SVM
+                    unloads it. See SvCallHypervisor. CPUID_ACCESS_GUEST_MEMORY
+                    and CPUID_SWITCH_NPT_VIEW are handled in the same way as for
+                    CPUID.
+
+                    Anything else, including VMMCALL from user mode or from L2,
+                    results in #UD as it would without SimpleSvm.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleVmmcall (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    int leaf, subLeaf;
+    SEGMENT_ATTRIBUTE attribute;
+
+    //
+    // Accept the request only from the kernel mode, tested in the same way as
+    // for CPUID_UNLOAD_SIMPLE_SVM, and not from the guest of the nested
+    // hypervisor.
+    //
+    attribute.AsUInt16 = VpData->Vmcb->StateSaveArea.SsAttrib;
+    if ((attribute.Fields.Dpl != DPL_SYSTEM) ||
+        (VpData->Nested.InL2 != FALSE))
+    {
+        SvInjectUndefinedOpcodeException(VpData);
+        return;
+    }
+
+    leaf = static_cast<int>(GuestContext->VpRegs->Rax);
+    subLeaf = static_cast<int>(GuestContext->VpRegs->Rcx);
+    RtlZeroMemory(registers, sizeof(registers));
+
+    switch (leaf)
+    {
+    case CPUID_HV_VENDOR_AND_MAX_FUNCTIONS:
+        registers[0] = CPUID_HV_MAX;
+        registers[1] = 'pmiS';  // "SimpleSvm   "
+        registers[2] = 'vSel';
+        registers[3] = '   m';
+        break;
+    case CPUID_UNLOAD_SIMPLE_SVM:
+        if (subLeaf != CPUID_UNLOAD_SIMPLE_SVM)
+        {
+            SvInjectUndefinedOpcodeException(VpData);
+            return;
+        }
+        SvLoadHostState(VpData);
+        GuestContext->ExitVm = TRUE;
+        break;
+    case CPUID_ACCESS_GUEST_MEMORY:
+        SvHandleMemoryAccessCall(VpData, GuestContext);
+        return;
+    case CPUID_SWITCH_NPT_VIEW:
+        SvHandleSwitchNptViewCall(VpData, GuestContext);
+        return;
+    default:
+        SvInjectUndefinedOpcodeException(VpData);
+        return;
+    }
+
+    GuestContext->VpRegs->Rax = registers[0];
+    GuestContext->VpRegs->Rbx = registers[1];
+    GuestContext->VpRegs->Rcx = registers[2];
+    GuestContext->VpRegs->Rdx = registers[3];
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the WRMSR and RDMSR
+                    instructions.
+
+    @details        This protects EFER.SVME from being cleared by the guest by
+                    injecting #GP when it is about to be cleared, and
+                    virtualizes IA32_MSR_VM_HSAVE_PA. For other MSR access, it
+                    passes-through.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleMsrAccess (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    ULARGE_INTEGER value;
+    UINT32 msr;
+    BOOLEAN writeAccess;
+    SV_MSR_ACCESS_RESULT result;
+
+    msr = GuestContext->VpRegs->Rcx & MAXUINT32;
+    writeAccess = (VpData->Vmcb->ControlArea.ExitInfo1 != 0);
+    value.LowPart = GuestContext->VpRegs->Rax & MAXUINT32;
+    value.HighPart = GuestContext->VpRegs->Rdx & MAXUINT32;
+
+    //
+    // Emulate MSRs SimpleSvm virtualizes: IA32_MSR_EFER, whose EFER_SVME bit
+    // must be protected from being cleared, and IA32_MSR_VM_HSAVE_PA for the
+    // nested hypervisor. See SvEmulateMsrAccess.
+    //
+    result = SvEmulateMsrAccess(VpData->Vmcb,
+                                &VpData->Nested.HostSavePa,
+                                VpData->Nested.InL2,
+                                msr,
+                                writeAccess,
+                                &value.QuadPart);
+    if (result == SvMsrAccessInjectGp)
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+    if (result == SvMsrAccessPassThrough)
+    {
+        //
+        // If the MSR being accessed is not virtualized, assert that #VMEXIT
+        // can only occur on access to MSR outside the ranges controlled with
+        // the MSR permissions map, unless the policy set at run time
+        // intercepts more MSRs. This is true because the map is otherwise
+        // configured not to intercept any MSR access but IA32_MSR_EFER. See
+        // "MSR Ranges Covered by MSRPM" in "MSR Intercepts" for the MSR ranges
+        // controlled by the map.
+        //
+        // Note that VMware Workstation has a bug that access to unimplemented
+        // MSRs unconditionally causes #VMEXIT ignoring bits in the MSR
+        // permissions map. This can be tested by reading MSR zero, for example.
+        //
+        NT_ASSERT(((msr > 0x00001fff) && (msr < 0xc0000000)) ||
+                  ((msr > 0xc0001fff) && (msr < 0xc0010000)) ||
+                   (msr > 0xc0011fff) ||
+                   (VpData->PolicyGeneration != 0));
+
+        //
+        // Execute WRMSR or RDMSR on behalf of the guest. Important that this
+        // can cause bug check when the guest tries to access unimplemented MSR
+        // *even within the SEH block* because the below WRMSR or RDMSR raises
+        // #GP and are not protected by the SEH block (or cannot be protected
+        // either as this code run outside the thread stack region Windows
+        // requires to proceed SEH). Hypervisors typically handle this by noop-ing
+        // WRMSR and returning zero for RDMSR with non-architecturally defined
+        // MSRs. Alternatively, one can probe which MSRs should cause #GP prior
+        // to installation of a hypervisor and the hypervisor can emulate the
+        // results.
+        //
+        if (writeAccess != FALSE)
+        {
+            __writemsr(msr, value.QuadPart);
+        }
+        else
+        {
+            value.QuadPart = __readmsr(msr);
+        }
+    }
+
+    if (writeAccess == FALSE)
+    {
+        GuestContext->VpRegs->Rax = value.LowPart;
+        GuestContext->VpRegs->Rdx = value.HighPart;
+    }
+
+    //
+    // Then, advance RIP to "complete" the instruction.
+    //
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Returns a pointer to the guest's general purpose register.
+
+    @details        GUEST_REGISTERS holds registers in the reverse order of their
+                    numbers, except RSP, which is only available in VMCB.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+    @param[in]      Register - A register number (0 is RAX, 15 is R15).
+
+    @result         A pointer to the register.
+ */
+_IRQL_requires_same_
+static
+PUINT64
+SvGetGuestRegisterAddress (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext,
+    _In_ UINT32 Register
+    )
+{
+    NT_ASSERT(Register < 16);
+
+    if (Register == 4)
+    {
+        return &VpData->Vmcb->StateSaveArea.Rsp;
+    }
+    return &reinterpret_cast<PUINT64>(GuestContext->VpRegs)[15 - Register];
+}
+
+/*!
+    @brief          Reads the guest's general purpose register.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+    @param[in]      Register - A register number (0 is RAX, 15 is R15).
+    @param[in]      Size - The size of the register operand in bytes.
+    @param[in]      HighByte - TRUE to read bits 15:8 (eg, AH).
+
+    @result         The value of the register, zero-extended.
+ */
+_IRQL_requires_same_
+static
+UINT64
+SvReadGuestRegister (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext,
+    _In_ UINT32 Register,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN HighByte
+    )
+{
+    UINT64 value;
+
+    value = *SvGetGuestRegisterAddress(VpData, GuestContext, Register);
+    if (HighByte != FALSE)
+    {
+        return (value >> 8) & MAXUINT8;
+    }
+
+    switch (Size)
+    {
+    case 1:
+        return value & MAXUINT8;
+    case 2:
+        return value & MAXUINT16;
+    case 4:
+        return value & MAXUINT32;
+    default:
+        return value;
+    }
+}
+
+/*!
+    @brief          Writes the guest's general purpose register.
+
+    @details        This function follows the processor's semantics: writing a
+                    32-bit register clears bits 63:32, and writing an 8 or 16-bit
+                    register preserves the rest of the bits.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+    @param[in]      Register - A register number (0 is RAX, 15 is R15).
+    @param[in]      Size - The size of the register operand in bytes.
+    @param[in]      HighByte - TRUE to write bits 15:8 (eg, AH).
+    @param[in]      Value - The value to write.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvWriteGuestRegister (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext,
+    _In_ UINT32 Register,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN HighByte,
+    _In_ UINT64 Value
+    )
+{
+    PUINT64 registerAddress;
+
+    registerAddress = SvGetGuestRegisterAddress(VpData, GuestContext, Register);
+    if (HighByte != FALSE)
+    {
+        *registerAddress = (*registerAddress & ~0xff00ULL) | ((Value & MAXUINT8) << 8);
+        return;
+    }
+
+    switch (Size)
+    {
+    case 1:
+        *registerAddress = (*registerAddress & ~0xffULL) | (Value & MAXUINT8);
+        break;
+    case 2:
+        *registerAddress = (*registerAddress & ~0xffffULL) | (Value & MAXUINT16);
+        break;
+    case 4:
+        *registerAddress = Value & MAXUINT32;
+        break;
+    default:
+        *registerAddress = Value;
+        break;
+    }
+}
+
+/*!
+    @brief          Returns the MMIO range that contains the guest physical
+                    address.
+
+    @param[in]      SharedVpData - The shared data.
+    @param[in]      GuestPa - The guest physical address to look up.
+
+    @result         The MMIO range, or NULL if the address is not trapped.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+PSV_MMIO_RANGE
+SvFindMmioRange (
+    _In_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ UINT64 GuestPa
+    )
+{
+    LONG count;
+    PSV_MMIO_RANGE range;
+
+    count = SharedVpData->NumberOfMmioRanges;
+    for (LONG i = 0; i < count; i++)
+    {
+        range = &SharedVpData->MmioRanges[i];
+        if ((GuestPa >= range->GuestPa) &&
+            (GuestPa < range->GuestPa + range->Size))
+        {
+            return range;
+        }
+    }
+    return nullptr;
+}
+
+/*!
+    @brief          Reads a guest paging structure entry for the page walker.
+
+    @details        The entry is read through SvMapGuestPhysical, in a slot of
+                    its own so that the page the caller is accessing stays
+                    mapped. Guest page tables outside physical memory fail the
+                    walk.
+
+    @param[in]      Context - Per processor data.
+    @param[in]      GuestPa - The guest physical address of the entry.
+    @param[out]     Value - Receives the entry.
+
+    @result         TRUE on success; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+static
+BOOLEAN
+SvReadGuestPhysical64 (
+    PVOID Context,
+    UINT64 GuestPa,
+    PUINT64 Value
+    )
+{
+    PUINT64 entry;
+
+    *Value = 0;
+
+    entry = static_cast<PUINT64>(SvMapGuestPhysical(
+                                static_cast<PVIRTUAL_PROCESSOR_DATA>(Context),
+                                SvGuestMappingPageTable,
+                                GuestPa));
+    if (entry == nullptr)
+    {
+        return FALSE;
+    }
+    *Value = *entry;
+    return TRUE;
+}
+
+/*!
+    @brief          Translates a guest virtual address with the current guest
+                    paging state.
+
+    @details        Translations are cached in the per processor software TLB
+                    for the rest of the #VMEXIT. The TLB is flushed on every
+                    #VMEXIT, as well as on any TLB flush request (see
+                    SvRequestTlbFlush).
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      GuestVa - The guest virtual address to translate.
+    @param[out]     Translation - Receives the result of translation.
+
+    @result         SvTranslationSuccess on success; otherwise, the reason of
+                    the failure.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+SV_TRANSLATION_STATUS
+SvTranslateGuestVirtualAddress (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 GuestVa,
+    _Out_ PSV_GUEST_TRANSLATION Translation
+    )
+{
+    SV_GUEST_PAGING_STATE state;
+
+    state.Cr0 = VpData->Vmcb->StateSaveArea.Cr0;
+    state.Cr3 = VpData->Vmcb->StateSaveArea.Cr3;
+    state.Cr4 = VpData->Vmcb->StateSaveArea.Cr4;
+    state.Efer = VpData->Vmcb->StateSaveArea.Efer;
+
+    return SvTranslateWithSoftTlb(&VpData->SoftTlb,
+                                  &state,
+                                  GuestVa,
+                                  SvReadGuestPhysical64,
+                                  VpData,
+                                  Translation);
+}
+
+/*!
+    @brief          Reads or writes guest virtual memory.
+
+    @details        This function stops at the first page that cannot be
+                    translated, is read-only for a write, or is outside physical
+                    memory, so the caller may access fewer bytes than requested,
+                    for example, when an instruction crosses into a page that is
+                    not present. Pages are accessed through SvMapGuestPhysical.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      GuestVa - The guest virtual address to access.
+    @param[in,out]  Buffer - The contents to write, or receives the contents
+                    read. Bytes not read are zeroed.
+    @param[in]      Size - The number of bytes to access.
+    @param[in]      IsWrite - TRUE to write Buffer into guest memory.
+
+    @result         The number of bytes accessed.
+ */
+_IRQL_requires_same_
+static
+UINT32
+SvAccessGuestVirtualMemory (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 GuestVa,
+    _Inout_updates_bytes_(Size) PVOID Buffer,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    UINT32 bytesAccessed, chunkSize;
+    SV_GUEST_TRANSLATION translation;
+    PUCHAR guestMemory, buffer;
+
+    buffer = static_cast<PUCHAR>(Buffer);
+    if (IsWrite == FALSE)
+    {
+        RtlZeroMemory(buffer, Size);
+    }
+
+    for (bytesAccessed = 0; bytesAccessed < Size; bytesAccessed += chunkSize)
+    {
+        if (SvTranslateGuestVirtualAddress(VpData,
+                                           GuestVa + bytesAccessed,
+                                           &translation) != SvTranslationSuccess)
+        {
+            break;
+        }
+        if ((IsWrite != FALSE) && (translation.Writable == FALSE))
+        {
+            break;
+        }
+
+        guestMemory = static_cast<PUCHAR>(SvMapGuestPhysical(VpData,
+                                                             SvGuestMappingData,
+                                                             translation.GuestPa));
+        if (guestMemory == nullptr)
+        {
+            break;
+        }
+
+        chunkSize = min(Size - bytesAccessed,
+                        PAGE_SIZE - BYTE_OFFSET(GuestVa + bytesAccessed));
+        if (IsWrite != FALSE)
+        {
+            RtlCopyMemory(guestMemory, buffer + bytesAccessed, chunkSize);
+        }
+        else
+        {
+            RtlCopyMemory(buffer + bytesAccessed, guestMemory, chunkSize);
+        }
+    }
+    return bytesAccessed;
+}
+
+/*!
+    @brief          Checks whether the guest may access guest virtual memory,
+                    and injects the exception the processor would raise if not.
+
+    @details        This function checks each page of the range as the
+                    processor does for a data access at the current CPL: the
+                    page must be present, writable for a write, and user
+                    accessible at CPL 3. Failures to walk the page tables other
+                    than a non-present entry, eg, a non-canonical address,
+                    inject #GP. SMAP and protection keys are not checked.
+
+                    Emulation of an instruction must call this function before
+                    causing any side effect, such as reading an I/O port, so
+                    that the instruction can be restarted after the exception
+                    is handled.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      GuestVa - The guest virtual address to access.
+    @param[in]      Size - The number of bytes to access.
+    @param[in]      IsWrite - TRUE for a write access.
+
+    @result         TRUE when the range is accessible; otherwise, FALSE, and an
+                    exception is injected.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvProbeGuestVirtualMemory (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 GuestVa,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    SV_GUEST_TRANSLATION translation;
+    SV_TRANSLATION_STATUS status;
+    UINT64 pageVa;
+    UINT32 errorCode;
+    BOOLEAN user;
+
+    NT_ASSERT(Size != 0);
+
+    user = (VpData->Vmcb->StateSaveArea.Cpl == 3);
+    errorCode = 0;
+    if (IsWrite != FALSE)
+    {
+        errorCode |= SV_PF_ERROR_WRITE;
+    }
+    if (user != FALSE)
+    {
+        errorCode |= SV_PF_ERROR_USER;
+    }
+
+    //
+    // CR2 is the first byte of the access in the page that faulted.
+    //
+    for (UINT32 offset = 0; offset < Size; offset += PAGE_SIZE - BYTE_OFFSET(pageVa))
+    {
+        pageVa = GuestVa + offset;
+        status = SvTranslateGuestVirtualAddress(VpData, pageVa, &translation);
+        if (status == SvTranslationNotPresent)
+        {
+            SvInjectPageFault(VpData, pageVa, errorCode);
+            return FALSE;
+        }
+        if (status != SvTranslationSuccess)
+        {
+            SvInjectGeneralProtectionException(VpData);
+            return FALSE;
+        }
+        if (((IsWrite != FALSE) && (translation.Writable == FALSE)) ||
+            ((user != FALSE) && (translation.User == FALSE)))
+        {
+            SvInjectPageFault(VpData, pageVa, errorCode | SV_PF_ERROR_PRESENT);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*!
+    @brief          Decodes the instruction that caused #VMEXIT due to #NPF.
+
+    @details        This function uses the instruction bytes fetched by the
+                    processor (decode assists) when available, and reads the
+                    instruction at RIP by walking guest page tables otherwise,
+                    ie, when the processor lacks decode assists or could not
+                    fetch the instruction bytes. Decoded instructions
+                    are cached per processor with RIP as a key, and a cache hit
+                    is confirmed by comparing the instruction bytes so that
+                    modification or reuse of the code address is not missed.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[out]     Instruction - Receives the decoded instruction.
+
+    @result         TRUE when the instruction is decoded; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvDecodeFaultingInstruction (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Out_ PSV_MMIO_INSTRUCTION Instruction
+    )
+{
+    UINT64 rip;
+    UINT32 bytesFetched;
+    const UINT8* bytes;
+    UINT8 buffer[SV_MAX_INSTRUCTION_LENGTH];
+    PSV_MMIO_DECODE_CACHE_ENTRY entry;
+
+    rip = VpData->Vmcb->StateSaveArea.Rip;
+    bytes = VpData->Vmcb->ControlArea.GuestInstructionBytes;
+    bytesFetched = VpData->Vmcb->ControlArea.NumOfBytesFetched;
+    if (bytesFetched > SV_MAX_INSTRUCTION_LENGTH)
+    {
+        bytesFetched = SV_MAX_INSTRUCTION_LENGTH;
+    }
+
+    //
+    // Only 64-bit mode is handled, where the CS base is zero and RIP is the
+    // linear address of the instruction.
+    //
+    if (bytesFetched == 0)
+    {
+        bytesFetched = SvAccessGuestVirtualMemory(VpData,
+                                                  rip,
+                                                  buffer,
+                                                  sizeof(buffer),
+                                                  FALSE);
+        bytes = buffer;
+    }
+
+    entry = &VpData->MmioDecodeCache[(rip ^ (rip >> 4)) % SV_MMIO_DECODE_CACHE_SIZE];
+    if ((entry->Rip == rip) &&
+        (entry->Instruction.Length != 0) &&
+        (entry->Instruction.Length <= bytesFetched) &&
+        (RtlEqualMemory(entry->Bytes, bytes, entry->Instruction.Length) != FALSE))
+    {
+        *Instruction = entry->Instruction;
+        return TRUE;
+    }
+
+    if (SvDecodeMmioInstruction(bytes, bytesFetched, Instruction) == FALSE)
+    {
+        return FALSE;
+    }
+
+    entry->Rip = rip;
+    RtlCopyMemory(entry->Bytes, bytes, Instruction->Length);
+    entry->Instruction = *Instruction;
+    return TRUE;
+}
+
+/*!
+    @brief          Accesses a trapped MMIO range through the host mapping.
+
+    @details        This is the default MMIO handler that simply performs the
+                    access the guest attempted.
+
+    @param[in]      Range - The MMIO range being accessed.
+    @param[in]      Offset - The offset from the base of the range.
+    @param[in]      AccessSize - The size of the access in bytes.
+    @param[in]      IsWrite - TRUE for a write access.
+    @param[in,out]  Value - The value to write, or receives the value read.
+ */
+_Use_decl_annotations_
+static
+VOID
+SvPassThroughMmioAccess (
+    PSV_MMIO_RANGE Range,
+    UINT64 Offset,
+    UINT32 AccessSize,
+    BOOLEAN IsWrite,
+    PUINT64 Value
+    )
+{
+    PUCHAR address;
+
+    address = static_cast<PUCHAR>(Range->MappedVa) + Offset;
+    switch (AccessSize)
+    {
+    case 1:
+        if (IsWrite != FALSE)
+        {
+            *reinterpret_cast<volatile UINT8*>(address) = static_cast<UINT8>(*Value);
+        }
+        else
+        {
+            *Value = *reinterpret_cast<volatile UINT8*>(address);
+        }
+        break;
+    case 2:
+        if (IsWrite != FALSE)
+        {
+            *reinterpret_cast<volatile UINT16*>(address) = static_cast<UINT16>(*Value);
+        }
+        else
+        {
+            *Value = *reinterpret_cast<volatile UINT16*>(address);
+        }
+        break;
+    case 4:
+        if (IsWrite != FALSE)
+        {
+            *reinterpret_cast<volatile UINT32*>(address) = static_cast<UINT32>(*Value);
+        }
+        else
+        {
+            *Value = *reinterpret_cast<volatile UINT32*>(address);
+        }
+        break;
+    default:
+        NT_ASSERT(AccessSize == 8);
+        if (IsWrite != FALSE)
+        {
+            *reinterpret_cast<volatile UINT64*>(address) = *Value;
+        }
+        else
+        {
+            *Value = *reinterpret_cast<volatile UINT64*>(address);
+        }
+        break;
+    }
+}
+
+/*!
+    @brief          Emulates the decoded instruction against the MMIO range.
+
+    @details        STOS with REP is emulated one element at a time: RIP is not
+                    advanced until RCX becomes zero, so the guest re-executes the
+                    instruction and either completes the rest natively or causes
+                    #NPF again for the next element.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+    @param[in]      Instruction - The decoded instruction.
+    @param[in]      Range - The MMIO range being accessed.
+    @param[in]      GuestPa - The guest physical address being accessed.
+
+    @result         TRUE when RIP should be advanced; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+static
+BOOLEAN
+SvEmulateMmioInstruction (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext,
+    _In_ const SV_MMIO_INSTRUCTION* Instruction,
+    _In_ PSV_MMIO_RANGE Range,
+    _In_ UINT64 GuestPa
+    )
+{
+    UINT64 value, count, addressMask;
+    INT64 step;
+    UINT32 shift;
+
+    if (Instruction->IsWrite != FALSE)
+    {
+        InterlockedIncrement64(&Range->WriteCount);
+    }
+    else
+    {
+        InterlockedIncrement64(&Range->ReadCount);
+    }
+
+    switch (Instruction->Kind)
+    {
+    case SvMmioMov:
+        if (Instruction->IsWrite != FALSE)
+        {
+            value = SvReadGuestRegister(VpData,
+                                        GuestContext,
+                                        Instruction->Register,
+                                        Instruction->RegisterSize,
+                                        Instruction->HighByteRegister);
+            Range->Handler(Range, GuestPa - Range->GuestPa, Instruction->AccessSize, TRUE, &value);
+        }
+        else
+        {
+            value = 0;
+            Range->Handler(Range, GuestPa - Range->GuestPa, Instruction->AccessSize, FALSE, &value);
+            SvWriteGuestRegister(VpData,
+                                 GuestContext,
+                                 Instruction->Register,
+                                 Instruction->RegisterSize,
+                                 Instruction->HighByteRegister,
+                                 value);
+        }
+        break;
+
+    case SvMmioMovImmediate:
+        value = Instruction->Immediate;
+        Range->Handler(Range, GuestPa - Range->GuestPa, Instruction->AccessSize, TRUE, &value);
+        break;
+
+    case SvMmioMovZx:
+    case SvMmioMovSx:
+        value = 0;
+        Range->Handler(Range, GuestPa - Range->GuestPa, Instruction->AccessSize, FALSE, &value);
+        if (Instruction->Kind == SvMmioMovSx)
+        {
+            shift = 64 - Instruction->AccessSize * 8;
+            value = static_cast<UINT64>(static_cast<INT64>(value << shift) >> shift);
+        }
+        SvWriteGuestRegister(VpData,
+                             GuestContext,
+                             Instruction->Register,
+                             Instruction->RegisterSize,
+                             FALSE,
+                             value);
+        break;
+
+    case SvMmioStos:
+        addressMask = (Instruction->AddressSize32 != FALSE) ? MAXUINT32 : MAXUINT64;
+        count = 0;
+        if (Instruction->Rep != FALSE)
+        {
+            count = GuestContext->VpRegs->Rcx & addressMask;
+            if (count == 0)
+            {
+                return TRUE;
+            }
+        }
+
+        value = GuestContext->VpRegs->Rax;
+        Range->Handler(Range, GuestPa - Range->GuestPa, Instruction->AccessSize, TRUE, &value);
+
+        step = Instruction->AccessSize;
+        if ((VpData->Vmcb->StateSaveArea.Rflags & RFLAGS_DF) != 0)
+        {
+            step = -step;
+        }
+        SvWriteGuestRegister(VpData,
+                             GuestContext,
+                             7,     // RDI
+                             (Instruction->AddressSize32 != FALSE) ? 4 : 8,
+                             FALSE,
+                             GuestContext->VpRegs->Rdi + step);
+        if (Instruction->Rep != FALSE)
+        {
+            count--;
+            SvWriteGuestRegister(VpData,
+                                 GuestContext,
+                                 1, // RCX
+                                 (Instruction->AddressSize32 != FALSE) ? 4 : 8,
+                                 FALSE,
+                                 count);
+            return (count == 0);
+        }
+        break;
+
+    default:
+        NT_ASSERT(FALSE);
+        break;
+    }
+    return TRUE;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to nested page fault (#NPF).
+
+    @details        #NPF only occurs on access to MMIO ranges registered with
+                    SvRegisterMmioRange, or to pages protected in the NPT view
+                    the processor runs in, since all other guest physical
+                    addresses are mapped. This function emulates the access to
+                    MMIO using the instruction bytes provided by decode assists,
+                    or read through guest page tables without them. Any other
+                    access is retried in view 0 after switching to it.
+
+                    Note that NRIP is not provided for #NPF, and RIP is advanced
+                    with the length of the decoded instruction.
+
+                    An access that cannot be emulated is not performed, and an
+                    exception is injected instead, so that the guest, not the
+                    host, is terminated if it does not handle it: #UD for an
+                    instruction the decoder does not understand, and #GP for
+                    non 64-bit code, an access crossing the end of the range,
+                    and an access outside any range.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleNestedPageFault (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    UINT64 guestPa;
+    PSV_MMIO_RANGE range;
+    SV_MMIO_INSTRUCTION instruction;
+    SEGMENT_ATTRIBUTE attribute;
+
+    guestPa = VpData->Vmcb->ControlArea.ExitInfo2;
+    range = SvFindMmioRange(VpData->HostStackLayout.SharedVpData, guestPa);
+    attribute.AsUInt16 = VpData->Vmcb->StateSaveArea.CsAttrib;
+
+    if ((range == nullptr) &&
+        (VpData->NptView != 0) &&
+        (VpData->Nested.InL2 == FALSE))
+    {
+        SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+        VpData->Statistics->NptViews[VpData->NptView].Faults++;
+        SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+        SvSwitchNptView(VpData, 0);
+        return;
+    }
+
+    //
+    // Only 64-bit code is supported, and the access must be within the range
+    // without crossing its end. An access outside any range is one beyond the
+    // physical address space the nested page tables map.
+    //
+    if ((range == nullptr) || (attribute.Fields.LongMode == 0))
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+    if (SvDecodeFaultingInstruction(VpData, &instruction) == FALSE)
+    {
+        SvInjectUndefinedOpcodeException(VpData);
+        return;
+    }
+    if (guestPa + instruction.AccessSize > range->GuestPa + range->Size)
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+
+    if (SvEmulateMmioInstruction(VpData,
+                                 GuestContext,
+                                 &instruction,
+                                 range,
+                                 guestPa) != FALSE)
+    {
+        VpData->Vmcb->StateSaveArea.Rip += instruction.Length;
+    }
+}
+
+/*!
+    @brief          Accesses an intercepted I/O port.
+
+    @details        This is the I/O port handler that simply performs the access
+                    the guest attempted.
+
+    @param[in]      Port - The port being accessed.
+    @param[in]      Size - The size of the access in bytes.
+    @param[in]      IsIn - TRUE for a read access.
+    @param[in,out]  Value - The value to write, or receives the value read.
+ */
+_Use_decl_annotations_
+static
+VOID
+SvPassThroughIoPortAccess (
+    UINT16 Port,
+    UINT32 Size,
+    BOOLEAN IsIn,
+    PUINT32 Value
+    )
+{
+    switch (Size)
+    {
+    case 1:
+        if (IsIn != FALSE)
+        {
+            *Value = __inbyte(Port);
+        }
+        else
+        {
+            __outbyte(Port, static_cast<UINT8>(*Value));
+        }
+        break;
+    case 2:
+        if (IsIn != FALSE)
+        {
+            *Value = __inword(Port);
+        }
+        else
+        {
+            __outword(Port, static_cast<UINT16>(*Value));
+        }
+        break;
+    default:
+        NT_ASSERT(Size == 4);
+        if (IsIn != FALSE)
+        {
+            *Value = __indword(Port);
+        }
+        else
+        {
+            __outdword(Port, *Value);
+        }
+        break;
+    }
+}
+
+/*!
+    @brief      Finds the I/O port policy that covers any of the accessed ports.
+
+    @param[in]  SharedVpData - The shared data that owns the policies.
+    @param[in]  Port - The first port being accessed.
+    @param[in]  Size - The size of the access in bytes.
+
+    @result     An index of the policy, or MAXULONG if not found.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+ULONG
+SvFindIoPortPolicy (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ UINT16 Port,
+    _In_ UINT32 Size
+    )
+{
+    const SV_IO_PORT_POLICY* policy;
+
+    for (ULONG i = 0; i < SharedVpData->NumberOfIoPortPolicies; i++)
+    {
+        policy = &SharedVpData->IoPortPolicies[i];
+        if ((static_cast<UINT32>(Port) + Size > policy->FirstPort) &&
+            (Port <= policy->LastPort))
+        {
+            return i;
+        }
+    }
+    return MAXULONG;
+}
+
+/*!
+    @brief          Accounts TSC cycles since the last switch to the address
+                    space being accounted.
+
+    @details        The caller must be updating Cr3Statistics with the seqlock.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      Now - The current TSC.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvAccountCr3Time (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 Now
+    )
+{
+    PSV_CR3_STATISTICS statistics;
+    PSV_CR3_STATISTICS_ENTRY entry;
+    UINT64 cycles;
+
+    statistics = VpData->Cr3Statistics;
+    cycles = Now - VpData->Cr3Accounting.SwitchTime;
+    entry = SvLookupCr3Statistics(statistics, VpData->Cr3Accounting.Cr3, TRUE);
+    if (entry != nullptr)
+    {
+        entry->Cycles += cycles;
+    }
+    else
+    {
+        statistics->UntrackedCycles += cycles;
+    }
+    statistics->Cycles += cycles;
+    VpData->Cr3Accounting.SwitchTime = Now;
+}
+
+/*!
+    @brief          Starts or stops intercepting CR3 writes according to the
+                    sampling window the processor is in.
+
+    @details        Windows are numbered from when the processor was
+                    virtualized, and CR3 writes are intercepted in every
+                    Cr3SamplingPeriod-th window. This function is called on
+                    every #VMEXIT, so a window may end late, but the windows
+                    are kept aligned to SV_CR3_SAMPLING_WINDOW_CYCLES.
+
+                    The intercept is on GuestVmcb even while L2 runs, as CR3
+                    writes of L2 are not accounted. L1's time spent running L2
+                    is accounted to the CR3 of L1.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      Now - The current TSC.
+ */
+template<typename Policy>
+_IRQL_requires_same_
+static
+VOID
+SvUpdateCr3SamplingWindow (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 Now
+    )
+{
+    PSV_CR3_ACCOUNTING accounting;
+    UINT64 windows;
+    BOOLEAN enable;
+
+    accounting = &VpData->Cr3Accounting;
+    if (Now - accounting->WindowStartTime < SV_CR3_SAMPLING_WINDOW_CYCLES)
+    {
+        return;
+    }
+
+    windows = (Now - accounting->WindowStartTime) / SV_CR3_SAMPLING_WINDOW_CYCLES;
+    accounting->WindowStartTime += windows * SV_CR3_SAMPLING_WINDOW_CYCLES;
+    accounting->WindowNumber += windows;
+    enable = ((accounting->WindowNumber % Policy::Cr3SamplingPeriod) == 0);
+
+    SvBeginSeqlockWrite(&VpData->Cr3Statistics->Sequence);
+    if (accounting->Enabled != FALSE)
+    {
+        SvAccountCr3Time(VpData, Now);
+        VpData->Cr3Statistics->SampledWindows += windows;
+    }
+    else
+    {
+        VpData->Cr3Statistics->SkippedWindows += windows;
+    }
+    SvEndSeqlockWrite(&VpData->Cr3Statistics->Sequence);
+
+    if (enable == accounting->Enabled)
+    {
+        return;
+    }
+
+    if (enable != FALSE)
+    {
+        accounting->Cr3 = VpData->GuestVmcb.StateSaveArea.Cr3;
+        accounting->SwitchTime = Now;
+    }
+    accounting->Enabled = enable;
+    SvUpdateNptViewTrackingIntercepts(VpData);
+}
+
+/*!
+    @brief          Starts or stops intercepting physical interrupts according
+                    to the sampling window the processor is in.
+
+    @details        Windows are numbered and kept aligned in the same way as
+                    ones of CR3 accounting. See SvUpdateCr3SamplingWindow.
+
+                    The intercept is set only on GuestVmcb, so interrupts are
+                    not measured while L2 runs.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      Now - The current TSC.
+ */
+template<typename Policy>
+_IRQL_requires_same_
+static
+VOID
+SvUpdateInterruptSamplingWindow (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 Now
+    )
+{
+    PSV_INTERRUPT_ACCOUNTING accounting;
+    UINT64 windows;
+    BOOLEAN enable;
+
+    accounting = &VpData->InterruptAccounting;
+    if (Now - accounting->WindowStartTime < SV_INTERRUPT_SAMPLING_WINDOW_CYCLES)
+    {
+        return;
+    }
+
+    windows = (Now - accounting->WindowStartTime) / SV_INTERRUPT_SAMPLING_WINDOW_CYCLES;
+    accounting->WindowStartTime += windows * SV_INTERRUPT_SAMPLING_WINDOW_CYCLES;
+    accounting->WindowNumber += windows;
+    enable = ((accounting->WindowNumber % Policy::InterruptSamplingPeriod) == 0);
+    if (enable == accounting->Enabled)
+    {
+        return;
+    }
+
+    if (enable != FALSE)
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SV_INTERRUPT_LATENCY_INTERCEPTS_MISC1;
+    }
+    else
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc1 &= ~SV_INTERRUPT_LATENCY_INTERCEPTS_MISC1;
+    }
+    VpData->GuestVmcb.ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+    accounting->Enabled = enable;
+}
+
+/*!
+    @brief          Accounts how long the host delayed a physical interrupt to
+                    the guest.
+
+    @details        This function is called at the end of every #VMEXIT while
+                    interrupts are intercepted, right before the guest is
+                    resumed.
+
+                    An intercepted interrupt stays pending until VMRUN, which
+                    delivers it to the guest, so the guest is delayed by the
+                    time this #VMEXIT took. An interrupt that arrived while the
+                    host was handling the previous #VMEXIT instead caused this
+                    #VMEXIT right after VMRUN, before the guest made progress.
+                    It is told by the guest having run for less than
+                    SV_HELD_INTERRUPT_CYCLES, and is counted as also delayed by
+                    the time the host had spent on the previous #VMEXIT and the
+                    round trip. As when exactly the interrupt arrived is unknown,
+                    this is an upper bound.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ExitCode - The #VMEXIT code being handled.
+    @param[in]      ExitTime - The TSC when handling of the #VMEXIT started.
+    @param[in]      Now - The current TSC.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvAccountInterruptLatency (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 ExitCode,
+    _In_ UINT64 ExitTime,
+    _In_ UINT64 Now
+    )
+{
+    PSV_INTERRUPT_ACCOUNTING accounting;
+    UINT64 delay;
+    BOOLEAN held;
+    ULONG bucket;
+
+    accounting = &VpData->InterruptAccounting;
+    if (accounting->Enabled == FALSE)
+    {
+        return;
+    }
+
+    if (ExitCode == VMEXIT_INTR)
+    {
+        delay = Now - ExitTime;
+        held = (ExitTime - accounting->ResumeTime < SV_HELD_INTERRUPT_CYCLES);
+        if (held != FALSE)
+        {
+            delay += accounting->HostCycles + (ExitTime - accounting->ResumeTime);
+        }
+        if (_BitScanReverse64(&bucket, delay) == 0)
+        {
+            bucket = 0;
+        }
+        bucket = min(bucket, SV_INTERRUPT_LATENCY_BUCKETS - 1UL);
+
+        SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+        VpData->Statistics->Interrupts++;
+        VpData->Statistics->HeldInterrupts += (held != FALSE) ? 1 : 0;
+        VpData->Statistics->InterruptDelayCycles += delay;
+        VpData->Statistics->InterruptLatency[bucket]++;
+        SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+    }
+
+    accounting->ResumeTime = Now;
+    accounting->HostCycles = Now - ExitTime;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to HLT or MWAIT.
+
+    @details        The guest goes idle by executing the instruction by itself:
+                    this function does not advance RIP, but removes intercepts
+                    of HLT and MWAIT, so that VMRUN resumes the guest at the
+                    same instruction, and the processor sleeps natively. The
+                    interrupt shadow, if any, is kept in the VMCB, so an
+                    interrupt cannot sneak in between STI and HLT.
+
+                    Physical interrupts are intercepted until the next #VMEXIT,
+                    which ends the idle period, and is accounted by
+                    SvEndIdlePeriod. The monitor armed by MONITOR may be lost
+                    while the host runs, in which case MWAIT returns at once,
+                    as it is allowed to.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleIdleInstruction (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PVMCB guestVmcb;
+
+    NT_ASSERT(VpData->Nested.InL2 == FALSE);
+
+    guestVmcb = &VpData->GuestVmcb;
+    guestVmcb->ControlArea.InterceptMisc1 &= ~SV_IDLE_ACCOUNTING_INTERCEPTS_MISC1;
+    guestVmcb->ControlArea.InterceptMisc1 |= SVM_INTERCEPT_MISC1_INTR;
+    guestVmcb->ControlArea.InterceptMisc2 &= ~SV_IDLE_ACCOUNTING_INTERCEPTS_MISC2;
+    guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+    VpData->IdleAccounting.Idle = TRUE;
+
+    SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+    if (guestVmcb->ControlArea.ExitCode == VMEXIT_HLT)
+    {
+        VpData->Statistics->Halts++;
+    }
+    else
+    {
+        VpData->Statistics->Mwaits++;
+    }
+    SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+}
+
+/*!
+    @brief          Ends the idle period of the guest and accounts it.
+
+    @details        This function is called at the start of the first #VMEXIT
+                    after the guest was resumed to go idle, and restores the
+                    intercepts removed by SvHandleIdleInstruction. Physical
+                    interrupts remain intercepted if interrupt latency is
+                    sampled.
+
+                    The guest may have woken without #VMEXIT, so the residency
+                    is the upper bound of how long the guest was idle.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ExitCode - The #VMEXIT code being handled.
+    @param[in]      ExitTime - The TSC when handling of the #VMEXIT started.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvEndIdlePeriod (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 ExitCode,
+    _In_ UINT64 ExitTime
+    )
+{
+    PVMCB guestVmcb;
+    UINT64 residency;
+    ULONG bucket;
+    UINT32 reason;
+
+    guestVmcb = &VpData->GuestVmcb;
+    guestVmcb->ControlArea.InterceptMisc1 |= SV_IDLE_ACCOUNTING_INTERCEPTS_MISC1;
+    if (VpData->InterruptAccounting.Enabled == FALSE)
+    {
+        guestVmcb->ControlArea.InterceptMisc1 &= ~SVM_INTERCEPT_MISC1_INTR;
+    }
+    guestVmcb->ControlArea.InterceptMisc2 |= SV_IDLE_ACCOUNTING_INTERCEPTS_MISC2;
+    guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+    VpData->IdleAccounting.Idle = FALSE;
+    VpData->IdleAccounting.Woken = TRUE;
+
+    if (ExitCode == VMEXIT_INTR)
+    {
+        reason = SV_IDLE_WAKE_INTERRUPT;
+    }
+    else if ((ExitCode == VMEXIT_HLT) ||
+             (ExitCode == VMEXIT_MWAIT) ||
+             (ExitCode == VMEXIT_MWAIT_CONDITIONAL))
+    {
+        reason = SV_IDLE_WAKE_IDLE;
+    }
+    else
+    {
+        reason = SV_IDLE_WAKE_OTHER;
+    }
+
+    residency = ExitTime - VpData->IdleAccounting.EntryTime;
+    if (_BitScanReverse64(&bucket, residency) == 0)
+    {
+        bucket = 0;
+    }
+    bucket = min(bucket, SV_IDLE_RESIDENCY_BUCKETS - 1UL);
+
+    SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+    VpData->Statistics->IdleCycles += residency;
+    VpData->Statistics->IdleResidency[bucket]++;
+    VpData->Statistics->IdleWakeReasons[reason]++;
+    SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+}
+
+/*!
+    @brief          Accounts the cost of #VMEXIT caused by idle accounting.
+
+    @details        This function is called at the end of every #VMEXIT, right
+                    before the guest is resumed. The cost is that of #VMEXIT
+                    due to HLT and MWAIT, and due to physical interrupts that
+                    ended idle periods.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ExitCode - The #VMEXIT code being handled.
+    @param[in]      ExitTime - The TSC when handling of the #VMEXIT started.
+    @param[in]      Now - The current TSC.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvAccountIdleExit (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 ExitCode,
+    _In_ UINT64 ExitTime,
+    _In_ UINT64 Now
+    )
+{
+    BOOLEAN woken;
+
+    woken = VpData->IdleAccounting.Woken;
+    VpData->IdleAccounting.Woken = FALSE;
+    if (VpData->IdleAccounting.Idle != FALSE)
+    {
+        VpData->IdleAccounting.EntryTime = Now;
+    }
+    else if ((woken == FALSE) || (ExitCode != VMEXIT_INTR))
+    {
+        return;
+    }
+
+    SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+    VpData->Statistics->IdleExitCycles += Now - ExitTime;
+    SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+}
+
+/*!
+    @brief          Removes intercepts of classes that are backing off.
+
+    @details        This function is idempotent, and called after any update of
+                    intercepts by the policy set at run time, which restores
+                    them.
+
+                    The MSRPM is switched to the built-in one, which keeps the
+                    mandatory MSR intercepts, such as write to EFER.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvApplyExitBackoffs (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PVMCB guestVmcb;
+    UINT32 backedOff;
+
+    guestVmcb = &VpData->GuestVmcb;
+    backedOff = VpData->ExitBudgets.BackedOff;
+    if (((backedOff & (1UL << SV_EXIT_BUDGET_IOIO)) != 0) &&
+        ((guestVmcb->ControlArea.InterceptMisc1 & SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1) != 0))
+    {
+        guestVmcb->ControlArea.InterceptMisc1 &= ~SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+    }
+    if (((backedOff & (1UL << SV_EXIT_BUDGET_MSR)) != 0) &&
+        (guestVmcb->ControlArea.MsrpmBasePa != VpData->ExitBudgets.MsrpmBasePa))
+    {
+        guestVmcb->ControlArea.MsrpmBasePa = VpData->ExitBudgets.MsrpmBasePa;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_IOPM;
+    }
+    if (((backedOff & (1UL << SV_EXIT_BUDGET_EXCEPTION)) != 0) &&
+        (guestVmcb->ControlArea.InterceptException != 0))
+    {
+        guestVmcb->ControlArea.InterceptException = 0;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+    }
+}
+
+/*!
+    @brief          Restores intercepts of a class that has backed off.
+
+    @details        Intercepts are restored from the policy set at run time that
+                    the processor uses, or from the built-in one. If the former
+                    has been replaced since SvSynchronizeInterceptPolicy ran,
+                    the built-in one is used, and the new policy overwrites it
+                    on the next #VMEXIT.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      Class - The SV_EXIT_BUDGET_* class to restore.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvRestoreExitBudgetClass (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT32 Class
+    )
+{
+    const SV_POLICY_VERSION* policy;
+    PVMCB guestVmcb;
+
+    guestVmcb = &VpData->GuestVmcb;
+    policy = VpData->HostStackLayout.SharedVpData->PolicyVersion;
+    if ((policy != nullptr) && (policy->Generation != VpData->PolicyGeneration))
+    {
+        policy = nullptr;
+    }
+
+    switch (Class)
+    {
+    case SV_EXIT_BUDGET_IOIO:
+        guestVmcb->ControlArea.InterceptMisc1 |= SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1 &
+                ((policy != nullptr) ? policy->InterceptMisc1 : SV_INTERCEPT_POLICY::InterceptMisc1);
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+        break;
+    case SV_EXIT_BUDGET_MSR:
+        guestVmcb->ControlArea.MsrpmBasePa = (policy != nullptr) ?
+                                             policy->MsrpmBasePa : VpData->ExitBudgets.MsrpmBasePa;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_IOPM;
+        break;
+    case SV_EXIT_BUDGET_EXCEPTION:
+        guestVmcb->ControlArea.InterceptException = (policy != nullptr) ?
+                                                    policy->InterceptException : 0;
+        guestVmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_INTERCEPTS;
+        break;
+    default:
+        NT_ASSERT(FALSE);
+    }
+}
+
+/*!
+    @brief          Counts #VMEXIT against the budget of its class, and backs off
+                    or restores intercepts of classes accordingly.
+
+    @details        This function is called at the end of every #VMEXIT, after
+                    SvSynchronizeInterceptPolicy. Only #VMEXITs from L1 are
+                    counted, as intercepts for L2 are not removed. None of the
+                    classes switches between L1 and L2, so InL2 tells where the
+                    #VMEXIT came from at this point too.
+
+                    A class exceeding its budget is backed off only when it has
+                    optional intercepts to remove. For example, storms of write
+                    to EFER are counted as MSR accesses but never relaxed.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ExitCode - The #VMEXIT code being handled.
+    @param[in]      Now - The current TSC.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvEnforceExitBudgets (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 ExitCode,
+    _In_ UINT64 Now
+    )
+{
+    PSV_EXIT_BUDGETS budgets;
+    PVMCB guestVmcb;
+    UINT32 exitClass;
+    BOOLEAN optional;
+
+    budgets = &VpData->ExitBudgets;
+    guestVmcb = &VpData->GuestVmcb;
+
+    //
+    // End back-off of classes whose period has passed, and re-apply the rest,
+    // which may have been restored by the policy set at run time.
+    //
+    if (budgets->BackedOff != 0)
+    {
+        for (UINT32 i = 0; i < SV_EXIT_BUDGET_CLASSES; i++)
+        {
+            if (((budgets->BackedOff & (1UL << i)) != 0) &&
+                (Now >= budgets->BackoffEndTime[i]))
+            {
+                budgets->BackedOff &= ~(1UL << i);
+                SvRestoreExitBudgetClass(VpData, i);
+            }
+        }
+        SvApplyExitBackoffs(VpData);
+    }
+
+    if (Now - budgets->WindowStartTime >= SV_EXIT_BUDGET_WINDOW_CYCLES)
+    {
+        RtlZeroMemory(budgets->Exits, sizeof(budgets->Exits));
+        budgets->WindowStartTime = Now;
+    }
+
+    if (VpData->Nested.InL2 != FALSE)
+    {
+        return;
+    }
+    if (ExitCode == VMEXIT_IOIO)
+    {
+        exitClass = SV_EXIT_BUDGET_IOIO;
+    }
+    else if (ExitCode == VMEXIT_MSR)
+    {
+        exitClass = SV_EXIT_BUDGET_MSR;
+    }
+    else if ((ExitCode >= VMEXIT_EXCEPTION_DE) && (ExitCode <= VMEXIT_EXCEPTION_31))
+    {
+        exitClass = SV_EXIT_BUDGET_EXCEPTION;
+    }
+    else
+    {
+        return;
+    }
+
+    if (++budgets->Exits[exitClass] <= g_ExitBudgets[exitClass])
+    {
+        return;
+    }
+    budgets->Exits[exitClass] = 0;
+
+    switch (exitClass)
+    {
+    case SV_EXIT_BUDGET_IOIO:
+        optional = ((guestVmcb->ControlArea.InterceptMisc1 & SV_EXIT_BUDGET_IOIO_INTERCEPTS_MISC1) != 0);
+        break;
+    case SV_EXIT_BUDGET_MSR:
+        optional = (guestVmcb->ControlArea.MsrpmBasePa != budgets->MsrpmBasePa);
+        break;
+    default:
+        optional = (guestVmcb->ControlArea.InterceptException != 0);
+        break;
+    }
+    if (optional == FALSE)
+    {
+        return;
+    }
+
+    budgets->BackedOff |= (1UL << exitClass);
+    budgets->BackoffEndTime[exitClass] = Now + SV_EXIT_BACKOFF_CYCLES;
+    SvApplyExitBackoffs(VpData);
+
+    SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+    VpData->Statistics->ExitBackoffs[exitClass]++;
+    VpData->Statistics->LastExitBackoffTime[exitClass] = Now;
+    SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+}
+
+/*!
+    @brief          Saves guest's extended state so that the calling #VMEXIT
+                    handler can use SIMD registers.
+
+    @details        SvLaunchVm saves only XMM0-5 of guest's registers, which the
+                    compiler may use as volatile registers, and XMM6-15 are
+                    preserved by the calling convention. Any other use of SIMD
+                    registers, such as YMM registers and AVX instructions,
+                    destroys guest's state, unless it is saved with this
+                    function first. The state is restored by SvHandleVmExit
+                    before the guest is resumed.
+
+                    This is lazy: #VMEXITs whose handlers do not call this
+                    function pay nothing but a test in SvHandleVmExit. Those
+                    that do pay XSAVEOPT, or XSAVE when it is unavailable, and
+                    XRSTOR of all components enabled in XCR0, which is shared
+                    with the guest. XSAVEOPT skips components that are in their
+                    initial state or unmodified since the last XRSTOR from the
+                    area. The cost is in ExtendedStateCycles of the statistics
+                    and in the "xstate_*" benchmarks.
+
+                    XMM0-5 may already hold host's values when this function
+                    is called; they are restored by SvLaunchVm after XRSTOR.
+
+    @param[in,out]  VpData - Per processor data.
+
+    @result         TRUE when the handler may use SIMD registers; FALSE when
+                    the processor does not support XSAVE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+inline
+BOOLEAN
+SvSaveGuestExtendedState (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PSV_EXTENDED_STATE state;
+    UINT64 startTime;
+
+    state = &VpData->ExtendedState;
+    if (state->SavedMask != 0)
+    {
+        return TRUE;
+    }
+    if (state->Area == nullptr)
+    {
+        return FALSE;
+    }
+
+    startTime = __rdtsc();
+    state->SavedMask = _xgetbv(0);
+    if (state->XsaveoptSupported != FALSE)
+    {
+        _xsaveopt64(state->Area, state->SavedMask);
+    }
+    else
+    {
+        _xsave64(state->Area, state->SavedMask);
+    }
+    state->SaveCycles = __rdtsc() - startTime;
+    return TRUE;
+}
+
+/*!
+    @brief          Restores guest's extended state saved by
+                    SvSaveGuestExtendedState.
+
+    @param[in,out]  VpData - Per processor data.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvRestoreGuestExtendedState (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PSV_EXTENDED_STATE state;
+
+    state = &VpData->ExtendedState;
+    NT_ASSERT(state->SavedMask != 0);
+
+    _xrstor64(state->Area, state->SavedMask);
+    state->SavedMask = 0;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to write to CR3.
+
+    @details        The write is emulated, and the time the guest ran in the
+                    previous address space is accounted. MOV to CR3 flushes
+                    non-global translations unless bit 63 of the source is set
+                    with CR4.PCIDE. This is emulated by flushing non-global
+                    translations of all PCIDs of the ASID, which is more than
+                    required but never less.
+
+                    As with EFER, the value is not validated, for simplicity.
+
+                    This handler relies on decode assists for the source
+                    register. SvPrepareForVirtualization does not intercept CR3
+                    writes without them.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleCr3Write (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    PSV_CR3_STATISTICS statistics;
+    PSV_CR3_STATISTICS_ENTRY entry;
+    UINT64 exitInfo1, newCr3, now;
+
+    now = __rdtsc();
+    exitInfo1 = VpData->Vmcb->ControlArea.ExitInfo1;
+
+    NT_ASSERT(VpData->Nested.InL2 == FALSE);
+    NT_ASSERT((exitInfo1 & SVM_EXITINFO1_MOV_CR) != 0);
+
+    newCr3 = SvReadGuestRegister(VpData,
+                                 GuestContext,
+                                 static_cast<UINT32>(exitInfo1 & SVM_EXITINFO1_GPR_MASK),
+                                 sizeof(UINT64),
+                                 FALSE);
+    if (((VpData->Vmcb->StateSaveArea.Cr4 & CR4_PCIDE) != 0) &&
+        ((newCr3 & CR3_NO_FLUSH) != 0))
+    {
+        newCr3 &= ~CR3_NO_FLUSH;
+    }
+    else
+    {
+        SvRequestTlbFlush(VpData, SvTlbFlushGuestNonGlobal);
+    }
+
+    //
+    // Account the switch, unless the sampling window has just ended. Writes
+    // that do not change the address space, eg, to flush TLB, are not counted
+    // as switches.
+    //
+    if (VpData->Cr3Accounting.Enabled != FALSE)
+    {
+        statistics = VpData->Cr3Statistics;
+        SvBeginSeqlockWrite(&statistics->Sequence);
+        SvAccountCr3Time(VpData, now);
+        if (((newCr3 ^ VpData->Cr3Accounting.Cr3) & SV_CR3_ADDRESS_MASK) != 0)
+        {
+            entry = SvLookupCr3Statistics(statistics, newCr3, TRUE);
+            if (entry != nullptr)
+            {
+                entry->Switches++;
+            }
+            statistics->Switches++;
+        }
+        SvEndSeqlockWrite(&statistics->Sequence);
+        VpData->Cr3Accounting.Cr3 = newCr3;
+    }
+
+    VpData->Vmcb->StateSaveArea.Cr3 = newCr3;
+    VpData->Vmcb->ControlArea.VmcbClean &= ~SVM_VMCB_CLEAN_CRX;
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to an instruction that invalidates guest
+                    translations while other NPT views are warm.
+
+    @details        The instruction does not invalidate translations cached with
+                    ASIDs of other views, so they stop being warm, and switching
+                    to them flushes the guest TLB. The instruction is not
+                    emulated. The intercepts are removed and RIP is left as it
+                    is, so that the guest executes the instruction again without
+                    #VMEXIT. See SvUpdateNptViewTrackingIntercepts.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleNptViewInvalidation (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    UNREFERENCED_PARAMETER(GuestContext);
+
+    NT_ASSERT(VpData->Nested.InL2 == FALSE);
+
+    VpData->WarmNptViews = 0;
+    SvUpdateNptViewTrackingIntercepts(VpData);
+}
+
+/*!
+    @brief          Handles #VMEXIT due to IN, OUT, INS and OUTS instructions.
+
+    @details        The access is performed by the handler of the policy that
+                    covers the port, and counted per processor with the cycles
+                    it took. INS and OUTS are emulated one element per #VMEXIT;
+                    with the REP prefix, RIP is not advanced until RCX reaches
+                    zero, so that the guest re-executes the instruction and
+                    remains interruptible between elements, just like the
+                    processor does.
+
+                    The memory operand of INS and OUTS is checked before the
+                    port is accessed. When it is not accessible, #PF or #GP is
+                    injected as the processor would, and the port is not
+                    accessed. When it translates to memory the host cannot
+                    access, #GP is injected instead. For INS, this is only known
+                    after the port is read.
+
+                    Unlike #NPF, the address of the next instruction is always
+                    provided in EXITINFO2 for IOIO.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleIoAccess (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+    SV_IOIO_EXIT_INFO exitInfo;
+    PSV_IO_PORT_HANDLER handler;
+    PSV_IO_PORT_STATISTICS statistics;
+    ULONG policyIndex;
+    UINT32 value, registerNumber;
+    UINT64 count, guestVa, startTime, cycles;
+    INT64 step;
+    BOOLEAN completed;
+
+    sharedVpData = VpData->HostStackLayout.SharedVpData;
+    if (SvDecodeIoioExitInfo(VpData->Vmcb->ControlArea.ExitInfo1,
+                             &exitInfo) == FALSE)
+    {
+        SV_DEBUG_BREAK();
+#pragma prefast(disable : __WARNING_USE_OTHER_FUNCTION, "Unrecoverble path.")
+        KeBugCheck(MANUALLY_INITIATED_CRASH);
+    }
+
+    //
+    // A wide access may be intercepted because it overlaps a port of a policy
+    // without starting at it. Such an access is attributed to that policy.
+    //
+    policyIndex = SvFindIoPortPolicy(sharedVpData, exitInfo.Port, exitInfo.Size);
+    if (policyIndex != MAXULONG)
+    {
+        handler = sharedVpData->IoPortPolicies[policyIndex].Handler;
+        statistics = &VpData->IoPortStatistics[policyIndex];
+    }
+    else
+    {
+        handler = SvPassThroughIoPortAccess;
+        statistics = nullptr;
+    }
+
+    completed = TRUE;
+    guestVa = 0;
+    value = 0;
+    count = 0;
+    registerNumber = (exitInfo.IsIn != FALSE) ? 7 : 6;     // RDI or RSI
+
+    if (exitInfo.IsString != FALSE)
+    {
+        if (exitInfo.Rep != FALSE)
+        {
+            count = SvReadGuestRegister(VpData, GuestContext, 1, exitInfo.AddressSize, FALSE);
+            if (count == 0)
+            {
+                goto Exit;
+            }
+        }
+
+        //
+        // Only FS and GS may have non-zero base in 64-bit mode. OUTS may be
+        // used with segment override prefixes, while INS always uses ES.
+        //
+        guestVa = SvReadGuestRegister(VpData,
+                                      GuestContext,
+                                      registerNumber,
+                                      exitInfo.AddressSize,
+                                      FALSE);
+        if (exitInfo.IsIn == FALSE)
+        {
+            if (exitInfo.Segment == 4)
+            {
+                guestVa += VpData->Vmcb->StateSaveArea.FsBase;
+            }
+            else if (exitInfo.Segment == 5)
+            {
+                guestVa += VpData->Vmcb->StateSaveArea.GsBase;
+            }
+        }
+
+        if (SvProbeGuestVirtualMemory(VpData,
+                                      guestVa,
+                                      exitInfo.Size,
+                                      exitInfo.IsIn) == FALSE)
+        {
+            completed = FALSE;
+            goto Exit;
+        }
+
+        if ((exitInfo.IsIn == FALSE) &&
+            (SvAccessGuestVirtualMemory(VpData,
+                                        guestVa,
+                                        &value,
+                                        exitInfo.Size,
+                                        FALSE) != exitInfo.Size))
+        {
+            SvInjectGeneralProtectionException(VpData);
+            completed = FALSE;
+            goto Exit;
+        }
+    }
+    else if (exitInfo.IsIn == FALSE)
+    {
+        value = static_cast<UINT32>(GuestContext->VpRegs->Rax);
+    }
+
+    startTime = __rdtsc();
+    handler(exitInfo.Port, exitInfo.Size, exitInfo.IsIn, &value);
+    cycles = __rdtsc() - startTime;
+
+    if (statistics != nullptr)
+    {
+        if (exitInfo.IsIn != FALSE)
+        {
+            statistics->InCount++;
+        }
+        else
+        {
+            statistics->OutCount++;
+        }
+        statistics->TotalCycles += cycles;
+        if (cycles > statistics->MaxCycles)
+        {
+            statistics->MaxCycles = cycles;
+        }
+    }
+
+    if (exitInfo.IsString == FALSE)
+    {
+        if (exitInfo.IsIn != FALSE)
+        {
+            SvWriteGuestRegister(VpData, GuestContext, 0, exitInfo.Size, FALSE, value);
+        }
+        goto Exit;
+    }
+
+    if ((exitInfo.IsIn != FALSE) &&
+        (SvAccessGuestVirtualMemory(VpData,
+                                    guestVa,
+                                    &value,
+                                    exitInfo.Size,
+                                    TRUE) != exitInfo.Size))
+    {
+        SvInjectGeneralProtectionException(VpData);
+        completed = FALSE;
+        goto Exit;
+    }
+
+    step = exitInfo.Size;
+    if ((VpData->Vmcb->StateSaveArea.Rflags & RFLAGS_DF) != 0)
+    {
+        step = -step;
+    }
+    SvWriteGuestRegister(VpData,
+                         GuestContext,
+                         registerNumber,
+                         exitInfo.AddressSize,
+                         FALSE,
+                         SvReadGuestRegister(VpData,
+                                             GuestContext,
+                                             registerNumber,
+                                             exitInfo.AddressSize,
+                                             FALSE) + step);
+    if (exitInfo.Rep != FALSE)
+    {
+        count--;
+        SvWriteGuestRegister(VpData, GuestContext, 1, exitInfo.AddressSize, FALSE, count);
+        completed = (count == 0);
+    }
+
+Exit:
+    if (completed != FALSE)
+    {
+        VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.ExitInfo2;
+    }
+}
+
+/*!
+    @brief          Tests a bit in a permissions map of the nested hypervisor.
+
+    @details        The map is accessed through SvMapGuestPhysical. As with the
+                    processor, the low 12 bits of MapPa are ignored. A bit
+                    outside physical memory is treated as set, so that the
+                    access is reflected to the nested hypervisor rather than
+                    silently allowed. SvHandleVmrun has validated the map, but
+                    L1 may change the VMCB from another processor while L2 runs.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      MapPa - The physical address of the map.
+    @param[in]      BitOffset - The offset of the bit from the start of the map.
+
+    @result         TRUE when the bit is set; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvTestGuestPhysicalBit (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 MapPa,
+    _In_ UINT64 BitOffset
+    )
+{
+    PUINT8 byte;
+
+    byte = static_cast<PUINT8>(SvMapGuestPhysical(
+                            VpData,
+                            SvGuestMappingData,
+                            (MapPa & ~static_cast<UINT64>(PAGE_SIZE - 1)) + BitOffset / CHAR_BIT));
+    if (byte == nullptr)
+    {
+        return TRUE;
+    }
+    return ((*byte & (1 << (BitOffset % CHAR_BIT))) != 0);
+}
+
+/*!
+    @brief          Merges a permissions map of the nested hypervisor with the
+                    one of SimpleSvm.
+
+    @details        Accesses intercepted by either of them are intercepted with
+                    the merged map. The nested hypervisor's map is accessed a
+                    page at a time through SvMapGuestPhysical, and the low 12
+                    bits of NestedMapPa are ignored as the processor does.
+                    SvHandleVmrun has validated the map, but any page outside
+                    physical memory is treated as intercepting everything.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[out]     MergedMap - The map to build.
+    @param[in]      OurMap - The map of SimpleSvm.
+    @param[in]      NestedMapPa - The physical address of the nested hypervisor's
+                    map.
+    @param[in]      Size - The size of the maps in bytes.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvMergePermissionsMap (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Out_writes_bytes_all_(Size) PVOID MergedMap,
+    _In_reads_bytes_(Size) const VOID* OurMap,
+    _In_ UINT64 NestedMapPa,
+    _In_ SIZE_T Size
+    )
+{
+    PUINT64 merged;
+    const UINT64* ours;
+    const UINT64* nested;
+
+    merged = static_cast<PUINT64>(MergedMap);
+    ours = static_cast<const UINT64*>(OurMap);
+    NestedMapPa &= ~static_cast<UINT64>(PAGE_SIZE - 1);
+    for (SIZE_T offset = 0; offset < Size; offset += PAGE_SIZE)
+    {
+        nested = static_cast<const UINT64*>(SvMapGuestPhysical(VpData,
+                                                               SvGuestMappingData,
+                                                               NestedMapPa + offset));
+        for (SIZE_T i = offset / sizeof(UINT64); i < (offset + PAGE_SIZE) / sizeof(UINT64); i++)
+        {
+            merged[i] = (nested != nullptr) ? (ours[i] | nested[i - offset / sizeof(UINT64)]) : MAXUINT64;
+        }
+    }
+}
+
+/*!
+    @brief          Copies state that is loaded and saved by VMLOAD and VMSAVE.
+
+    @details        Neither VMRUN nor #VMEXIT switches this state. See "VMSAVE"
+                    and "VMLOAD".
+
+    @param[out]     Destination - The state save area to copy to.
+    @param[in]      Source - The state save area to copy from.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvCopyVmloadState (
+    _Out_ PVMCB_STATE_SAVE_AREA Destination,
+    _In_ const VMCB_STATE_SAVE_AREA* Source
+    )
+{
+    Destination->FsSelector = Source->FsSelector;
+    Destination->FsAttrib = Source->FsAttrib;
+    Destination->FsLimit = Source->FsLimit;
+    Destination->FsBase = Source->FsBase;
+    Destination->GsSelector = Source->GsSelector;
+    Destination->GsAttrib = Source->GsAttrib;
+    Destination->GsLimit = Source->GsLimit;
+    Destination->GsBase = Source->GsBase;
+    Destination->TrSelector = Source->TrSelector;
+    Destination->TrAttrib = Source->TrAttrib;
+    Destination->TrLimit = Source->TrLimit;
+    Destination->TrBase = Source->TrBase;
+    Destination->LdtrSelector = Source->LdtrSelector;
+    Destination->LdtrAttrib = Source->LdtrAttrib;
+    Destination->LdtrLimit = Source->LdtrLimit;
+    Destination->LdtrBase = Source->LdtrBase;
+    Destination->KernelGsBase = Source->KernelGsBase;
+    Destination->Star = Source->Star;
+    Destination->LStar = Source->LStar;
+    Destination->CStar = Source->CStar;
+    Destination->SfMask = Source->SfMask;
+    Destination->SysenterCs = Source->SysenterCs;
+    Destination->SysenterEsp = Source->SysenterEsp;
+    Destination->SysenterEip = Source->SysenterEip;
+}
+
+/*!
+    @brief          Copies DebugCtl and the last branch records.
+
+    @details        With LBR virtualization, VMRUN and #VMEXIT switch this
+                    state. See "Enabling LBR Virtualization".
+
+    @param[out]     Destination - The state save area to copy to.
+    @param[in]      Source - The state save area to copy from.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvCopyLbrState (
+    _Out_ PVMCB_STATE_SAVE_AREA Destination,
+    _In_ const VMCB_STATE_SAVE_AREA* Source
+    )
+{
+    Destination->DbgCtl = Source->DbgCtl;
+    Destination->BrFrom = Source->BrFrom;
+    Destination->BrTo = Source->BrTo;
+    Destination->LastExcepFrom = Source->LastExcepFrom;
+    Destination->LastExcepTo = Source->LastExcepTo;
+}
+
+/*!
+    @brief          Returns whether #VMEXIT from L2 is intercepted by L1.
+
+    @details        NestedVmcb intercepts what L1 intercepts plus what SimpleSvm
+                    intercepts, so this function looks up the intercept bits and
+                    permissions maps of the L1 VMCB to tell which of them caused
+                    #VMEXIT. Any #VMEXIT SimpleSvm does not know how to attribute
+                    is given to L1.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      GuestContext - Guest's GPRs.
+
+    @result         TRUE when the #VMEXIT should be reflected to L1; otherwise,
+                    FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvIsVmExitForL1 (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ const GUEST_CONTEXT* GuestContext
+    )
+{
+    const VMCB_CONTROL_AREA* l1Control;
+    const VMCB_CONTROL_AREA* control;
+    SV_IOIO_EXIT_INFO ioioInfo;
+    UINT64 exitCode;
+    UINT32 bitOffset;
+
+    l1Control = &VpData->Nested.L1Vmcb->ControlArea;
+    control = &VpData->NestedVmcb.ControlArea;
+    exitCode = control->ExitCode;
+
+    if (exitCode < VMEXIT_CR0_WRITE)
+    {
+        return ((l1Control->InterceptCrRead & (1UL << (exitCode - VMEXIT_CR0_READ))) != 0);
+    }
+    if (exitCode < VMEXIT_DR0_READ)
+    {
+        return ((l1Control->InterceptCrWrite & (1UL << (exitCode - VMEXIT_CR0_WRITE))) != 0);
+    }
+    if (exitCode < VMEXIT_DR0_WRITE)
+    {
+        return ((l1Control->InterceptDrRead & (1UL << (exitCode - VMEXIT_DR0_READ))) != 0);
+    }
+    if (exitCode < VMEXIT_EXCEPTION_DE)
+    {
+        return ((l1Control->InterceptDrWrite & (1UL << (exitCode - VMEXIT_DR0_WRITE))) != 0);
+    }
+    if (exitCode < VMEXIT_INTR)
+    {
+        return ((l1Control->InterceptException & (1UL << (exitCode - VMEXIT_EXCEPTION_DE))) != 0);
+    }
+    if (exitCode < VMEXIT_VMRUN)
+    {
+        if ((l1Control->InterceptMisc1 & (1UL << (exitCode - VMEXIT_INTR))) == 0)
+        {
+            return FALSE;
+        }
+
+        //
+        // L1 intercepts I/O port and MSR accesses selectively with its IOPM
+        // and MSRPM.
+        //
+        if (exitCode == VMEXIT_IOIO)
+        {
+            if (SvDecodeIoioExitInfo(control->ExitInfo1, &ioioInfo) == FALSE)
+            {
+                return TRUE;
+            }
+            for (UINT32 port = ioioInfo.Port; port < ioioInfo.Port + ioioInfo.Size; port++)
+            {
+                if (SvTestGuestPhysicalBit(VpData, l1Control->IopmBasePa, port) != FALSE)
+                {
+                    return TRUE;
+                }
+            }
+            return FALSE;
+        }
+        if (exitCode == VMEXIT_MSR)
+        {
+            if (SvGetMsrPermissionsMapOffset(GuestContext->VpRegs->Rcx & MAXUINT32,
+                                             &bitOffset) == FALSE)
+            {
+                return TRUE;
+            }
+            return SvTestGuestPhysicalBit(VpData,
+                                          l1Control->MsrpmBasePa,
+                                          bitOffset + ((control->ExitInfo1 != 0) ? 1 : 0));
+        }
+        return TRUE;
+    }
+    if (exitCode <= VMEXIT_XSETBV)
+    {
+        return ((l1Control->InterceptMisc2 & (1UL << (exitCode - VMEXIT_VMRUN))) != 0);
+    }
+    if (exitCode == VMEXIT_NPF)
+    {
+        //
+        // Without nested paging of L1, nested page tables of SimpleSvm are used
+        // as is, and #VMEXIT is due to them.
+        //
+        return (l1Control->NpEnable & SVM_NP_ENABLE_NP_ENABLE) != 0;
+    }
+    return TRUE;
+}
+
+/*!
+    @brief          Reflects #VMEXIT from L2 to L1.
+
+    @details        This function does what the processor does on #VMEXIT for
+                    L1: writes L2's state and the #VMEXIT information into the
+                    L1 VMCB, and resumes L1 after its VMRUN instruction with GIF
+                    cleared.
+
+                    State handled by VMLOAD and VMSAVE is not switched by
+                    #VMEXIT, so it is carried over from NestedVmcb to
+                    GuestVmcb. The L1 VMCB receives it too, which is harmless,
+                    as L1 would save the same values with VMSAVE. So are
+                    DebugCtl and the last branch records, as L1 does not
+                    virtualize them for L2.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvReflectVmExitToL1 (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    PVMCB l1Vmcb;
+    PVMCB nestedVmcb;
+
+    l1Vmcb = VpData->Nested.L1Vmcb;
+    nestedVmcb = &VpData->NestedVmcb;
+
+    nestedVmcb->StateSaveArea.Rax = GuestContext->VpRegs->Rax;
+    l1Vmcb->StateSaveArea = nestedVmcb->StateSaveArea;
+    SvCopyVmloadState(&VpData->GuestVmcb.StateSaveArea, &nestedVmcb->StateSaveArea);
+    SvCopyLbrState(&VpData->GuestVmcb.StateSaveArea, &nestedVmcb->StateSaveArea);
+
+    l1Vmcb->ControlArea.ExitCode = nestedVmcb->ControlArea.ExitCode;
+    l1Vmcb->ControlArea.ExitInfo1 = nestedVmcb->ControlArea.ExitInfo1;
+    l1Vmcb->ControlArea.ExitInfo2 = nestedVmcb->ControlArea.ExitInfo2;
+    l1Vmcb->ControlArea.ExitIntInfo = nestedVmcb->ControlArea.ExitIntInfo;
+    l1Vmcb->ControlArea.NRip = nestedVmcb->ControlArea.NRip;
+    l1Vmcb->ControlArea.NumOfBytesFetched = nestedVmcb->ControlArea.NumOfBytesFetched;
+    RtlCopyMemory(l1Vmcb->ControlArea.GuestInstructionBytes,
+                  nestedVmcb->ControlArea.GuestInstructionBytes,
+                  sizeof(l1Vmcb->ControlArea.GuestInstructionBytes));
+    l1Vmcb->ControlArea.InterruptShadow = nestedVmcb->ControlArea.InterruptShadow;
+    l1Vmcb->ControlArea.VIntr = (l1Vmcb->ControlArea.VIntr & (SVM_V_INTR_V_GIF | SVM_V_INTR_V_GIF_ENABLE)) |
+                                (nestedVmcb->ControlArea.VIntr & ~(SVM_V_INTR_V_GIF | SVM_V_INTR_V_GIF_ENABLE));
+    l1Vmcb->ControlArea.EventInj = 0;
+
+    //
+    // Switch back to L1. #VMEXIT clears GIF.
+    //
+    VpData->Nested.InL2 = FALSE;
+    VpData->Vmcb = &VpData->GuestVmcb;
+    VpData->HostStackLayout.GuestVmcbPa = VpData->Nested.GuestVmcbPa;
+    GuestContext->VpRegs->Rax = VpData->GuestVmcb.StateSaveArea.Rax;
+
+    if (VpData->HostStackLayout.SharedVpData->VirtualGifSupported != FALSE)
+    {
+        VpData->GuestVmcb.ControlArea.VIntr &= ~SVM_V_INTR_V_GIF;
+    }
+    else
+    {
+        VpData->Nested.Gif = FALSE;
+    }
+}
+
+/*!
+    @brief          Tests whether the permissions maps an L1 VMCB enables are in
+                    physical memory.
+
+    @details        As with the processor, the low 12 bits of the addresses of
+                    the maps are ignored.
+
+    @param[in]      SharedVpData - The shared data that owns physical memory
+                    ranges.
+    @param[in]      L1Control - The control area of the L1 VMCB.
+
+    @result         TRUE when the maps are usable; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvArePermissionsMapsPhysical (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ const VMCB_CONTROL_AREA* L1Control
+    )
+{
+    static const UINT64 pageMask = ~static_cast<UINT64>(PAGE_SIZE - 1);
+
+    if (((L1Control->InterceptMisc1 & SVM_INTERCEPT_MISC1_MSR_PROT) != 0) &&
+        (SvIsPhysicalMemoryRange(SharedVpData,
+                                 L1Control->MsrpmBasePa & pageMask,
+                                 SVM_MSR_PERMISSIONS_MAP_SIZE) == FALSE))
+    {
+        return FALSE;
+    }
+    if (((L1Control->InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0) &&
+        (SvIsPhysicalMemoryRange(SharedVpData,
+                                 L1Control->IopmBasePa & pageMask,
+                                 SV_IO_PERMISSIONS_MAP_SIZE) == FALSE))
+    {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the VMRUN instruction.
+
+    @details        This function emulates VMRUN of L1 by building NestedVmcb
+                    from the L1 VMCB and switching the VMCB SimpleSvm runs to
+                    it. NestedVmcb intercepts anything either L1 or SimpleSvm
+                    intercepts, and runs with NestedGuestAsid.
+
+                    The L1 VMCB is read every time, but intercepts and
+                    permissions maps are merged only when L1 marks them as
+                    modified with clean bits, or when L1 runs a different VMCB.
+                    Clean bits L1 set are passed through to NestedVmcb for state
+                    copied without modification, so the processor does not
+                    reload it either.
+
+                    The L1 VMCB is mapped through SvMapGuestPhysical into a
+                    slot that is left mapped while L2 runs, so that #VMEXIT
+                    from L2 can be reflected into it.
+
+                    #GP is injected if nested virtualization is unavailable,
+                    VMRUN is executed in a state the processor would reject, or
+                    the L1 VMCB or the permissions maps it enables are outside
+                    physical memory.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleVmrun (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+    PHYSICAL_ADDRESS l1VmcbPa;
+    PVMCB l1Vmcb;
+    PVMCB nestedVmcb;
+    PVMCB guestVmcb;
+    UINT64 clean;
+    BOOLEAN l1NestedPaging;
+
+    sharedVpData = VpData->HostStackLayout.SharedVpData;
+    guestVmcb = &VpData->GuestVmcb;
+    nestedVmcb = &VpData->NestedVmcb;
+
+    l1VmcbPa.QuadPart = static_cast<LONGLONG>(GuestContext->VpRegs->Rax);
+    l1Vmcb = nullptr;
+    if ((BYTE_OFFSET(l1VmcbPa.QuadPart) == 0) &&
+        (VpData->Nested.HostSavePa != 0))
+    {
+        l1Vmcb = static_cast<PVMCB>(SvMapGuestPhysical(VpData,
+                                                       SvGuestMappingL1Vmcb,
+                                                       l1VmcbPa.QuadPart));
+    }
+    if ((sharedVpData->NestedGuestAsid == 0) ||
+        (guestVmcb->StateSaveArea.Cpl != 0) ||
+        (l1Vmcb == nullptr) ||
+        (SvArePermissionsMapsPhysical(sharedVpData, &l1Vmcb->ControlArea) == FALSE))
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+
+    //
+    // L1 resumes after VMRUN on #VMEXIT from L2.
+    //
+    guestVmcb->StateSaveArea.Rip = guestVmcb->ControlArea.NRip;
+
+    //
+    // The processor fails VMRUN without the VMRUN intercept or with ASID zero.
+    // Fail in the same way, without leaving L1.
+    //
+    if (((l1Vmcb->ControlArea.InterceptMisc2 & SVM_INTERCEPT_MISC2_VMRUN) == 0) ||
+        (l1Vmcb->ControlArea.GuestAsid == 0))
+    {
+        l1Vmcb->ControlArea.ExitCode = static_cast<UINT64>(VMEXIT_INVALID);
+        return;
+    }
+
+    l1NestedPaging = ((l1Vmcb->ControlArea.NpEnable & SVM_NP_ENABLE_NP_ENABLE) != 0);
+    clean = (static_cast<UINT64>(l1VmcbPa.QuadPart) == VpData->Nested.L1VmcbPa) ?
+            (l1Vmcb->ControlArea.VmcbClean & SVM_VMCB_CLEAN_ALL) : 0;
+
+    if ((clean & (SVM_VMCB_CLEAN_INTERCEPTS | SVM_VMCB_CLEAN_IOPM | SVM_VMCB_CLEAN_NP)) !=
+        (SVM_VMCB_CLEAN_INTERCEPTS | SVM_VMCB_CLEAN_IOPM | SVM_VMCB_CLEAN_NP))
+    {
+        nestedVmcb->ControlArea.InterceptCrRead = l1Vmcb->ControlArea.InterceptCrRead;
+        nestedVmcb->ControlArea.InterceptCrWrite = l1Vmcb->ControlArea.InterceptCrWrite;
+        nestedVmcb->ControlArea.InterceptDrRead = l1Vmcb->ControlArea.InterceptDrRead;
+        nestedVmcb->ControlArea.InterceptDrWrite = l1Vmcb->ControlArea.InterceptDrWrite;
+        nestedVmcb->ControlArea.InterceptException = l1Vmcb->ControlArea.InterceptException;
+        nestedVmcb->ControlArea.InterceptMisc1 = l1Vmcb->ControlArea.InterceptMisc1 |
+                                                 SV_INTERCEPT_POLICY::InterceptMisc1;
+        nestedVmcb->ControlArea.InterceptMisc2 = l1Vmcb->ControlArea.InterceptMisc2 |
+                                                 SV_INTERCEPT_POLICY::InterceptMisc2;
+        nestedVmcb->ControlArea.PauseFilterThreshold = l1Vmcb->ControlArea.PauseFilterThreshold;
+        nestedVmcb->ControlArea.PauseFilterCount = l1Vmcb->ControlArea.PauseFilterCount;
+        nestedVmcb->ControlArea.TscOffset = l1Vmcb->ControlArea.TscOffset +
+                                            guestVmcb->ControlArea.TscOffset;
+
+        //
+        // MSR accesses are always intercepted by SimpleSvm. Merge L1's MSRPM
+        // only when L1 uses it.
+        //
+        if ((l1Vmcb->ControlArea.InterceptMisc1 & SVM_INTERCEPT_MISC1_MSR_PROT) != 0)
+        {
+            SvMergePermissionsMap(VpData,
+                                  VpData->Nested.MsrPermissionsMap,
+                                  sharedVpData->MsrPermissionsMap,
+                                  l1Vmcb->ControlArea.MsrpmBasePa,
+                                  SVM_MSR_PERMISSIONS_MAP_SIZE);
+            nestedVmcb->ControlArea.MsrpmBasePa = MmGetPhysicalAddress(
+                                    VpData->Nested.MsrPermissionsMap).QuadPart;
+        }
+        else
+        {
+            //
+            // Not GuestVmcb's MSRPM: it may be the one of the intercept policy,
+            // which is freed when another policy replaces it while L2 runs.
+            //
+            nestedVmcb->ControlArea.MsrpmBasePa = MmGetPhysicalAddress(
+                                    sharedVpData->MsrPermissionsMap).QuadPart;
+        }
+
+        //
+        // Ports SimpleSvm handles are physical ports only when L1 does not use
+        // nested paging; otherwise, L2 sees whatever L1 gives it, and L1's IOPM
+        // is used as is.
+        //
+        if ((l1Vmcb->ControlArea.InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0)
+        {
+            if ((l1NestedPaging != FALSE) ||
+                ((SV_INTERCEPT_POLICY::InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) == 0))
+            {
+                nestedVmcb->ControlArea.IopmBasePa = l1Vmcb->ControlArea.IopmBasePa;
+            }
+            else
+            {
+                SvMergePermissionsMap(VpData,
+                                      VpData->Nested.IoPermissionsMap,
+                                      sharedVpData->IoPermissionsMap,
+                                      l1Vmcb->ControlArea.IopmBasePa,
+                                      SV_IO_PERMISSIONS_MAP_SIZE);
+                nestedVmcb->ControlArea.IopmBasePa = MmGetPhysicalAddress(
+                                    VpData->Nested.IoPermissionsMap).QuadPart;
+            }
+        }
+        else if (((SV_INTERCEPT_POLICY::InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0) &&
+                 (l1NestedPaging == FALSE))
+        {
+            nestedVmcb->ControlArea.IopmBasePa = guestVmcb->ControlArea.IopmBasePa;
+        }
+        else
+        {
+            nestedVmcb->ControlArea.InterceptMisc1 &= ~SVM_INTERCEPT_MISC1_IOIO_PROT;
+        }
+
+        //
+        // L2 always runs with nested paging. L1's nested page tables translate
+        // L2's physical addresses to L1's, which are host physical addresses.
+        // Without them, L2 runs in NPT view 0, whichever view L1 runs in.
+        //
+        nestedVmcb->ControlArea.NpEnable = SVM_NP_ENABLE_NP_ENABLE;
+        nestedVmcb->ControlArea.NCr3 = (l1NestedPaging != FALSE) ?
+                                       l1Vmcb->ControlArea.NCr3 :
+                                       sharedVpData->NptViews[0].NptBasePa;
+
+        clean &= ~(SVM_VMCB_CLEAN_INTERCEPTS | SVM_VMCB_CLEAN_IOPM | SVM_VMCB_CLEAN_NP);
+    }
+
+    //
+    // Load L2's state. State handled by VMLOAD and VMSAVE is not loaded by
+    // VMRUN, and whatever L1 has loaded with VMLOAD is used.
+    //
+    nestedVmcb->StateSaveArea = l1Vmcb->StateSaveArea;
+    SvCopyVmloadState(&nestedVmcb->StateSaveArea, &guestVmcb->StateSaveArea);
+    if (l1NestedPaging == FALSE)
+    {
+        nestedVmcb->StateSaveArea.GPat = guestVmcb->StateSaveArea.GPat;
+    }
+
+    nestedVmcb->ControlArea.GuestAsid = sharedVpData->NestedGuestAsid;
+    nestedVmcb->ControlArea.VIntr = l1Vmcb->ControlArea.VIntr &
+                                    ~(SVM_V_INTR_V_GIF | SVM_V_INTR_V_GIF_ENABLE);
+    nestedVmcb->ControlArea.InterruptShadow = l1Vmcb->ControlArea.InterruptShadow;
+    nestedVmcb->ControlArea.EventInj = l1Vmcb->ControlArea.EventInj;
+
+    //
+    // LBR virtualization is not exposed to L1, so L2 shares DebugCtl and the
+    // last branch records with L1, as it would without SimpleSvm. Carry them
+    // over from GuestVmcb when the processor virtualizes them.
+    //
+    nestedVmcb->ControlArea.LbrVirtualizationEnable = guestVmcb->ControlArea.LbrVirtualizationEnable &
+                                                      SVM_LBR_CONTROL_LBR_VIRTUALIZATION;
+    SvCopyLbrState(&nestedVmcb->StateSaveArea, &guestVmcb->StateSaveArea);
+    nestedVmcb->ControlArea.VmcbClean = clean & ~SVM_VMCB_CLEAN_LBR;
+
+    //
+    // All of L1's ASIDs share NestedGuestAsid. Flush it when L1 switches to
+    // another ASID or nested page tables, or asks to flush.
+    //
+    if ((l1Vmcb->ControlArea.GuestAsid != VpData->Nested.L1Asid) ||
+        (l1Vmcb->ControlArea.TlbControl != SVM_TLB_CONTROL_DO_NOTHING) ||
+        (nestedVmcb->ControlArea.NCr3 != VpData->Nested.NCr3))
+    {
+        SvRequestTlbFlush(VpData, SvTlbFlushGuest);
+    }
+
+    //
+    // Switch to L2.
+    //
+    VpData->Nested.InL2 = TRUE;
+    VpData->Nested.L1VmcbPa = static_cast<UINT64>(l1VmcbPa.QuadPart);
+    VpData->Nested.L1Vmcb = l1Vmcb;
+    VpData->Nested.L1Asid = l1Vmcb->ControlArea.GuestAsid;
+    VpData->Nested.NCr3 = nestedVmcb->ControlArea.NCr3;
+    VpData->Vmcb = nestedVmcb;
+    VpData->HostStackLayout.GuestVmcbPa = VpData->Nested.NestedVmcbPa;
+    GuestContext->VpRegs->Rax = nestedVmcb->StateSaveArea.Rax;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the VMLOAD or VMSAVE
+                    instructions.
+
+    @details        This function is only used when the processor does not
+                    support virtual VMLOAD and VMSAVE. The VMCB specified by RAX
+                    is accessed through SvMapGuestPhysical, and #GP is injected
+                    when it is outside physical memory.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleVmloadVmsave (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    PHYSICAL_ADDRESS vmcbPa;
+    PVMCB vmcb;
+
+    vmcbPa.QuadPart = static_cast<LONGLONG>(GuestContext->VpRegs->Rax);
+    vmcb = nullptr;
+    if ((VpData->Vmcb->StateSaveArea.Cpl == 0) &&
+        (BYTE_OFFSET(vmcbPa.QuadPart) == 0))
+    {
+        vmcb = static_cast<PVMCB>(SvMapGuestPhysical(VpData,
+                                                     SvGuestMappingData,
+                                                     vmcbPa.QuadPart));
+    }
+    if (vmcb == nullptr)
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+
+    if (VpData->Vmcb->ControlArea.ExitCode == VMEXIT_VMLOAD)
+    {
+        SvCopyVmloadState(&VpData->Vmcb->StateSaveArea, &vmcb->StateSaveArea);
+    }
+    else
+    {
+        SvCopyVmloadState(&vmcb->StateSaveArea, &VpData->Vmcb->StateSaveArea);
+    }
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+/*!
+    @brief          Handles #VMEXIT due to execution of the STGI or CLGI
+                    instructions.
+
+    @details        This function is only used when the processor does not
+                    support vGIF. L1's GIF is only tracked; SimpleSvm does not
+                    hold interrupts while it is cleared.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvHandleGifInstruction (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    UNREFERENCED_PARAMETER(GuestContext);
+
+    if (VpData->Vmcb->StateSaveArea.Cpl != 0)
+    {
+        SvInjectGeneralProtectionException(VpData);
+        return;
+    }
+
+    VpData->Nested.Gif = (VpData->Vmcb->ControlArea.ExitCode == VMEXIT_STGI);
+    VpData->Vmcb->StateSaveArea.Rip = VpData->Vmcb->ControlArea.NRip;
+}
+
+#if defined(SV_CAPTURE_HOST_LBR)
+/*!
+    @brief          Records the last branch the host took while handling the
+                    #VMEXIT.
+
+    @details        The processor keeps only one branch record, so this tells
+                    where the #VMEXIT handler last branched before this
+                    function is called, which is mostly useful to find out
+                    which path the handler took. The host records branches only
+                    with LBR virtualization; otherwise, the records belong to
+                    the guest and nothing is recorded.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in]      ExitCode - The #VMEXIT code being handled.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvCaptureHostLbr (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ UINT64 ExitCode
+    )
+{
+    PSV_HOST_LBR_RECORD record;
+
+    if ((VpData->GuestVmcb.ControlArea.LbrVirtualizationEnable &
+         SVM_LBR_CONTROL_LBR_VIRTUALIZATION) == 0)
+    {
+        return;
+    }
+
+    record = &VpData->HostLbrRecords[VpData->NextHostLbrRecord];
+    record->ExitCode = ExitCode;
+    record->BranchFrom = __readmsr(IA32_MSR_LAST_BRANCH_FROM_IP);
+    record->BranchTo = __readmsr(IA32_MSR_LAST_BRANCH_TO_IP);
+    VpData->NextHostLbrRecord = (VpData->NextHostLbrRecord + 1) % SV_HOST_LBR_RECORDS;
+}
+#endif
+
+/*!
+    @brief          Calls the #VMEXIT handler for the #VMEXIT code in the VMCB.
+
+    @details        Only handlers of #VMEXITs Policy can cause are compiled in,
+                    except the one of exceptions, which the policy set at run
+                    time may intercept with any Policy. Any other #VMEXIT is
+                    unexpected and results in bug check.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestContext - Guest's GPRs.
+ */
+template<typename Policy>
+_IRQL_requires_same_
+static
+VOID
+SvDispatchVmExit (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_CONTEXT GuestContext
+    )
+{
+    //
+    // Exceptions are intercepted only by the policy set at run time.
+    //
+    if ((VpData->Vmcb->ControlArea.ExitCode >= VMEXIT_EXCEPTION_DE) &&
+        (VpData->Vmcb->ControlArea.ExitCode <= VMEXIT_EXCEPTION_31))
+    {
+        SvHandleExceptionIntercept(VpData);
+        return;
+    }
+
+    switch (VpData->Vmcb->ControlArea.ExitCode)
+    {
+    case VMEXIT_CPUID:
+        SvHandleCpuid(VpData, GuestContext);
+        break;
+    case VMEXIT_VMMCALL:
+        if constexpr ((Policy::InterceptMisc2 & SVM_INTERCEPT_MISC2_VMMCALL) != 0)
+        {
+            SvHandleVmmcall(VpData, GuestContext);
+            break;
+        }
+        goto Unexpected;
+    case VMEXIT_MSR:
+        SvHandleMsrAccess(VpData, GuestContext);
+        break;
+    case VMEXIT_CR3_WRITE:
+        //
+        // CR3 writes are emulated while they are accounted. Otherwise, they
+        // are intercepted only to track invalidations, as the following are.
+        //
+        if constexpr (Policy::Cr3SamplingPeriod != 0)
+        {
+            if (VpData->Cr3Accounting.Enabled != FALSE)
+            {
+                SvHandleNptViewInvalidation(VpData, GuestContext);
+                SvHandleCr3Write(VpData, GuestContext);
+                break;
+            }
+        }
+        [[fallthrough]];
+    case VMEXIT_CR0_WRITE:
+    case VMEXIT_CR4_WRITE:
+    case VMEXIT_INVLPG:
+    case VMEXIT_INVPCID:
+        SvHandleNptViewInvalidation(VpData, GuestContext);
+        break;
+    case VMEXIT_VMRUN:
+        SvHandleVmrun(VpData, GuestContext);
+        break;
+    case VMEXIT_VMLOAD:
+    case VMEXIT_VMSAVE:
+        SvHandleVmloadVmsave(VpData, GuestContext);
+        break;
+    case VMEXIT_STGI:
+    case VMEXIT_CLGI:
+        SvHandleGifInstruction(VpData, GuestContext);
+        break;
+    case VMEXIT_NPF:
+        SvHandleNestedPageFault(VpData, GuestContext);
+        break;
+    case VMEXIT_INTR:
+        //
+        // Intercepted only to measure interrupt latency and to notice the end
+        // of idle periods. Nothing to do, as the interrupt is delivered to the
+        // guest on VMRUN.
+        //
+        if constexpr ((Policy::InterruptSamplingPeriod != 0) || Policy::AccountIdle)
+        {
+            break;
+        }
+        goto Unexpected;
+    case VMEXIT_HLT:
+    case VMEXIT_MWAIT:
+    case VMEXIT_MWAIT_CONDITIONAL:
+        if constexpr (Policy::AccountIdle)
+        {
+            SvHandleIdleInstruction(VpData);
+            break;
+        }
+        goto Unexpected;
+    case VMEXIT_IOIO:
+        if constexpr ((Policy::InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0)
+        {
+            SvHandleIoAccess(VpData, GuestContext);
+            break;
+        }
+        goto Unexpected;
+    default:
+        goto Unexpected;
+    }
+    return;
+
+Unexpected:
+    SV_DEBUG_BREAK();
+#pragma prefast(disable : __WARNING_USE_OTHER_FUNCTION, "Unrecoverble path.")
+    KeBugCheck(MANUALLY_INITIATED_CRASH);
+}
+
+/*!
+    @brief          C-level entry point of the host code called from SvLaunchVm.
+
+    @details        This function loads save host state first, and then, handles
+                    #VMEXIT which may or may not change guest's state via VpData
+                    or GuestRegisters.
+
+                    Interrupts are disabled when this function is called due to
+                    the cleared GIF. Not all host state are loaded yet, so do it
+                    with the VMLOAD instruction.
+
+                    If the #VMEXIT handler detects a request to unload the
+                    hypervisor, this function loads guest state, disables SVM
+                    and returns to execution flow where the #VMEXIT triggered.
+
+    @param[in,out]  VpData - Per processor data.
+    @param[in,out]  GuestRegisters - Guest's GPRs.
+
+    @result         TRUE when virtualization is terminated; otherwise FALSE.
+ */
+_IRQL_requires_same_
+EXTERN_C
+BOOLEAN
+NTAPI
+SvHandleVmExit (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _Inout_ PGUEST_REGISTERS GuestRegisters
+    )
+{
+    GUEST_CONTEXT guestContext;
+    KIRQL oldIrql;
+    UINT64 startTime, cycles, exitCode;
+    UINT32 bucket;
+    BOOLEAN reflected, hostStateRequired;
+
+    startTime = 0;
+    if constexpr (SV_INTERCEPT_POLICY::AccountExits ||
+                  SV_INTERCEPT_POLICY::AccountIdle ||
+                  (SV_INTERCEPT_POLICY::InterruptSamplingPeriod != 0))
+    {
+        startTime = __rdtsc();
+    }
+
+    guestContext.VpRegs = GuestRegisters;
+    guestContext.ExitVm = FALSE;
+    exitCode = VpData->Vmcb->ControlArea.ExitCode;
+    reflected = FALSE;
+
+    NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
+    NT_ASSERT(VpData->HostStackLayout.HostStateLoaded == FALSE);
+
+    //
+    // The guest may have changed its page tables, or executed INVLPG or INVPCID
+    // without #VMEXIT, since the last #VMEXIT. Translations cached in the
+    // software TLB are only valid within a single #VMEXIT.
+    //
+    SvFlushSoftTlb(&VpData->SoftTlb);
+
+    //
+    // Load some host state that are not loaded on #VMEXIT, unless the #VMEXIT
+    // is handled without it. CPUID, VMMCALL, MSR and CR3 handlers neither call
+    // kernel API nor access that state, except for few cases where they load
+    // it by themselves. #VMEXIT due to interrupts is not handled at all, and
+    // that due to HLT and MWAIT only updates the VMCB. #VMEXIT from L2 may be
+    // reflected, which switches the VMCB.
+    //
+    hostStateRequired = ((exitCode != VMEXIT_CPUID) &&
+                         (exitCode != VMEXIT_VMMCALL) &&
+                         (exitCode != VMEXIT_MSR) &&
+                         (exitCode != VMEXIT_CR3_WRITE) &&
+                         (exitCode != VMEXIT_INTR) &&
+                         (exitCode != VMEXIT_HLT) &&
+                         (exitCode != VMEXIT_MWAIT) &&
+                         (exitCode != VMEXIT_MWAIT_CONDITIONAL)) ||
+                        (VpData->Nested.InL2 != FALSE);
+    if (hostStateRequired != FALSE)
+    {
+        SvLoadHostState(VpData);
+    }
+
+    //
+    // End the idle period if the guest was resumed to go idle. This is done
+    // before the interrupt sampling window is updated, which may then keep
+    // physical interrupts intercepted.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::AccountIdle)
+    {
+        if (VpData->IdleAccounting.Idle != FALSE)
+        {
+            SvEndIdlePeriod(VpData, exitCode, startTime);
+        }
+    }
+
+    //
+    // Start or stop intercepting CR3 writes if the sampling window has ended.
+    // CR3 is not accounted at all without decode assists.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::Cr3SamplingPeriod > 1)
+    {
+        if (VpData->HostStackLayout.SharedVpData->DecodeAssistsSupported != FALSE)
+        {
+            SvUpdateCr3SamplingWindow<SV_INTERCEPT_POLICY>(VpData, __rdtsc());
+        }
+    }
+
+    //
+    // Likewise, start or stop intercepting physical interrupts.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::InterruptSamplingPeriod > 1)
+    {
+        SvUpdateInterruptSamplingWindow<SV_INTERCEPT_POLICY>(VpData, startTime);
+    }
+
+    //
+    // Raise the IRQL to the DISPATCH_LEVEL level. This has no actual effect since
+    // interrupts are disabled at #VMEXI but warrants bug check when some of
+    // kernel API that are not usable on this context is called with Driver
+    // Verifier. This protects developers from accidentally writing such #VMEXIT
+    // handling code. This should actually raise IRQL to HIGH_LEVEL to represent
+    // this running context better, but our Logger code is not designed to run at
+    // that level unfortunately. Finally, note that this API is a thin wrapper
+    // of mov-to-CR8 on x64 and safe to call on this context.
+    //
+    // With the lean exit stub, this is done only while a kernel debugger is
+    // attached, as it is purely a development aid that costs two writes to CR8
+    // on every #VMEXIT. It is not done without the host state either, as
+    // KeRaiseIrql may access the processor control block through GS.
+    //
+#if defined(SV_LEAN_EXIT_STUB)
+    oldIrql = (KD_DEBUGGER_NOT_PRESENT || (hostStateRequired == FALSE)) ?
+              DISPATCH_LEVEL : KeGetCurrentIrql();
+#else
+    oldIrql = (hostStateRequired == FALSE) ? DISPATCH_LEVEL : KeGetCurrentIrql();
+#endif
+    if (oldIrql < DISPATCH_LEVEL)
+    {
+        KeRaiseIrqlToDpcLevel();
+    }
+
+    //
+    // Guest's RAX is overwritten by the host's value on #VMEXIT and saved in
+    // the VMCB instead. Reflect the guest RAX to the context.
+    //
+    GuestRegisters->Rax = VpData->Vmcb->StateSaveArea.Rax;
+
+    //
+    // Update the _KTRAP_FRAME structure values in hypervisor stack, so that
+    // Windbg can reconstruct call stack of the guest during debug session.
+    // This is optional but very useful thing to do for debugging.
+    //
+    // The lean exit stub does not allocate the trap frame, and guest's GPRs
+    // occupy the same stack location. See SvLaunchVm.
+    //
+#if !defined(SV_LEAN_EXIT_STUB)
+    VpData->HostStackLayout.TrapFrame.Rsp = VpData->Vmcb->StateSaveArea.Rsp;
+    VpData->HostStackLayout.TrapFrame.Rip = VpData->Vmcb->ControlArea.NRip;
+#endif
+
+    //
+    // Handle #VMEXIT according with its reason, unless it is from L2 and L1
+    // intercepts it.
+    //
+    if ((VpData->Nested.InL2 != FALSE) &&
+        (SvIsVmExitForL1(VpData, &guestContext) != FALSE))
+    {
+        SvReflectVmExitToL1(VpData, &guestContext);
+        reflected = TRUE;
+    }
+    else
+    {
+        SvDispatchVmExit<SV_INTERCEPT_POLICY>(VpData, &guestContext);
+    }
+
+    //
+    // Again, no effect to change IRQL but restoring it here since a #VMEXIT
+    // handler where the developers most likely call the kernel API inadvertently
+    // is already executed.
+    //
+    if (oldIrql < DISPATCH_LEVEL)
+    {
+        KeLowerIrql(oldIrql);
+    }
+
+    //
+    // Restore guest's extended state if the handler used SIMD registers.
+    //
+    if (VpData->ExtendedState.SavedMask != 0)
+    {
+        cycles = __rdtsc();
+        SvRestoreGuestExtendedState(VpData);
+        cycles = __rdtsc() - cycles + VpData->ExtendedState.SaveCycles;
+
+        SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+        VpData->Statistics->ExtendedStateSaves++;
+        VpData->Statistics->ExtendedStateCycles += cycles;
+        SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+    }
+
+    //
+    // Terminate the SimpleSvm hypervisor if requested.
+    //
+    if (guestContext.ExitVm != FALSE)
+    {
+        NT_ASSERT((VpData->Vmcb->ControlArea.ExitCode == VMEXIT_CPUID) ||
+                  (VpData->Vmcb->ControlArea.ExitCode == VMEXIT_VMMCALL));
+
+        //
+        // Set return values of CPUID instruction as follows:
+        //  RBX     = An address to return
+        //  RCX     = A stack pointer to restore
+        //  EDX:EAX = An address of per processor data to be freed by the caller
+        //
+        guestContext.VpRegs->Rax = reinterpret_cast<UINT64>(VpData) & MAXUINT32;
+        guestContext.VpRegs->Rbx = VpData->Vmcb->ControlArea.NRip;
+        guestContext.VpRegs->Rcx = VpData->Vmcb->StateSaveArea.Rsp;
+        guestContext.VpRegs->Rdx = reinterpret_cast<UINT64>(VpData) >> 32;
+
+        //
+        // Load guest state (currently host state is loaded).
+        //
+        NT_ASSERT(VpData->HostStackLayout.HostStateLoaded != FALSE);
+        __svm_vmload(MmGetPhysicalAddress(&VpData->GuestVmcb).QuadPart);
+
+        //
+        // Also restore guest's DebugCtl, which #VMEXIT switched to the host's
+        // with LBR virtualization. The last branch records cannot be written
+        // and are left as the host's.
+        //
+        if ((VpData->GuestVmcb.ControlArea.LbrVirtualizationEnable &
+             SVM_LBR_CONTROL_LBR_VIRTUALIZATION) != 0)
+        {
+            __writemsr(IA32_MSR_DEBUGCTL, VpData->GuestVmcb.StateSaveArea.DbgCtl);
+        }
+
+        //
+        // Set the global interrupt flag (GIF) but still disable interrupts by
+        // clearing IF. GIF must be set to return to the normal execution, but
+        // interruptions are not desirable until SVM is disabled as it would
+        // execute random kernel-code in the host context.
+        //
+        _disable();
+        __svm_stgi();
+
+        //
+        // Disable SVM, and restore the guest RFLAGS. This may enable interrupts.
+        // Some of arithmetic flags are destroyed by the subsequent code.
+        //
+        __writemsr(IA32_MSR_EFER, __readmsr(IA32_MSR_EFER) & ~EFER_SVME);
+        __writeeflags(VpData->Vmcb->StateSaveArea.Rflags);
+        goto Exit;
+    }
+
+    //
+    // Reflect potentially updated guest's RAX to VMCB. Again, unlike other GPRs,
+    // RAX is loaded from VMCB on VMRUN.
+    //
+    VpData->Vmcb->StateSaveArea.Rax = guestContext.VpRegs->Rax;
+
+    //
+    // Reflect any TLB flush requested while handling #VMEXIT, or required due
+    // to modification of nested page tables by other processors. Also switch
+    // to the intercept policy set since the last #VMEXIT, if any.
+    //
+    SvSynchronizeNptGeneration(VpData);
+    SvSynchronizeInterceptPolicy(VpData);
+    if constexpr (SV_INTERCEPT_POLICY::EnforceExitBudgets)
+    {
+        SvEnforceExitBudgets(VpData, exitCode, __rdtsc());
+    }
+    SvApplyPendingTlbFlush(VpData);
+
+#if defined(SV_CAPTURE_HOST_LBR)
+    SvCaptureHostLbr(VpData, exitCode);
+#endif
+
+    //
+    // Account interrupt latency as late as possible, as the guest receives the
+    // interrupt only once resumed.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::InterruptSamplingPeriod != 0)
+    {
+        SvAccountInterruptLatency(VpData, exitCode, startTime, __rdtsc());
+    }
+    if constexpr (SV_INTERCEPT_POLICY::AccountIdle)
+    {
+        SvAccountIdleExit(VpData, exitCode, startTime, __rdtsc());
+    }
+
+    //
+    // Account the #VMEXIT. This processor is the only writer of its statistics,
+    // and user mode readers take consistent snapshots with the sequence.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::AccountExits)
+    {
+        cycles = __rdtsc() - startTime;
+        bucket = SvGetExitCodeBucket(exitCode);
+        SvBeginSeqlockWrite(&VpData->Statistics->Sequence);
+        VpData->Statistics->ExitCount++;
+        VpData->Statistics->HostCycles += cycles;
+        VpData->Statistics->ExitCounts[bucket]++;
+        VpData->Statistics->ExitCycles[bucket] += cycles;
+        SvEndSeqlockWrite(&VpData->Statistics->Sequence);
+
+        if (reflected != FALSE)
+        {
+            VpData->Nested.ReflectedExitCounts[bucket]++;
+            VpData->Nested.ReflectedExitCycles[bucket] += cycles;
+        }
+    }
+
+Exit:
+    NT_ASSERT(VpData->HostStackLayout.Reserved1 == MAXUINT64);
+    return guestContext.ExitVm;
+}
+
+/*!
+    @brief      Calls the SimpleSvm hypervisor through the interface the
+                intercept policy uses.
+
+    @details    The interface is CPUID, or VMMCALL when CPUID is not
+                intercepted. VMMCALL raises #UD when the hypervisor is not
+                installed, in which case all results are zero.
+
+    @param[out] Registers - Receives EAX, EBX, ECX and EDX.
+    @param[in]  Function - The CPUID leaf of the function to call. It is also
+                passed as the subleaf.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvCallHypervisor (
+    _Out_writes_(4) int Registers[4],
+    _In_ int Function
+    )
+{
+    if constexpr ((SV_INTERCEPT_POLICY::InterceptMisc1 & SVM_INTERCEPT_MISC1_CPUID) != 0)
+    {
+        __cpuidex(Registers, Function, Function);
+    }
+    else
+    {
+        __try
+        {
+            SvVmmcall(Registers, Function);
+        }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            RtlZeroMemory(Registers, sizeof(int) * 4);
+        }
+    }
+}
+
+/*!
+    @brief      Tests whether the SimpleSvm hypervisor is installed.
+
+    @details    This function checks a result of CPUID leaf 40000000h, which
+                should return a vendor name of the hypervisor if any of those
+                who implement the Microsoft Hypervisor interface is installed.
+                If the SimpleSvm hypervisor is installed, this should return
+                "SimpleSvm", and if no hypervisor is installed, it the result of
+                CPUID is undefined. For more details of the interface, see
+                "Requirements for implementing the Microsoft Hypervisor interface"
+                https://msdn.microsoft.com/en-us/library/windows/hardware/Dn613994(v=vs.85).aspx
+
+                When CPUID is not intercepted, the same leaf is queried with
+                VMMCALL instead. See SvCallHypervisor.
+
+    @result     TRUE when the SimpleSvm is installed; otherwise, FALSE.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvIsSimpleSvmHypervisorInstalled (
+    VOID
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    char vendorId[13];
+
+    //
+    // When the SimpleSvm hypervisor is installed, CPUID leaf 40000000h will
+    // return "SimpleSvm   " as the vendor name.
+    //
+    SvCallHypervisor(registers, CPUID_HV_VENDOR_AND_MAX_FUNCTIONS);
+    RtlCopyMemory(vendorId + 0, &registers[1], sizeof(registers[1]));
+    RtlCopyMemory(vendorId + 4, &registers[2], sizeof(registers[2]));
+    RtlCopyMemory(vendorId + 8, &registers[3], sizeof(registers[3]));
+    vendorId[12] = ANSI_NULL;
+
+    return (strcmp(vendorId, "SimpleSvm   ") == 0);
+}
+
+/*!
+    @brief      Virtualize the current processor.
+
+    @details    This function enables SVM, initialize VMCB with the current
+                processor state, and enters the guest mode on the current
+                processor.
+
+    @param[in,out]  VpData - The address of per processor data.
+    @param[in]      SharedVpData - The address of share data.
+    @param[in]      ContextRecord - The address of CONETEXT to use as an initial
+                    context of the processor after it is virtualized.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvPrepareForVirtualization (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData,
+    _In_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ const CONTEXT* ContextRecord
+    )
+{
+    DESCRIPTOR_TABLE_REGISTER gdtr, idtr;
+    PHYSICAL_ADDRESS guestVmcbPa, hostVmcbPa, hostStateAreaPa, msrpmPa;
+    PHYSICAL_ADDRESS iopmPa, nestedVmcbPa;
+    PUINT64 stack;
+
+    //
+    // Capture the current GDTR and IDTR to use as initial values of the guest
+    // mode.
+    //
+    _sgdt(&gdtr);
+    __sidt(&idtr);
+
+    guestVmcbPa = MmGetPhysicalAddress(&VpData->GuestVmcb);
+    hostVmcbPa = MmGetPhysicalAddress(&VpData->HostVmcb);
+    hostStateAreaPa = MmGetPhysicalAddress(&VpData->HostStateArea);
+    nestedVmcbPa = MmGetPhysicalAddress(&VpData->NestedVmcb);
+    msrpmPa = MmGetPhysicalAddress(SharedVpData->MsrPermissionsMap);
+    iopmPa = MmGetPhysicalAddress(SharedVpData->IoPermissionsMap);
+
+    //
+    // Configure intercepts as defined by the intercept policy. Any policy
+    // triggers #VMEXIT with the instruction SvCallHypervisor uses (CPUID, or
+    // VMMCALL in the exit-free CPUID mode) and VMRUN. The former presents
+    // existence of the SimpleSvm hypervisor and provides an interface to ask
+    // it to unload itself.
+    //
+    // VMRUN is intercepted because it is required by the processor to enter the
+    // guest mode; otherwise, #VMEXIT occurs due to VMEXIT_INVALID when a
+    // processor attempts to enter the guest mode. See "Canonicalization and
+    // Consistency Checks" on "VMRUN Instruction".
+    //
+    // Also, any policy triggers #VMEXIT on MSR access as configured by the
+    // MSRPM, in which write to IA32_MSR_EFER is intercepted. The profiling
+    // policy additionally triggers #VMEXIT on I/O port access as configured by
+    // the IOPM. See SvBuildIoPermissionsMap for ports intercepted.
+    //
+    VpData->GuestVmcb.ControlArea.InterceptMisc1 = SV_INTERCEPT_POLICY::InterceptMisc1;
+    VpData->GuestVmcb.ControlArea.InterceptMisc2 = SV_INTERCEPT_POLICY::InterceptMisc2;
+    VpData->GuestVmcb.ControlArea.MsrpmBasePa = msrpmPa.QuadPart;
+    VpData->GuestVmcb.ControlArea.IopmBasePa = iopmPa.QuadPart;
+
+    //
+    // Let a nested hypervisor use STGI, CLGI, VMLOAD and VMSAVE without
+    // #VMEXIT when the processor can virtualize them; otherwise, emulate them.
+    // Note that VMMCALL is not intercepted unless the policy uses it as the
+    // interface instead of CPUID; it raises #UD in the guest as it would
+    // without SimpleSvm, and is reflected to the nested hypervisor when it
+    // intercepts it for its guest. See SvHandleVmrun and SvHandleVmmcall.
+    //
+    if (SharedVpData->VirtualGifSupported != FALSE)
+    {
+        VpData->GuestVmcb.ControlArea.VIntr |= SVM_V_INTR_V_GIF_ENABLE | SVM_V_INTR_V_GIF;
+    }
+    else
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc2 |= SVM_INTERCEPT_MISC2_STGI |
+                                                        SVM_INTERCEPT_MISC2_CLGI;
+    }
+    if (SharedVpData->VirtualVmloadVmsaveSupported != FALSE)
+    {
+        VpData->GuestVmcb.ControlArea.LbrVirtualizationEnable |= SVM_LBR_CONTROL_VIRTUAL_VMLOAD_VMSAVE;
+    }
+    else
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc2 |= SVM_INTERCEPT_MISC2_VMLOAD |
+                                                        SVM_INTERCEPT_MISC2_VMSAVE;
+    }
+
+    //
+    // Have the processor switch DebugCtl and the last branch records on VMRUN
+    // and #VMEXIT when it can, so that branches the host takes do not corrupt
+    // records the guest collects, eg, for profiling. The guest starts with the
+    // current values. Otherwise, the host and the guest share them.
+    //
+    if (SharedVpData->LbrVirtualizationSupported != FALSE)
+    {
+        VpData->GuestVmcb.ControlArea.LbrVirtualizationEnable |= SVM_LBR_CONTROL_LBR_VIRTUALIZATION;
+        VpData->GuestVmcb.StateSaveArea.DbgCtl = __readmsr(IA32_MSR_DEBUGCTL);
+        VpData->GuestVmcb.StateSaveArea.BrFrom = __readmsr(IA32_MSR_LAST_BRANCH_FROM_IP);
+        VpData->GuestVmcb.StateSaveArea.BrTo = __readmsr(IA32_MSR_LAST_BRANCH_TO_IP);
+        VpData->GuestVmcb.StateSaveArea.LastExcepFrom = __readmsr(IA32_MSR_LAST_EXCEPTION_FROM_IP);
+        VpData->GuestVmcb.StateSaveArea.LastExcepTo = __readmsr(IA32_MSR_LAST_EXCEPTION_TO_IP);
+
+#if defined(SV_CAPTURE_HOST_LBR)
+        //
+        // Have the host record branches for SvCaptureHostLbr. The current
+        // DebugCtl becomes the host's one with VMRUN in SvLaunchVm.
+        //
+        __writemsr(IA32_MSR_DEBUGCTL, VpData->GuestVmcb.StateSaveArea.DbgCtl | DEBUGCTL_LBR);
+#endif
+    }
+
+    //
+    // Intercept CR3 writes to account guest run time per address space when
+    // the policy does so. SvHandleCr3Write relies on decode assists, so CR3 is
+    // not accounted without them. Accounting starts with the current CR3, in
+    // the first sampling window, which is always sampled.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::Cr3SamplingPeriod != 0)
+    {
+        if (SharedVpData->DecodeAssistsSupported != FALSE)
+        {
+            VpData->GuestVmcb.ControlArea.InterceptCrWrite = SV_INTERCEPT_POLICY::InterceptCrWrite;
+            VpData->Cr3Accounting.Enabled = TRUE;
+            VpData->Cr3Accounting.Cr3 = __readcr3();
+            VpData->Cr3Accounting.SwitchTime = __rdtsc();
+            VpData->Cr3Accounting.WindowStartTime = VpData->Cr3Accounting.SwitchTime;
+        }
+    }
+
+    //
+    // Intercept physical interrupts to measure how long the host delays them
+    // when the policy does so, starting with the first sampling window, which
+    // is always sampled.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::InterruptSamplingPeriod != 0)
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SV_INTERRUPT_LATENCY_INTERCEPTS_MISC1;
+        VpData->InterruptAccounting.Enabled = TRUE;
+        VpData->InterruptAccounting.ResumeTime = __rdtsc();
+        VpData->InterruptAccounting.WindowStartTime = VpData->InterruptAccounting.ResumeTime;
+    }
+
+    //
+    // Intercept HLT and MWAIT to account idle residency when the policy does
+    // so.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::AccountIdle)
+    {
+        VpData->GuestVmcb.ControlArea.InterceptMisc1 |= SV_IDLE_ACCOUNTING_INTERCEPTS_MISC1;
+        VpData->GuestVmcb.ControlArea.InterceptMisc2 |= SV_IDLE_ACCOUNTING_INTERCEPTS_MISC2;
+    }
+
+    //
+    // Remember the built-in MSRPM to fall back to while MSR accesses back off
+    // when exit budgets are enforced.
+    //
+    if constexpr (SV_INTERCEPT_POLICY::EnforceExitBudgets)
+    {
+        VpData->ExitBudgets.MsrpmBasePa = msrpmPa.QuadPart;
+        VpData->ExitBudgets.WindowStartTime = __rdtsc();
+    }
+
+    //
+    // Specify guest's address space ID (ASID). TLB is maintained by the ID for
+    // guests. Use the same value for all processors since all of them run a
+    // single guest in our case. The ASID was allocated within the supported
+    // range when the shared data was initialized. See SvInitializeSvmFeatures.
+    //
+    // Each NPT view has its own ASID, and processors start in view 0. See
+    // SvSwitchNptView.
+    //
+    VpData->GuestVmcb.ControlArea.GuestAsid = SharedVpData->NptViews[0].Asid;
+
+    //
+    // Enable Nested Page Tables. By enabling this, the processor performs the
+    // nested page walk, that involves with an additional page walk to translate
+    // a guest physical address to a system physical address. An address of
+    // nested page tables is specified by the NCr3 field of VMCB.
+    //
+    // We have already build the nested page tables with SvBuildNestedPageTables.
+    //
+    // Note that our hypervisor does not trigger any additional #VMEXIT due to
+    // the use of Nested Page Tables since all physical addresses from 0-512 GB
+    // are configured to be accessible from the guest.
+    //
+    VpData->GuestVmcb.ControlArea.NpEnable |= SVM_NP_ENABLE_NP_ENABLE;
+    VpData->GuestVmcb.ControlArea.NCr3 = SharedVpData->NptViews[0].NptBasePa;
+
+    //
+    // Set up the initial guest state based on the current system state. Those
+    // values are loaded into the processor as guest state when the VMRUN
+    // instruction is executed.
+    //
+    VpData->GuestVmcb.StateSaveArea.GdtrBase = gdtr.Base;
+    VpData->GuestVmcb.StateSaveArea.GdtrLimit = gdtr.Limit;
+    VpData->GuestVmcb.StateSaveArea.IdtrBase = idtr.Base;
+    VpData->GuestVmcb.StateSaveArea.IdtrLimit = idtr.Limit;
+
+    VpData->GuestVmcb.StateSaveArea.CsLimit = GetSegmentLimit(ContextRecord->SegCs);
+    VpData->GuestVmcb.StateSaveArea.DsLimit = GetSegmentLimit(ContextRecord->SegDs);
+    VpData->GuestVmcb.StateSaveArea.EsLimit = GetSegmentLimit(ContextRecord->SegEs);
+    VpData->GuestVmcb.StateSaveArea.SsLimit = GetSegmentLimit(ContextRecord->SegSs);
+    VpData->GuestVmcb.StateSaveArea.CsSelector = ContextRecord->SegCs;
+    VpData->GuestVmcb.StateSaveArea.DsSelector = ContextRecord->SegDs;
+    VpData->GuestVmcb.StateSaveArea.EsSelector = ContextRecord->SegEs;
+    VpData->GuestVmcb.StateSaveArea.SsSelector = ContextRecord->SegSs;
+    VpData->GuestVmcb.StateSaveArea.CsAttrib = SvGetSegmentAccessRight(ContextRecord->SegCs, gdtr.Base);
+    VpData->GuestVmcb.StateSaveArea.DsAttrib = SvGetSegmentAccessRight(ContextRecord->SegDs, gdtr.Base);
+    VpData->GuestVmcb.StateSaveArea.EsAttrib = SvGetSegmentAccessRight(ContextRecord->SegEs, gdtr.Base);
+    VpData->GuestVmcb.StateSaveArea.SsAttrib = SvGetSegmentAccessRight(ContextRecord->SegSs, gdtr.Base);
+
+    VpData->GuestVmcb.StateSaveArea.Efer = __readmsr(IA32_MSR_EFER);
+    VpData->GuestVmcb.StateSaveArea.Cr0 = __readcr0();
+    VpData->GuestVmcb.StateSaveArea.Cr2 = __readcr2();
+    VpData->GuestVmcb.StateSaveArea.Cr3 = __readcr3();
+    VpData->GuestVmcb.StateSaveArea.Cr4 = __readcr4();
+    VpData->GuestVmcb.StateSaveArea.Rflags = ContextRecord->EFlags;
+    VpData->GuestVmcb.StateSaveArea.Rsp = ContextRecord->Rsp;
+    VpData->GuestVmcb.StateSaveArea.Rip = ContextRecord->Rip;
+    VpData->GuestVmcb.StateSaveArea.GPat = __readmsr(IA32_MSR_PAT);
+
+    //
     // Save some of the current state on VMCB. Some of those states are:
     // - FS, GS, TR, LDTR (including all hidden state)
     // - KernelGsBase
@@ -1087,731 +5607,3665 @@ SvPrepareForVirtualization (
     // - SYSENTER_CS, SYSENTER_ESP, SYSENTER_EIP
     // See "VMSAVE and VMLOAD Instructions" for mode details.
     //
-    // Those are restored to the processor right before #VMEXIT with the VMLOAD
-    // instruction so that the guest can start its execution with saved state,
-    // and also, re-saved to the VMCS with right after #VMEXIT with the VMSAVE
-    // instruction so that the host (hypervisor) do not destroy guest's state.
+    // Those are restored to the processor right before #VMEXIT with the VMLOAD
+    // instruction so that the guest can start its execution with saved state,
+    // and also, re-saved to the VMCS with right after #VMEXIT with the VMSAVE
+    // instruction so that the host (hypervisor) do not destroy guest's state.
+    //
+    __svm_vmsave(guestVmcbPa.QuadPart);
+
+    //
+    // Fill the host stack with the canary, so that how much of it is used by
+    // the host can be told later. See SvGetHostStackHighWater.
+    //
+    stack = reinterpret_cast<PUINT64>(VpData->HostStackLayout.StackContents);
+    for (SIZE_T i = 0; i < sizeof(VpData->HostStackLayout.StackContents) / sizeof(UINT64); i++)
+    {
+        stack[i] = SV_HOST_STACK_CANARY;
+    }
+
+    //
+    // Store data to stack so that the host (hypervisor) can use those values.
+    //
+    VpData->HostStackLayout.Reserved1 = MAXUINT64;
+    VpData->HostStackLayout.SharedVpData = SharedVpData;
+    VpData->HostStackLayout.Self = VpData;
+    VpData->HostStackLayout.HostVmcbPa = hostVmcbPa.QuadPart;
+    VpData->HostStackLayout.GuestVmcbPa = guestVmcbPa.QuadPart;
+
+    //
+    // The processor does not hold the guest state yet. Have SvLaunchVm load it
+    // with VMLOAD before the first VMRUN. See SvLoadHostState.
+    //
+    VpData->HostStackLayout.HostStateLoaded = TRUE;
+
+    //
+    // The guest starts outside of nested virtualization, with GIF set.
+    //
+    VpData->Vmcb = &VpData->GuestVmcb;
+    VpData->Nested.GuestVmcbPa = guestVmcbPa.QuadPart;
+    VpData->Nested.NestedVmcbPa = nestedVmcbPa.QuadPart;
+    VpData->Nested.Gif = TRUE;
+
+    //
+    // The TLB may still hold translations tagged with our ASID from a previous
+    // virtualization (eg, before sleep), so flush them on the first VMRUN.
+    // After that, the TLB is flushed only when something that could make the
+    // cached translations stale is changed. See SvRequestTlbFlush. No other
+    // view is warm, so switching to any of them flushes the TLB too.
+    //
+    VpData->NptView = 0;
+    VpData->WarmNptViews = 0;
+    VpData->NptViewSwitchTime = __rdtsc();
+    VpData->NptGenerations[0] = SharedVpData->NptViews[0].Generation;
+    SvRequestTlbFlush(VpData, SvTlbFlushGuest);
+    SvApplyPendingTlbFlush(VpData);
+
+    //
+    // Set an address of the host state area to VM_HSAVE_PA MSR. The processor
+    // saves some of the current state on VMRUN and loads them on #VMEXIT. See
+    // "VM_HSAVE_PA MSR (C001_0117h)".
+    //
+    __writemsr(SVM_MSR_VM_HSAVE_PA, hostStateAreaPa.QuadPart);
+
+    //
+    // Also, save some of the current state to VMCB for the host. This is loaded
+    // after #VMEXIT to reproduce the current state for the host (hypervisor).
+    //
+    __svm_vmsave(hostVmcbPa.QuadPart);
+}
+
+/*!
+    @brief      Returns the PTE that maps a kernel virtual address.
+
+    @details    The paging structures of the current address space are walked
+                through their kernel mappings. That is only possible before
+                virtualization, as it calls MmGetVirtualForPhysical.
+
+    @param[in]  VirtualAddress - The virtual address to find the PTE for.
+
+    @result     The PTE, or nullptr when the address is not mapped by a 4KB
+                page table.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Check_return_
+static
+volatile UINT64*
+SvGetHostPte (
+    _In_ PVOID VirtualAddress
+    )
+{
+    UINT64 va;
+    ULONG level;
+    PHYSICAL_ADDRESS tableBase;
+    volatile UINT64* entry;
+
+    va = reinterpret_cast<UINT64>(VirtualAddress);
+    level = ((__readcr4() & SV_CR4_LA57) != 0) ? 5 : 4;
+    tableBase.QuadPart = static_cast<LONGLONG>(__readcr3() & SV_PTE_PFN_MASK);
+    for (;;)
+    {
+        entry = static_cast<volatile UINT64*>(MmGetVirtualForPhysical(tableBase));
+        if (entry == nullptr)
+        {
+            return nullptr;
+        }
+        entry += (va >> (PAGE_SHIFT + (level - 1) * 9)) & 0x1ff;
+        if (level == 1)
+        {
+            return entry;
+        }
+        if (((*entry & SV_PTE_PRESENT) == 0) ||
+            ((*entry & SV_PTE_LARGE_PAGE) != 0))
+        {
+            return nullptr;
+        }
+        tableBase.QuadPart = static_cast<LONGLONG>(*entry & SV_PTE_PFN_MASK);
+        level--;
+    }
+}
+
+/*!
+    @brief      Reserves the slots to map guest physical memory into for the
+                processor.
+
+    @details    The address space is reserved by MmAllocateMappingAddress,
+                which leaves its PTEs to the caller. The PTE of each slot is
+                looked up once here, so that SvMapGuestPhysical can map a page
+                without calling the kernel.
+
+    @param[in,out]  VpData - Per processor data to reserve the slots for.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvReserveGuestMappings (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PSV_GUEST_MAPPING mapping;
+    ULONG slot;
+
+    mapping = &VpData->GuestMapping;
+    mapping->BaseVa = MmAllocateMappingAddress(SvGuestMappingSlots * PAGE_SIZE,
+                                               'MVSS');
+    if (mapping->BaseVa == nullptr)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (slot = 0; slot < SvGuestMappingSlots; slot++)
+    {
+        mapping->Ptes[slot] = SvGetHostPte(static_cast<PUCHAR>(mapping->BaseVa) +
+                                           slot * PAGE_SIZE);
+        if (mapping->Ptes[slot] == nullptr)
+        {
+            return STATUS_UNSUCCESSFUL;
+        }
+        mapping->MappedPfns[slot] = MAXUINT64;
+    }
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief      Unmaps and releases the slots reserved by SvReserveGuestMappings.
+
+    @details    This must run on the processor that owns the slots, as only its
+                TLB may cache translations of them.
+
+    @param[in,out]  VpData - Per processor data to release the slots of.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+SvReleaseGuestMappings (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PSV_GUEST_MAPPING mapping;
+    ULONG slot;
+
+    mapping = &VpData->GuestMapping;
+    if (mapping->BaseVa == nullptr)
+    {
+        return;
+    }
+
+    for (slot = 0; slot < SvGuestMappingSlots; slot++)
+    {
+        if (mapping->Ptes[slot] != nullptr)
+        {
+            *mapping->Ptes[slot] = 0;
+            __invlpg(static_cast<PUCHAR>(mapping->BaseVa) + slot * PAGE_SIZE);
+        }
+    }
+    MmFreeMappingAddress(mapping->BaseVa, 'MVSS');
+    mapping->BaseVa = nullptr;
+}
+
+/*!
+    @brief      Frees per processor data and everything it owns.
+
+    @details    This must run on the processor the data belongs to. See
+                SvReleaseGuestMappings.
+
+    @param[in]  VpData - Per processor data to free.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeVirtualProcessorData (
+    _In_ __drv_freesMem(Mem) PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    SvReleaseGuestMappings(VpData);
+    if (VpData->ExtendedState.Area != nullptr)
+    {
+        SvFreePageAlingedPhysicalMemory(VpData->ExtendedState.Area);
+    }
+    if (VpData->Nested.MsrPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(VpData->Nested.MsrPermissionsMap);
+    }
+    if (VpData->Nested.IoPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(VpData->Nested.IoPermissionsMap);
+    }
+    SvFreePageAlingedPhysicalMemory(VpData);
+}
+
+/*!
+    @brief      Virtualize the current processor.
+
+    @details    This function enables SVM, initialize VMCB with the current
+                processor state, and enters the guest mode on the current
+                processor.
+
+    @param[in]  Context - A pointer of share data.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvVirtualizeProcessor (
+    _In_opt_ PVOID Context
+    )
+{
+    NTSTATUS status;
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+    PVIRTUAL_PROCESSOR_DATA vpData;
+    PCONTEXT contextRecord;
+    UINT64 startTime;
+    ULONG processorIndex;
+
+    SV_DEBUG_BREAK();
+
+    startTime = __rdtsc();
+    vpData = nullptr;
+
+    NT_ASSERT(ARGUMENT_PRESENT(Context));
+    _Analysis_assume_(ARGUMENT_PRESENT(Context));
+
+    contextRecord = static_cast<PCONTEXT>(ExAllocatePoolWithTag(
+                                                        NonPagedPool,
+                                                        sizeof(*contextRecord),
+                                                        'MVSS'));
+    if (contextRecord == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Allocate per processor data.
+    //
+#pragma prefast(push)
+#pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
+    vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(
+            SvAllocatePageAlingedPhysicalMemory(sizeof(VIRTUAL_PROCESSOR_DATA)));
+#pragma prefast(pop)
+    if (vpData == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Allocate the permissions maps merged with the nested hypervisor's ones,
+    // if nested virtualization is available.
+    //
+    if (static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context)->NestedGuestAsid != 0)
+    {
+        vpData->Nested.MsrPermissionsMap = SvAllocateContiguousMemory(
+                                                SVM_MSR_PERMISSIONS_MAP_SIZE);
+        vpData->Nested.IoPermissionsMap = SvAllocateContiguousMemory(
+                                                SV_IO_PERMISSIONS_MAP_SIZE);
+        if ((vpData->Nested.MsrPermissionsMap == nullptr) ||
+            (vpData->Nested.IoPermissionsMap == nullptr))
+        {
+            SvDebugPrint("Insufficient memory.\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
+
+    //
+    // Allocate the area to save guest's extended state to while handlers use
+    // SIMD registers, if XSAVE is available.
+    //
+    if (static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context)->ExtendedStateSize != 0)
+    {
+        vpData->ExtendedState.Area = SvAllocatePageAlingedPhysicalMemory(ROUND_TO_PAGES(
+                static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context)->ExtendedStateSize));
+        if (vpData->ExtendedState.Area == nullptr)
+        {
+            SvDebugPrint("Insufficient memory.\n");
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        vpData->ExtendedState.XsaveoptSupported =
+                static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context)->XsaveoptSupported;
+    }
+
+    //
+    // Reserve the address space #VMEXIT handlers map guest physical memory
+    // into. See SvMapGuestPhysical.
+    //
+    status = SvReserveGuestMappings(vpData);
+    if (!NT_SUCCESS(status))
+    {
+        SvDebugPrint("Failed to reserve guest mappings (%08x).\n", status);
+        goto Exit;
+    }
+
+    //
+    // Capture the current RIP, RSP, RFLAGS, and segment selectors. This
+    // captured state is used as an initial state of the guest mode; therefore
+    // when virtualization starts by the later call of SvLaunchVm, a processor
+    // resume its execution at this location and state.
+    //
+    RtlCaptureContext(contextRecord);
+
+    //
+    // First time of this execution, the SimpleSvm hypervisor is not installed
+    // yet. Therefore, the branch is taken, and virtualization is attempted.
+    //
+    // At the second execution of here, after SvLaunchVm virtualized the
+    // processor, SvIsSimpleSvmHypervisorInstalled returns TRUE, and this
+    // function exits with STATUS_SUCCESS.
+    //
+    if (SvIsSimpleSvmHypervisorInstalled() == FALSE)
+    {
+        SvDebugPrint("Attempting to virtualize the processor.\n");
+        sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
+
+        //
+        // Enable SVM by setting EFER.SVME. It has already been verified that this
+        // bit was writable with SvIsSvmSupported.
+        //
+        __writemsr(IA32_MSR_EFER, __readmsr(IA32_MSR_EFER) | EFER_SVME);
+
+        //
+        // Set up VMCB, the structure describes the guest state and what events
+        // within the guest should be intercepted, ie, triggers #VMEXIT.
+        //
+        SvPrepareForVirtualization(vpData, sharedVpData, contextRecord);
+
+        //
+        // Record how long it took to get ready to launch the guest, which
+        // mostly consists of allocation and set up of VMCB.
+        //
+        processorIndex = KeGetCurrentProcessorNumberEx(nullptr);
+        NT_ASSERT(processorIndex < g_Statistics->NumberOfProcessors);
+        vpData->Statistics = reinterpret_cast<PSV_VP_STATISTICS>(
+                reinterpret_cast<PUCHAR>(g_Statistics) +
+                (1ULL + processorIndex) * SV_STATISTICS_PAGE_SIZE);
+        SvBeginSeqlockWrite(&vpData->Statistics->Sequence);
+        vpData->Statistics->ProcessorIndex = processorIndex;
+        vpData->Statistics->BringUpCycles = __rdtsc() - startTime;
+        SvEndSeqlockWrite(&vpData->Statistics->Sequence);
+
+        vpData->Cr3Statistics = reinterpret_cast<PSV_CR3_STATISTICS>(
+                reinterpret_cast<PUCHAR>(g_Statistics) +
+                (1ULL + g_Statistics->NumberOfProcessors + processorIndex) * SV_STATISTICS_PAGE_SIZE);
+        SvBeginSeqlockWrite(&vpData->Cr3Statistics->Sequence);
+        vpData->Cr3Statistics->ProcessorIndex = processorIndex;
+        SvEndSeqlockWrite(&vpData->Cr3Statistics->Sequence);
+
+        //
+        // Switch to the host RSP to run as the host (hypervisor), and then
+        // enters loop that executes code as a guest until #VMEXIT happens and
+        // handles #VMEXIT as the host.
+        //
+        // This function should never return to here.
+        //
+        SvLaunchVm(&vpData->HostStackLayout.GuestVmcbPa);
+        SV_DEBUG_BREAK();
+        KeBugCheck(MANUALLY_INITIATED_CRASH);
+    }
+
+    SvDebugPrint("The processor has been virtualized.\n");
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (contextRecord != nullptr)
+    {
+        ExFreePoolWithTag(contextRecord, 'MVSS');
+    }
+    if ((!NT_SUCCESS(status)) && (vpData != nullptr))
+    {
+        //
+        // Frees per processor data if allocated and this function is
+        // unsuccessful.
+        //
+        SvFreeVirtualProcessorData(vpData);
+    }
+    return status;
+}
+
+/*!
+    @brief      Execute a callback on all processors one-by-one.
+
+    @details    This function execute Callback with Context as a parameter for
+                each processor on the current IRQL. If the callback returned
+                non-STATUS_SUCCESS value or any error occurred, this function
+                stops execution of the callback and returns the error code.
+
+                When NumOfProcessorCompleted is not NULL, this function always
+                set a number of processors that successfully executed the
+                callback.
+
+    @param[in]  Callback - A function to execute on all processors.
+    @param[in]  Context - A parameter to pass to the callback.
+    @param[out] NumOfProcessorCompleted - A pointer to receive a number of
+                processors executed the callback successfully.
+
+    @result     STATUS_SUCCESS when Callback executed and returned STATUS_SUCCESS
+                on all processors; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvExecuteOnEachProcessor (
+    _In_ NTSTATUS (*Callback)(PVOID),
+    _In_opt_ PVOID Context,
+    _Out_opt_ PULONG NumOfProcessorCompleted
+    )
+{
+    NTSTATUS status;
+    ULONG i, numOfProcessors;
+    PROCESSOR_NUMBER processorNumber;
+    GROUP_AFFINITY affinity, oldAffinity;
+
+    status = STATUS_SUCCESS;
+
+    //
+    // Get a number of processors on this system.
+    //
+    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    for (i = 0; i < numOfProcessors; i++)
+    {
+        //
+        // Convert from an index to a processor number.
+        //
+        status = KeGetProcessorNumberFromIndex(i, &processorNumber);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        //
+        // Switch execution of this code to a processor #i.
+        //
+        affinity.Group = processorNumber.Group;
+        affinity.Mask = 1ULL << processorNumber.Number;
+        affinity.Reserved[0] = affinity.Reserved[1] = affinity.Reserved[2] = 0;
+        KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
+
+        //
+        // Execute the callback.
+        //
+        status = Callback(Context);
+
+        //
+        // Revert the previously executed processor.
+        //
+        KeRevertToUserGroupAffinityThread(&oldAffinity);
+
+        //
+        // Exit if the callback returned error.
+        //
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+    }
+
+Exit:
+    //
+    // i must be the same as the number of processors on the system when this
+    // function returns STATUS_SUCCESS;
+    //
+    NT_ASSERT(!NT_SUCCESS(status) || (i == numOfProcessors));
+
+    //
+    // Set a number of processors that successfully executed callback if the
+    // out parameter is present.
+    //
+    if (ARGUMENT_PRESENT(NumOfProcessorCompleted))
+    {
+        *NumOfProcessorCompleted = i;
+    }
+    return status;
+}
+
+/*!
+    @brief      Prints statistics of intercepted I/O ports of the processor.
+
+    @param[in]  VpData - Per processor data of the de-virtualized processor.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvReportIoPortStatistics (
+    _In_ const VIRTUAL_PROCESSOR_DATA* VpData
+    )
+{
+    const SHARED_VIRTUAL_PROCESSOR_DATA* sharedVpData;
+    const SV_IO_PORT_STATISTICS* statistics;
+    UINT64 count;
+
+    sharedVpData = VpData->HostStackLayout.SharedVpData;
+    for (ULONG i = 0; i < sharedVpData->NumberOfIoPortPolicies; i++)
+    {
+        statistics = &VpData->IoPortStatistics[i];
+        count = statistics->InCount + statistics->OutCount;
+        if (count == 0)
+        {
+            continue;
+        }
+
+        SvDebugPrint("%s: in %llu, out %llu, average %llu cycles, max %llu cycles\n",
+                     sharedVpData->IoPortPolicies[i].Name,
+                     statistics->InCount,
+                     statistics->OutCount,
+                     statistics->TotalCycles / count,
+                     statistics->MaxCycles);
+    }
+}
+
+/*!
+    @brief      Prints the number and cost of #VMEXITs reflected to the nested
+                hypervisor on the processor, per #VMEXIT code bucket.
+
+    @param[in]  VpData - Per processor data of the de-virtualized processor.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvReportNestedStatistics (
+    _In_ const VIRTUAL_PROCESSOR_DATA* VpData
+    )
+{
+    for (ULONG i = 0; i < SV_STATISTICS_EXIT_BUCKETS; i++)
+    {
+        if (VpData->Nested.ReflectedExitCounts[i] == 0)
+        {
+            continue;
+        }
+
+        SvDebugPrint("Reflected #VMEXIT %llx: %llu, average %llu cycles\n",
+                     SvGetBucketExitCode(i),
+                     VpData->Nested.ReflectedExitCounts[i],
+                     VpData->Nested.ReflectedExitCycles[i] /
+                        VpData->Nested.ReflectedExitCounts[i]);
+    }
+}
+
+/*!
+    @brief          Accounts the address space the processor was running in up
+                    to de-virtualization, and prints the summary of CR3
+                    accounting on the processor.
+
+    @param[in,out]  VpData - Per processor data of the de-virtualized processor.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvReportCr3Statistics (
+    _Inout_ PVIRTUAL_PROCESSOR_DATA VpData
+    )
+{
+    PSV_CR3_STATISTICS statistics;
+    ULONG addressSpaces;
+
+    if (VpData->Cr3Accounting.Enabled == FALSE)
+    {
+        return;
+    }
+
+    statistics = VpData->Cr3Statistics;
+    SvBeginSeqlockWrite(&statistics->Sequence);
+    SvAccountCr3Time(VpData, __rdtsc());
+    SvEndSeqlockWrite(&statistics->Sequence);
+
+    addressSpaces = 0;
+    for (ULONG i = 0; i < SV_CR3_STATISTICS_ENTRIES; i++)
+    {
+        if (statistics->Entries[i].Cr3 != 0)
+        {
+            addressSpaces++;
+        }
+    }
+
+    SvDebugPrint("CR3: %llu switches among %lu address spaces, %llu of %llu cycles untracked\n",
+                 statistics->Switches,
+                 addressSpaces,
+                 statistics->UntrackedCycles,
+                 statistics->Cycles);
+}
+
+#if defined(SV_CAPTURE_HOST_LBR)
+/*!
+    @brief      Prints the last branch records of the host, oldest first.
+
+    @param[in]  VpData - Per processor data of the de-virtualized processor.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvReportHostLbrRecords (
+    _In_ const VIRTUAL_PROCESSOR_DATA* VpData
+    )
+{
+    const SV_HOST_LBR_RECORD* record;
+
+    for (ULONG i = 0; i < SV_HOST_LBR_RECORDS; i++)
+    {
+        record = &VpData->HostLbrRecords[(VpData->NextHostLbrRecord + i) % SV_HOST_LBR_RECORDS];
+        if (record->BranchFrom == 0)
+        {
+            continue;
+        }
+
+        SvDebugPrint("Host LBR for #VMEXIT %llx: %016llx -> %016llx\n",
+                     record->ExitCode,
+                     record->BranchFrom,
+                     record->BranchTo);
+    }
+}
+#endif
+
+/*!
+    @brief      Returns how much of the host stack has ever been used.
+
+    @details    The host stack is filled with SV_HOST_STACK_CANARY before the
+                processor is virtualized. This function finds the lowest word
+                overwritten since then. HostStackLayout and the trap frame are
+                always counted as used.
+
+    @param[in]  VpData - Per processor data of the de-virtualized processor.
+
+    @result     The number of bytes from the stack base to the lowest word used.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+UINT64
+SvGetHostStackHighWater (
+    _In_ const VIRTUAL_PROCESSOR_DATA* VpData
+    )
+{
+    const UINT64* stack;
+    SIZE_T i;
+
+    stack = reinterpret_cast<const UINT64*>(VpData->HostStackLayout.StackContents);
+    for (i = 0; i < sizeof(VpData->HostStackLayout.StackContents) / sizeof(UINT64); i++)
+    {
+        if (stack[i] != SV_HOST_STACK_CANARY)
+        {
+            break;
+        }
+    }
+    return SV_HOST_STACK_SIZE - i * sizeof(UINT64);
+}
+
+/*!
+    @brief      De-virtualize the current processor if virtualized.
+
+    @details    This function asks SimpleSVM hypervisor to deactivate itself
+                through CPUID (or VMMCALL when CPUID is not intercepted) with a
+                back-door function id and frees per
+                processor data if it is returned. If the SimpleSvm is not
+                installed, this function does nothing.
+
+    @param[in]  Context - An out pointer to receive an address of shared data.
+
+    @result     Always STATUS_SUCCESS.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvDevirtualizeProcessor (
+    _In_opt_ PVOID Context
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    UINT64 high, low, highWater;
+    PVIRTUAL_PROCESSOR_DATA vpData;
+    PSHARED_VIRTUAL_PROCESSOR_DATA* sharedVpDataPtr;
+
+    if (!ARGUMENT_PRESENT(Context))
+    {
+        goto Exit;
+    }
+
+    //
+    // Ask SimpleSVM hypervisor to deactivate itself. If the hypervisor is
+    // installed, this ECX is set to 'SSVM', and EDX:EAX indicates an address
+    // of per processor data to be freed.
+    //
+    SvCallHypervisor(registers, CPUID_UNLOAD_SIMPLE_SVM);
+    if (registers[2] != 'SSVM')
+    {
+        goto Exit;
+    }
+
+    SvDebugPrint("The processor has been de-virtualized.\n");
+
+    //
+    // Get an address of per processor data indicated by EDX:EAX.
+    //
+    high = registers[3];
+    low = registers[0] & MAXUINT32;
+    vpData = reinterpret_cast<PVIRTUAL_PROCESSOR_DATA>(high << 32 | low);
+    NT_ASSERT(vpData->HostStackLayout.Reserved1 == MAXUINT64);
+
+    SvReportIoPortStatistics(vpData);
+    SvReportNestedStatistics(vpData);
+    SvReportCr3Statistics(vpData);
+#if defined(SV_CAPTURE_HOST_LBR)
+    SvReportHostLbrRecords(vpData);
+#endif
+
+    //
+    // Record the host stack use. Keep the largest value across virtualization
+    // cycles, eg, sleep and resume.
+    //
+    highWater = SvGetHostStackHighWater(vpData);
+    SvDebugPrint("Host stack: %llu of %lu bytes used.\n",
+                 highWater,
+                 static_cast<ULONG>(SV_HOST_STACK_SIZE));
+    SvBeginSeqlockWrite(&vpData->Statistics->Sequence);
+    if (highWater > vpData->Statistics->HostStackHighWater)
+    {
+        vpData->Statistics->HostStackHighWater = highWater;
+    }
+    SvEndSeqlockWrite(&vpData->Statistics->Sequence);
+
+    //
+    // Save an address of shared data, then free per processor data.
+    //
+    sharedVpDataPtr = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA*>(Context);
+    *sharedVpDataPtr = vpData->HostStackLayout.SharedVpData;
+    SvFreeVirtualProcessorData(vpData);
+
+Exit:
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief          Releases a reference to the identity nested page tables.
+
+    @details        The tables are freed when the last reference is released.
+                    As this may free contiguous memory, this function must be
+                    called at PASSIVE_LEVEL or APC_LEVEL, never from the #VMEXIT
+                    handler. References are only taken and released under
+                    NptUpdateLock or before processors are virtualized.
+
+    @param[in,out]  SharedVpData - The shared data that owns the tables.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvReleaseSharedNpt (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    NT_ASSERT(SharedVpData->NptReferences > 0);
+
+    if (InterlockedDecrement(&SharedVpData->NptReferences) == 0)
+    {
+        SvFreeContiguousMemory(SharedVpData->Npt);
+        SharedVpData->Npt = nullptr;
+    }
+}
+
+/*!
+    @brief          Tests whether the page directory of the NPT view is the
+                    one of the identity nested page tables.
+
+    @param[in]      SharedVpData - The shared data that owns NPT views.
+    @param[in]      View - The view to test.
+    @param[in]      DirectoryIndex - The index of the PDP entry.
+
+    @result         TRUE when the page directory is shared; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+static
+BOOLEAN
+SvIsSharedNptDirectory (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ const SV_NPT_VIEW* View,
+    _In_ ULONG DirectoryIndex
+    )
+{
+    return ((SharedVpData->Npt != nullptr) &&
+            (View->Directories[DirectoryIndex] == SharedVpData->Npt->PdeEntries[DirectoryIndex]));
+}
+
+/*!
+    @brief          Frees nested page tables of the NPT view.
+
+    @details        Page directories copied by the view and page tables split
+                    by it are freed, and references to shared page directories
+                    and the identity nested page tables are released. The view
+                    is left empty, and can be freed again. Its ASID is not freed,
+                    as ASIDs are never reused.
+
+                    View 0 must be freed last, as other views may point to its
+                    page tables from page directories they copied.
+
+    @param[in,out]  SharedVpData - The shared data that owns NPT views.
+    @param[in,out]  View - The view to free.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeNptView (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _Inout_ PSV_NPT_VIEW View
+    )
+{
+    for (ULONG i = 0; i < View->NumberOfSplitPageTables; i++)
+    {
+        SvFreePageAlingedPhysicalMemory(View->SplitPageTables[i]);
+    }
+    View->NumberOfSplitPageTables = 0;
+    if (View->Root == nullptr)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(View->Directories); i++)
+    {
+        if (SvIsSharedNptDirectory(SharedVpData, View, i) != FALSE)
+        {
+            InterlockedDecrement(&SharedVpData->DirectoryReferences[i]);
+        }
+        else
+        {
+            SvFreePageAlingedPhysicalMemory(View->Directories[i]);
+        }
+        View->Directories[i] = nullptr;
+    }
+    View->NumberOfPrivateDirectories = 0;
+
+    if (View->Root != &SharedVpData->Npt->Root)
+    {
+        SvFreeContiguousMemory(View->Root);
+    }
+    View->Root = nullptr;
+    SvReleaseSharedNpt(SharedVpData);
+}
+
+/*!
+    @brief      Frees shared data and everything it owns.
+
+    @details    This function must be called only after all processors have
+                been de-virtualized, or before any of them is virtualized.
+
+    @param[in]  SharedVpData - The shared data to free.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvFreeSharedVirtualProcessorData (
+    _In_ __drv_freesMem(Mem) PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    for (LONG i = 0; i < SharedVpData->NumberOfMmioRanges; i++)
+    {
+        MmUnmapIoSpace(SharedVpData->MmioRanges[i].MappedVa,
+                       SharedVpData->MmioRanges[i].Size);
+    }
+    for (ULONG i = SV_MAX_NPT_VIEWS; i > 0; i--)
+    {
+        SvFreeNptView(SharedVpData, &SharedVpData->NptViews[i - 1]);
+    }
+    if (SharedVpData->Npt != nullptr)
+    {
+        //
+        // Never shared by any view, as virtualization failed before view 0
+        // was set up.
+        //
+        NT_ASSERT(SharedVpData->NptReferences == 0);
+        SvFreeContiguousMemory(SharedVpData->Npt);
+    }
+    if (SharedVpData->MsrPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(SharedVpData->MsrPermissionsMap);
+    }
+    if (SharedVpData->IoPermissionsMap != nullptr)
+    {
+        SvFreeContiguousMemory(SharedVpData->IoPermissionsMap);
+    }
+    if (SharedVpData->PolicyVersion != nullptr)
+    {
+        SvFreeContiguousMemory(SharedVpData->PolicyVersion->MsrPermissionsMap);
+        ExFreePoolWithTag(SharedVpData->PolicyVersion, 'MVSS');
+    }
+    if (SharedVpData->PhysicalMemoryRanges != nullptr)
+    {
+        ExFreePool(SharedVpData->PhysicalMemoryRanges);
+    }
+    SvFreePageAlingedPhysicalMemory(SharedVpData);
+}
+
+/*!
+    @brief      De-virtualize all virtualized processors.
+
+    @details    This function execute a callback to de-virtualize a processor on
+                all processors, and frees shared data when the callback returned
+                its pointer from a hypervisor.
+
+                Processors are enumerated at the time of the call, so ones
+                virtualized by SvProcessorChangeCallback are de-virtualized as
+                well. Processors that are not virtualized are skipped.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvDevirtualizeAllProcessors (
+    VOID
+    )
+{
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+
+    sharedVpData = nullptr;
+
+    //
+    // De-virtualize all processors and free shared data when returned.
+    //
+    NT_VERIFY(NT_SUCCESS(SvExecuteOnEachProcessor(SvDevirtualizeProcessor,
+                                                  &sharedVpData,
+                                                  nullptr)));
+    if (sharedVpData != nullptr)
+    {
+        SvFreeSharedVirtualProcessorData(sharedVpData);
+    }
+    g_SharedVpData = nullptr;
+}
+
+/*!
+    @brief          Allocates an unused ASID.
+
+    @details        ASIDs are never freed while the hypervisor is loaded. Zero
+                    is reserved for the host and is never returned as a valid
+                    ASID.
+
+    @param[in,out]  SharedVpData - The shared data to allocate an ASID from.
+
+    @result         An allocated ASID, or zero if all supported ASIDs are in
+                    use.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+UINT32
+SvAllocateAsid (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    LONG asid;
+
+    asid = InterlockedIncrement(&SharedVpData->LastAllocatedAsid);
+    if (static_cast<UINT32>(asid) >= SharedVpData->NumberOfAsids)
+    {
+        InterlockedDecrement(&SharedVpData->LastAllocatedAsid);
+        return 0;
+    }
+    return static_cast<UINT32>(asid);
+}
+
+/*!
+    @brief          Checks if host handlers can save guest's extended state, and
+                    how large the area to save it to must be.
+
+    @details        XSAVE is used only when the OS enabled it (CR4.OSXSAVE).
+                    The size covers all components the processor supports,
+                    rather than ones currently enabled in XCR0, which the guest
+                    may change.
+
+    @param[in,out]  SharedVpData - The shared data to initialize.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvInitializeExtendedStateFeatures (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+
+    SharedVpData->ExtendedStateSize = 0;
+    SharedVpData->XsaveoptSupported = FALSE;
+
+    __cpuid(registers, CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS);
+    if ((registers[2] & (CPUID_FN0000_0001_ECX_XSAVE | CPUID_FN0000_0001_ECX_OSXSAVE)) !=
+        (CPUID_FN0000_0001_ECX_XSAVE | CPUID_FN0000_0001_ECX_OSXSAVE))
+    {
+        SvDebugPrint("Host handlers cannot use SIMD registers without XSAVE.\n");
+        return;
+    }
+
+    __cpuidex(registers, CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION, 0);
+    SharedVpData->ExtendedStateSize = static_cast<UINT32>(registers[2]);
+    __cpuidex(registers, CPUID_PROCESSOR_EXTENDED_STATE_ENUMERATION, 1);
+    SharedVpData->XsaveoptSupported = ((registers[0] & CPUID_FN0000_000D_EAX_XSAVEOPT) != 0);
+}
+
+/*!
+    @brief          Initializes optional SVM features and ASID management.
+
+    @details        This function reads the number of ASIDs and optional SVM
+                    features from CPUID, and allocates the ASID used by the
+                    guest. See "CPUID Fn8000_000A_EBX SVM Revision and Feature
+                    Identification" and "CPUID Fn8000_000A_EDX SVM Feature
+                    Identification".
+
+    @param[out]     SharedVpData - The shared data to initialize.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvInitializeSvmFeatures (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+
+    __cpuid(registers, CPUID_SVM_FEATURES);
+    SharedVpData->NumberOfAsids = static_cast<UINT32>(registers[1]);
+    SharedVpData->FlushByAsidSupported =
+                ((registers[3] & CPUID_FN8000_000A_EDX_FLUSH_BY_ASID) != 0);
+    SharedVpData->DecodeAssistsSupported =
+                ((registers[3] & CPUID_FN8000_000A_EDX_DECODE_ASSISTS) != 0);
+    SharedVpData->VirtualGifSupported =
+                ((registers[3] & CPUID_FN8000_000A_EDX_VGIF) != 0);
+    SharedVpData->VirtualVmloadVmsaveSupported =
+                ((registers[3] & CPUID_FN8000_000A_EDX_VIRTUAL_VMLOAD_VMSAVE) != 0);
+    SharedVpData->LbrVirtualizationSupported =
+                ((registers[3] & CPUID_FN8000_000A_EDX_LBR_VIRTUALIZATION) != 0);
+    SharedVpData->LastAllocatedAsid = 0;
+
+    SharedVpData->NptViews[0].Asid = SvAllocateAsid(SharedVpData);
+    if (SharedVpData->NptViews[0].Asid == 0)
+    {
+        return STATUS_HV_FEATURE_UNAVAILABLE;
+    }
+
+    //
+    // Nested virtualization needs its own ASID, but is optional.
+    //
+    SharedVpData->NestedGuestAsid = SvAllocateAsid(SharedVpData);
+    if (SharedVpData->NestedGuestAsid == 0)
+    {
+        SvDebugPrint("Nested virtualization is unavailable.\n");
+    }
+
+    SvInitializeExtendedStateFeatures(SharedVpData);
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief      Locates the ACPI PM timer from the FADT.
+
+    @details    The PM timer is a 32-bit read-only register, and is located at
+                PM_TMR_BLK, or X_PM_TMR_BLK when it is in system I/O space and
+                PM_TMR_BLK is zero. See "Fixed ACPI Description Table (FADT)" in
+                the ACPI specification.
+
+    @param[out] FirstPort - Receives the first port of the PM timer.
+    @param[out] LastPort - Receives the last port of the PM timer.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_Use_decl_annotations_
+static
+NTSTATUS
+SvLocateAcpiPmTimer (
+    PUINT16 FirstPort,
+    PUINT16 LastPort
+    )
+{
+    static const ULONG FADT_PM_TMR_BLK_OFFSET = 76;
+    static const ULONG FADT_X_PM_TMR_BLK_OFFSET = 208;
+    static const ULONG ACPI_GAS_SIZE = 12;
+    static const UINT8 ACPI_GAS_SYSTEM_IO = 1;
+    NTSTATUS status;
+    PUCHAR fadt;
+    ULONG fadtSize;
+    UINT64 port;
+
+    *FirstPort = *LastPort = 0;
+    fadt = nullptr;
+
+    status = AuxKlibInitialize();
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    status = AuxKlibGetSystemFirmwareTable('ACPI', 'PCAF', nullptr, 0, &fadtSize);
+    if (status != STATUS_BUFFER_TOO_SMALL)
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    fadt = static_cast<PUCHAR>(ExAllocatePoolWithTag(NonPagedPool, fadtSize, 'MVSS'));
+    if (fadt == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    status = AuxKlibGetSystemFirmwareTable('ACPI', 'PCAF', fadt, fadtSize, &fadtSize);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    port = 0;
+    if (fadtSize >= FADT_PM_TMR_BLK_OFFSET + sizeof(UINT32))
+    {
+        port = *reinterpret_cast<UNALIGNED UINT32*>(&fadt[FADT_PM_TMR_BLK_OFFSET]);
+    }
+    if ((port == 0) &&
+        (fadtSize >= FADT_X_PM_TMR_BLK_OFFSET + ACPI_GAS_SIZE) &&
+        (fadt[FADT_X_PM_TMR_BLK_OFFSET] == ACPI_GAS_SYSTEM_IO))
+    {
+        port = *reinterpret_cast<UNALIGNED UINT64*>(&fadt[FADT_X_PM_TMR_BLK_OFFSET + 4]);
+    }
+
+    //
+    // Hardware-reduced ACPI platforms may not have the PM timer.
+    //
+    if ((port == 0) || (port > MAXUINT16 - 3))
+    {
+        status = STATUS_NOT_FOUND;
+        goto Exit;
+    }
+
+    *FirstPort = static_cast<UINT16>(port);
+    *LastPort = static_cast<UINT16>(port + 3);
+
+Exit:
+    if (fadt != nullptr)
+    {
+        ExFreePoolWithTag(fadt, 'MVSS');
+    }
+    return status;
+}
+
+//
+// I/O ports to intercept. Legacy ports some drivers spin on are intercepted to
+// profile how often they are accessed and how long each access takes.
+//
+static const SV_IO_PORT_POLICY g_IoPortPolicies[] =
+{
+    { "POST delay (0x80)", 0x80, 0x80, nullptr, SvPassThroughIoPortAccess },
+    { "ACPI PM timer", 0, 0, SvLocateAcpiPmTimer, SvPassThroughIoPortAccess },
+};
+static_assert(RTL_NUMBER_OF(g_IoPortPolicies) <= SV_MAX_IO_PORT_POLICIES,
+              "Too many I/O port policies");
+
+/*!
+    @brief          Build the I/O permissions map (IOPM).
+
+    @details        This function locates the ports of each policy in
+                    g_IoPortPolicies and sets up the IOPM to intercept them.
+                    Policies whose ports cannot be located are skipped. Accesses
+                    to all other ports are not intercepted.
+
+    @param[in,out]  SharedVpData - The shared data that owns the IOPM.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvBuildIoPermissionsMap (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    NTSTATUS status;
+    PSV_IO_PORT_POLICY policy;
+
+    SvInitializeIoPermissionsMap(SharedVpData->IoPermissionsMap);
+    SharedVpData->NumberOfIoPortPolicies = 0;
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(g_IoPortPolicies); i++)
+    {
+        policy = &SharedVpData->IoPortPolicies[SharedVpData->NumberOfIoPortPolicies];
+        *policy = g_IoPortPolicies[i];
+        if (policy->Locate != nullptr)
+        {
+            status = policy->Locate(&policy->FirstPort, &policy->LastPort);
+            if (!NT_SUCCESS(status))
+            {
+                SvDebugPrint("%s is not intercepted (%08x).\n", policy->Name, status);
+                continue;
+            }
+        }
+
+        SvDebugPrint("Intercepting %s at %04x-%04x.\n",
+                     policy->Name,
+                     policy->FirstPort,
+                     policy->LastPort);
+        SvInterceptIoPorts(SharedVpData->IoPermissionsMap,
+                           policy->FirstPort,
+                           policy->LastPort);
+        SharedVpData->NumberOfIoPortPolicies++;
+    }
+}
+
+/*!
+    @brief      Causes #VMEXIT on the current processor.
+
+    @details    This function is executed on all processors through IPI by
+                SvEndNptUpdate and SvSetInterceptPolicy. The hypervisor
+                interface (CPUID or VMMCALL) is always intercepted, and the
+                #VMEXIT handler picks up the latest NPT generation and intercept
+                policy before returning to the guest; therefore, when the call
+                returns, this processor no longer uses stale translations or
+                policy.
+
+    @param[in]  Argument - Unused.
+
+    @result     Always zero.
+ */
+_IRQL_requires_same_
+static
+ULONG_PTR
+SvForceVmExit (
+    _In_ ULONG_PTR Argument
+    )
+{
+    int registers[4];   // EAX, EBX, ECX, and EDX
+
+    UNREFERENCED_PARAMETER(Argument);
+
+    SvCallHypervisor(registers, CPUID_HV_VENDOR_AND_MAX_FUNCTIONS);
+    return 0;
+}
+
+/*!
+    @brief          Starts a batch of modifications of nested page tables.
+
+    @details        All modifications of nested page tables must be done between
+                    this function and SvEndNptUpdate. Entries are modified in
+                    place and are visible to the page walker of any processor
+                    immediately; only the TLB flush that makes processors stop
+                    using stale translations is deferred until SvEndNptUpdate,
+                    and is done once no matter how many entries are modified in
+                    the batch.
+
+    @param[in,out]  SharedVpData - The shared data that owns nested page tables.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+static
+VOID
+SvBeginNptUpdate (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+    )
+{
+    ExAcquireFastMutex(&SharedVpData->NptUpdateLock);
+    SharedVpData->NptModified = 0;
+}
+
+/*!
+    @brief          Records that nested page tables are modified in the batch.
+
+    @details        This function must be called by any code that modifies an
+                    entry of nested page tables that may already be in use.
+
+    @param[in,out]  SharedVpData - The shared data that owns nested page tables.
+    @param[in]      ViewIndex - The index of the NPT view modified.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvNoteNptModification (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ ULONG ViewIndex
+    )
+{
+    SharedVpData->NptModified |= (1UL << ViewIndex);
+}
+
+/*!
+    @brief          Ends a batch of modifications of nested page tables.
+
+    @details        This function bumps the generation of each NPT view
+                    modified in the batch, so that each processor flushes its
+                    guest TLB before the next VMRUN in the view. See
+                    SvSynchronizeNptGeneration and SvSwitchNptView.
+
+                    By default, processors pick up the change at their next
+                    #VMEXIT, which is typically soon enough. When Synchronous is
+                    TRUE, this function also forces #VMEXIT on all processors so
+                    that no processor uses stale translations when this function
+                    returns. This is done by calling SvCallHypervisor from the
+                    IPI (see SvForceVmExit), since sending IPIs from the host to
+                    processors in the guest mode is not an option.
+
+    @param[in,out]  SharedVpData - The shared data that owns nested page tables.
+    @param[in]      Synchronous - Whether to wait until all processors dropped
+                    stale translations.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+static
+VOID
+SvEndNptUpdate (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ BOOLEAN Synchronous
+    )
+{
+    ULONG modified;
+
+    modified = SharedVpData->NptModified;
+    for (ULONG i = 0; i < SV_MAX_NPT_VIEWS; i++)
+    {
+        if ((modified & (1UL << i)) != 0)
+        {
+            InterlockedIncrement64(&SharedVpData->NptViews[i].Generation);
+        }
+    }
+    ExReleaseFastMutex(&SharedVpData->NptUpdateLock);
+
+    if ((modified != 0) && (Synchronous != FALSE))
+    {
+        KeIpiGenericCall(SvForceVmExit, 0);
+    }
+}
+
+/*!
+    @brief          Makes the NPT view share all page directories of the
+                    identity nested page tables.
+
+    @details        Unless the view is view 0, whose Root is the one of the
+                    identity nested page tables, the PML4 entry of the view is
+                    pointed to its own PDP, and PDP entries are copied from view
+                    0. A reference is taken on each page directory and on the
+                    tables. This costs the view two pages instead of a copy of
+                    SV_NESTED_PAGE_TABLES.
+
+                    MMIO ranges registered so far are made not-present in page
+                    directories or page tables of view 0, so they are trapped in
+                    the view as well.
+
+    @param[in,out]  SharedVpData - The shared data that owns NPT views.
+    @param[in,out]  View - The view with Root and NptBasePa set.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvShareNptDirectories (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _Inout_ PSV_NPT_VIEW View
+    )
+{
+    PML4_ENTRY_2MB pml4Entry;
+
+    if (View->Root != &SharedVpData->Npt->Root)
+    {
+        pml4Entry = SharedVpData->Npt->Root.Pml4Entries[0];
+        pml4Entry.Fields.PageFrameNumber = (View->NptBasePa +
+                            FIELD_OFFSET(SV_NPT_ROOT, PdpEntries)) >> PAGE_SHIFT;
+        View->Root->Pml4Entries[0] = pml4Entry;
+        RtlCopyMemory(View->Root->PdpEntries,
+                      SharedVpData->Npt->Root.PdpEntries,
+                      sizeof(View->Root->PdpEntries));
+    }
+
+    for (ULONG i = 0; i < RTL_NUMBER_OF(View->Directories); i++)
+    {
+        View->Directories[i] = SharedVpData->Npt->PdeEntries[i];
+        InterlockedIncrement(&SharedVpData->DirectoryReferences[i]);
+    }
+    InterlockedIncrement(&SharedVpData->NptReferences);
+}
+
+/*!
+    @brief          Copies a page directory the NPT view shares, so that the
+                    view can modify it.
+
+    @details        The PDP entry of the view is replaced with a single write,
+                    and the reference to the shared page directory is released.
+                    Entries pointing to page tables of view 0 are copied as-is;
+                    SvSplitNptLargePage copies such page tables when modifying
+                    them. This must be called between SvBeginNptUpdate and
+                    SvEndNptUpdate.
+
+    @param[in,out]  SharedVpData - The shared data that owns NPT views.
+    @param[in]      ViewIndex - The index of the view, other than zero.
+    @param[in]      DirectoryIndex - The index of the PDP entry.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvCopyNptDirectory (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ ULONG ViewIndex,
+    _In_ ULONG DirectoryIndex
+    )
+{
+    PSV_NPT_VIEW view;
+    PPD_ENTRY_2MB directory;
+    PDP_ENTRY_2MB pdpEntry;
+
+    NT_ASSERT(ViewIndex != 0);
+
+    view = &SharedVpData->NptViews[ViewIndex];
+    if (view->NumberOfPrivateDirectories >= SV_MAX_SPLIT_PAGE_TABLES)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    directory = static_cast<PPD_ENTRY_2MB>(SvAllocatePageAlingedPhysicalMemory(PAGE_SIZE));
+    if (directory == nullptr)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlCopyMemory(directory, view->Directories[DirectoryIndex], PAGE_SIZE);
+
+    pdpEntry = view->Root->PdpEntries[DirectoryIndex];
+    pdpEntry.Fields.PageFrameNumber = MmGetPhysicalAddress(directory).QuadPart >> PAGE_SHIFT;
+    InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&view->Root->PdpEntries[DirectoryIndex].AsUInt64),
+                          static_cast<LONG64>(pdpEntry.AsUInt64));
+    SvNoteNptModification(SharedVpData, ViewIndex);
+
+    view->Directories[DirectoryIndex] = directory;
+    view->NumberOfPrivateDirectories++;
+    InterlockedDecrement(&SharedVpData->DirectoryReferences[DirectoryIndex]);
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief          Finds the page table split by the NPT view.
+
+    @param[in]      View - The view to search.
+    @param[in]      PageFrameNumber - The page frame number of the page table.
+
+    @result         The page table, or nullptr when the view did not split it.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_same_
+static
+PPT_ENTRY_4KB
+SvFindNptPageTable (
+    _In_ const SV_NPT_VIEW* View,
+    _In_ UINT64 PageFrameNumber
+    )
+{
+    for (ULONG i = 0; i < View->NumberOfSplitPageTables; i++)
+    {
+        if ((MmGetPhysicalAddress(View->SplitPageTables[i]).QuadPart >> PAGE_SHIFT) ==
+            static_cast<LONGLONG>(PageFrameNumber))
+        {
+            return View->SplitPageTables[i];
+        }
+    }
+    return nullptr;
+}
+
+/*!
+    @brief          Splits a 2MB large page of nested page tables into 4KB pages.
+
+    @details        This function allocates a page table that translates the
+                    same range with the same permissions as the large page, and
+                    replaces the page directory entry to point to it. This must
+                    be called between SvBeginNptUpdate and SvEndNptUpdate.
+
+                    Views other than view 0 first copy the page directory when
+                    they share it, and the page table when it is view 0's, so
+                    that the returned page table can be modified without
+                    affecting other views. See SvCopyNptDirectory.
+
+    @param[in,out]  SharedVpData - The shared data that owns nested page tables.
+    @param[in]      ViewIndex - The index of the NPT view to split the page of.
+    @param[in]      GuestPa - A guest physical address within the large page.
+    @param[out]     PageTable - Receives the page table that translates GuestPa.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvSplitNptLargePage (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ ULONG ViewIndex,
+    _In_ UINT64 GuestPa,
+    _Outptr_ PPT_ENTRY_4KB* PageTable
+    )
+{
+    NTSTATUS status;
+    PSV_NPT_VIEW view;
+    ULONG directoryIndex;
+    PPD_ENTRY_2MB pdEntry;
+    PD_ENTRY_4KB newPdEntry;
+    PPT_ENTRY_4KB pageTable, sharedPageTable;
+    UINT64 basePfn;
+
+    view = &SharedVpData->NptViews[ViewIndex];
+    directoryIndex = (GuestPa >> 30) & 0x1ff;
+    if ((ViewIndex != 0) &&
+        (SvIsSharedNptDirectory(SharedVpData, view, directoryIndex) != FALSE))
+    {
+        status = SvCopyNptDirectory(SharedVpData, ViewIndex, directoryIndex);
+        if (!NT_SUCCESS(status))
+        {
+            return status;
+        }
+    }
+
+    sharedPageTable = nullptr;
+    pdEntry = &view->Directories[directoryIndex][(GuestPa >> 21) & 0x1ff];
+    if (pdEntry->Fields.LargePage == 0)
+    {
+        //
+        // Already split. Find the page table this entry points to. If it is
+        // not the view's, it is view 0's, inherited with the page directory.
+        //
+        newPdEntry.AsUInt64 = pdEntry->AsUInt64;
+        pageTable = SvFindNptPageTable(view, newPdEntry.Fields.PageFrameNumber);
+        if (pageTable != nullptr)
+        {
+            *PageTable = pageTable;
+            return STATUS_SUCCESS;
+        }
+        if (ViewIndex != 0)
+        {
+            sharedPageTable = SvFindNptPageTable(&SharedVpData->NptViews[0],
+                                                 newPdEntry.Fields.PageFrameNumber);
+        }
+        if (sharedPageTable == nullptr)
+        {
+            NT_ASSERT(FALSE);
+            return STATUS_NOT_FOUND;
+        }
+    }
+
+    if (view->NumberOfSplitPageTables >= SV_MAX_SPLIT_PAGE_TABLES)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    pageTable = static_cast<PPT_ENTRY_4KB>(SvAllocatePageAlingedPhysicalMemory(PAGE_SIZE));
+    if (pageTable == nullptr)
+    {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (sharedPageTable != nullptr)
+    {
+        RtlCopyMemory(pageTable, sharedPageTable, PAGE_SIZE);
+    }
+    else
+    {
+        //
+        // Build 512 entries that translate the same 2MB with the same
+        // permissions as the large page.
+        //
+        basePfn = pdEntry->Fields.PageFrameNumber * 512;
+        for (ULONG64 i = 0; i < 512; i++)
+        {
+            pageTable[i].Fields.PageFrameNumber = basePfn + i;
+            pageTable[i].Fields.Valid = pdEntry->Fields.Valid;
+            pageTable[i].Fields.Write = pdEntry->Fields.Write;
+            pageTable[i].Fields.User = pdEntry->Fields.User;
+            pageTable[i].Fields.NoExecute = pdEntry->Fields.NoExecute;
+        }
+    }
+
+    //
+    // Then, replace the large page with the page table with a single write, so
+    // the processor never sees a partially updated entry.
+    //
+    newPdEntry.AsUInt64 = 0;
+    newPdEntry.Fields.PageFrameNumber = MmGetPhysicalAddress(pageTable).QuadPart >> PAGE_SHIFT;
+    newPdEntry.Fields.Valid = 1;
+    newPdEntry.Fields.Write = 1;
+    newPdEntry.Fields.User = 1;
+    InterlockedExchange64(reinterpret_cast<volatile LONG64*>(&pdEntry->AsUInt64),
+                          static_cast<LONG64>(newPdEntry.AsUInt64));
+    SvNoteNptModification(SharedVpData, ViewIndex);
+
+    view->SplitPageTables[view->NumberOfSplitPageTables++] = pageTable;
+    *PageTable = pageTable;
+    return STATUS_SUCCESS;
+}
+
+/*!
+    @brief          Traps accesses to the MMIO range and emulates them.
+
+    @details        This function makes the range not-present in nested page
+                    tables of all NPT views, so that any access to it causes
+                    #NPF, which is handled by SvHandleNestedPageFault. The range
+                    is split into 4KB pages as needed, so that the rest of the
+                    2MB pages stay accessible without #VMEXIT.
+
+                    Handler is called to perform each access. When it is NULL,
+                    accesses are passed through to the device and only counted.
+
+                    This function returns after all processors stopped using
+                    translations of the range.
+
+    @param[in,out]  SharedVpData - The shared data that owns nested page tables.
+    @param[in]      GuestPa - A page aligned guest physical address of the range.
+                    The range must not overlap physical memory.
+    @param[in]      Size - A size of the range in bytes. Must be page aligned.
+    @param[in]      Handler - A handler of accesses, or NULL for pass-through.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvRegisterMmioRange (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ UINT64 GuestPa,
+    _In_ UINT64 Size,
+    _In_opt_ PSV_MMIO_HANDLER Handler
+    )
+{
+    NTSTATUS status;
+    PSV_MMIO_RANGE range;
+    PPT_ENTRY_4KB pageTable;
+    PHYSICAL_ADDRESS physicalAddress;
+
+    if ((Size == 0) ||
+        (BYTE_OFFSET(GuestPa) != 0) ||
+        (BYTE_OFFSET(Size) != 0) ||
+        (GuestPa + Size < GuestPa) ||
+        (GuestPa + Size > 512ULL * 1024 * 1024 * 1024))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    //
+    // Trapping RAM would emulate every access to it through a non-cached
+    // mapping, and pages of the range may back the driver itself.
+    //
+    if (SvOverlapsPhysicalMemory(SharedVpData, GuestPa, Size) != FALSE)
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SvBeginNptUpdate(SharedVpData);
+
+    if (SharedVpData->NumberOfMmioRanges >= SV_MAX_MMIO_RANGES)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    range = &SharedVpData->MmioRanges[SharedVpData->NumberOfMmioRanges];
+    physicalAddress.QuadPart = static_cast<LONGLONG>(GuestPa);
+    range->MappedVa = MmMapIoSpace(physicalAddress, Size, MmNonCached);
+    if (range->MappedVa == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    range->GuestPa = GuestPa;
+    range->Size = Size;
+    range->Handler = (Handler != nullptr) ? Handler : SvPassThroughMmioAccess;
+    range->ReadCount = range->WriteCount = 0;
+
+    //
+    // Publish the range before making it not-present, so that #NPF on the
+    // range always finds it.
+    //
+    InterlockedIncrement(&SharedVpData->NumberOfMmioRanges);
+
+    for (UINT64 pa = GuestPa; pa < GuestPa + Size; pa += PAGE_SIZE)
+    {
+        for (ULONG i = 0; i < static_cast<ULONG>(SharedVpData->NumberOfNptViews); i++)
+        {
+            //
+            // Views sharing the page directory with view 0 see the change made
+            // to view 0, which is always the first.
+            //
+            if ((i != 0) &&
+                (SvIsSharedNptDirectory(SharedVpData,
+                                        &SharedVpData->NptViews[i],
+                                        (pa >> 30) & 0x1ff) != FALSE))
+            {
+                SvNoteNptModification(SharedVpData, i);
+                continue;
+            }
+
+            status = SvSplitNptLargePage(SharedVpData, i, pa, &pageTable);
+            if (!NT_SUCCESS(status))
+            {
+                //
+                // Leave the range registered. Pages already made not-present
+                // are still emulated correctly, and the rest are simply
+                // accessed without #VMEXIT.
+                //
+                goto Exit;
+            }
+            pageTable[(pa >> PAGE_SHIFT) & 0x1ff].Fields.Valid = 0;
+            SvNoteNptModification(SharedVpData, i);
+        }
+    }
+    status = STATUS_SUCCESS;
+
+Exit:
+    SvEndNptUpdate(SharedVpData, TRUE);
+    return status;
+}
+
+/*!
+    @brief          Creates an NPT view.
+
+    @details        The view maps all memory as view 0 does, with registered
+                    MMIO ranges made not-present, and is tagged with a newly
+                    allocated ASID. It shares all page directories with view 0
+                    until they are modified. Memory used by views is bounded by
+                    SV_MAX_NPT_VIEWS, each with its PML4 and PDP, and up to
+                    SV_MAX_SPLIT_PAGE_TABLES page directories and as many page
+                    tables.
+
+                    No processor uses the view until it is published, so this
+                    function does not wait for processors.
+
+    @param[in,out]  SharedVpData - The shared data that owns NPT views.
+    @param[out]     ViewIndex - Receives the index of the view.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvCreateNptView (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _Out_ PULONG ViewIndex
+    )
+{
+    NTSTATUS status;
+    PSV_NPT_VIEW view;
+    ULONG viewIndex;
+
+    *ViewIndex = 0;
+    view = nullptr;
+
+    SvBeginNptUpdate(SharedVpData);
+
+    viewIndex = static_cast<ULONG>(SharedVpData->NumberOfNptViews);
+    if (viewIndex >= SV_MAX_NPT_VIEWS)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    view = &SharedVpData->NptViews[viewIndex];
+    view->Root = static_cast<PSV_NPT_ROOT>(SvAllocateContiguousMemory(sizeof(SV_NPT_ROOT)));
+    if (view->Root == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    view->NptBasePa = MmGetPhysicalAddress(view->Root).QuadPart;
+    SvShareNptDirectories(SharedVpData, view);
+
+    //
+    // Allocate the ASID last, as ASIDs are never freed.
+    //
+    view->Asid = SvAllocateAsid(SharedVpData);
+    if (view->Asid == 0)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    *ViewIndex = viewIndex;
+    InterlockedIncrement(&SharedVpData->NumberOfNptViews);
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (!NT_SUCCESS(status) && (view != nullptr))
+    {
+        SvFreeNptView(SharedVpData, view);
+    }
+    SvEndNptUpdate(SharedVpData, FALSE);
+    return status;
+}
+
+/*!
+    @brief          Denies access to the range in the NPT view.
+
+    @details        Pages of the range are split into 4KB pages as needed, and
+                    access to them is denied as specified, so that it causes
+                    #NPF and the processor falls back to view 0. See
+                    SvHandleNestedPageFault. Pages of MMIO ranges stay
+                    not-present. View 0 cannot be protected, as it is where
+                    denied accesses are retried.
+
+                    This function returns after all processors stopped using
+                    translations of the range.
+
+    @param[in,out]  SharedVpData - The shared data that owns NPT views.
+    @param[in]      ViewIndex - The index of the view to protect the range in.
+    @param[in]      GuestPa - A page aligned guest physical address of the range.
+    @param[in]      Size - A size of the range in bytes. Must be page aligned.
+    @param[in]      DeniedAccess - SV_NPT_VIEW_DENY_* to deny, or zero to allow
+                    any access.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_min_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvProtectNptView (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ ULONG ViewIndex,
+    _In_ UINT64 GuestPa,
+    _In_ UINT64 Size,
+    _In_ ULONG DeniedAccess
+    )
+{
+    NTSTATUS status;
+    PPT_ENTRY_4KB pageTable;
+    PT_ENTRY_4KB entry;
+
+    if ((ViewIndex == 0) ||
+        (ViewIndex >= static_cast<ULONG>(SharedVpData->NumberOfNptViews)) ||
+        ((DeniedAccess & ~(SV_NPT_VIEW_DENY_WRITE |
+                           SV_NPT_VIEW_DENY_EXECUTE |
+                           SV_NPT_VIEW_DENY_ALL)) != 0) ||
+        (Size == 0) ||
+        (BYTE_OFFSET(GuestPa) != 0) ||
+        (BYTE_OFFSET(Size) != 0) ||
+        (GuestPa + Size < GuestPa) ||
+        (GuestPa + Size > 512ULL * 1024 * 1024 * 1024))
+    {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SvBeginNptUpdate(SharedVpData);
+
+    for (UINT64 pa = GuestPa; pa < GuestPa + Size; pa += PAGE_SIZE)
+    {
+        if (SvFindMmioRange(SharedVpData, pa) != nullptr)
+        {
+            continue;
+        }
+
+        status = SvSplitNptLargePage(SharedVpData, ViewIndex, pa, &pageTable);
+        if (!NT_SUCCESS(status))
+        {
+            goto Exit;
+        }
+
+        //
+        // Update the entry with a single write, as the view may be in use.
+        //
+        entry = pageTable[(pa >> PAGE_SHIFT) & 0x1ff];
+        entry.Fields.Valid = ((DeniedAccess & SV_NPT_VIEW_DENY_ALL) == 0);
+        entry.Fields.Write = ((DeniedAccess & (SV_NPT_VIEW_DENY_WRITE | SV_NPT_VIEW_DENY_ALL)) == 0);
+        entry.Fields.NoExecute = ((DeniedAccess & SV_NPT_VIEW_DENY_EXECUTE) != 0);
+        pageTable[(pa >> PAGE_SHIFT) & 0x1ff].AsUInt64 = entry.AsUInt64;
+        SvNoteNptModification(SharedVpData, ViewIndex);
+    }
+    status = STATUS_SUCCESS;
+
+Exit:
+    SvEndNptUpdate(SharedVpData, TRUE);
+    return status;
+}
+
+/*!
+    @brief          Replaces the intercept policy without de-virtualizing.
+
+    @details        This function validates the policy, builds its MSRPM and
+                    publishes it with a new generation. Processors switch to it
+                    at their next #VMEXIT. See SvSynchronizeInterceptPolicy.
+
+                    Only handlers compiled for SV_INTERCEPT_POLICY exist, so the
+                    policy may remove intercepts of it but never add new ones,
+                    except for faults and MSRs in the ranges the MSRPM covers.
+                    Intercepts the hypervisor requires cannot be removed.
+
+                    This function waits for all processors to pick up the
+                    policy for up to SV_POLICY_CONVERGENCE_TIMEOUT_MS, and then
+                    forces #VMEXIT on the processors that have not, in the same
+                    way as SvEndNptUpdate does. The old policy is freed after
+                    that, as no processor references its MSRPM anymore.
+
+                    The caller must hold the virtualization lock.
+
+    @param[in,out]  SharedVpData - The shared data to publish the policy to.
+    @param[in]      Input - The policy to set.
+    @param[out]     Output - Receives the generation and how long it took for
+                    all processors to pick up the policy.
+
+    @result         STATUS_SUCCESS on success; otherwise, an appropriate error
+                    code.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvSetInterceptPolicy (
+    _Inout_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData,
+    _In_ const SV_SET_INTERCEPT_POLICY_INPUT* Input,
+    _Out_ PSV_SET_INTERCEPT_POLICY_OUTPUT Output
+    )
+{
+    NTSTATUS status;
+    PSV_POLICY_VERSION policy, oldPolicy;
+    UINT32 offset;
+    ULONG numberOfProcessors;
+    UINT64 startTime, cycles;
+    LARGE_INTEGER interval;
+    BOOLEAN forced;
+
+    RtlZeroMemory(Output, sizeof(*Output));
+    policy = nullptr;
+
+    if (((Input->InterceptMisc1 & SV_REQUIRED_INTERCEPTS_MISC1) != SV_REQUIRED_INTERCEPTS_MISC1) ||
+        ((Input->InterceptMisc2 & SV_REQUIRED_INTERCEPTS_MISC2) != SV_REQUIRED_INTERCEPTS_MISC2) ||
+        ((Input->InterceptMisc1 & ~SV_INTERCEPT_POLICY::InterceptMisc1) != 0) ||
+        ((Input->InterceptMisc2 & ~SV_INTERCEPT_POLICY::InterceptMisc2) != 0) ||
+        ((Input->InterceptException & ~SV_INTERCEPTABLE_EXCEPTIONS) != 0) ||
+        (Input->NumberOfReadInterceptedMsrs > SV_MAX_POLICY_MSRS) ||
+        (Input->NumberOfWriteInterceptedMsrs > SV_MAX_POLICY_MSRS))
+    {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+    for (UINT32 i = 0; i < Input->NumberOfReadInterceptedMsrs; i++)
+    {
+        if (SvGetMsrPermissionsMapOffset(Input->ReadInterceptedMsrs[i], &offset) == FALSE)
+        {
+            status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+    for (UINT32 i = 0; i < Input->NumberOfWriteInterceptedMsrs; i++)
+    {
+        if (SvGetMsrPermissionsMapOffset(Input->WriteInterceptedMsrs[i], &offset) == FALSE)
+        {
+            status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    policy = static_cast<PSV_POLICY_VERSION>(ExAllocatePoolWithTag(
+                                            NonPagedPool, sizeof(*policy), 'MVSS'));
+    if (policy == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    policy->MsrPermissionsMap = SvAllocateContiguousMemory(SVM_MSR_PERMISSIONS_MAP_SIZE);
+    if (policy->MsrPermissionsMap == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Intercepts of SV_INTERCEPT_POLICY, such as write to EFER, are always
+    // kept in addition to the requested ones.
+    //
+    SvBuildMsrPermissionsMap<SV_INTERCEPT_POLICY>(policy->MsrPermissionsMap);
+    for (UINT32 i = 0; i < Input->NumberOfReadInterceptedMsrs; i++)
+    {
+        NT_VERIFY(SvInterceptMsr(policy->MsrPermissionsMap, Input->ReadInterceptedMsrs[i], FALSE));
+    }
+    for (UINT32 i = 0; i < Input->NumberOfWriteInterceptedMsrs; i++)
+    {
+        NT_VERIFY(SvInterceptMsr(policy->MsrPermissionsMap, Input->WriteInterceptedMsrs[i], TRUE));
+    }
+
+    oldPolicy = SharedVpData->PolicyVersion;
+    policy->Generation = (oldPolicy != nullptr) ? oldPolicy->Generation + 1 : 1;
+    policy->InterceptMisc1 = Input->InterceptMisc1;
+    policy->InterceptMisc2 = Input->InterceptMisc2;
+    policy->InterceptException = Input->InterceptException;
+    policy->MsrpmBasePa = MmGetPhysicalAddress(policy->MsrPermissionsMap).QuadPart;
+
+    //
+    // Publish the policy, and wait for processors to pick it up at their own
+    // #VMEXIT. Most processors exit often enough that this takes less than
+    // a timer tick; idle ones are forced to.
+    //
+    numberOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    InterlockedExchange(&SharedVpData->PolicyPickups, 0);
+    startTime = __rdtsc();
+    InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(&SharedVpData->PolicyVersion),
+                               policy);
+
+    forced = FALSE;
+    interval.QuadPart = -10000;     // 1ms
+    for (ULONG i = 0; i < SV_POLICY_CONVERGENCE_TIMEOUT_MS; i++)
+    {
+        if (static_cast<ULONG>(SharedVpData->PolicyPickups) >= numberOfProcessors)
+        {
+            break;
+        }
+        NT_VERIFY(NT_SUCCESS(KeDelayExecutionThread(KernelMode, FALSE, &interval)));
+    }
+    if (static_cast<ULONG>(SharedVpData->PolicyPickups) < numberOfProcessors)
+    {
+        KeIpiGenericCall(SvForceVmExit, 0);
+        forced = TRUE;
+    }
+    NT_ASSERT(static_cast<ULONG>(SharedVpData->PolicyPickups) >= numberOfProcessors);
+    cycles = __rdtsc() - startTime;
+
+    if (oldPolicy != nullptr)
+    {
+        SvFreeContiguousMemory(oldPolicy->MsrPermissionsMap);
+        ExFreePoolWithTag(oldPolicy, 'MVSS');
+    }
+    policy = nullptr;
+
+    SvBeginSeqlockWrite(&g_Statistics->Sequence);
+    g_Statistics->PolicyConvergenceCycles = cycles;
+    SvEndSeqlockWrite(&g_Statistics->Sequence);
+
+    SvDebugPrint("Intercept policy %lld used by all processors in %llu cycles%s.\n",
+                 SharedVpData->PolicyVersion->Generation,
+                 cycles,
+                 (forced != FALSE) ? " (forced)" : "");
+
+    Output->Generation = static_cast<UINT64>(SharedVpData->PolicyVersion->Generation);
+    Output->ConvergenceCycles = cycles;
+    Output->Forced = forced;
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (policy != nullptr)
+    {
+        if (policy->MsrPermissionsMap != nullptr)
+        {
+            SvFreeContiguousMemory(policy->MsrPermissionsMap);
+        }
+        ExFreePoolWithTag(policy, 'MVSS');
+    }
+    return status;
+}
+
+/*!
+    @brief      Test whether the current processor support the SVM feature.
+
+    @details    This function tests whether the current processor has enough
+                features to run SimpleSvm, especially about SVM features.
+
+    @result     TRUE if the processor supports the SVM feature; otherwise, FALSE.
+ */
+_IRQL_requires_same_
+_Check_return_
+static
+BOOLEAN
+SvIsSvmSupported (
+    VOID
+    )
+{
+    BOOLEAN svmSupported;
+    int registers[4];   // EAX, EBX, ECX, and EDX
+    ULONG64 vmcr;
+
+    svmSupported = FALSE;
+
+    //
+    // Test if the current processor is AMD one. An AMD processor should return
+    // "AuthenticAMD" from CPUID function 0. See "Function 0h-Maximum Standard
+    // Function Number and Vendor String".
+    //
+    __cpuid(registers, CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING);
+    if ((registers[1] != 'htuA') ||
+        (registers[3] != 'itne') ||
+        (registers[2] != 'DMAc'))
+    {
+        goto Exit;
+    }
+
+    //
+    // Test if the SVM feature is supported by the current processor. See
+    // "Enabling SVM" and "CPUID Fn8000_0001_ECX Feature Identifiers".
+    //
+    __cpuid(registers, CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX);
+    if ((registers[2] & CPUID_FN8000_0001_ECX_SVM) == 0)
+    {
+        goto Exit;
+    }
+
+    //
+    // Test if the Nested Page Tables feature is supported by the current
+    // processor. See "Enabling Nested Paging" and "CPUID Fn8000_000A_EDX SVM
+    // Feature Identification".
+    //
+    __cpuid(registers, CPUID_SVM_FEATURES);
+    if ((registers[3] & CPUID_FN8000_000A_EDX_NP) == 0)
+    {
+        goto Exit;
+    }
+
+    //
+    // Test if the SVM feature can be enabled. When VM_CR.SVMDIS is set,
+    // EFER.SVME cannot be 1; therefore, SVM cannot be enabled. When
+    // VM_CR.SVMDIS is clear, EFER.SVME can be written normally and SVM can be
+    // enabled. See "Enabling SVM".
+    //
+    vmcr = __readmsr(SVM_MSR_VM_CR);
+    if ((vmcr & SVM_VM_CR_SVMDIS) != 0)
+    {
+        goto Exit;
+    }
+
+    svmSupported = TRUE;
+
+Exit:
+    return svmSupported;
+}
+
+/*!
+    @brief      Updates the statistics header.
+
+    @details    This function must be called with g_VirtualizationLock held,
+                which makes the caller the only writer of the header.
+
+    @details    Memory footprint is also reported to the kernel debugger, by
+                allocation type.
+
+    @param[in]  SharedVpData - The shared data of virtualized processors.
+    @param[in]  BringUpCycles - TSC cycles it took to virtualize all processors,
+                or zero to keep the current value.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_IRQL_requires_same_
+static
+VOID
+SvUpdateStatisticsHeader (
+    _In_ const SHARED_VIRTUAL_PROCESSOR_DATA* SharedVpData,
+    _In_ UINT64 BringUpCycles
+    )
+{
+    UINT64 nestedPageTables, splitPageTables, nestedMaps, extendedState, numberOfProcessors;
+    ULONG numberOfNptViews;
+    UINT32 sharedPages[SV_MAX_NPT_VIEWS], privatePages[SV_MAX_NPT_VIEWS];
+    const SV_NPT_VIEW* view;
+
+    numberOfProcessors = g_Statistics->NumberOfProcessors;
+    numberOfNptViews = static_cast<ULONG>(SharedVpData->NumberOfNptViews);
+
+    //
+    // Views other than view 0 allocate their PML4 and PDP on contiguous
+    // memory, and page directories they copied along with split page tables
+    // from the pool.
+    //
+    nestedPageTables = sizeof(SV_NESTED_PAGE_TABLES) +
+                       (numberOfNptViews - 1) * sizeof(SV_NPT_ROOT);
+    splitPageTables = 0;
+    RtlZeroMemory(sharedPages, sizeof(sharedPages));
+    RtlZeroMemory(privatePages, sizeof(privatePages));
+    for (ULONG i = 0; i < numberOfNptViews; i++)
+    {
+        view = &SharedVpData->NptViews[i];
+        splitPageTables += (view->NumberOfSplitPageTables +
+                            view->NumberOfPrivateDirectories) * PAGE_SIZE;
+
+        privatePages[i] = BYTES_TO_PAGES(sizeof(SV_NPT_ROOT)) +
+                          view->NumberOfPrivateDirectories +
+                          view->NumberOfSplitPageTables;
+        for (ULONG j = 0; j < RTL_NUMBER_OF(view->Directories); j++)
+        {
+            if (SvIsSharedNptDirectory(SharedVpData, view, j) == FALSE)
+            {
+                continue;
+            }
+            if (SharedVpData->DirectoryReferences[j] > 1)
+            {
+                sharedPages[i]++;
+            }
+            else
+            {
+                privatePages[i]++;
+            }
+        }
+    }
+    nestedMaps = (SharedVpData->NestedGuestAsid != 0) ?
+                 SVM_MSR_PERMISSIONS_MAP_SIZE + SV_IO_PERMISSIONS_MAP_SIZE : 0;
+    extendedState = ROUND_TO_PAGES(SharedVpData->ExtendedStateSize);
+
+    SvBeginSeqlockWrite(&g_Statistics->Sequence);
+    if (BringUpCycles != 0)
+    {
+        g_Statistics->BringUpCycles = BringUpCycles;
+    }
+    g_Statistics->SharedFootprint = sizeof(*SharedVpData) +
+                                    nestedPageTables +
+                                    SVM_MSR_PERMISSIONS_MAP_SIZE +
+                                    SV_IO_PERMISSIONS_MAP_SIZE +
+                                    splitPageTables;
+    g_Statistics->PerProcessorFootprint = sizeof(VIRTUAL_PROCESSOR_DATA) + nestedMaps + extendedState;
+    g_Statistics->PoolFootprint = sizeof(*SharedVpData) +
+                                  splitPageTables +
+                                  (sizeof(VIRTUAL_PROCESSOR_DATA) + extendedState) * numberOfProcessors +
+                                  g_Statistics->StatisticsFootprint;
+    g_Statistics->ContiguousFootprint = nestedPageTables +
+                                        SVM_MSR_PERMISSIONS_MAP_SIZE +
+                                        SV_IO_PERMISSIONS_MAP_SIZE +
+                                        nestedMaps * numberOfProcessors +
+                                        ((SharedVpData->PolicyVersion != nullptr) ?
+                                                SVM_MSR_PERMISSIONS_MAP_SIZE : 0);
+    g_Statistics->NptFootprint = nestedPageTables + splitPageTables;
+    g_Statistics->HostStackSize = SV_HOST_STACK_SIZE;
+    g_Statistics->Cr3SamplingPeriod = (SharedVpData->DecodeAssistsSupported != FALSE) ?
+                                      SV_INTERCEPT_POLICY::Cr3SamplingPeriod : 0;
+    g_Statistics->Cr3SamplingWindowCycles = SV_CR3_SAMPLING_WINDOW_CYCLES;
+    g_Statistics->InterruptSamplingPeriod = SV_INTERCEPT_POLICY::InterruptSamplingPeriod;
+    g_Statistics->InterruptSamplingWindowCycles = SV_INTERRUPT_SAMPLING_WINDOW_CYCLES;
+    g_Statistics->IdleAccounting = SV_INTERCEPT_POLICY::AccountIdle ? 1 : 0;
+    g_Statistics->ExtendedStateSize = SharedVpData->ExtendedStateSize;
+    g_Statistics->XsaveoptSupported = (SharedVpData->XsaveoptSupported != FALSE) ? 1 : 0;
+    if constexpr (SV_INTERCEPT_POLICY::EnforceExitBudgets)
+    {
+        RtlCopyMemory(g_Statistics->ExitBudgets, g_ExitBudgets, sizeof(g_ExitBudgets));
+        g_Statistics->ExitBudgetWindowCycles = SV_EXIT_BUDGET_WINDOW_CYCLES;
+        g_Statistics->ExitBackoffCycles = SV_EXIT_BACKOFF_CYCLES;
+    }
+    g_Statistics->PolicyGeneration = (SharedVpData->PolicyVersion != nullptr) ?
+                                     SharedVpData->PolicyVersion->Generation : 0;
+    g_Statistics->NumberOfNptViews = numberOfNptViews;
+    RtlCopyMemory(g_Statistics->NptViewSharedPages, sharedPages, sizeof(sharedPages));
+    RtlCopyMemory(g_Statistics->NptViewPrivatePages, privatePages, sizeof(privatePages));
+    SvEndSeqlockWrite(&g_Statistics->Sequence);
+
+    SvDebugPrint("Footprint: pool %llu (NPT %llu in %lu views), contiguous %llu, per processor %llu (host stack %lu) bytes\n",
+                 g_Statistics->PoolFootprint,
+                 g_Statistics->NptFootprint,
+                 numberOfNptViews,
+                 g_Statistics->ContiguousFootprint,
+                 g_Statistics->PerProcessorFootprint,
+                 static_cast<ULONG>(SV_HOST_STACK_SIZE));
+}
+
+/*!
+    @brief      Virtualizes all processors on the system.
+
+    @details    This function attempts to virtualize all processors on the
+                system, and returns STATUS_SUCCESS if all processors are
+                successfully virtualized. If any processor is not virtualized,
+                this function de-virtualizes all processors and returns an error
+                code.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_IRQL_requires_same_
+_Check_return_
+static
+NTSTATUS
+SvVirtualizeAllProcessors (
+    VOID
+    )
+{
+    NTSTATUS status;
+    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
+    ULONG numOfProcessorsCompleted;
+    UINT64 startTime;
+
+    startTime = __rdtsc();
+    sharedVpData = nullptr;
+    numOfProcessorsCompleted = 0;
+
+    //
+    // Test whether the current processor supports all required SVM features. If
+    // not, exit as error.
     //
-    __svm_vmsave(guestVmcbPa.QuadPart);
+    if (SvIsSvmSupported() == FALSE)
+    {
+        SvDebugPrint("SVM is not fully supported on this processor.\n");
+        status = STATUS_HV_FEATURE_UNAVAILABLE;
+        goto Exit;
+    }
 
     //
-    // Store data to stack so that the host (hypervisor) can use those values.
+    // Allocate a data structure shared across all processors. This data is
+    // page tables used for Nested Page Tables.
     //
-    VpData->HostStackLayout.Reserved1 = MAXUINT64;
-    VpData->HostStackLayout.SharedVpData = SharedVpData;
-    VpData->HostStackLayout.Self = VpData;
-    VpData->HostStackLayout.HostVmcbPa = hostVmcbPa.QuadPart;
-    VpData->HostStackLayout.GuestVmcbPa = guestVmcbPa.QuadPart;
+#pragma prefast(push)
+#pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
+    sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(
+        SvAllocatePageAlingedPhysicalMemory(sizeof(SHARED_VIRTUAL_PROCESSOR_DATA)));
+#pragma prefast(pop)
+    if (sharedVpData == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
 
     //
-    // Set an address of the host state area to VM_HSAVE_PA MSR. The processor
-    // saves some of the current state on VMRUN and loads them on #VMEXIT. See
-    // "VM_HSAVE_PA MSR (C001_0117h)".
+    // Allocate nested page tables onto contiguous physical memory.
     //
-    __writemsr(SVM_MSR_VM_HSAVE_PA, hostStateAreaPa.QuadPart);
+    sharedVpData->Npt = static_cast<PSV_NESTED_PAGE_TABLES>(
+                        SvAllocateContiguousMemory(sizeof(SV_NESTED_PAGE_TABLES)));
+    if (sharedVpData->Npt == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    sharedVpData->NptBasePa = MmGetPhysicalAddress(sharedVpData->Npt).QuadPart;
+
+    //
+    // Allocate MSR permissions map (MSRPM) onto contiguous physical memory.
+    //
+    sharedVpData->MsrPermissionsMap = SvAllocateContiguousMemory(
+                                                    SVM_MSR_PERMISSIONS_MAP_SIZE);
+    if (sharedVpData->MsrPermissionsMap == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Allocate I/O permissions map (IOPM) onto contiguous physical memory.
+    //
+    sharedVpData->IoPermissionsMap = SvAllocateContiguousMemory(
+                                                    SV_IO_PERMISSIONS_MAP_SIZE);
+    if (sharedVpData->IoPermissionsMap == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Snapshot physical memory ranges. Guest physical memory is accessed on
+    // behalf of the guest only within them.
+    //
+    sharedVpData->PhysicalMemoryRanges = MmGetPhysicalMemoryRanges();
+    if (sharedVpData->PhysicalMemoryRanges == nullptr)
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    ExInitializeFastMutex(&sharedVpData->NptUpdateLock);
+
+    //
+    // Allocate an ASID for the guest.
+    //
+    status = SvInitializeSvmFeatures(sharedVpData);
+    if (!NT_SUCCESS(status))
+    {
+        SvDebugPrint("No ASID is available.\n");
+        goto Exit;
+    }
+
+    //
+    // Build nested page table, MSRPM and IOPM. The IOPM is left cleared when
+    // the intercept policy does not intercept I/O ports.
+    //
+    SvBuildNestedPageTables(sharedVpData->Npt, sharedVpData->NptBasePa);
+    sharedVpData->NptViews[0].Root = &sharedVpData->Npt->Root;
+    sharedVpData->NptViews[0].NptBasePa = sharedVpData->NptBasePa;
+    SvShareNptDirectories(sharedVpData, &sharedVpData->NptViews[0]);
+    sharedVpData->NumberOfNptViews = 1;
+    SvBuildMsrPermissionsMap<SV_INTERCEPT_POLICY>(sharedVpData->MsrPermissionsMap);
+    if constexpr ((SV_INTERCEPT_POLICY::InterceptMisc1 & SVM_INTERCEPT_MISC1_IOIO_PROT) != 0)
+    {
+        SvBuildIoPermissionsMap(sharedVpData);
+    }
+
+    //
+    // Execute SvVirtualizeProcessor on and virtualize each processor one-by-one.
+    // How many processors were successfully virtualized is stored in the third
+    // parameter.
+    //
+    // STATUS_SUCCESS is returned if all processor are successfully virtualized.
+    // When any error occurs while virtualizing processors, this function does
+    // not attempt to virtualize the rest of processor. Therefore, only part of
+    // processors on the system may have been virtualized on error. In this case,
+    // it is a caller's responsibility to clean-up (de-virtualize) such
+    // processors.
+    //
+    status = SvExecuteOnEachProcessor(SvVirtualizeProcessor,
+                                      sharedVpData,
+                                      &numOfProcessorsCompleted);
+    if (!NT_SUCCESS(status))
+    {
+        goto Exit;
+    }
+
+    //
+    // Make the shared data available to the control device, and publish how
+    // long it took to virtualize all processors and how much memory is used.
+    //
+    g_SharedVpData = sharedVpData;
+    SvUpdateStatisticsHeader(sharedVpData, __rdtsc() - startTime);
+
+Exit:
+    if (!NT_SUCCESS(status))
+    {
+        //
+        // On failure, after successful allocation of shared data.
+        //
+        if (numOfProcessorsCompleted != 0)
+        {
+            //
+            // If one or more processors have already been virtualized,
+            // de-virtualize any of those processors, and free shared data.
+            //
+            NT_ASSERT(sharedVpData != nullptr);
+            SvDevirtualizeAllProcessors();
+        }
+        else
+        {
+            //
+            // If none of processors has not been virtualized, simply free
+            // shared data.
+            //
+            if (sharedVpData != nullptr)
+            {
+                SvFreeSharedVirtualProcessorData(sharedVpData);
+            }
+        }
+    }
+    return status;
+}
+
+/*!
+    @brief      Acquires g_VirtualizationLock exclusively.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Acquires_lock_(g_VirtualizationLock)
+static
+VOID
+SvAcquireVirtualizationLock (
+    VOID
+    )
+{
+    KeEnterCriticalRegion();
+    ExAcquireResourceExclusiveLite(&g_VirtualizationLock, TRUE);
+}
+
+/*!
+    @brief      Releases g_VirtualizationLock.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Releases_lock_(g_VirtualizationLock)
+static
+VOID
+SvReleaseVirtualizationLock (
+    VOID
+    )
+{
+    ExReleaseResourceLite(&g_VirtualizationLock);
+    KeLeaveCriticalRegion();
+}
+
+/*!
+    @brief      Allocates the statistics region and the MDL to map it.
+
+    @details    The region has a header page and a page for each processor that
+                can ever be present on the system.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvAllocateStatistics (
+    VOID
+    )
+{
+    NTSTATUS status;
+    ULONG numberOfProcessors;
+    SIZE_T size;
+
+    numberOfProcessors = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    size = (1ULL + numberOfProcessors * 2ULL) * SV_STATISTICS_PAGE_SIZE;
+
+    g_Statistics = static_cast<PSV_STATISTICS_HEADER>(
+                                    SvAllocatePageAlingedPhysicalMemory(size));
+    if (g_Statistics == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    g_StatisticsMdl = IoAllocateMdl(g_Statistics,
+                                    static_cast<ULONG>(size),
+                                    FALSE,
+                                    FALSE,
+                                    nullptr);
+    if (g_StatisticsMdl == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    MmBuildMdlForNonPagedPool(g_StatisticsMdl);
+
+    g_Statistics->Magic = SV_STATISTICS_MAGIC;
+    g_Statistics->Version = SV_STATISTICS_VERSION;
+    g_Statistics->NumberOfProcessors = numberOfProcessors;
+    g_Statistics->StatisticsFootprint = size;
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (!NT_SUCCESS(status) && (g_Statistics != nullptr))
+    {
+        SvFreePageAlingedPhysicalMemory(g_Statistics);
+        g_Statistics = nullptr;
+    }
+    return status;
+}
+
+/*!
+    @brief      Frees the statistics region allocated by SvAllocateStatistics.
+
+    @details    This function must be called only after all mappings are gone,
+                ie, the control device has no open handle.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static
+VOID
+SvFreeStatistics (
+    VOID
+    )
+{
+    if (g_StatisticsMdl != nullptr)
+    {
+        IoFreeMdl(g_StatisticsMdl);
+        g_StatisticsMdl = nullptr;
+    }
+    if (g_Statistics != nullptr)
+    {
+        SvFreePageAlingedPhysicalMemory(g_Statistics);
+        g_Statistics = nullptr;
+    }
+}
+
+/*!
+    @brief      Maps the statistics region into the current process.
+
+    @details    The region is mapped read-only and non-executable. The mapping
+                is associated with FileObject and unmapped on IRP_MJ_CLEANUP.
+
+    @param[in]  FileObject - The file object the request was issued with.
+    @param[out] Output - Receives the address and size of the mapping.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+_Check_return_
+static
+NTSTATUS
+SvMapStatistics (
+    _Inout_ PFILE_OBJECT FileObject,
+    _Out_ PSV_MAP_STATISTICS_OUTPUT Output
+    )
+{
+    NTSTATUS status;
+    PSV_STATISTICS_MAPPING mapping;
+    PVOID userVa;
+
+    mapping = static_cast<PSV_STATISTICS_MAPPING>(FileObject->FsContext);
+    if (mapping != nullptr)
+    {
+        if (mapping->Process != PsGetCurrentProcess())
+        {
+            status = STATUS_ACCESS_DENIED;
+            goto Exit;
+        }
+        userVa = mapping->UserVa;
+        status = STATUS_SUCCESS;
+        goto Exit;
+    }
+
+    mapping = static_cast<PSV_STATISTICS_MAPPING>(
+                ExAllocatePoolWithTag(NonPagedPool, sizeof(*mapping), 'MVSS'));
+    if (mapping == nullptr)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    //
+    // Mapping into user mode raises an exception on failure.
+    //
+    __try
+    {
+        userVa = MmMapLockedPagesSpecifyCache(g_StatisticsMdl,
+                                              UserMode,
+                                              MmCached,
+                                              nullptr,
+                                              FALSE,
+                                              NormalPagePriority |
+                                                MdlMappingNoWrite |
+                                                MdlMappingNoExecute);
+    }
+    __except (EXCEPTION_EXECUTE_HANDLER)
+    {
+        userVa = nullptr;
+    }
+    if (userVa == nullptr)
+    {
+        ExFreePoolWithTag(mapping, 'MVSS');
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    mapping->Process = PsGetCurrentProcess();
+    mapping->UserVa = userVa;
 
     //
-    // Also, save some of the current state to VMCB for the host. This is loaded
-    // after #VMEXIT to reproduce the current state for the host (hypervisor).
+    // Another thread may have mapped the region with the same file object in
+    // the meantime. Keep the first mapping in that case.
     //
-    __svm_vmsave(hostVmcbPa.QuadPart);
+    if (InterlockedCompareExchangePointer(&FileObject->FsContext,
+                                          mapping,
+                                          nullptr) != nullptr)
+    {
+        MmUnmapLockedPages(userVa, g_StatisticsMdl);
+        ExFreePoolWithTag(mapping, 'MVSS');
+        mapping = static_cast<PSV_STATISTICS_MAPPING>(FileObject->FsContext);
+        userVa = mapping->UserVa;
+    }
+    status = STATUS_SUCCESS;
+
+Exit:
+    if (NT_SUCCESS(status))
+    {
+        Output->BaseAddress = reinterpret_cast<UINT64>(userVa);
+        Output->Size = MmGetMdlByteCount(g_StatisticsMdl);
+    }
+    return status;
 }
 
+#if defined(SV_ENABLE_BENCHMARKS)
 /*!
-    @brief      Virtualize the current processor.
+    @brief          Benchmarks building the nested page tables with bit fields.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkBuildNestedPageTablesWithBitFields (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
 
-    @details    This function enables SVM, initialize VMCB with the current
-                processor state, and enters the guest mode on the current
-                processor.
+    SvBuildNestedPageTablesWithBitFields(Context->SharedVpData->Npt,
+                                         Context->SharedVpData->NptBasePa);
+}
 
-    @param[in]  Context - A pointer of share data.
+/*!
+    @brief          Benchmarks building the nested page tables.
 
-    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
+    @details        Each iteration writes 1 + 512 + 512 * 512 entries. Compare
+                    with npt_build_2mb_bitfield for the rate in entries per
+                    cycle.
  */
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
 _IRQL_requires_same_
-_Check_return_
 static
-NTSTATUS
-SvVirtualizeProcessor (
-    _In_opt_ PVOID Context
+VOID
+SvBenchmarkBuildNestedPageTables (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
     )
 {
-    NTSTATUS status;
-    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
-    PVIRTUAL_PROCESSOR_DATA vpData;
-    PCONTEXT contextRecord;
+    UNREFERENCED_PARAMETER(Iteration);
 
-    SV_DEBUG_BREAK();
+    SvBuildNestedPageTables(Context->SharedVpData->Npt, Context->SharedVpData->NptBasePa);
+}
 
-    vpData = nullptr;
+/*!
+    @brief          Benchmarks building the MSRPM.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkBuildMsrPermissionsMap (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
 
-    NT_ASSERT(ARGUMENT_PRESENT(Context));
-    _Analysis_assume_(ARGUMENT_PRESENT(Context));
+    SvBuildMsrPermissionsMap<SV_INTERCEPT_POLICY>(Context->SharedVpData->MsrPermissionsMap);
+}
 
-    contextRecord = static_cast<PCONTEXT>(ExAllocatePoolWithTag(
-                                                        NonPagedPool,
-                                                        sizeof(*contextRecord),
-                                                        'MVSS'));
-    if (contextRecord == nullptr)
+/*!
+    @brief          Benchmarks SvGetSegmentAccessRight with the selectors of the
+                    current processor.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkGetSegmentAccessRight (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    Context->Sink += SvGetSegmentAccessRight(
+                    Context->Selectors[Iteration % RTL_NUMBER_OF(Context->Selectors)],
+                    Context->GdtBase);
+}
+
+/*!
+    @brief          Sets up the mocked VMCB and GPRs for #VMEXIT due to CPUID or
+                    WRMSR to IA32_MSR_EFER, and calls SvDispatchVmExit.
+
+    @details        CPUID queries the feature identifiers leaf, which the
+                    handler modifies. WRMSR writes the current value of EFER,
+                    which is only reflected to the mocked VMCB.
+
+    @param[in,out]  Context - The benchmark context.
+    @param[in]      ExitCode - VMEXIT_CPUID or VMEXIT_MSR.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvReplayVmExit (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ UINT32 ExitCode
+    )
+{
+    GUEST_REGISTERS guestRegisters;
+    GUEST_CONTEXT guestContext;
+
+    RtlZeroMemory(&guestRegisters, sizeof(guestRegisters));
+    guestContext.VpRegs = &guestRegisters;
+    guestContext.ExitVm = FALSE;
+
+    Context->VpData->GuestVmcb.ControlArea.ExitCode = ExitCode;
+    if (ExitCode == VMEXIT_CPUID)
     {
-        SvDebugPrint("Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
+        guestRegisters.Rax = CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS;
+        Context->VpData->GuestVmcb.ControlArea.ExitInfo1 = 0;
     }
-
-    //
-    // Allocate per processor data.
-    //
-#pragma prefast(push)
-#pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
-    vpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(
-            SvAllocatePageAlingedPhysicalMemory(sizeof(VIRTUAL_PROCESSOR_DATA)));
-#pragma prefast(pop)
-    if (vpData == nullptr)
+    else
     {
-        SvDebugPrint("Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
+        guestRegisters.Rcx = IA32_MSR_EFER;
+        guestRegisters.Rax = Context->GuestEfer & MAXUINT32;
+        guestRegisters.Rdx = Context->GuestEfer >> 32;
+        Context->VpData->GuestVmcb.ControlArea.ExitInfo1 = 1;
     }
+    SvDispatchVmExit<SV_INTERCEPT_POLICY>(Context->VpData, &guestContext);
+}
 
-    //
-    // Capture the current RIP, RSP, RFLAGS, and segment selectors. This
-    // captured state is used as an initial state of the guest mode; therefore
-    // when virtualization starts by the later call of SvLaunchVm, a processor
-    // resume its execution at this location and state.
-    //
-    RtlCaptureContext(contextRecord);
+/*!
+    @brief          Benchmarks the CPUID handler on the mocked VMCB.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkHandleCpuid (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
 
-    //
-    // First time of this execution, the SimpleSvm hypervisor is not installed
-    // yet. Therefore, the branch is taken, and virtualization is attempted.
-    //
-    // At the second execution of here, after SvLaunchVm virtualized the
-    // processor, SvIsSimpleSvmHypervisorInstalled returns TRUE, and this
-    // function exits with STATUS_SUCCESS.
-    //
-    if (SvIsSimpleSvmHypervisorInstalled() == FALSE)
+    SvReplayVmExit(Context, VMEXIT_CPUID);
+}
+
+/*!
+    @brief          Benchmarks the MSR handler on the mocked VMCB.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkHandleMsrAccess (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
+
+    SvReplayVmExit(Context, VMEXIT_MSR);
+}
+
+/*!
+    @brief          Benchmarks saving and restoring guest's extended state as a
+                    #VMEXIT handler using SIMD registers does.
+
+    @details        The state is not modified between iterations, so XSAVEOPT,
+                    if supported, writes little. This is the best case of the
+                    lazy mode; xstate_xsave_xrstor is the worst case.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkSaveExtendedState (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
+
+    if (SvSaveGuestExtendedState(Context->VpData) != FALSE)
     {
-        SvDebugPrint("Attempting to virtualize the processor.\n");
-        sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(Context);
+        SvRestoreGuestExtendedState(Context->VpData);
+    }
+}
 
-        //
-        // Enable SVM by setting EFER.SVME. It has already been verified that this
-        // bit was writable with SvIsSvmSupported.
-        //
-        __writemsr(IA32_MSR_EFER, __readmsr(IA32_MSR_EFER) | EFER_SVME);
+/*!
+    @brief          Benchmarks saving all extended state with XSAVE and
+                    restoring it.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkSaveExtendedStateWithXsave (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UINT64 mask;
 
-        //
-        // Set up VMCB, the structure describes the guest state and what events
-        // within the guest should be intercepted, ie, triggers #VMEXIT.
-        //
-        SvPrepareForVirtualization(vpData, sharedVpData, contextRecord);
+    UNREFERENCED_PARAMETER(Iteration);
 
-        //
-        // Switch to the host RSP to run as the host (hypervisor), and then
-        // enters loop that executes code as a guest until #VMEXIT happens and
-        // handles #VMEXIT as the host.
-        //
-        // This function should never return to here.
-        //
-        SvLaunchVm(&vpData->HostStackLayout.GuestVmcbPa);
-        SV_DEBUG_BREAK();
-        KeBugCheck(MANUALLY_INITIATED_CRASH);
+    if (Context->VpData->ExtendedState.Area != nullptr)
+    {
+        mask = _xgetbv(0);
+        _xsave64(Context->VpData->ExtendedState.Area, mask);
+        _xrstor64(Context->VpData->ExtendedState.Area, mask);
     }
+}
 
-    SvDebugPrint("The processor has been virtualized.\n");
-    status = STATUS_SUCCESS;
+/*!
+    @brief          Reads an entry of the synthetic page tables for the software
+                    TLB benchmarks.
 
-Exit:
-    if (contextRecord != nullptr)
+    @details        Synthetic guest physical addresses are indexes into
+                    PageTables of the benchmark context, shifted by PAGE_SHIFT.
+
+    @param[in]      Context - The benchmark context.
+    @param[in]      GuestPa - The synthetic guest physical address of the entry.
+    @param[out]     Value - Receives the entry.
+
+    @result         TRUE on success; otherwise, FALSE.
+ */
+_Use_decl_annotations_
+static
+BOOLEAN
+SvReadBenchmarkPageTable (
+    PVOID Context,
+    UINT64 GuestPa,
+    PUINT64 Value
+    )
+{
+    PSV_BENCHMARK_CONTEXT context;
+
+    context = static_cast<PSV_BENCHMARK_CONTEXT>(Context);
+    if ((GuestPa >> PAGE_SHIFT) >= SV_BENCHMARK_PAGE_TABLE_LEVELS)
     {
-        ExFreePoolWithTag(contextRecord, 'MVSS');
+        *Value = 0;
+        return FALSE;
     }
-    if ((!NT_SUCCESS(status)) && (vpData != nullptr))
+    *Value = context->PageTables[GuestPa >> PAGE_SHIFT][BYTE_OFFSET(GuestPa) / sizeof(UINT64)];
+    return TRUE;
+}
+
+/*!
+    @brief          Builds synthetic 4-level page tables that map
+                    SV_BENCHMARK_GUEST_VA with 4KB pages.
+
+    @param[in,out]  Context - The benchmark context.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBuildBenchmarkPageTables (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context
+    )
+{
+    UINT64 index, nextPfn;
+
+    //
+    // Each table points to the next one in PageTables, and the PTE to an
+    // arbitrary page.
+    //
+    for (UINT32 level = 4; level > 0; level--)
     {
-        //
-        // Frees per processor data if allocated and this function is
-        // unsuccessful.
-        //
-        SvFreePageAlingedPhysicalMemory(vpData);
+        index = (SV_BENCHMARK_GUEST_VA >> (12 + 9 * (level - 1))) & 0x1ff;
+        nextPfn = (level == 1) ? 0x1234 : (5 - level);
+        Context->PageTables[4 - level][index] = (nextPfn << PAGE_SHIFT) |
+                                                SV_PTE_PRESENT | SV_PTE_WRITE;
     }
-    return status;
+
+    Context->PagingState.Cr0 = SV_CR0_PG;
+    Context->PagingState.Cr3 = 0;
+    Context->PagingState.Cr4 = 0;
+    Context->PagingState.Efer = SV_EFER_LMA;
+    SvFlushSoftTlb(&Context->SoftTlb);
 }
 
 /*!
-    @brief      Execute a callback on all processors one-by-one.
+    @brief          Benchmarks translating a guest virtual address that hits the
+                    software TLB.
 
-    @details    This function execute Callback with Context as a parameter for
-                each processor on the current IRQL. If the callback returned
-                non-STATUS_SUCCESS value or any error occurred, this function
-                stops execution of the callback and returns the error code.
+    @details        Only the first iteration walks the page tables. Compare with
+                    soft_tlb_miss for the cost saved by each hit.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkTranslateWithSoftTlbHit (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    SV_GUEST_TRANSLATION translation;
 
-                When NumOfProcessorCompleted is not NULL, this function always
-                set a number of processors that successfully executed the
-                callback.
+    UNREFERENCED_PARAMETER(Iteration);
 
-    @param[in]  Callback - A function to execute on all processors.
-    @param[in]  Context - A parameter to pass to the callback.
-    @param[out] NumOfProcessorCompleted - A pointer to receive a number of
-                processors executed the callback successfully.
+    if (SvTranslateWithSoftTlb(&Context->SoftTlb,
+                               &Context->PagingState,
+                               SV_BENCHMARK_GUEST_VA,
+                               SvReadBenchmarkPageTable,
+                               Context,
+                               &translation) == SvTranslationSuccess)
+    {
+        Context->Sink += translation.GuestPa;
+    }
+}
 
-    @result     STATUS_SUCCESS when Callback executed and returned STATUS_SUCCESS
-                on all processors; otherwise, an appropriate error code.
+/*!
+    @brief          Benchmarks translating a guest virtual address that misses
+                    the software TLB, as the first translation in each #VMEXIT
+                    does.
  */
-_IRQL_requires_max_(APC_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
 _IRQL_requires_same_
-_Check_return_
 static
-NTSTATUS
-SvExecuteOnEachProcessor (
-    _In_ NTSTATUS (*Callback)(PVOID),
-    _In_opt_ PVOID Context,
-    _Out_opt_ PULONG NumOfProcessorCompleted
+VOID
+SvBenchmarkTranslateWithSoftTlbMiss (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
     )
 {
-    NTSTATUS status;
-    ULONG i, numOfProcessors;
-    PROCESSOR_NUMBER processorNumber;
-    GROUP_AFFINITY affinity, oldAffinity;
+    SV_GUEST_TRANSLATION translation;
 
-    status = STATUS_SUCCESS;
+    UNREFERENCED_PARAMETER(Iteration);
 
-    //
-    // Get a number of processors on this system.
-    //
-    numOfProcessors = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    SvFlushSoftTlb(&Context->SoftTlb);
+    if (SvTranslateWithSoftTlb(&Context->SoftTlb,
+                               &Context->PagingState,
+                               SV_BENCHMARK_GUEST_VA,
+                               SvReadBenchmarkPageTable,
+                               Context,
+                               &translation) == SvTranslationSuccess)
+    {
+        Context->Sink += translation.GuestPa;
+    }
+}
+
+/*!
+    @brief          Benchmarks dispatching the recorded mix of #VMEXITs.
+ */
+_IRQL_requires_same_
+static
+VOID
+SvBenchmarkDispatchExitMix (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iteration
+    )
+{
+    UNREFERENCED_PARAMETER(Iteration);
 
-    for (i = 0; i < numOfProcessors; i++)
+    for (ULONG i = 0; i < SV_BENCHMARK_EXIT_MIX_LENGTH; i++)
     {
-        //
-        // Convert from an index to a processor number.
-        //
-        status = KeGetProcessorNumberFromIndex(i, &processorNumber);
-        if (!NT_SUCCESS(status))
-        {
-            goto Exit;
-        }
+        SvReplayVmExit(Context, Context->ExitMix[i]);
+    }
+}
 
-        //
-        // Switch execution of this code to a processor #i.
-        //
-        affinity.Group = processorNumber.Group;
-        affinity.Mask = 1ULL << processorNumber.Number;
-        affinity.Reserved[0] = affinity.Reserved[1] = affinity.Reserved[2] = 0;
-        KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
+/*!
+    @brief          Builds the mix of #VMEXITs replayed by
+                    SvBenchmarkDispatchExitMix.
 
-        //
-        // Execute the callback.
-        //
-        status = Callback(Context);
+    @details        The mix follows the ratio of CPUID and MSR #VMEXITs recorded
+                    in the statistics of all processors, so the benchmark
+                    reflects the workload the system has actually run. Other
+                    #VMEXITs access devices and cannot be replayed against the
+                    mocked VMCB. When nothing is recorded yet, for example, the
+                    system is not virtualized, both are evenly mixed.
 
-        //
-        // Revert the previously executed processor.
-        //
-        KeRevertToUserGroupAffinityThread(&oldAffinity);
+    @param[in,out]  Context - The benchmark context.
+ */
+_IRQL_requires_max_(APC_LEVEL)
+static
+VOID
+SvBuildBenchmarkExitMix (
+    _Inout_ PSV_BENCHMARK_CONTEXT Context
+    )
+{
+    UINT64 cpuidCount, msrCount, cpuidSlots;
+    UINT32 cpuidBucket, msrBucket;
 
-        //
-        // Exit if the callback returned error.
-        //
-        if (!NT_SUCCESS(status))
+    cpuidBucket = SvGetExitCodeBucket(VMEXIT_CPUID);
+    msrBucket = SvGetExitCodeBucket(VMEXIT_MSR);
+    cpuidCount = msrCount = 0;
+    for (UINT32 i = 0; i < g_Statistics->NumberOfProcessors; i++)
+    {
+        if (SvReadSeqlockProtected(SvGetVpStatistics(g_Statistics, i),
+                                   &Context->RecordedStatistics,
+                                   sizeof(Context->RecordedStatistics),
+                                   16) == FALSE)
         {
-            goto Exit;
+            continue;
         }
+        cpuidCount += Context->RecordedStatistics.ExitCounts[cpuidBucket];
+        msrCount += Context->RecordedStatistics.ExitCounts[msrBucket];
     }
 
-Exit:
-    //
-    // i must be the same as the number of processors on the system when this
-    // function returns STATUS_SUCCESS;
-    //
-    NT_ASSERT(!NT_SUCCESS(status) || (i == numOfProcessors));
+    if (cpuidCount + msrCount == 0)
+    {
+        cpuidCount = msrCount = 1;
+    }
+    cpuidSlots = SV_BENCHMARK_EXIT_MIX_LENGTH * cpuidCount / (cpuidCount + msrCount);
 
     //
-    // Set a number of processors that successfully executed callback if the
-    // out parameter is present.
+    // Spread CPUID evenly over the mix rather than replaying all of them first.
     //
-    if (ARGUMENT_PRESENT(NumOfProcessorCompleted))
+    for (UINT64 i = 0; i < SV_BENCHMARK_EXIT_MIX_LENGTH; i++)
     {
-        *NumOfProcessorCompleted = i;
+        Context->ExitMix[i] = (((i + 1) * cpuidSlots / SV_BENCHMARK_EXIT_MIX_LENGTH) !=
+                               (i * cpuidSlots / SV_BENCHMARK_EXIT_MIX_LENGTH)) ?
+                              VMEXIT_CPUID : VMEXIT_MSR;
     }
-    return status;
+    SvDebugPrint("Replaying %llu CPUID and %llu MSR #VMEXITs per %d.\n",
+                 cpuidSlots,
+                 SV_BENCHMARK_EXIT_MIX_LENGTH - cpuidSlots,
+                 SV_BENCHMARK_EXIT_MIX_LENGTH);
 }
 
 /*!
-    @brief      De-virtualize the current processor if virtualized.
+    @brief          Runs a benchmark and appends its result to the output.
+
+    @details        The routine is executed at DISPATCH_LEVEL so that the thread
+                    is neither preempted nor migrated while it is measured.
+                    Each result is also printed to the debugger as a line of
+                    comma separated values starting with "SVBENCH".
+
+    @param[in]      Name - The name of the benchmark.
+    @param[in]      Routine - The routine to measure.
+    @param[in,out]  Context - The benchmark context.
+    @param[in]      Iterations - The number of times to execute Routine.
+    @param[in,out]  Output - The zero-initialized output to append the
+                    result to.
+ */
+_IRQL_requires_max_(DISPATCH_LEVEL)
+static
+VOID
+SvRunBenchmark (
+    _In_z_ PCSTR Name,
+    _In_ PSV_BENCHMARK_ROUTINE Routine,
+    _Inout_ PSV_BENCHMARK_CONTEXT Context,
+    _In_ ULONG Iterations,
+    _Inout_ PSV_BENCHMARK_OUTPUT Output
+    )
+{
+    PSV_BENCHMARK_RESULT result;
+    KIRQL oldIrql;
+    UINT64 startTime, cycles;
 
-    @details    This function asks SimpleSVM hypervisor to deactivate itself
-                through CPUID with a back-door function id and frees per
-                processor data if it is returned. If the SimpleSvm is not
-                installed, this function does nothing.
+    NT_ASSERT(Output->NumberOfResults < SV_MAX_BENCHMARK_RESULTS);
 
-    @param[in]  Context - An out pointer to receive an address of shared data.
+    result = &Output->Results[Output->NumberOfResults++];
+    NT_ASSERT(strlen(Name) < RTL_NUMBER_OF(result->Name));
+    RtlCopyMemory(result->Name, Name, strlen(Name));
+    result->Iterations = Iterations;
+    result->TotalCycles = 0;
+    result->MinCycles = MAXUINT64;
+    result->MaxCycles = 0;
 
-    @result     Always STATUS_SUCCESS.
+    oldIrql = KeRaiseIrqlToDpcLevel();
+    for (ULONG i = 0; i < Iterations; i++)
+    {
+        startTime = __rdtsc();
+        Routine(Context, i);
+        cycles = __rdtsc() - startTime;
+
+        result->TotalCycles += cycles;
+        result->MinCycles = min(result->MinCycles, cycles);
+        result->MaxCycles = max(result->MaxCycles, cycles);
+    }
+    KeLowerIrql(oldIrql);
+
+    SvDebugPrint("SVBENCH,%s,%llu,%llu,%llu,%llu\n",
+                 result->Name,
+                 result->Iterations,
+                 result->TotalCycles / result->Iterations,
+                 result->MinCycles,
+                 result->MaxCycles);
+}
+
+/*!
+    @brief      Runs all benchmarks on the current processor.
+
+    @details    The nested page tables and MSRPM are built into scratch memory,
+                and handlers are executed against a mocked VMCB, so benchmarks
+                do not interfere with the hypervisor, if running. The CPUID
+                handler executes CPUID, which causes #VMEXIT when the processor
+                is virtualized; this cost is included in the results.
+
+    @param[out] Output - Receives the results.
+
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
-_IRQL_requires_max_(DISPATCH_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
 _Check_return_
 static
 NTSTATUS
-SvDevirtualizeProcessor (
-    _In_opt_ PVOID Context
+SvRunBenchmarks (
+    _Out_ PSV_BENCHMARK_OUTPUT Output
     )
 {
-    int registers[4];   // EAX, EBX, ECX, and EDX
-    UINT64 high, low;
-    PVIRTUAL_PROCESSOR_DATA vpData;
-    PSHARED_VIRTUAL_PROCESSOR_DATA* sharedVpDataPtr;
+    NTSTATUS status;
+    PSV_BENCHMARK_CONTEXT context;
+    DESCRIPTOR_TABLE_REGISTER gdtr;
 
-    if (!ARGUMENT_PRESENT(Context))
+    RtlZeroMemory(Output, sizeof(*Output));
+    Output->Version = SV_BENCHMARK_VERSION;
+
+    context = static_cast<PSV_BENCHMARK_CONTEXT>(ExAllocatePoolWithTag(
+                                                    NonPagedPool,
+                                                    sizeof(*context),
+                                                    'MVSS'));
+    if (context == nullptr)
     {
+        status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
+    RtlZeroMemory(context, sizeof(*context));
 
-    //
-    // Ask SimpleSVM hypervisor to deactivate itself. If the hypervisor is
-    // installed, this ECX is set to 'SSVM', and EDX:EAX indicates an address
-    // of per processor data to be freed.
-    //
-    __cpuidex(registers, CPUID_UNLOAD_SIMPLE_SVM, CPUID_UNLOAD_SIMPLE_SVM);
-    if (registers[2] != 'SSVM')
+    context->SharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(
+        SvAllocatePageAlingedPhysicalMemory(sizeof(SHARED_VIRTUAL_PROCESSOR_DATA)));
+    context->VpData = static_cast<PVIRTUAL_PROCESSOR_DATA>(
+        SvAllocatePageAlingedPhysicalMemory(sizeof(VIRTUAL_PROCESSOR_DATA)));
+    if ((context->SharedVpData == nullptr) || (context->VpData == nullptr))
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+    context->SharedVpData->Npt = static_cast<PSV_NESTED_PAGE_TABLES>(
+                        SvAllocateContiguousMemory(sizeof(SV_NESTED_PAGE_TABLES)));
+    context->SharedVpData->MsrPermissionsMap = SvAllocateContiguousMemory(
+                                                    SVM_MSR_PERMISSIONS_MAP_SIZE);
+    if ((context->SharedVpData->Npt == nullptr) ||
+        (context->SharedVpData->MsrPermissionsMap == nullptr))
     {
+        status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
+    context->SharedVpData->NptBasePa = MmGetPhysicalAddress(
+                                            context->SharedVpData->Npt).QuadPart;
 
-    SvDebugPrint("The processor has been de-virtualized.\n");
+    context->VpData->Vmcb = &context->VpData->GuestVmcb;
+    context->VpData->HostStackLayout.HostStateLoaded = TRUE;
 
-    //
-    // Get an address of per processor data indicated by EDX:EAX.
-    //
-    high = registers[3];
-    low = registers[0] & MAXUINT32;
-    vpData = reinterpret_cast<PVIRTUAL_PROCESSOR_DATA>(high << 32 | low);
-    NT_ASSERT(vpData->HostStackLayout.Reserved1 == MAXUINT64);
+    RtlCaptureContext(&context->ContextRecord);
+    _sgdt(&gdtr);
+    context->GdtBase = gdtr.Base;
+    context->Selectors[0] = context->ContextRecord.SegCs;
+    context->Selectors[1] = context->ContextRecord.SegDs;
+    context->Selectors[2] = context->ContextRecord.SegSs;
+    context->Selectors[3] = context->ContextRecord.SegFs;
+    context->GuestEfer = __readmsr(IA32_MSR_EFER) | EFER_SVME;
+    SvBuildBenchmarkExitMix(context);
+    SvBuildBenchmarkPageTables(context);
+
+    SvInitializeExtendedStateFeatures(context->SharedVpData);
+    if (context->SharedVpData->ExtendedStateSize != 0)
+    {
+        context->VpData->ExtendedState.Area = SvAllocatePageAlingedPhysicalMemory(
+                            ROUND_TO_PAGES(context->SharedVpData->ExtendedStateSize));
+        if (context->VpData->ExtendedState.Area == nullptr)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+        context->VpData->ExtendedState.XsaveoptSupported = context->SharedVpData->XsaveoptSupported;
+    }
 
-    //
-    // Save an address of shared data, then free per processor data.
-    //
-    sharedVpDataPtr = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA*>(Context);
-    *sharedVpDataPtr = vpData->HostStackLayout.SharedVpData;
-    SvFreePageAlingedPhysicalMemory(vpData);
+    SvRunBenchmark("npt_build_2mb", SvBenchmarkBuildNestedPageTables, context, 16, Output);
+    SvRunBenchmark("npt_build_2mb_bitfield", SvBenchmarkBuildNestedPageTablesWithBitFields, context, 16, Output);
+    SvRunBenchmark("msrpm_build", SvBenchmarkBuildMsrPermissionsMap, context, 256, Output);
+    SvRunBenchmark("segment_access_right", SvBenchmarkGetSegmentAccessRight, context, 4096, Output);
+    SvRunBenchmark("cpuid_handler", SvBenchmarkHandleCpuid, context, 256, Output);
+    SvRunBenchmark("msr_handler_efer", SvBenchmarkHandleMsrAccess, context, 4096, Output);
+    SvRunBenchmark("exit_dispatch_mix", SvBenchmarkDispatchExitMix, context, 64, Output);
+    SvRunBenchmark("xstate_lazy_save_restore", SvBenchmarkSaveExtendedState, context, 4096, Output);
+    SvRunBenchmark("xstate_xsave_xrstor", SvBenchmarkSaveExtendedStateWithXsave, context, 4096, Output);
+    SvRunBenchmark("soft_tlb_hit", SvBenchmarkTranslateWithSoftTlbHit, context, 4096, Output);
+    SvRunBenchmark("soft_tlb_miss", SvBenchmarkTranslateWithSoftTlbMiss, context, 4096, Output);
+    status = STATUS_SUCCESS;
 
 Exit:
-    return STATUS_SUCCESS;
+    if (context != nullptr)
+    {
+        if (context->SharedVpData != nullptr)
+        {
+            if (context->SharedVpData->Npt != nullptr)
+            {
+                SvFreeContiguousMemory(context->SharedVpData->Npt);
+            }
+            if (context->SharedVpData->MsrPermissionsMap != nullptr)
+            {
+                SvFreeContiguousMemory(context->SharedVpData->MsrPermissionsMap);
+            }
+            SvFreePageAlingedPhysicalMemory(context->SharedVpData);
+        }
+        if (context->VpData != nullptr)
+        {
+            if (context->VpData->ExtendedState.Area != nullptr)
+            {
+                SvFreePageAlingedPhysicalMemory(context->VpData->ExtendedState.Area);
+            }
+            SvFreePageAlingedPhysicalMemory(context->VpData);
+        }
+        ExFreePoolWithTag(context, 'MVSS');
+    }
+    return status;
 }
+#endif
 
 /*!
-    @brief      De-virtualize all virtualized processors.
+    @brief      Handles IRP_MJ_CREATE and IRP_MJ_CLOSE.
 
-    @details    This function execute a callback to de-virtualize a processor on
-                all processors, and frees shared data when the callback returned
-                its pointer from a hypervisor.
+    @param[in]  DeviceObject - Unused.
+    @param[in]  Irp - The request.
+
+    @result     Always STATUS_SUCCESS.
  */
-_IRQL_requires_max_(APC_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_same_
+_Use_decl_annotations_
 static
-VOID
-SvDevirtualizeAllProcessors (
-    VOID
+NTSTATUS
+SvDispatchCreateClose (
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
     )
 {
-    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
-
-    sharedVpData = nullptr;
+    UNREFERENCED_PARAMETER(DeviceObject);
 
-    //
-    // De-virtualize all processors and free shared data when returned.
-    //
-    NT_VERIFY(NT_SUCCESS(SvExecuteOnEachProcessor(SvDevirtualizeProcessor,
-                                                  &sharedVpData,
-                                                  nullptr)));
-    if (sharedVpData != nullptr)
-    {
-        SvFreeContiguousMemory(sharedVpData->MsrPermissionsMap);
-        SvFreePageAlingedPhysicalMemory(sharedVpData);
-    }
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return STATUS_SUCCESS;
 }
 
 /*!
-    @brief          Build the MSR permissions map (MSRPM).
+    @brief      Handles IRP_MJ_CLEANUP.
 
-    @details        This function sets up MSRPM to intercept to IA32_MSR_EFER,
-                    as suggested in "Extended Feature Enable Register (EFER)"
-                    ----
-                    Secure Virtual Machine Enable (SVME) Bit
-                    Bit 12, read/write. Enables the SVM extensions. (...) The
-                    effect of turning off EFER.SVME while a guest is running is
-                    undefined; therefore, the VMM should always prevent guests
-                    from writing EFER.
-                    ----
+    @details    This function unmaps the statistics region mapped with the file
+                object, if any. Cleanup is usually issued in the context of the
+                process that mapped the region, but it is not guaranteed when a
+                handle was duplicated into another process.
 
-                    Each MSR is controlled by two bits in the MSRPM. The LSB of
-                    the two bits controls read access to the MSR and the MSB
-                    controls write access. A value of 1 indicates that the
-                    operation is intercepted. This function locates an offset for
-                    IA32_MSR_EFER and sets the MSB bit. For details of logic, see
-                    "MSR Intercepts".
+    @param[in]  DeviceObject - Unused.
+    @param[in]  Irp - The request.
 
-    @param[in,out]  MsrPermissionsMap - The MSRPM to set up.
+    @result     Always STATUS_SUCCESS.
  */
-_IRQL_requires_same_
+_Use_decl_annotations_
 static
-VOID
-SvBuildMsrPermissionsMap (
-    _Inout_ PVOID MsrPermissionsMap
+NTSTATUS
+SvDispatchCleanup (
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
     )
 {
-    static const UINT32 BITS_PER_MSR = 2;
-    static const UINT32 SECOND_MSR_RANGE_BASE = 0xc0000000;
-    static const UINT32 SECOND_MSRPM_OFFSET = 0x800 * CHAR_BIT;
-    RTL_BITMAP bitmapHeader;
-    ULONG offsetFrom2ndBase, offset;
+    PFILE_OBJECT fileObject;
+    PSV_STATISTICS_MAPPING mapping;
+    KAPC_STATE apcState;
 
-    //
-    // Setup and clear all bits, indicating no MSR access should be intercepted.
-    //
-    RtlInitializeBitMap(&bitmapHeader,
-                        static_cast<PULONG>(MsrPermissionsMap),
-                        SVM_MSR_PERMISSIONS_MAP_SIZE * CHAR_BIT
-                        );
-    RtlClearAllBits(&bitmapHeader);
+    UNREFERENCED_PARAMETER(DeviceObject);
 
-    //
-    // Compute an offset from the second MSR permissions map offset (0x800) for
-    // IA32_MSR_EFER in bits. Then, add an offset until the second MSR
-    // permissions map.
-    //
-    offsetFrom2ndBase = (IA32_MSR_EFER - SECOND_MSR_RANGE_BASE) * BITS_PER_MSR;
-    offset = SECOND_MSRPM_OFFSET + offsetFrom2ndBase;
+    fileObject = IoGetCurrentIrpStackLocation(Irp)->FileObject;
+    mapping = static_cast<PSV_STATISTICS_MAPPING>(fileObject->FsContext);
+    if (mapping != nullptr)
+    {
+        if (mapping->Process == PsGetCurrentProcess())
+        {
+            MmUnmapLockedPages(mapping->UserVa, g_StatisticsMdl);
+        }
+        else
+        {
+            KeStackAttachProcess(mapping->Process, &apcState);
+            MmUnmapLockedPages(mapping->UserVa, g_StatisticsMdl);
+            KeUnstackDetachProcess(&apcState);
+        }
+        fileObject->FsContext = nullptr;
+        ExFreePoolWithTag(mapping, 'MVSS');
+    }
 
-    //
-    // Set the MSB bit indicating write accesses to the MSR should be intercepted.
-    //
-    RtlSetBits(&bitmapHeader, offset + 1, 1);
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return STATUS_SUCCESS;
 }
 
 /*!
-    @brief      Build pass-through style page tables used in nested paging.
+    @brief      Handles IRP_MJ_DEVICE_CONTROL.
 
-    @details    This function build page tables used in Nested Page Tables. The
-                page tables are used to translate from a guest physical address
-                to a system physical address and pointed by the NCr3 field of
-                VMCB, like the traditional page tables are pointed by CR3.
+    @details    See ControlInterface.hpp for supported IOCTLs.
 
-                The nested page tables built in this function are set to
-                translate a guest physical address to the same system physical
-                address. For example, guest physical address 0x1000 is
-                translated into system physical address 0x1000.
+    @param[in]  DeviceObject - Unused.
+    @param[in]  Irp - The request.
 
-                In order to save memory to build nested page tables, 2MB large
-                pages are used (as opposed to the standard pages that describe
-                translation only for 4K granularity. Also, only up to 512 GB of
-                translation is built. 1GB huge pages are not used due to VMware
-                not supporting this feature.
-
-    @param[out] SharedVpData - Out buffer to build nested page tables.
+    @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
-_IRQL_requires_same_
+_Use_decl_annotations_
 static
-VOID
-SvBuildNestedPageTables (
-    _Out_ PSHARED_VIRTUAL_PROCESSOR_DATA SharedVpData
+NTSTATUS
+SvDispatchDeviceControl (
+    PDEVICE_OBJECT DeviceObject,
+    PIRP Irp
     )
 {
-    ULONG64 pdpBasePa, pdeBasePa, translationPa;
+    NTSTATUS status;
+    PIO_STACK_LOCATION stack;
+    PSV_REGISTER_MMIO_RANGE_INPUT registerInput;
+    PSV_SET_INTERCEPT_POLICY_INPUT policyInput;
+    PSV_PROTECT_NPT_VIEW_INPUT protectInput;
+    ULONG viewIndex;
+    ULONG_PTR information;
 
-    //
-    // Build only one PML4 entry. This entry has subtables that control up to
-    // 512GB physical memory. PFN points to a base physical address of the page
-    // directory pointer table.
-    //
-    pdpBasePa = MmGetPhysicalAddress(&SharedVpData->PdpEntries).QuadPart;
-    SharedVpData->Pml4Entries[0].Fields.PageFrameNumber = pdpBasePa >> PAGE_SHIFT;
+    UNREFERENCED_PARAMETER(DeviceObject);
 
-    //
-    // The US (User) bit of all nested page table entries to be translated
-    // without #VMEXIT, as all guest accesses are treated as user accesses at
-    // the nested level. Also, the RW (Write) bit of nested page table entries
-    // that corresponds to guest page tables must be 1 since all guest page
-    // table accesses are threated as write access. See "Nested versus Guest
-    // Page Faults, Fault Ordering" for more details.
-    //
-    // Nested page tables built here set 1 to those bits for all entries, so
-    // that all translation can complete without triggering #VMEXIT. This does
-    // not lower security since security checks are done twice independently:
-    // based on guest page tables, and nested page tables. See "Nested versus
-    // Guest Page Faults, Fault Ordering" for more details.
-    //
-    SharedVpData->Pml4Entries[0].Fields.Valid = 1;
-    SharedVpData->Pml4Entries[0].Fields.Write = 1;
-    SharedVpData->Pml4Entries[0].Fields.User = 1;
+    stack = IoGetCurrentIrpStackLocation(Irp);
+    information = 0;
 
-    //
-    // One PML4 entry controls 512 page directory pointer entires.
-    //
-    for (ULONG64 i = 0; i < 512; i++)
+    switch (stack->Parameters.DeviceIoControl.IoControlCode)
     {
-        //
-        // PFN points to a base physical address of the page directory table.
-        //
-        pdeBasePa = MmGetPhysicalAddress(&SharedVpData->PdeEntries[i][0]).QuadPart;
-        SharedVpData->PdpEntries[i].Fields.PageFrameNumber = pdeBasePa >> PAGE_SHIFT;
-        SharedVpData->PdpEntries[i].Fields.Valid = 1;
-        SharedVpData->PdpEntries[i].Fields.Write = 1;
-        SharedVpData->PdpEntries[i].Fields.User = 1;
+    case IOCTL_SV_MAP_STATISTICS:
+        if (stack->Parameters.DeviceIoControl.OutputBufferLength <
+                                            sizeof(SV_MAP_STATISTICS_OUTPUT))
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        status = SvMapStatistics(stack->FileObject,
+                                 static_cast<PSV_MAP_STATISTICS_OUTPUT>(
+                                            Irp->AssociatedIrp.SystemBuffer));
+        if (NT_SUCCESS(status))
+        {
+            information = sizeof(SV_MAP_STATISTICS_OUTPUT);
+        }
+        break;
+
+    case IOCTL_SV_REGISTER_MMIO_RANGE:
+        if (stack->Parameters.DeviceIoControl.InputBufferLength <
+                                            sizeof(SV_REGISTER_MMIO_RANGE_INPUT))
+        {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        registerInput = static_cast<PSV_REGISTER_MMIO_RANGE_INPUT>(
+                                            Irp->AssociatedIrp.SystemBuffer);
+
+        SvAcquireVirtualizationLock();
+        if (g_SharedVpData == nullptr)
+        {
+            status = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            status = SvRegisterMmioRange(g_SharedVpData,
+                                         registerInput->GuestPa,
+                                         registerInput->Size,
+                                         nullptr);
+            SvUpdateStatisticsHeader(g_SharedVpData, 0);
+        }
+        SvReleaseVirtualizationLock();
+        break;
+
+    case IOCTL_SV_SET_INTERCEPT_POLICY:
+        if (stack->Parameters.DeviceIoControl.InputBufferLength <
+                                            sizeof(SV_SET_INTERCEPT_POLICY_INPUT))
+        {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        if (stack->Parameters.DeviceIoControl.OutputBufferLength <
+                                            sizeof(SV_SET_INTERCEPT_POLICY_OUTPUT))
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
 
         //
-        // One page directory entry controls 512 page directory entries.
-        //
-        // We do not explicitly configure PAT in the NPT entry. The consequences
-        // of this are: 1) pages whose PAT (Page Attribute Table) type is the
-        // Write-Combining (WC) memory type could be treated as the
-        // Write-Combining Plus (WC+) while it should be WC when the MTRR type is
-        // either Write Protect (WP), Writethrough (WT) or Writeback (WB), and
-        // 2) pages whose PAT type is Uncacheable Minus (UC-) could be treated
-        // as Cache Disabled (CD) while it should be WC, when MTRR type is WC.
-        //
-        // While those are not desirable, this is acceptable given that 1) only
-        // introduces additional cache snooping and associated performance
-        // penalty, which would not be significant since WC+ still lets
-        // processors combine multiple writes into one and avoid large
-        // performance penalty due to frequent writes to memory without caching.
-        // 2) might be worse but I have not seen MTRR ranges configured as WC
-        // on testing, hence the unintentional UC- will just results in the same
-        // effective memory type as what would be with UC.
-        //
-        // See "Memory Types" (7.4), for details of memory types,
-        // "PAT-Register PA-Field Indexing", "Combining Guest and Host PAT Types",
-        // and "Combining PAT and MTRR Types" for how the effective memory type
-        // is determined based on Guest PAT type, Host PAT type, and the MTRR
-        // type.
-        //
-        // The correct approach may be to look up the guest PTE and copy the
-        // caching related bits (PAT, PCD, and PWT) when constructing NTP
-        // entries for non RAM regions, so the combined PAT will always be the
-        // same as the guest PAT type. This may be done when any issue manifests
-        // with the current implementation.
+        // The input and output share the system buffer. Take a copy of the
+        // input, as the output is initialized before the input is consumed.
         //
-        for (ULONG64 j = 0; j < 512; j++)
+        policyInput = static_cast<PSV_SET_INTERCEPT_POLICY_INPUT>(
+                                            ExAllocatePoolWithTag(NonPagedPool,
+                                                                  sizeof(*policyInput),
+                                                                  'MVSS'));
+        if (policyInput == nullptr)
         {
-            //
-            // PFN points to a base physical address of system physical address
-            // to be translated from a guest physical address. Set the PS
-            // (LargePage) bit to indicate that this is a large page and no
-            // subtable exists.
-            //
-            translationPa = (i * 512) + j;
-            SharedVpData->PdeEntries[i][j].Fields.PageFrameNumber = translationPa;
-            SharedVpData->PdeEntries[i][j].Fields.Valid = 1;
-            SharedVpData->PdeEntries[i][j].Fields.Write = 1;
-            SharedVpData->PdeEntries[i][j].Fields.User = 1;
-            SharedVpData->PdeEntries[i][j].Fields.LargePage = 1;
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
         }
-    }
-}
+        RtlCopyMemory(policyInput, Irp->AssociatedIrp.SystemBuffer, sizeof(*policyInput));
 
-/*!
-    @brief      Test whether the current processor support the SVM feature.
-
-    @details    This function tests whether the current processor has enough
-                features to run SimpleSvm, especially about SVM features.
+        SvAcquireVirtualizationLock();
+        if (g_SharedVpData == nullptr)
+        {
+            status = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            status = SvSetInterceptPolicy(g_SharedVpData,
+                                          policyInput,
+                                          static_cast<PSV_SET_INTERCEPT_POLICY_OUTPUT>(
+                                            Irp->AssociatedIrp.SystemBuffer));
+            if (NT_SUCCESS(status))
+            {
+                SvUpdateStatisticsHeader(g_SharedVpData, 0);
+                information = sizeof(SV_SET_INTERCEPT_POLICY_OUTPUT);
+            }
+        }
+        SvReleaseVirtualizationLock();
+        ExFreePoolWithTag(policyInput, 'MVSS');
+        break;
 
-    @result     TRUE if the processor supports the SVM feature; otherwise, FALSE.
- */
-_IRQL_requires_same_
-_Check_return_
-static
-BOOLEAN
-SvIsSvmSupported (
-    VOID
-    )
-{
-    BOOLEAN svmSupported;
-    int registers[4];   // EAX, EBX, ECX, and EDX
-    ULONG64 vmcr;
+    case IOCTL_SV_CREATE_NPT_VIEW:
+        if (stack->Parameters.DeviceIoControl.OutputBufferLength <
+                                            sizeof(SV_CREATE_NPT_VIEW_OUTPUT))
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
 
-    svmSupported = FALSE;
+        SvAcquireVirtualizationLock();
+        if (g_SharedVpData == nullptr)
+        {
+            status = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            status = SvCreateNptView(g_SharedVpData, &viewIndex);
+            if (NT_SUCCESS(status))
+            {
+                SvUpdateStatisticsHeader(g_SharedVpData, 0);
+                RtlZeroMemory(Irp->AssociatedIrp.SystemBuffer, sizeof(SV_CREATE_NPT_VIEW_OUTPUT));
+                static_cast<PSV_CREATE_NPT_VIEW_OUTPUT>(
+                            Irp->AssociatedIrp.SystemBuffer)->ViewIndex = viewIndex;
+                information = sizeof(SV_CREATE_NPT_VIEW_OUTPUT);
+            }
+        }
+        SvReleaseVirtualizationLock();
+        break;
 
-    //
-    // Test if the current processor is AMD one. An AMD processor should return
-    // "AuthenticAMD" from CPUID function 0. See "Function 0h-Maximum Standard
-    // Function Number and Vendor String".
-    //
-    __cpuid(registers, CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING);
-    if ((registers[1] != 'htuA') ||
-        (registers[3] != 'itne') ||
-        (registers[2] != 'DMAc'))
-    {
-        goto Exit;
-    }
+    case IOCTL_SV_PROTECT_NPT_VIEW:
+        if (stack->Parameters.DeviceIoControl.InputBufferLength <
+                                            sizeof(SV_PROTECT_NPT_VIEW_INPUT))
+        {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+        protectInput = static_cast<PSV_PROTECT_NPT_VIEW_INPUT>(
+                                            Irp->AssociatedIrp.SystemBuffer);
 
-    //
-    // Test if the SVM feature is supported by the current processor. See
-    // "Enabling SVM" and "CPUID Fn8000_0001_ECX Feature Identifiers".
-    //
-    __cpuid(registers, CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX);
-    if ((registers[2] & CPUID_FN8000_0001_ECX_SVM) == 0)
-    {
-        goto Exit;
-    }
+        SvAcquireVirtualizationLock();
+        if (g_SharedVpData == nullptr)
+        {
+            status = STATUS_DEVICE_NOT_READY;
+        }
+        else
+        {
+            status = SvProtectNptView(g_SharedVpData,
+                                      protectInput->ViewIndex,
+                                      protectInput->GuestPa,
+                                      protectInput->Size,
+                                      protectInput->DeniedAccess);
+            SvUpdateStatisticsHeader(g_SharedVpData, 0);
+        }
+        SvReleaseVirtualizationLock();
+        break;
 
-    //
-    // Test if the Nested Page Tables feature is supported by the current
-    // processor. See "Enabling Nested Paging" and "CPUID Fn8000_000A_EDX SVM
-    // Feature Identification".
-    //
-    __cpuid(registers, CPUID_SVM_FEATURES);
-    if ((registers[3] & CPUID_FN8000_000A_EDX_NP) == 0)
-    {
-        goto Exit;
-    }
+#if defined(SV_ENABLE_BENCHMARKS)
+    case IOCTL_SV_RUN_BENCHMARKS:
+        if (stack->Parameters.DeviceIoControl.OutputBufferLength <
+                                            sizeof(SV_BENCHMARK_OUTPUT))
+        {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+        status = SvRunBenchmarks(static_cast<PSV_BENCHMARK_OUTPUT>(
+                                            Irp->AssociatedIrp.SystemBuffer));
+        if (NT_SUCCESS(status))
+        {
+            information = sizeof(SV_BENCHMARK_OUTPUT);
+        }
+        break;
+#endif
 
-    //
-    // Test if the SVM feature can be enabled. When VM_CR.SVMDIS is set,
-    // EFER.SVME cannot be 1; therefore, SVM cannot be enabled. When
-    // VM_CR.SVMDIS is clear, EFER.SVME can be written normally and SVM can be
-    // enabled. See "Enabling SVM".
-    //
-    vmcr = __readmsr(SVM_MSR_VM_CR);
-    if ((vmcr & SVM_VM_CR_SVMDIS) != 0)
-    {
-        goto Exit;
+    default:
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        break;
     }
 
-    svmSupported = TRUE;
-
-Exit:
-    return svmSupported;
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = information;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+    return status;
 }
 
 /*!
-    @brief      Virtualizes all processors on the system.
+    @brief      Creates the control device.
 
-    @details    This function attempts to virtualize all processors on the
-                system, and returns STATUS_SUCCESS if all processors are
-                successfully virtualized. If any processor is not virtualized,
-                this function de-virtualizes all processors and returns an error
-                code.
+    @details    Only SYSTEM and administrators can open the device.
+
+    @param[in]  DriverObject - A driver object.
 
     @result     STATUS_SUCCESS on success; otherwise, an appropriate error code.
  */
-_IRQL_requires_max_(APC_LEVEL)
-_IRQL_requires_min_(PASSIVE_LEVEL)
-_IRQL_requires_same_
+_IRQL_requires_max_(PASSIVE_LEVEL)
 _Check_return_
 static
 NTSTATUS
-SvVirtualizeAllProcessors (
-    VOID
+SvCreateControlDevice (
+    _Inout_ PDRIVER_OBJECT DriverObject
     )
 {
     NTSTATUS status;
-    PSHARED_VIRTUAL_PROCESSOR_DATA sharedVpData;
-    ULONG numOfProcessorsCompleted;
-
-    sharedVpData = nullptr;
-    numOfProcessorsCompleted = 0;
-
-    //
-    // Test whether the current processor supports all required SVM features. If
-    // not, exit as error.
-    //
-    if (SvIsSvmSupported() == FALSE)
-    {
-        SvDebugPrint("SVM is not fully supported on this processor.\n");
-        status = STATUS_HV_FEATURE_UNAVAILABLE;
-        goto Exit;
-    }
-
-    //
-    // Allocate a data structure shared across all processors. This data is
-    // page tables used for Nested Page Tables.
-    //
-#pragma prefast(push)
-#pragma prefast(disable : __WARNING_MEMORY_LEAK, "Ownership is taken on success.")
-    sharedVpData = static_cast<PSHARED_VIRTUAL_PROCESSOR_DATA>(
-        SvAllocatePageAlingedPhysicalMemory(sizeof(SHARED_VIRTUAL_PROCESSOR_DATA)));
-#pragma prefast(pop)
-    if (sharedVpData == nullptr)
+    UNICODE_STRING deviceName, dosDeviceName;
+    PDEVICE_OBJECT deviceObject;
+
+    deviceName = RTL_CONSTANT_STRING(SV_CONTROL_DEVICE_NAME);
+    dosDeviceName = RTL_CONSTANT_STRING(SV_CONTROL_DOS_DEVICE_NAME);
+
+    status = IoCreateDeviceSecure(DriverObject,
+                                  0,
+                                  &deviceName,
+                                  FILE_DEVICE_UNKNOWN,
+                                  FILE_DEVICE_SECURE_OPEN,
+                                  FALSE,
+                                  &SDDL_DEVOBJ_SYS_ALL_ADM_ALL,
+                                  &g_ControlDeviceClassGuid,
+                                  &deviceObject);
+    if (!NT_SUCCESS(status))
     {
-        SvDebugPrint("Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
         goto Exit;
     }
 
-    //
-    // Allocate MSR permissions map (MSRPM) onto contiguous physical memory.
-    //
-    sharedVpData->MsrPermissionsMap = SvAllocateContiguousMemory(
-                                                    SVM_MSR_PERMISSIONS_MAP_SIZE);
-    if (sharedVpData->MsrPermissionsMap == nullptr)
+    status = IoCreateSymbolicLink(&dosDeviceName, &deviceName);
+    if (!NT_SUCCESS(status))
     {
-        SvDebugPrint("Insufficient memory.\n");
-        status = STATUS_INSUFFICIENT_RESOURCES;
+        IoDeleteDevice(deviceObject);
         goto Exit;
     }
 
-    //
-    // Build nested page table and MSRPM.
-    //
-    SvBuildNestedPageTables(sharedVpData);
-    SvBuildMsrPermissionsMap(sharedVpData->MsrPermissionsMap);
-
-    //
-    // Execute SvVirtualizeProcessor on and virtualize each processor one-by-one.
-    // How many processors were successfully virtualized is stored in the third
-    // parameter.
-    //
-    // STATUS_SUCCESS is returned if all processor are successfully virtualized.
-    // When any error occurs while virtualizing processors, this function does
-    // not attempt to virtualize the rest of processor. Therefore, only part of
-    // processors on the system may have been virtualized on error. In this case,
-    // it is a caller's responsibility to clean-up (de-virtualize) such
-    // processors.
-    //
-    status = SvExecuteOnEachProcessor(SvVirtualizeProcessor,
-                                      sharedVpData,
-                                      &numOfProcessorsCompleted);
+    DriverObject->MajorFunction[IRP_MJ_CREATE] = SvDispatchCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLOSE] = SvDispatchCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP] = SvDispatchCleanup;
+    DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = SvDispatchDeviceControl;
+    deviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
 Exit:
-    if (!NT_SUCCESS(status))
-    {
-        //
-        // On failure, after successful allocation of shared data.
-        //
-        if (numOfProcessorsCompleted != 0)
-        {
-            //
-            // If one or more processors have already been virtualized,
-            // de-virtualize any of those processors, and free shared data.
-            //
-            NT_ASSERT(sharedVpData != nullptr);
-            SvDevirtualizeAllProcessors();
-        }
-        else
-        {
-            //
-            // If none of processors has not been virtualized, simply free
-            // shared data.
-            //
-            if (sharedVpData != nullptr)
-            {
-                if (sharedVpData->MsrPermissionsMap != nullptr)
-                {
-                    SvFreeContiguousMemory(sharedVpData->MsrPermissionsMap);
-                }
-                SvFreePageAlingedPhysicalMemory(sharedVpData);
-            }
-        }
-    }
     return status;
 }
 
+/*!
+    @brief      Deletes the control device created by SvCreateControlDevice.
+
+    @param[in]  DriverObject - A driver object.
+ */
+_IRQL_requires_max_(PASSIVE_LEVEL)
+static
+VOID
+SvDeleteControlDevice (
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    UNICODE_STRING dosDeviceName;
+
+    dosDeviceName = RTL_CONSTANT_STRING(SV_CONTROL_DOS_DEVICE_NAME);
+    NT_VERIFY(NT_SUCCESS(IoDeleteSymbolicLink(&dosDeviceName)));
+    IoDeleteDevice(DriverObject->DeviceObject);
+}
+
 /*!
     @brief      An entry point of this driver.
 
@@ -1832,13 +9286,16 @@ DriverEntry (
     UNICODE_STRING objectName;
     OBJECT_ATTRIBUTES objectAttributes;
     PCALLBACK_OBJECT callbackObject;
-    PVOID callbackRegistration;
+    PVOID callbackRegistration, processorCallbackRegistration;
+    BOOLEAN controlDeviceCreated;
 
     UNREFERENCED_PARAMETER(RegistryPath);
 
     SV_DEBUG_BREAK();
 
     callbackRegistration = nullptr;
+    processorCallbackRegistration = nullptr;
+    controlDeviceCreated = FALSE;
     DriverObject->DriverUnload = SvDriverUnload;
 
     //
@@ -1851,6 +9308,28 @@ DriverEntry (
     //
     ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
+    NT_VERIFY(NT_SUCCESS(ExInitializeResourceLite(&g_VirtualizationLock)));
+
+    //
+    // Allocate the statistics region before virtualizing processors, so that
+    // each processor has a page to record its statistics in, and expose it
+    // through the control device.
+    //
+    status = SvAllocateStatistics();
+    if (!NT_SUCCESS(status))
+    {
+        SvDebugPrint("Insufficient memory.\n");
+        goto Exit;
+    }
+
+    status = SvCreateControlDevice(DriverObject);
+    if (!NT_SUCCESS(status))
+    {
+        SvDebugPrint("Failed to create the control device.\n");
+        goto Exit;
+    }
+    controlDeviceCreated = TRUE;
+
     //
     // Registers a power state callback (SvPowerCallbackRoutine) to handle
     // system sleep and resume to manage virtualization state.
@@ -1887,29 +9366,60 @@ DriverEntry (
         goto Exit;
     }
 
+    //
+    // Registers a processor change callback (SvProcessorChangeCallback) to
+    // virtualize processors brought online later. This is done before
+    // virtualizing processors, so that no processor added in between runs
+    // without the hypervisor.
+    //
+    processorCallbackRegistration = KeRegisterProcessorChangeCallback(
+                                                    SvProcessorChangeCallback,
+                                                    nullptr,
+                                                    0);
+    if (processorCallbackRegistration == nullptr)
+    {
+        SvDebugPrint("Failed to register a processor change callback.\n");
+        status = STATUS_UNSUCCESSFUL;
+        goto Exit;
+    }
+
     //
     // Virtualize all processors on the system.
     //
+    SvAcquireVirtualizationLock();
     status = SvVirtualizeAllProcessors();
+    SvReleaseVirtualizationLock();
 
 Exit:
     if (NT_SUCCESS(status))
     {
         //
-        // On success, save the registration handle for un-registration.
+        // On success, save the registration handles for un-registration.
         //
         NT_ASSERT(callbackRegistration);
+        NT_ASSERT(processorCallbackRegistration);
         g_PowerCallbackRegistration = callbackRegistration;
+        g_ProcessorChangeCallbackRegistration = processorCallbackRegistration;
     }
     else
     {
         //
         // On any failure, clean up stuff as needed.
         //
+        if (processorCallbackRegistration != nullptr)
+        {
+            KeDeregisterProcessorChangeCallback(processorCallbackRegistration);
+        }
         if (callbackRegistration != nullptr)
         {
             ExUnregisterCallback(callbackRegistration);
         }
+        if (controlDeviceCreated != FALSE)
+        {
+            SvDeleteControlDevice(DriverObject);
+        }
+        SvFreeStatistics();
+        ExDeleteResourceLite(&g_VirtualizationLock);
     }
     return status;
 }
@@ -1917,9 +9427,10 @@ Exit:
 /*!
     @brief      Driver unload callback.
 
-    @details    This function de-virtualize all processors on the system.
+    @details    This function de-virtualize all processors on the system, and
+                deletes the control device.
 
-    @param[in]  DriverObject - Unused.
+    @param[in]  DriverObject - A driver object.
  */
 _Use_decl_annotations_
 static
@@ -1928,8 +9439,6 @@ SvDriverUnload (
     PDRIVER_OBJECT DriverObject
     )
 {
-    UNREFERENCED_PARAMETER(DriverObject);
-
     SV_DEBUG_BREAK();
 
     //
@@ -1938,10 +9447,27 @@ SvDriverUnload (
     NT_ASSERT(g_PowerCallbackRegistration);
     ExUnregisterCallback(g_PowerCallbackRegistration);
 
+    //
+    // Unregister the processor change callback, so that no processor is
+    // virtualized after the below.
+    //
+    NT_ASSERT(g_ProcessorChangeCallbackRegistration);
+    KeDeregisterProcessorChangeCallback(g_ProcessorChangeCallbackRegistration);
+
     //
     // De-virtualize all processors on the system.
     //
+    SvAcquireVirtualizationLock();
     SvDevirtualizeAllProcessors();
+    SvReleaseVirtualizationLock();
+
+    //
+    // The driver is not unloaded while the control device has open handles, so
+    // no mapping of the statistics region remains here.
+    //
+    SvDeleteControlDevice(DriverObject);
+    SvFreeStatistics();
+    ExDeleteResourceLite(&g_VirtualizationLock);
 }
 
 /*!
@@ -1986,7 +9512,9 @@ SvPowerCallbackRoutine (
         //
         // The system has just reentered S0. Re-virtualize all processors.
         //
+        SvAcquireVirtualizationLock();
         NT_VERIFY(NT_SUCCESS(SvVirtualizeAllProcessors()));
+        SvReleaseVirtualizationLock();
     }
     else
     {
@@ -1994,8 +9522,100 @@ SvPowerCallbackRoutine (
         // The system is about to exit system power state S0. De-virtualize all
         // processors.
         //
+        SvAcquireVirtualizationLock();
         SvDevirtualizeAllProcessors();
+        SvReleaseVirtualizationLock();
+    }
+
+Exit:
+    return;
+}
+
+/*!
+    @brief          Processor change callback routine.
+
+    @details        This function virtualizes a processor brought online after
+                    all processors were virtualized, with the current shared
+                    data, ie, the same nested page tables, MSRPM and intercept
+                    policy as the others. Nothing is done while processors are
+                    not virtualized, eg, during sleep, as SvVirtualizeAllProcessors
+                    covers all processors active by then.
+
+                    The processor is de-virtualized with the others by
+                    SvDevirtualizeAllProcessors.
+
+                    For the meanings of parameters, see
+                    KeRegisterProcessorChangeCallback in MSDN.
+
+    @param[in]      CallbackContext - Unused.
+    @param[in]      ChangeContext - Describes the processor being added.
+    @param[in,out]  OperationStatus - Unused, as addition is never vetoed.
+ */
+_Use_decl_annotations_
+static
+VOID
+SvProcessorChangeCallback (
+    PVOID CallbackContext,
+    PKE_PROCESSOR_CHANGE_NOTIFY_CONTEXT ChangeContext,
+    PNTSTATUS OperationStatus
+    )
+{
+    NTSTATUS status;
+    UINT64 startTime;
+    GROUP_AFFINITY affinity, oldAffinity;
+
+    UNREFERENCED_PARAMETER(CallbackContext);
+    UNREFERENCED_PARAMETER(OperationStatus);
+
+    //
+    // The processor is running and can be switched to only once the addition
+    // has completed.
+    //
+    if (ChangeContext->State != KeProcessorAddCompleteNotify)
+    {
+        goto Exit;
+    }
+
+    startTime = __rdtsc();
+    affinity.Group = ChangeContext->ProcNumber.Group;
+    affinity.Mask = 1ULL << ChangeContext->ProcNumber.Number;
+    affinity.Reserved[0] = affinity.Reserved[1] = affinity.Reserved[2] = 0;
+
+    SvAcquireVirtualizationLock();
+    if (g_SharedVpData != nullptr)
+    {
+        //
+        // Switch to the new processor, and virtualize it unless
+        // SvVirtualizeAllProcessors already did as it came online while that
+        // was running.
+        //
+        KeSetSystemGroupAffinityThread(&affinity, &oldAffinity);
+        if (SvIsSimpleSvmHypervisorInstalled() == FALSE)
+        {
+            status = SvVirtualizeProcessor(g_SharedVpData);
+
+            SvBeginSeqlockWrite(&g_Statistics->Sequence);
+            if (NT_SUCCESS(status))
+            {
+                g_Statistics->HotAddedProcessors++;
+                g_Statistics->HotAddCycles = __rdtsc() - startTime;
+            }
+            else
+            {
+                g_Statistics->HotAddFailures++;
+            }
+            SvEndSeqlockWrite(&g_Statistics->Sequence);
+
+            if (!NT_SUCCESS(status))
+            {
+                SvDebugPrint("Failed to virtualize the added processor %lu (%08x).\n",
+                             ChangeContext->NtNumber,
+                             status);
+            }
+        }
+        KeRevertToUserGroupAffinityThread(&oldAffinity);
     }
+    SvReleaseVirtualizationLock();
 
 Exit:
     return;
@@ -14,7 +14,7 @@
 //
 // A size of two the MSR permissions map.
 //
-#define SVM_MSR_PERMISSIONS_MAP_SIZE    (PAGE_SIZE * 2)
+#define SVM_MSR_PERMISSIONS_MAP_SIZE    (0x1000 * 2)
 
 //
 // See "SVM Related MSRs"
@@ -27,10 +27,54 @@
 //
 // See "VMCB Layout, Control Area"
 //
+#define SVM_INTERCEPT_CR_WRITE_CR0      (1UL << 0)
+#define SVM_INTERCEPT_CR_WRITE_CR3      (1UL << 3)
+#define SVM_INTERCEPT_CR_WRITE_CR4      (1UL << 4)
+#define SVM_INTERCEPT_MISC1_INTR        (1UL << 0)
 #define SVM_INTERCEPT_MISC1_CPUID       (1UL << 18)
+#define SVM_INTERCEPT_MISC1_HLT         (1UL << 24)
+#define SVM_INTERCEPT_MISC1_INVLPG      (1UL << 25)
+#define SVM_INTERCEPT_MISC1_IOIO_PROT   (1UL << 27)
 #define SVM_INTERCEPT_MISC1_MSR_PROT    (1UL << 28)
 #define SVM_INTERCEPT_MISC2_VMRUN       (1UL << 0)
+#define SVM_INTERCEPT_MISC2_VMMCALL     (1UL << 1)
+#define SVM_INTERCEPT_MISC2_VMLOAD      (1UL << 2)
+#define SVM_INTERCEPT_MISC2_VMSAVE      (1UL << 3)
+#define SVM_INTERCEPT_MISC2_STGI        (1UL << 4)
+#define SVM_INTERCEPT_MISC2_CLGI        (1UL << 5)
+#define SVM_INTERCEPT_MISC2_MWAIT       (1UL << 11)
+#define SVM_INTERCEPT_MISC2_MWAIT_CONDITIONAL   (1UL << 12)
+#define SVM_INTERCEPT_MISC3_INVPCID     (1UL << 2)
 #define SVM_NP_ENABLE_NP_ENABLE         (1UL << 0)
+#define SVM_V_INTR_V_GIF                (1ULL << 9)
+#define SVM_V_INTR_V_GIF_ENABLE         (1ULL << 25)
+#define SVM_LBR_CONTROL_LBR_VIRTUALIZATION      (1ULL << 0)
+#define SVM_LBR_CONTROL_VIRTUAL_VMLOAD_VMSAVE   (1ULL << 1)
+
+//
+// See "MOV CRx and MOV DRx" in "Decode Assists"
+//
+#define SVM_EXITINFO1_MOV_CR            (1ULL << 63)
+#define SVM_EXITINFO1_GPR_MASK          0xfULL
+
+//
+// See "VMCB Clean Field"
+//
+#define SVM_VMCB_CLEAN_INTERCEPTS       (1UL << 0)
+#define SVM_VMCB_CLEAN_IOPM             (1UL << 1)
+#define SVM_VMCB_CLEAN_ASID             (1UL << 2)
+#define SVM_VMCB_CLEAN_NP               (1UL << 4)
+#define SVM_VMCB_CLEAN_CRX              (1UL << 5)
+#define SVM_VMCB_CLEAN_LBR              (1UL << 10)
+#define SVM_VMCB_CLEAN_ALL              0xfffUL
+
+//
+// See "TLB Flush" and "VMCB Layout, Control Area"
+//
+#define SVM_TLB_CONTROL_DO_NOTHING                  0x0
+#define SVM_TLB_CONTROL_FLUSH_ENTIRE_TLB            0x1
+#define SVM_TLB_CONTROL_FLUSH_GUEST_TLB             0x3
+#define SVM_TLB_CONTROL_FLUSH_GUEST_NON_GLOBAL_TLB  0x7
 
 typedef struct _VMCB_CONTROL_AREA
 {
@@ -41,7 +85,8 @@ typedef struct _VMCB_CONTROL_AREA
     UINT32 InterceptException;          // +0x008
     UINT32 InterceptMisc1;              // +0x00c
     UINT32 InterceptMisc2;              // +0x010
-    UINT8 Reserved1[0x03c - 0x014];     // +0x014
+    UINT32 InterceptMisc3;              // +0x014
+    UINT8 Reserved1[0x03c - 0x018];     // +0x018
     UINT16 PauseFilterThreshold;        // +0x03c
     UINT16 PauseFilterCount;            // +0x03e
     UINT64 IopmBasePa;                  // +0x040
@@ -353,6 +398,7 @@ static_assert(sizeof(EVENTINJ) == 8,
 #define VMEXIT_CR13_WRITE_TRAP      0x009d
 #define VMEXIT_CR14_WRITE_TRAP      0x009e
 #define VMEXIT_CR15_WRITE_TRAP      0x009f
+#define VMEXIT_INVPCID              0x00a2
 #define VMEXIT_NPF                  0x0400
 #define AVIC_INCOMPLETE_IPI         0x0401
 #define AVIC_NOACCEL                0x0402
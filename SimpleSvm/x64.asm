@@ -73,6 +73,13 @@ POPAQ macro
 ;               returns execution flow to the next instruction of the
 ;               instruction triggered #VMEXIT after terminating virtualization.
 ;
+;               When SV_LEAN_EXIT_STUB is defined (Release builds), the trap
+;               frame is not allocated, and guest's GPRs are saved right below
+;               HostStackLayout instead. This saves stack writes on every
+;               #VMEXIT at the cost of Windbg not being able to show the guest
+;               stack trace from the host. SvHandleVmExit does not maintain the
+;               trap frame in that case.
+;
 ;   @param[in]  HostRsp - A stack pointer for the hypervisor.
 ;
 SvLaunchVm proc frame
@@ -91,18 +98,27 @@ SvLV10: ;
         ;                 0x...fd8 HostVmcbPa        ;
         ;                 0x...fe0 Self              ;
         ;                 0x...fe8 SharedVpData      ;
-        ;                 0x...ff0 Padding1          ;
+        ;                 0x...ff0 HostStateLoaded   ;
         ;                 0x...ff8 Reserved1         ;
         ; ----
         ;
         mov rax, [rsp]  ; RAX <= VpData->HostStackLayout.GuestVmcbPa
-        vmload rax      ; load previously saved guest state from VMCB
 
         ;
+        ; Load previously saved guest state from VMCB, only if SvHandleVmExit
+        ; replaced it with the host state (see SvLoadHostState). Otherwise,
+        ; the processor still holds the guest state as of #VMEXIT.
+        ;
+        cmp qword ptr [rsp + 8 * 4], 0  ; if (HostStateLoaded == FALSE)
+        je SvLV15                       ;   jmp SvLV15
+        vmload rax                      ; load guest state from VMCB
+        mov qword ptr [rsp + 8 * 4], 0  ; HostStateLoaded <= FALSE
+
+SvLV15: ;
         ; Start the guest. The VMRUN instruction resumes execution of the guest
         ; with state described in VMCB (specified by RAX by its physical address)
         ; until #VMEXI is triggered. On #VMEXIT, the VMRUN instruction completes
-        ; and resumes the next instruction (ie, vmsave in our case).
+        ; and resumes the next instruction.
         ;
         ; The VMRUN instruction does the following things in this order:
         ; - saves some current state (ie. host state) into the host state-save
@@ -124,13 +140,14 @@ SvLV10: ;
 
         ;
         ; #VMEXIT occured. Now, some of guest state has been saved to VMCB, but
-        ; not all of it. Save some of unsaved state with the VMSAVE instruction.
+        ; not all of it. The rest is left in the processor, and saved with the
+        ; VMSAVE instruction only when SvHandleVmExit needs the host state.
         ;
         ; RAX (and some other state like RSP) has been restored from the host
         ; state-save, so it has the same value as before and not guest's one.
         ;
-        vmsave rax      ; Save current guest state to VMCB
 
+ifndef SV_LEAN_EXIT_STUB
         ;
         ; Optionally, allocate the trap frame so that Windbg can display stack
         ; trace of the guest while SvHandleVmExit is being executed. The trap
@@ -139,6 +156,7 @@ SvLV10: ;
         .pushframe
         sub     rsp, KTRAP_FRAME_SIZE
         .allocstack KTRAP_FRAME_SIZE - MACHINE_FRAME_SIZE + 100h
+endif
 
         ;
         ; Also save guest's GPRs since those are not saved anywhere by the
@@ -159,22 +177,34 @@ SvLV10: ;
         ;                                    0x...fd8 HostVmcbPa        ;
         ; Rsp + 8 * 18 + KTRAP_FRAME_SIZE => 0x...fe0 Self              ;
         ;                                    0x...fe8 SharedVpData      ;
-        ;                                    0x...ff0 Padding1          ;
+        ;                                    0x...ff0 HostStateLoaded   ;
         ;                                    0x...ff8 Reserved1         ;
         ; ----
         ;
+        ; Without the trap frame (SV_LEAN_EXIT_STUB), GUEST_REGISTERS is
+        ; immediately followed by GuestVmcbPa, ie, KTRAP_FRAME_SIZE is zero in
+        ; the above layout.
+        ;
         mov rdx, rsp                                ; Rdx <= GuestRegisters
+ifdef SV_LEAN_EXIT_STUB
+        mov rcx, [rsp + 8 * 18]                     ; Rcx <= VpData
+else
         mov rcx, [rsp + 8 * 18 + KTRAP_FRAME_SIZE]  ; Rcx <= VpData
+endif
 
         ;
         ; Allocate stack for homing space (0x20) and volatile XMM registers
         ; (0x60). Save those registers because subsequent host code may destroy
         ; any of those registers. XMM6-15 are not saved because those should be
-        ; preserved (those are non volatile registers). Finally, indicates the
-        ; end of the function prolog as stack pointer changes are all done. This
-        ; is for Windbg to reconstruct stack trace.
+        ; preserved (those are non volatile registers). Handlers that use any
+        ; other SIMD state save it with SvSaveGuestExtendedState. Finally,
+        ; indicates the end of the function prolog as stack pointer changes are
+        ; all done. This is for Windbg to reconstruct stack trace.
         ;
         sub rsp, 80h
+ifdef SV_LEAN_EXIT_STUB
+        .allocstack 100h
+endif
         movaps xmmword ptr [rsp + 20h], xmm0
         movaps xmmword ptr [rsp + 30h], xmm1
         movaps xmmword ptr [rsp + 40h], xmm2
@@ -211,7 +241,9 @@ SvLV10: ;
         ; the loop. Otherwise, continue the loop and resume the guest.
         ;
         jnz SvLV20                  ; if (ExitVm != 0) jmp SvLV20
+ifndef SV_LEAN_EXIT_STUB
         add rsp, KTRAP_FRAME_SIZE   ; else, restore RSP and
+endif
         jmp SvLV10                  ; jmp SvLV10
 
 SvLV20: ;
@@ -242,4 +274,34 @@ SvLV20: ;
         jmp rbx
 SvLaunchVm endp
 
+;
+;   @brief      Calls the SimpleSvm hypervisor with the VMMCALL instruction.
+;
+;   @details    Function is passed in EAX and ECX, as the leaf and subleaf of
+;               the CPUID interface are, and EAX, EBX, ECX and EDX on return are
+;               stored into Registers, in the same way as __cpuidex does. RBX is
+;               preserved, as it is destroyed when the hypervisor is unloaded.
+;               R8 is preserved by the hypervisor in any case.
+;
+;   @param[out] Registers - RCX: An array of four integers to receive results.
+;   @param[in]  Function - EDX: The function to call.
+;
+SvVmmcall proc frame
+        push rbx
+        .pushreg rbx
+        .endprolog
+
+        mov r8, rcx     ; R8 <= Registers
+        mov eax, edx    ; EAX <= Function
+        mov ecx, edx    ; ECX <= Function
+        vmmcall
+        mov dword ptr [r8 + 0], eax
+        mov dword ptr [r8 + 4], ebx
+        mov dword ptr [r8 + 8], ecx
+        mov dword ptr [r8 + 12], edx
+
+        pop rbx
+        ret
+SvVmmcall endp
+
         end
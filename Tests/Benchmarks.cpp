@@ -0,0 +1,458 @@
+/*!
+    @file       Benchmarks.cpp
+
+    @brief      Benchmarks of the kernel-independent parts of SimpleSvm.
+
+    @details    Each result is printed as a line of comma separated values
+                starting with "SVBENCH", in the same format as the driver
+                prints with SV_ENABLE_BENCHMARKS: the name, the number of
+                iterations, and the average, minimum and maximum TSC cycles of
+                an iteration. Benchmarks that process a known number of items
+                also print a line starting with "SVBENCH_RATE" with the number
+                of items processed per nanosecond.
+
+                Results are compared against Benchmarks.baseline.csv by the
+                CompareBenchmarks target. With --smoke, each benchmark runs
+                once, only to test that it works.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "CpuidMsrEmulation.hpp"
+#include "GuestPageWalker.hpp"
+#include "MsrPermissionsMap.hpp"
+#include "NestedPageTables.hpp"
+#include "SegmentDescriptor.hpp"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+//
+// A policy shaped like the profiling policy of SimpleSvm.cpp.
+//
+typedef struct _BENCHMARK_POLICY
+{
+    static constexpr UINT32 ReadInterceptedMsrs[] = { SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT32 WriteInterceptedMsrs[] = { IA32_MSR_EFER, SVM_MSR_VM_HSAVE_PA, };
+} BENCHMARK_POLICY;
+
+//
+// The number of entries SvBuildNestedPageTables writes.
+//
+#define BENCHMARK_NPT_ENTRIES   (1 + SV_NPT_ENTRIES_PER_TABLE + \
+                                 SV_NPT_ENTRIES_PER_TABLE * SV_NPT_ENTRIES_PER_TABLE)
+
+//
+// A physical address of the nested page tables. Nothing translates with them.
+//
+#define BENCHMARK_NPT_BASE_PA   0x12340000ULL
+
+//
+// The guest virtual address the software TLB benchmarks translate, and the
+// number of synthetic page tables that map it.
+//
+#define BENCHMARK_GUEST_VA              0x00007ff612345000ULL
+#define BENCHMARK_PAGE_TABLE_LEVELS     4
+
+//
+// State shared by benchmark routines.
+//
+typedef struct _BENCHMARK_CONTEXT
+{
+    SV_NESTED_PAGE_TABLES Npt;
+    VMCB Vmcb;
+    UINT64 HostSavePa;
+    UINT64 Gdt[8];
+    UINT8 MsrPermissionsMap[SVM_MSR_PERMISSIONS_MAP_SIZE];
+    UINT64 PageTables[BENCHMARK_PAGE_TABLE_LEVELS][512];
+    SV_GUEST_PAGING_STATE PagingState;
+    SV_SOFT_TLB SoftTlb;
+    UINT64 Sink;
+} BENCHMARK_CONTEXT, *PBENCHMARK_CONTEXT;
+
+typedef
+VOID
+BENCHMARK_ROUTINE (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    );
+typedef BENCHMARK_ROUTINE *PBENCHMARK_ROUTINE;
+
+static bool g_Smoke;
+
+/*!
+    @brief          Executes CPUID on the host.
+
+    @param[out]     Registers - Receives EAX, EBX, ECX and EDX.
+    @param[in]      Leaf - The leaf to query.
+    @param[in]      SubLeaf - The subleaf to query.
+ */
+static
+VOID
+BenchmarkCpuid (
+    _Out_ int Registers[4],
+    _In_ int Leaf,
+    _In_ int SubLeaf
+    )
+{
+#if defined(_MSC_VER)
+    __cpuidex(Registers, Leaf, SubLeaf);
+#else
+    unsigned int eax, ebx, ecx, edx;
+
+    __cpuid_count(Leaf, SubLeaf, eax, ebx, ecx, edx);
+    Registers[0] = static_cast<int>(eax);
+    Registers[1] = static_cast<int>(ebx);
+    Registers[2] = static_cast<int>(ecx);
+    Registers[3] = static_cast<int>(edx);
+#endif
+}
+
+/*!
+    @brief      Benchmarks building the nested page tables.
+ */
+static
+VOID
+BenchmarkBuildNestedPageTables (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    (void)Iteration;
+
+    SvBuildNestedPageTables(&Context->Npt, BENCHMARK_NPT_BASE_PA);
+    Context->Sink += Context->Npt.PdeEntries[511][511].AsUInt64;
+}
+
+/*!
+    @brief      Benchmarks building the nested page tables with bit fields.
+ */
+static
+VOID
+BenchmarkBuildNestedPageTablesWithBitFields (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    (void)Iteration;
+
+    SvBuildNestedPageTablesWithBitFields(&Context->Npt, BENCHMARK_NPT_BASE_PA);
+    Context->Sink += Context->Npt.PdeEntries[511][511].AsUInt64;
+}
+
+/*!
+    @brief      Benchmarks building the MSRPM.
+ */
+static
+VOID
+BenchmarkBuildMsrPermissionsMap (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    (void)Iteration;
+
+    SvBuildMsrPermissionsMap<BENCHMARK_POLICY>(Context->MsrPermissionsMap);
+    Context->Sink += Context->MsrPermissionsMap[0x820];
+}
+
+/*!
+    @brief      Benchmarks SvGetSegmentAccessRight with the selectors of a
+                synthetic GDT.
+ */
+static
+VOID
+BenchmarkGetSegmentAccessRight (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    static const UINT16 selectors[] = { 0x10, 0x18, 0x2b, 0x33, };
+
+    Context->Sink += SvGetSegmentAccessRight(
+                        selectors[Iteration % (sizeof(selectors) / sizeof(selectors[0]))],
+                        reinterpret_cast<ULONG_PTR>(Context->Gdt));
+}
+
+/*!
+    @brief      Benchmarks CPUID of the feature identifiers leaf as the CPUID
+                handler processes it.
+
+    @details    CPUID is executed on the host, as the handler does. It causes
+                #VMEXIT when the host is virtualized; this cost is included in
+                the results.
+ */
+static
+VOID
+BenchmarkHandleCpuid (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    int registers[4];
+
+    (void)Iteration;
+
+    BenchmarkCpuid(registers, CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS, 0);
+    SvAdjustCpuidResult(CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS, TRUE, registers);
+    Context->Sink += static_cast<UINT32>(registers[2]);
+}
+
+/*!
+    @brief      Benchmarks WRMSR to IA32_MSR_EFER on the mocked VMCB as the MSR
+                handler processes it.
+ */
+static
+VOID
+BenchmarkHandleMsrAccess (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    UINT64 value;
+
+    (void)Iteration;
+
+    value = Context->Vmcb.StateSaveArea.Efer;
+    if (SvEmulateMsrAccess(&Context->Vmcb,
+                           &Context->HostSavePa,
+                           FALSE,
+                           IA32_MSR_EFER,
+                           TRUE,
+                           &value) == SvMsrAccessEmulated)
+    {
+        Context->Vmcb.StateSaveArea.Rip = Context->Vmcb.ControlArea.NRip;
+    }
+    Context->Sink += Context->Vmcb.StateSaveArea.Rip;
+}
+
+/*!
+    @brief      Reads an entry of the synthetic page tables for the software TLB
+                benchmarks.
+
+    @details    Synthetic guest physical addresses are indexes into PageTables
+                of the benchmark context, shifted by 12.
+ */
+static
+BOOLEAN
+BenchmarkReadPageTable (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Out_ PUINT64 Value
+    )
+{
+    PBENCHMARK_CONTEXT context;
+
+    context = static_cast<PBENCHMARK_CONTEXT>(Context);
+    if ((GuestPa >> 12) >= BENCHMARK_PAGE_TABLE_LEVELS)
+    {
+        *Value = 0;
+        return FALSE;
+    }
+    *Value = context->PageTables[GuestPa >> 12][(GuestPa & 0xfff) / sizeof(UINT64)];
+    return TRUE;
+}
+
+/*!
+    @brief      Builds synthetic 4-level page tables that map
+                BENCHMARK_GUEST_VA with 4KB pages.
+ */
+static
+VOID
+BenchmarkBuildPageTables (
+    _Inout_ PBENCHMARK_CONTEXT Context
+    )
+{
+    UINT64 index, nextPfn;
+
+    //
+    // Each table points to the next one in PageTables, and the PTE to an
+    // arbitrary page.
+    //
+    for (UINT32 level = 4; level > 0; level--)
+    {
+        index = (BENCHMARK_GUEST_VA >> (12 + 9 * (level - 1))) & 0x1ff;
+        nextPfn = (level == 1) ? 0x1234 : (5 - level);
+        Context->PageTables[4 - level][index] = (nextPfn << 12) |
+                                                SV_PTE_PRESENT | SV_PTE_WRITE;
+    }
+
+    Context->PagingState.Cr0 = SV_CR0_PG;
+    Context->PagingState.Cr3 = 0;
+    Context->PagingState.Cr4 = 0;
+    Context->PagingState.Efer = SV_EFER_LMA;
+    SvFlushSoftTlb(&Context->SoftTlb);
+}
+
+/*!
+    @brief      Benchmarks translating a guest virtual address that hits the
+                software TLB.
+
+    @details    Only the first iteration walks the page tables. Compare with
+                soft_tlb_miss for the cost saved by each hit.
+ */
+static
+VOID
+BenchmarkTranslateWithSoftTlbHit (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    SV_GUEST_TRANSLATION translation;
+
+    (void)Iteration;
+
+    if (SvTranslateWithSoftTlb(&Context->SoftTlb,
+                               &Context->PagingState,
+                               BENCHMARK_GUEST_VA,
+                               BenchmarkReadPageTable,
+                               Context,
+                               &translation) == SvTranslationSuccess)
+    {
+        Context->Sink += translation.GuestPa;
+    }
+}
+
+/*!
+    @brief      Benchmarks translating a guest virtual address that misses the
+                software TLB, as the first translation in each #VMEXIT does.
+ */
+static
+VOID
+BenchmarkTranslateWithSoftTlbMiss (
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iteration
+    )
+{
+    SV_GUEST_TRANSLATION translation;
+
+    (void)Iteration;
+
+    SvFlushSoftTlb(&Context->SoftTlb);
+    if (SvTranslateWithSoftTlb(&Context->SoftTlb,
+                               &Context->PagingState,
+                               BENCHMARK_GUEST_VA,
+                               BenchmarkReadPageTable,
+                               Context,
+                               &translation) == SvTranslationSuccess)
+    {
+        Context->Sink += translation.GuestPa;
+    }
+}
+
+/*!
+    @brief      Runs a benchmark and prints its result.
+
+    @param[in]      Name - The name of the benchmark.
+    @param[in]      Routine - The routine to measure.
+    @param[in,out]  Context - The benchmark context.
+    @param[in]      Iterations - The number of times to execute Routine.
+    @param[in]      ItemsPerIteration - The number of items Routine processes,
+                    or zero when it is not meaningful.
+ */
+static
+VOID
+BenchmarkRun (
+    _In_ const char* Name,
+    _In_ PBENCHMARK_ROUTINE Routine,
+    _Inout_ PBENCHMARK_CONTEXT Context,
+    _In_ UINT32 Iterations,
+    _In_ UINT64 ItemsPerIteration
+    )
+{
+    UINT64 startTime, cycles, totalCycles, minCycles, maxCycles;
+    std::chrono::steady_clock::time_point startClock;
+    double nanoseconds;
+
+    if (g_Smoke)
+    {
+        Iterations = 1;
+    }
+
+    totalCycles = 0;
+    minCycles = MAXUINT64;
+    maxCycles = 0;
+    startClock = std::chrono::steady_clock::now();
+    for (UINT32 i = 0; i < Iterations; i++)
+    {
+        startTime = __rdtsc();
+        Routine(Context, i);
+        cycles = __rdtsc() - startTime;
+
+        totalCycles += cycles;
+        minCycles = (cycles < minCycles) ? cycles : minCycles;
+        maxCycles = (cycles > maxCycles) ? cycles : maxCycles;
+    }
+    nanoseconds = std::chrono::duration<double, std::nano>(
+                                std::chrono::steady_clock::now() - startClock).count();
+
+    printf("SVBENCH,%s,%u,%llu,%llu,%llu\n",
+           Name,
+           Iterations,
+           static_cast<unsigned long long>(totalCycles / Iterations),
+           static_cast<unsigned long long>(minCycles),
+           static_cast<unsigned long long>(maxCycles));
+    if ((ItemsPerIteration != 0) && (nanoseconds > 0))
+    {
+        printf("SVBENCH_RATE,%s,%.3f\n",
+               Name,
+               static_cast<double>(ItemsPerIteration) * Iterations / nanoseconds);
+    }
+}
+
+int
+main (
+    int Argc,
+    char* Argv[]
+    )
+{
+    static BENCHMARK_CONTEXT context;
+
+    g_Smoke = ((Argc > 1) && (strcmp(Argv[1], "--smoke") == 0));
+
+    //
+    // Touch the nested page tables, so that page faults on the first access
+    // are not measured. The driver builds them on non-paged memory.
+    //
+    memset(&context.Npt, 0, sizeof(context.Npt));
+
+    //
+    // The GDT of 64-bit Windows. See SegmentDescriptorTest.cpp.
+    //
+    context.Gdt[1] = 0x00cf9b000000ffffULL;
+    context.Gdt[2] = 0x00209b0000000000ULL;
+    context.Gdt[3] = 0x00cf93000000ffffULL;
+    context.Gdt[4] = 0x00cffb000000ffffULL;
+    context.Gdt[5] = 0x00cff3000000ffffULL;
+    context.Gdt[6] = 0x0020fb0000000000ULL;
+    context.Vmcb.StateSaveArea.Efer = 0xd01 | EFER_SVME;
+    context.Vmcb.ControlArea.NRip = 0x1000;
+    BenchmarkBuildPageTables(&context);
+
+    BenchmarkRun("npt_build_2mb",
+                 BenchmarkBuildNestedPageTables,
+                 &context,
+                 16,
+                 BENCHMARK_NPT_ENTRIES);
+    BenchmarkRun("npt_build_2mb_bitfield",
+                 BenchmarkBuildNestedPageTablesWithBitFields,
+                 &context,
+                 16,
+                 BENCHMARK_NPT_ENTRIES);
+    BenchmarkRun("msrpm_build", BenchmarkBuildMsrPermissionsMap, &context, 256, 0);
+    BenchmarkRun("segment_access_right", BenchmarkGetSegmentAccessRight, &context, 4096, 0);
+    BenchmarkRun("cpuid_handler", BenchmarkHandleCpuid, &context, 256, 0);
+    BenchmarkRun("msr_handler_efer", BenchmarkHandleMsrAccess, &context, 4096, 0);
+    BenchmarkRun("soft_tlb_hit", BenchmarkTranslateWithSoftTlbHit, &context, 4096, 0);
+    BenchmarkRun("soft_tlb_miss", BenchmarkTranslateWithSoftTlbMiss, &context, 4096, 0);
+
+    return (context.Sink == 0) ? 1 : 0;
+}
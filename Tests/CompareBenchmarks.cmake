@@ -0,0 +1,69 @@
+#
+# Runs Benchmarks and compares the minimum cycles of each SVBENCH line with the
+# baseline. The minimum is compared because the average and maximum include
+# interrupts and preemption, and vary too much between runs. Invoked by the
+# CompareBenchmarks and UpdateBenchmarkBaseline targets with:
+#
+#   BENCHMARKS  - The path to the Benchmarks executable.
+#   BASELINE    - The path to the baseline CSV.
+#   RESULTS     - The path to write the results to.
+#   TOLERANCE   - The allowed regression in percent.
+#   UPDATE      - When ON, copies the results to the baseline instead.
+#
+execute_process(COMMAND ${BENCHMARKS}
+                OUTPUT_FILE ${RESULTS}
+                RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Benchmarks failed: ${result}")
+endif()
+
+if(UPDATE)
+    configure_file(${RESULTS} ${BASELINE} COPYONLY)
+    message(STATUS "Updated ${BASELINE}")
+    return()
+endif()
+
+#
+# Reads SVBENCH lines of File into <Prefix>_NAMES and <Prefix>_<name>, the
+# minimum cycles.
+#
+function(sv_read_benchmarks File Prefix)
+    file(STRINGS ${File} lines REGEX "^SVBENCH,")
+    set(names)
+    foreach(line IN LISTS lines)
+        string(REPLACE "," ";" fields "${line}")
+        list(GET fields 1 name)
+        list(GET fields 4 minimum)
+        list(APPEND names ${name})
+        set(${Prefix}_${name} ${minimum} PARENT_SCOPE)
+    endforeach()
+    set(${Prefix}_NAMES ${names} PARENT_SCOPE)
+endfunction()
+
+sv_read_benchmarks(${BASELINE} BASE)
+sv_read_benchmarks(${RESULTS} NEW)
+
+set(regressions 0)
+foreach(name IN LISTS NEW_NAMES)
+    if(NOT DEFINED BASE_${name})
+        message(STATUS "${name}: ${NEW_${name}} cycles (no baseline)")
+        continue()
+    endif()
+    math(EXPR limit "${BASE_${name}} * (100 + ${TOLERANCE}) / 100")
+    if(NEW_${name} GREATER limit)
+        message(STATUS "${name}: ${NEW_${name}} cycles, baseline ${BASE_${name}} -- REGRESSED")
+        math(EXPR regressions "${regressions} + 1")
+    else()
+        message(STATUS "${name}: ${NEW_${name}} cycles, baseline ${BASE_${name}}")
+    endif()
+endforeach()
+foreach(name IN LISTS BASE_NAMES)
+    if(NOT DEFINED NEW_${name})
+        message(STATUS "${name}: missing from the results")
+        math(EXPR regressions "${regressions} + 1")
+    endif()
+endforeach()
+
+if(regressions GREATER 0)
+    message(FATAL_ERROR "${regressions} benchmark(s) regressed by more than ${TOLERANCE}% or are missing")
+endif()
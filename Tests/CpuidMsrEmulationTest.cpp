@@ -0,0 +1,165 @@
+/*!
+    @file       CpuidMsrEmulationTest.cpp
+
+    @brief      Tests of CPUID and MSR emulation on a mocked VMCB.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "CpuidMsrEmulation.hpp"
+#include "TestCommon.hpp"
+
+static
+VOID
+TestAdjustCpuidResult (
+    VOID
+    )
+{
+    int registers[4];
+
+    //
+    // The hypervisor present bit is set, and nothing else is changed.
+    //
+    registers[0] = 1;
+    registers[1] = 2;
+    registers[2] = 3;
+    registers[3] = 4;
+    SvAdjustCpuidResult(CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS, TRUE, registers);
+    SV_CHECK((registers[0] == 1) && (registers[1] == 2) && (registers[3] == 4));
+    SV_CHECK(static_cast<UINT32>(registers[2]) == (3 | CPUID_FN0000_0001_ECX_HYPERVISOR_PRESENT));
+
+    //
+    // SVM is hidden only without nested virtualization.
+    //
+    registers[2] = CPUID_FN8000_0001_ECX_SVM | 1;
+    SvAdjustCpuidResult(CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX, TRUE, registers);
+    SV_CHECK(registers[2] == (CPUID_FN8000_0001_ECX_SVM | 1));
+    SvAdjustCpuidResult(CPUID_PROCESSOR_AND_PROCESSOR_FEATURE_IDENTIFIERS_EX, FALSE, registers);
+    SV_CHECK(registers[2] == 1);
+
+    //
+    // Only virtualized SVM features are reported.
+    //
+    registers[3] = CPUID_FN8000_000A_EDX_NP | CPUID_FN8000_000A_EDX_VGIF |
+                   CPUID_FN8000_000A_EDX_LBR_VIRTUALIZATION;
+    SvAdjustCpuidResult(CPUID_SVM_FEATURES, TRUE, registers);
+    SV_CHECK(registers[3] == CPUID_FN8000_000A_EDX_NP);
+
+    //
+    // The vendor leaf returns "SimpleSvm   ", and the interface leaf "Hv#0".
+    //
+    SvAdjustCpuidResult(CPUID_HV_VENDOR_AND_MAX_FUNCTIONS, TRUE, registers);
+    SV_CHECK(registers[0] == CPUID_HV_MAX);
+    SV_CHECK(registers[1] == 0x706d6953);   // "Simp"
+    SV_CHECK(registers[2] == 0x7653656c);   // "leSv"
+    SV_CHECK(registers[3] == 0x2020206d);   // "m   "
+    SvAdjustCpuidResult(CPUID_HV_INTERFACE, TRUE, registers);
+    SV_CHECK(registers[0] == 0x30237648);   // "Hv#0"
+    SV_CHECK((registers[1] == 0) && (registers[2] == 0) && (registers[3] == 0));
+
+    //
+    // Other leaves are passed through.
+    //
+    registers[0] = registers[1] = registers[2] = registers[3] = -1;
+    SvAdjustCpuidResult(CPUID_MAX_STANDARD_FN_NUMBER_AND_VENDOR_STRING, FALSE, registers);
+    SV_CHECK((registers[0] == -1) && (registers[1] == -1) &&
+             (registers[2] == -1) && (registers[3] == -1));
+}
+
+static
+VOID
+TestEmulateEferAccess (
+    VOID
+    )
+{
+    static VMCB vmcb;
+    UINT64 hostSavePa, value;
+
+    vmcb.StateSaveArea.Efer = 0xd01 | EFER_SVME;
+    vmcb.ControlArea.VmcbClean = SVM_VMCB_CLEAN_ALL;
+    hostSavePa = 0;
+
+    //
+    // Writes that keep SVME are reflected to the VMCB, and EFER is reloaded.
+    //
+    value = 0x501 | EFER_SVME;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, IA32_MSR_EFER, TRUE, &value) ==
+             SvMsrAccessEmulated);
+    SV_CHECK(vmcb.StateSaveArea.Efer == (0x501 | EFER_SVME));
+    SV_CHECK((vmcb.ControlArea.VmcbClean & SVM_VMCB_CLEAN_CRX) == 0);
+
+    //
+    // Clearing SVME raises #GP without changing EFER, unless in L2.
+    //
+    value = 0x501;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, IA32_MSR_EFER, TRUE, &value) ==
+             SvMsrAccessInjectGp);
+    SV_CHECK(vmcb.StateSaveArea.Efer == (0x501 | EFER_SVME));
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, TRUE, IA32_MSR_EFER, TRUE, &value) ==
+             SvMsrAccessEmulated);
+    SV_CHECK(vmcb.StateSaveArea.Efer == 0x501);
+
+    //
+    // Reads return the guest's EFER.
+    //
+    value = 0;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, IA32_MSR_EFER, FALSE, &value) ==
+             SvMsrAccessEmulated);
+    SV_CHECK(value == 0x501);
+    SV_CHECK(hostSavePa == 0);
+}
+
+static
+VOID
+TestEmulateHostSavePaAccess (
+    VOID
+    )
+{
+    static VMCB vmcb;
+    UINT64 hostSavePa, value;
+
+    hostSavePa = 0;
+
+    value = 0x12345000;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, SVM_MSR_VM_HSAVE_PA, TRUE, &value) ==
+             SvMsrAccessEmulated);
+    SV_CHECK(hostSavePa == 0x12345000);
+
+    //
+    // The address must be page aligned, and L2 cannot access it at all.
+    //
+    value = 0x12346008;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, SVM_MSR_VM_HSAVE_PA, TRUE, &value) ==
+             SvMsrAccessInjectGp);
+    SV_CHECK(hostSavePa == 0x12345000);
+    value = 0;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, TRUE, SVM_MSR_VM_HSAVE_PA, FALSE, &value) ==
+             SvMsrAccessInjectGp);
+    SV_CHECK(value == 0);
+
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, SVM_MSR_VM_HSAVE_PA, FALSE, &value) ==
+             SvMsrAccessEmulated);
+    SV_CHECK(value == 0x12345000);
+
+    //
+    // Other MSRs are left to the caller, and the VMCB is untouched.
+    //
+    vmcb.ControlArea.VmcbClean = SVM_VMCB_CLEAN_ALL;
+    value = 1;
+    SV_CHECK(SvEmulateMsrAccess(&vmcb, &hostSavePa, FALSE, 0x277, TRUE, &value) ==
+             SvMsrAccessPassThrough);
+    SV_CHECK(vmcb.ControlArea.VmcbClean == SVM_VMCB_CLEAN_ALL);
+    SV_CHECK((value == 1) && (hostSavePa == 0x12345000));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestAdjustCpuidResult();
+    TestEmulateEferAccess();
+    TestEmulateHostSavePaAccess();
+    return g_Failures;
+}
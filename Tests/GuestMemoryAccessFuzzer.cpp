@@ -0,0 +1,160 @@
+/*!
+    @file       GuestMemoryAccessFuzzer.cpp
+
+    @brief      libFuzzer entry point for memory access descriptor lists.
+
+    @details    The input is the parameters of the hypercall followed by the
+                contents of synthetic guest physical memory, which holds the
+                list and the memory it accesses. The list is processed as the
+                guest would re-execute the hypercall, and the invariants the
+                hypervisor relies on are checked by aborting on violation.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "GuestMemoryAccess.hpp"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//
+// Synthetic guest physical memory starting at zero. Accesses beyond it fail.
+//
+#define FUZZ_MEMORY_PAGES   4
+#define FUZZ_MEMORY_SIZE    (FUZZ_MEMORY_PAGES * SV_MEMORY_ACCESS_PAGE_SIZE)
+
+//
+// The parameters of the hypercall at the start of the input.
+//
+typedef struct _FUZZ_PARAMETERS
+{
+    UINT64 ListPa;
+    UINT64 NumberOfDescriptors;
+    UINT64 NextDescriptor;
+} FUZZ_PARAMETERS;
+
+static UINT8 g_Memory[FUZZ_MEMORY_SIZE];
+
+/*!
+    @brief      Aborts unless the range is non-empty and within a page, as the
+                callbacks are promised, and returns whether it is in the
+                synthetic memory.
+ */
+static
+bool
+FuzzIsValidRange (
+    _In_ UINT64 GuestPa,
+    _In_ UINT32 Size
+    )
+{
+    if ((Size == 0) || (Size > SvBytesToPageEnd(GuestPa)))
+    {
+        abort();
+    }
+    return ((GuestPa < FUZZ_MEMORY_SIZE) && (Size <= FUZZ_MEMORY_SIZE - GuestPa));
+}
+
+static
+BOOLEAN
+FuzzAccessMemory (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Inout_updates_bytes_(Size) PVOID Buffer,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    (void)Context;
+
+    if (!FuzzIsValidRange(GuestPa, Size))
+    {
+        return FALSE;
+    }
+    if (IsWrite != FALSE)
+    {
+        memcpy(&g_Memory[GuestPa], Buffer, Size);
+    }
+    else
+    {
+        memcpy(Buffer, &g_Memory[GuestPa], Size);
+    }
+    return TRUE;
+}
+
+static
+BOOLEAN
+FuzzCopyMemory (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 DestinationPa,
+    _In_ UINT64 SourcePa,
+    _In_ UINT32 Size
+    )
+{
+    (void)Context;
+
+    if (!FuzzIsValidRange(DestinationPa, Size) || !FuzzIsValidRange(SourcePa, Size))
+    {
+        return FALSE;
+    }
+    memmove(&g_Memory[DestinationPa], &g_Memory[SourcePa], Size);
+    return TRUE;
+}
+
+extern "C"
+int
+LLVMFuzzerTestOneInput (
+    const UINT8* Data,
+    size_t Size
+    )
+{
+    FUZZ_PARAMETERS parameters;
+    SV_MEMORY_ACCESS_LIST_STATUS status;
+    UINT64 next, previous;
+    BOOLEAN completed;
+
+    if (Size < sizeof(parameters))
+    {
+        return 0;
+    }
+    memcpy(&parameters, Data, sizeof(parameters));
+    Data += sizeof(parameters);
+    Size -= sizeof(parameters);
+
+    memset(g_Memory, 0, sizeof(g_Memory));
+    memcpy(g_Memory, Data, (Size < sizeof(g_Memory)) ? Size : sizeof(g_Memory));
+
+    //
+    // Each call must either complete or make progress without going past
+    // the end of the list, so that the guest never re-executes the hypercall
+    // forever. A successful list is complete only when all descriptors have
+    // been processed.
+    //
+    next = parameters.NextDescriptor;
+    do
+    {
+        previous = next;
+        status = SvProcessMemoryAccessList(parameters.ListPa,
+                                           parameters.NumberOfDescriptors,
+                                           &next,
+                                           FuzzAccessMemory,
+                                           FuzzCopyMemory,
+                                           nullptr,
+                                           &completed);
+        if ((completed == FALSE) &&
+            ((status != SvMemoryAccessListSuccess) ||
+             (next <= previous) ||
+             (next >= parameters.NumberOfDescriptors)))
+        {
+            abort();
+        }
+        if ((completed != FALSE) &&
+            (status == SvMemoryAccessListSuccess) &&
+            (next != parameters.NumberOfDescriptors))
+        {
+            abort();
+        }
+    } while (completed == FALSE);
+    return 0;
+}
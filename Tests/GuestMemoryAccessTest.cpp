@@ -0,0 +1,412 @@
+/*!
+    @file       GuestMemoryAccessTest.cpp
+
+    @brief      Tests of processing memory access descriptor lists against
+                synthetic guest physical memory.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "GuestMemoryAccess.hpp"
+#include "TestCommon.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+//
+// Synthetic guest physical memory starting at zero. Accesses beyond it fail.
+//
+#define TEST_MEMORY_PAGES   16
+#define TEST_MEMORY_SIZE    (TEST_MEMORY_PAGES * SV_MEMORY_ACCESS_PAGE_SIZE)
+
+typedef struct _TEST_MEMORY
+{
+    UINT8 Bytes[TEST_MEMORY_SIZE];
+    UINT32 AccessCalls;
+    UINT32 CopyCalls;
+} TEST_MEMORY, *PTEST_MEMORY;
+
+static TEST_MEMORY g_Memory;
+
+/*!
+    @brief      Returns whether the range is in the synthetic memory and does
+                not cross a page boundary, as the callbacks are promised.
+ */
+static
+bool
+TestIsValidRange (
+    _In_ UINT64 GuestPa,
+    _In_ UINT32 Size
+    )
+{
+    SV_CHECK(Size != 0);
+    SV_CHECK(Size <= SvBytesToPageEnd(GuestPa));
+    return ((GuestPa < TEST_MEMORY_SIZE) && (Size <= TEST_MEMORY_SIZE - GuestPa));
+}
+
+static
+BOOLEAN
+TestAccessMemory (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Inout_updates_bytes_(Size) PVOID Buffer,
+    _In_ UINT32 Size,
+    _In_ BOOLEAN IsWrite
+    )
+{
+    PTEST_MEMORY memory;
+
+    memory = static_cast<PTEST_MEMORY>(Context);
+    memory->AccessCalls++;
+    if (!TestIsValidRange(GuestPa, Size))
+    {
+        return FALSE;
+    }
+    if (IsWrite != FALSE)
+    {
+        memcpy(&memory->Bytes[GuestPa], Buffer, Size);
+    }
+    else
+    {
+        memcpy(Buffer, &memory->Bytes[GuestPa], Size);
+    }
+    return TRUE;
+}
+
+static
+BOOLEAN
+TestCopyMemory (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 DestinationPa,
+    _In_ UINT64 SourcePa,
+    _In_ UINT32 Size
+    )
+{
+    PTEST_MEMORY memory;
+
+    memory = static_cast<PTEST_MEMORY>(Context);
+    memory->CopyCalls++;
+    if (!TestIsValidRange(DestinationPa, Size) || !TestIsValidRange(SourcePa, Size))
+    {
+        return FALSE;
+    }
+    memmove(&memory->Bytes[DestinationPa], &memory->Bytes[SourcePa], Size);
+    return TRUE;
+}
+
+/*!
+    @brief      Fills the synthetic memory with a pattern and resets counters.
+ */
+static
+VOID
+TestResetMemory (
+    VOID
+    )
+{
+    for (UINT32 i = 0; i < TEST_MEMORY_SIZE; i++)
+    {
+        g_Memory.Bytes[i] = static_cast<UINT8>(i * 7 + (i >> 12));
+    }
+    g_Memory.AccessCalls = 0;
+    g_Memory.CopyCalls = 0;
+}
+
+/*!
+    @brief      Writes a descriptor into the synthetic memory.
+ */
+static
+VOID
+TestWriteDescriptor (
+    _In_ UINT64 DescriptorPa,
+    _In_ UINT64 GuestPa,
+    _In_ UINT64 BufferPa,
+    _In_ UINT32 Length,
+    _In_ UINT16 Direction
+    )
+{
+    SV_MEMORY_ACCESS_DESCRIPTOR descriptor;
+
+    descriptor.GuestPa = GuestPa;
+    descriptor.BufferPa = BufferPa;
+    descriptor.Length = Length;
+    descriptor.Direction = Direction;
+    descriptor.Status = 0xffff;
+    memcpy(&g_Memory.Bytes[DescriptorPa], &descriptor, sizeof(descriptor));
+}
+
+/*!
+    @brief      Reads the status of a descriptor from the synthetic memory.
+ */
+static
+UINT16
+TestReadStatus (
+    _In_ UINT64 DescriptorPa
+    )
+{
+    UINT16 status;
+
+    memcpy(&status,
+           &g_Memory.Bytes[DescriptorPa + offsetof(SV_MEMORY_ACCESS_DESCRIPTOR, Status)],
+           sizeof(status));
+    return status;
+}
+
+static
+SV_MEMORY_ACCESS_STATUS
+TestExecute (
+    _In_ UINT64 GuestPa,
+    _In_ UINT64 BufferPa,
+    _In_ UINT32 Length,
+    _In_ UINT16 Direction
+    )
+{
+    SV_MEMORY_ACCESS_DESCRIPTOR descriptor;
+
+    descriptor.GuestPa = GuestPa;
+    descriptor.BufferPa = BufferPa;
+    descriptor.Length = Length;
+    descriptor.Direction = Direction;
+    descriptor.Status = 0;
+    return SvExecuteMemoryAccessDescriptor(&descriptor, TestCopyMemory, &g_Memory);
+}
+
+static
+VOID
+TestExecuteAcrossPages (
+    VOID
+    )
+{
+    static UINT8 expected[0x100];
+
+    //
+    // Both the region and the buffer cross a page boundary at different
+    // offsets: 0x10 bytes to the end of the region's page, then 0x70 bytes to
+    // the end of the buffer's page, then the remaining 0x80 bytes.
+    //
+    TestResetMemory();
+    memcpy(expected, &g_Memory.Bytes[0x1ff0], sizeof(expected));
+    SV_CHECK(TestExecute(0x1ff0, 0x5f80, sizeof(expected), SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessSuccess);
+    SV_CHECK(g_Memory.CopyCalls == 3);
+    SV_CHECK(memcmp(&g_Memory.Bytes[0x5f80], expected, sizeof(expected)) == 0);
+
+    TestResetMemory();
+    memcpy(expected, &g_Memory.Bytes[0x5f80], sizeof(expected));
+    SV_CHECK(TestExecute(0x1ff0, 0x5f80, sizeof(expected), SV_MEMORY_ACCESS_WRITE) ==
+             SvMemoryAccessSuccess);
+    SV_CHECK(g_Memory.CopyCalls == 3);
+    SV_CHECK(memcmp(&g_Memory.Bytes[0x1ff0], expected, sizeof(expected)) == 0);
+
+    //
+    // A full page at the same offset on both sides is split once.
+    //
+    TestResetMemory();
+    SV_CHECK(TestExecute(0x2800, 0x7800, SV_MAX_MEMORY_ACCESS_LENGTH, SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessSuccess);
+    SV_CHECK(g_Memory.CopyCalls == 2);
+}
+
+static
+VOID
+TestExecuteInvalidDescriptors (
+    VOID
+    )
+{
+    TestResetMemory();
+
+    SV_CHECK(TestExecute(0x1000, 0x2000, 0, SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(TestExecute(0x1000, 0x3000, SV_MAX_MEMORY_ACCESS_LENGTH + 1, SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(TestExecute(0x1000, 0x2000, 8, 2) == SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(TestExecute(0x1000, 0x2000, 8, 0xffff) == SvMemoryAccessInvalidDescriptor);
+
+    //
+    // Neither range may wrap around the address space.
+    //
+    SV_CHECK(TestExecute(0xffffffffffffff00ULL, 0x2000, 0x200, SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(TestExecute(0x1000, 0xfffffffffffffff8ULL, 0x10, SV_MEMORY_ACCESS_WRITE) ==
+             SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(g_Memory.CopyCalls == 0);
+
+    //
+    // Memory that the callback cannot access.
+    //
+    SV_CHECK(TestExecute(TEST_MEMORY_SIZE, 0x2000, 8, SV_MEMORY_ACCESS_READ) ==
+             SvMemoryAccessInaccessible);
+    SV_CHECK(TestExecute(TEST_MEMORY_SIZE - 8, 0x2000, 0x10, SV_MEMORY_ACCESS_WRITE) ==
+             SvMemoryAccessInaccessible);
+}
+
+static
+SV_MEMORY_ACCESS_LIST_STATUS
+TestProcess (
+    _In_ UINT64 ListPa,
+    _In_ UINT64 NumberOfDescriptors,
+    _Inout_ PUINT64 NextDescriptor,
+    _Out_ PBOOLEAN Completed
+    )
+{
+    return SvProcessMemoryAccessList(ListPa,
+                                     NumberOfDescriptors,
+                                     NextDescriptor,
+                                     TestAccessMemory,
+                                     TestCopyMemory,
+                                     &g_Memory,
+                                     Completed);
+}
+
+static
+VOID
+TestProcessStraddlingDescriptor (
+    VOID
+    )
+{
+    static UINT8 expected[0x40];
+    UINT64 listPa, next;
+    BOOLEAN completed;
+
+    //
+    // The first descriptor has 8 bytes in the first page of the list and 16
+    // bytes in the next. The second is invalid, which does not stop the list.
+    //
+    TestResetMemory();
+    listPa = 0x1000 - 8;
+    memcpy(expected, &g_Memory.Bytes[0x3000], sizeof(expected));
+    TestWriteDescriptor(listPa, 0x3000, 0x4000, sizeof(expected), SV_MEMORY_ACCESS_READ);
+    TestWriteDescriptor(listPa + sizeof(SV_MEMORY_ACCESS_DESCRIPTOR),
+                        0x3000,
+                        0x4000,
+                        0,
+                        SV_MEMORY_ACCESS_READ);
+
+    next = 0;
+    SV_CHECK(TestProcess(listPa, 2, &next, &completed) == SvMemoryAccessListSuccess);
+    SV_CHECK((next == 2) && (completed != FALSE));
+    SV_CHECK(TestReadStatus(listPa) == SvMemoryAccessSuccess);
+    SV_CHECK(TestReadStatus(listPa + sizeof(SV_MEMORY_ACCESS_DESCRIPTOR)) ==
+             SvMemoryAccessInvalidDescriptor);
+    SV_CHECK(memcmp(&g_Memory.Bytes[0x4000], expected, sizeof(expected)) == 0);
+
+    //
+    // Two reads for the straddling descriptor, one for the other, and a
+    // status write for each.
+    //
+    SV_CHECK(g_Memory.AccessCalls == 5);
+}
+
+static
+VOID
+TestProcessAcrossBudgets (
+    VOID
+    )
+{
+    static const UINT64 numberOfDescriptors = 20;
+    UINT64 listPa, next, firstBatch;
+    BOOLEAN completed;
+
+    //
+    // Each full-page descriptor costs 0x1018 bytes of the budget, so the
+    // first call processes 15 of them and returns incomplete.
+    //
+    TestResetMemory();
+    listPa = 0x100;
+    for (UINT64 i = 0; i < numberOfDescriptors; i++)
+    {
+        TestWriteDescriptor(listPa + i * sizeof(SV_MEMORY_ACCESS_DESCRIPTOR),
+                            0x2000 + (i % 4) * SV_MEMORY_ACCESS_PAGE_SIZE,
+                            0x8000 + (i % 4) * SV_MEMORY_ACCESS_PAGE_SIZE,
+                            SV_MAX_MEMORY_ACCESS_LENGTH,
+                            SV_MEMORY_ACCESS_READ);
+    }
+    firstBatch = SV_MEMORY_ACCESS_BUDGET /
+                 (sizeof(SV_MEMORY_ACCESS_DESCRIPTOR) + SV_MAX_MEMORY_ACCESS_LENGTH);
+
+    next = 0;
+    SV_CHECK(TestProcess(listPa, numberOfDescriptors, &next, &completed) ==
+             SvMemoryAccessListSuccess);
+    SV_CHECK((next == firstBatch) && (completed == FALSE));
+    SV_CHECK(TestReadStatus(listPa + (firstBatch - 1) * sizeof(SV_MEMORY_ACCESS_DESCRIPTOR)) ==
+             SvMemoryAccessSuccess);
+    SV_CHECK(TestReadStatus(listPa + firstBatch * sizeof(SV_MEMORY_ACCESS_DESCRIPTOR)) == 0xffff);
+
+    //
+    // Resuming from NextDescriptor processes the rest.
+    //
+    SV_CHECK(TestProcess(listPa, numberOfDescriptors, &next, &completed) ==
+             SvMemoryAccessListSuccess);
+    SV_CHECK((next == numberOfDescriptors) && (completed != FALSE));
+    for (UINT64 i = 0; i < numberOfDescriptors; i++)
+    {
+        SV_CHECK(TestReadStatus(listPa + i * sizeof(SV_MEMORY_ACCESS_DESCRIPTOR)) ==
+                 SvMemoryAccessSuccess);
+    }
+    SV_CHECK(memcmp(&g_Memory.Bytes[0x8000], &g_Memory.Bytes[0x2000], 0x4000) == 0);
+
+    //
+    // Processing a completed list does nothing.
+    //
+    g_Memory.AccessCalls = 0;
+    SV_CHECK(TestProcess(listPa, numberOfDescriptors, &next, &completed) ==
+             SvMemoryAccessListSuccess);
+    SV_CHECK((next == numberOfDescriptors) && (completed != FALSE));
+    SV_CHECK(g_Memory.AccessCalls == 0);
+}
+
+static
+VOID
+TestProcessInvalidLists (
+    VOID
+    )
+{
+    UINT64 next;
+    BOOLEAN completed;
+
+    TestResetMemory();
+
+    next = 0;
+    SV_CHECK(TestProcess(0x1000, SV_MAX_MEMORY_ACCESS_DESCRIPTORS + 1, &next, &completed) ==
+             SvMemoryAccessListInvalid);
+    SV_CHECK((next == 0) && (completed != FALSE));
+
+    next = 3;
+    SV_CHECK(TestProcess(0x1000, 2, &next, &completed) == SvMemoryAccessListInvalid);
+    SV_CHECK(next == 3);
+
+    next = 0;
+    SV_CHECK(TestProcess(0x1004, 1, &next, &completed) == SvMemoryAccessListInvalid);
+    SV_CHECK(TestProcess(0xfffffffffffffff0ULL, 1, &next, &completed) ==
+             SvMemoryAccessListInvalid);
+    SV_CHECK(g_Memory.AccessCalls == 0);
+
+    //
+    // A list that runs off the synthetic memory stops at the descriptor that
+    // cannot be read, leaving NextDescriptor at it.
+    //
+    TestWriteDescriptor(TEST_MEMORY_SIZE - sizeof(SV_MEMORY_ACCESS_DESCRIPTOR),
+                        0x1000,
+                        0x2000,
+                        8,
+                        SV_MEMORY_ACCESS_READ);
+    next = 0;
+    SV_CHECK(TestProcess(TEST_MEMORY_SIZE - sizeof(SV_MEMORY_ACCESS_DESCRIPTOR),
+                         2,
+                         &next,
+                         &completed) == SvMemoryAccessListInaccessible);
+    SV_CHECK((next == 1) && (completed != FALSE));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestExecuteAcrossPages();
+    TestExecuteInvalidDescriptors();
+    TestProcessStraddlingDescriptor();
+    TestProcessAcrossBudgets();
+    TestProcessInvalidLists();
+    return g_Failures;
+}
@@ -0,0 +1,270 @@
+/*!
+    @file       GuestPageWalkerTest.cpp
+
+    @brief      Tests of the guest page walker and the software TLB against
+                synthetic page tables.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "GuestPageWalker.hpp"
+#include "TestCommon.hpp"
+
+#include <string.h>
+
+//
+// Synthetic guest physical memory. Page N is Pages[N].
+//
+#define TEST_PAGES      16
+
+typedef struct _TEST_MEMORY
+{
+    UINT64 Pages[TEST_PAGES][512];
+    UINT32 Reads;
+} TEST_MEMORY, *PTEST_MEMORY;
+
+static
+BOOLEAN
+ReadTestMemory (
+    _In_opt_ PVOID Context,
+    _In_ UINT64 GuestPa,
+    _Out_ PUINT64 Value
+    )
+{
+    PTEST_MEMORY memory;
+
+    memory = static_cast<PTEST_MEMORY>(Context);
+    memory->Reads++;
+    if ((GuestPa >> 12) >= TEST_PAGES)
+    {
+        *Value = 0;
+        return FALSE;
+    }
+    *Value = memory->Pages[GuestPa >> 12][(GuestPa & 0xfff) / sizeof(UINT64)];
+    return TRUE;
+}
+
+static
+VOID
+SetEntry (
+    _Inout_ PTEST_MEMORY Memory,
+    _In_ UINT64 TablePfn,
+    _In_ UINT64 GuestVa,
+    _In_ UINT32 Level,
+    _In_ UINT64 Entry
+    )
+{
+    Memory->Pages[TablePfn][(GuestVa >> (12 + 9 * (Level - 1))) & 0x1ff] = Entry;
+}
+
+static
+SV_GUEST_PAGING_STATE
+LongModeState (
+    _In_ UINT64 Cr3
+    )
+{
+    SV_GUEST_PAGING_STATE state;
+
+    state.Cr0 = SV_CR0_PG;
+    state.Cr3 = Cr3;
+    state.Cr4 = 0;
+    state.Efer = SV_EFER_LMA | SV_EFER_NXE;
+    return state;
+}
+
+static
+VOID
+TestWalk (
+    VOID
+    )
+{
+    static TEST_MEMORY memory;
+    SV_GUEST_PAGING_STATE state;
+    SV_GUEST_TRANSLATION translation;
+    const UINT64 va4k = 0x00007ff612345678ULL;
+    const UINT64 va2m = 0xffff800000234567ULL;
+    const UINT64 rw = SV_PTE_PRESENT | SV_PTE_WRITE | SV_PTE_USER;
+
+    memset(&memory, 0, sizeof(memory));
+
+    //
+    // PML4 at page 1. A 4KB page through pages 2, 3 and 4, and a 2MB page,
+    // read-only and not executable, through page 5.
+    //
+    SetEntry(&memory, 1, va4k, 4, (2ULL << 12) | rw);
+    SetEntry(&memory, 2, va4k, 3, (3ULL << 12) | rw);
+    SetEntry(&memory, 3, va4k, 2, (4ULL << 12) | rw);
+    SetEntry(&memory, 4, va4k, 1, (0xabcdeULL << 12) | rw);
+    SetEntry(&memory, 1, va2m, 4, (5ULL << 12) | rw);
+    SetEntry(&memory, 5, va2m, 3, (6ULL << 12) | SV_PTE_PRESENT);
+    SetEntry(&memory, 6, va2m, 2, (0x40000000ULL) | SV_PTE_PRESENT |
+                                  SV_PTE_LARGE_PAGE | SV_PTE_NO_EXECUTE);
+
+    state = LongModeState(1ULL << 12);
+    SV_CHECK(SvWalkGuestPageTables(&state, va4k, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == ((0xabcdeULL << 12) | 0x678));
+    SV_CHECK(translation.Writable && translation.User && translation.Executable);
+
+    SV_CHECK(SvWalkGuestPageTables(&state, va2m, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == 0x40034567ULL);
+    SV_CHECK(!translation.Writable && !translation.User && !translation.Executable);
+
+    //
+    // NX is ignored unless EFER.NXE is set.
+    //
+    state.Efer = SV_EFER_LMA;
+    SV_CHECK(SvWalkGuestPageTables(&state, va2m, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.Executable);
+    state.Efer |= SV_EFER_NXE;
+
+    SV_CHECK(SvWalkGuestPageTables(&state, va4k + 0x1000, ReadTestMemory, &memory, &translation) ==
+             SvTranslationNotPresent);
+    SV_CHECK(SvWalkGuestPageTables(&state, 0x0000800000000000ULL, ReadTestMemory, &memory, &translation) ==
+             SvTranslationNonCanonical);
+
+    //
+    // The PML4 outside the synthetic memory.
+    //
+    state.Cr3 = 0x100000ULL << 12;
+    SV_CHECK(SvWalkGuestPageTables(&state, va4k, ReadTestMemory, &memory, &translation) ==
+             SvTranslationReadFailure);
+
+    state = LongModeState(1ULL << 12);
+    state.Efer = 0;
+    SV_CHECK(SvWalkGuestPageTables(&state, va4k, ReadTestMemory, &memory, &translation) ==
+             SvTranslationUnsupportedMode);
+
+    state.Cr0 = 0;
+    SV_CHECK(SvWalkGuestPageTables(&state, 0x1234, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == 0x1234);
+}
+
+static
+VOID
+TestWalk5Level (
+    VOID
+    )
+{
+    static TEST_MEMORY memory;
+    SV_GUEST_PAGING_STATE state;
+    SV_GUEST_TRANSLATION translation;
+    const UINT64 va = 0x00ff123456789000ULL;
+    const UINT64 rw = SV_PTE_PRESENT | SV_PTE_WRITE;
+
+    memset(&memory, 0, sizeof(memory));
+    SetEntry(&memory, 1, va, 5, (2ULL << 12) | rw);
+    SetEntry(&memory, 2, va, 4, (3ULL << 12) | rw);
+    SetEntry(&memory, 3, va, 3, (4ULL << 12) | rw);
+    SetEntry(&memory, 4, va, 2, (5ULL << 12) | rw);
+    SetEntry(&memory, 5, va, 1, (0x777ULL << 12) | rw);
+
+    state = LongModeState(1ULL << 12);
+    SV_CHECK(SvWalkGuestPageTables(&state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationNonCanonical);
+
+    state.Cr4 = SV_CR4_LA57;
+    SV_CHECK(SvWalkGuestPageTables(&state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == (0x777ULL << 12));
+    SV_CHECK(translation.Writable && !translation.User);
+}
+
+static
+VOID
+TestSoftTlb (
+    VOID
+    )
+{
+    static TEST_MEMORY memory;
+    static SV_SOFT_TLB tlb;
+    SV_GUEST_PAGING_STATE state;
+    SV_GUEST_TRANSLATION translation;
+    const UINT64 va = 0x0000000000401000ULL;
+    const UINT64 rw = SV_PTE_PRESENT | SV_PTE_WRITE;
+
+    memset(&memory, 0, sizeof(memory));
+    memset(&tlb, 0, sizeof(tlb));
+    SetEntry(&memory, 0, va, 4, (2ULL << 12) | rw);
+    SetEntry(&memory, 2, va, 3, (3ULL << 12) | rw);
+    SetEntry(&memory, 3, va, 2, (4ULL << 12) | rw);
+    SetEntry(&memory, 4, va, 1, (0x100ULL << 12) | rw);
+
+    //
+    // A zero-initialized TLB must not hit VA 0 with CR3 0 after the first
+    // flush.
+    //
+    SvFlushSoftTlb(&tlb);
+    state = LongModeState(0);
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, 0, ReadTestMemory, &memory, &translation) ==
+             SvTranslationNotPresent);
+    SV_CHECK(tlb.Misses == 1);
+
+    //
+    // The first translation walks, and the second one hits.
+    //
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va + 0x10, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == ((0x100ULL << 12) | 0x10));
+    memory.Reads = 0;
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va + 0x20, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == ((0x100ULL << 12) | 0x20));
+    SV_CHECK(translation.Writable);
+    SV_CHECK(memory.Reads == 0);
+    SV_CHECK(tlb.Hits == 1);
+
+    //
+    // The guest edits its PTE without telling the hypervisor, as it may do
+    // between #VMEXITs. The stale translation is returned until the TLB is
+    // flushed, which is why it is flushed on every #VMEXIT.
+    //
+    SetEntry(&memory, 4, va, 1, (0x200ULL << 12) | SV_PTE_PRESENT);
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == (0x100ULL << 12));
+
+    SvFlushSoftTlb(&tlb);
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == (0x200ULL << 12));
+    SV_CHECK(!translation.Writable);
+
+    //
+    // Entries are tagged with CR3. The same VA in another address space, that
+    // happens to share the page tables, misses.
+    //
+    memory.Reads = 0;
+    state.Cr3 = 0x1000ULL << 12;
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationReadFailure);
+    SV_CHECK(memory.Reads == 1);
+
+    //
+    // Failed walks are not cached.
+    //
+    state.Cr3 = 0;
+    SetEntry(&memory, 4, va, 1, 0);
+    SvFlushSoftTlb(&tlb);
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationNotPresent);
+    SetEntry(&memory, 4, va, 1, (0x300ULL << 12) | rw);
+    SV_CHECK(SvTranslateWithSoftTlb(&tlb, &state, va, ReadTestMemory, &memory, &translation) ==
+             SvTranslationSuccess);
+    SV_CHECK(translation.GuestPa == (0x300ULL << 12));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestWalk();
+    TestWalk5Level();
+    TestSoftTlb();
+    return g_Failures;
+}
@@ -0,0 +1,40 @@
+/*!
+    @file       basetsd.h
+
+    @brief      Windows base types for building the kernel-independent headers
+                of SimpleSvm with a non-Windows compiler.
+
+    @details    Only what those headers use is defined. SAL annotations expand
+                to nothing.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef void VOID, *PVOID;
+typedef uint8_t UINT8, *PUINT8, UCHAR, *PUCHAR, BOOLEAN, *PBOOLEAN;
+typedef uint16_t UINT16, *PUINT16;
+typedef uint32_t UINT32, *PUINT32;
+typedef uint64_t UINT64, *PUINT64;
+typedef int32_t INT32, *PINT32;
+typedef int64_t INT64, *PINT64;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+
+#define TRUE                            1
+#define FALSE                           0
+#define MAXUINT64                       (~0ULL)
+
+#define _In_
+#define _In_opt_
+#define _In_reads_(Count)
+#define _In_reads_bytes_(Size)
+#define _Out_
+#define _Out_writes_bytes_all_(Size)
+#define _Inout_
+#define _Inout_updates_(Count)
+#define _Inout_updates_bytes_(Size)
+#define _Inout_updates_bytes_all_(Size)
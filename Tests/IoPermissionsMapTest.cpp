@@ -0,0 +1,130 @@
+/*!
+    @file       IoPermissionsMapTest.cpp
+
+    @brief      Tests of the IOPM helpers and the decoder of IOIO EXITINFO1.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "IoPermissionsMap.hpp"
+#include "TestCommon.hpp"
+
+static
+VOID
+TestIoPermissionsMap (
+    VOID
+    )
+{
+    static UINT8 map[SV_IO_PERMISSIONS_MAP_SIZE];
+
+    for (UINT32 i = 0; i < sizeof(map); i++)
+    {
+        map[i] = 0xff;
+    }
+    SvInitializeIoPermissionsMap(map);
+    for (UINT32 i = 0; i < sizeof(map); i++)
+    {
+        SV_CHECK(map[i] == 0);
+    }
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0x80, 1));
+
+    //
+    // A wide access is intercepted when any port it touches is.
+    //
+    SvInterceptIoPorts(map, 0x80, 0x80);
+    SV_CHECK(SvIsIoPortIntercepted(map, 0x80, 1));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0x7f, 1));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0x81, 1));
+    SV_CHECK(SvIsIoPortIntercepted(map, 0x7e, 4));
+    SV_CHECK(SvIsIoPortIntercepted(map, 0x7f, 2));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0x7c, 4));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0x81, 4));
+
+    //
+    // A range across bytes of the map, including the last port.
+    //
+    SvInterceptIoPorts(map, 0xcf8, 0xcff);
+    SvInterceptIoPorts(map, 0xfffe, 0xffff);
+    for (UINT32 port = 0xcf8; port <= 0xcff; port++)
+    {
+        SV_CHECK(SvIsIoPortIntercepted(map, static_cast<UINT16>(port), 1));
+    }
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0xcf7, 1));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0xd00, 1));
+    SV_CHECK(SvIsIoPortIntercepted(map, 0xffff, 1));
+    SV_CHECK(map[0xffff / 8] == 0xc0);
+
+    //
+    // An access past port 0xffff checks the bits that follow the 64K bits,
+    // as the processor does.
+    //
+    SvInitializeIoPermissionsMap(map);
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0xffff, 4));
+    map[0x10000 / 8] = 0x1;
+    SV_CHECK(SvIsIoPortIntercepted(map, 0xffff, 2));
+    SV_CHECK(!SvIsIoPortIntercepted(map, 0xffff, 1));
+}
+
+static
+VOID
+TestDecodeIoioExitInfo (
+    VOID
+    )
+{
+    SV_IOIO_EXIT_INFO info;
+
+    //
+    // OUT DX, AL to port 0x80.
+    //
+    SV_CHECK(SvDecodeIoioExitInfo((0x80ULL << SV_IOIO_PORT_SHIFT) | SV_IOIO_SIZE8 |
+                                  SV_IOIO_ADDRESS64,
+                                  &info));
+    SV_CHECK(info.Port == 0x80);
+    SV_CHECK(info.Size == 1);
+    SV_CHECK(!info.IsIn && !info.IsString && !info.Rep);
+
+    //
+    // IN EAX, DX does not require an address size.
+    //
+    SV_CHECK(SvDecodeIoioExitInfo((0xcfcULL << SV_IOIO_PORT_SHIFT) | SV_IOIO_TYPE_IN |
+                                  SV_IOIO_SIZE32,
+                                  &info));
+    SV_CHECK(info.Port == 0xcfc);
+    SV_CHECK(info.Size == 4);
+    SV_CHECK(info.IsIn);
+
+    //
+    // REP OUTSW with a GS override and 32-bit addressing.
+    //
+    SV_CHECK(SvDecodeIoioExitInfo((0xffffULL << SV_IOIO_PORT_SHIFT) | SV_IOIO_STRING |
+                                  SV_IOIO_REP | SV_IOIO_SIZE16 | SV_IOIO_ADDRESS32 |
+                                  (5ULL << SV_IOIO_SEGMENT_SHIFT),
+                                  &info));
+    SV_CHECK(info.Port == 0xffff);
+    SV_CHECK(info.Size == 2);
+    SV_CHECK(info.AddressSize == 4);
+    SV_CHECK(info.Segment == 5);
+    SV_CHECK(!info.IsIn && info.IsString && info.Rep);
+
+    //
+    // Malformed: no or multiple operand sizes, and INS without an address
+    // size.
+    //
+    SV_CHECK(!SvDecodeIoioExitInfo(SV_IOIO_ADDRESS64, &info));
+    SV_CHECK(!SvDecodeIoioExitInfo(SV_IOIO_SIZE8 | SV_IOIO_SIZE16, &info));
+    SV_CHECK(!SvDecodeIoioExitInfo(SV_IOIO_TYPE_IN | SV_IOIO_STRING | SV_IOIO_SIZE8, &info));
+    SV_CHECK(!SvDecodeIoioExitInfo(SV_IOIO_STRING | SV_IOIO_SIZE8 | SV_IOIO_ADDRESS32 |
+                                   SV_IOIO_ADDRESS64,
+                                   &info));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestIoPermissionsMap();
+    TestDecodeIoioExitInfo();
+    return g_Failures;
+}
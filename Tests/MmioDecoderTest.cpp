@@ -0,0 +1,240 @@
+/*!
+    @file       MmioDecoderTest.cpp
+
+    @brief      Tests of the MMIO instruction decoder against a corpus of
+                instructions and randomly generated bytes.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "MmioDecoder.hpp"
+#include "TestCommon.hpp"
+
+#include <string.h>
+
+//
+// An instruction and how it must be decoded. Length of zero means the bytes
+// must be rejected.
+//
+typedef struct _TEST_INSTRUCTION
+{
+    const char* Text;
+    UINT8 Bytes[SV_MAX_INSTRUCTION_LENGTH];
+    UINT32 BytesLength;
+    SV_MMIO_INSTRUCTION Expected;
+} TEST_INSTRUCTION;
+
+//
+// Immediate, Kind, Length, AccessSize, RegisterSize, Register,
+// HighByteRegister, IsWrite, Rep, AddressSize32
+//
+static const TEST_INSTRUCTION k_Corpus[] =
+{
+    { "mov eax, [rax]", { 0x8b, 0x00 }, 2,
+      { 0, SvMmioMov, 2, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov [rax], rcx", { 0x48, 0x89, 0x08 }, 3,
+      { 0, SvMmioMov, 3, 8, 8, 1, FALSE, TRUE, FALSE, FALSE } },
+    { "mov r8d, [rax+0x10]", { 0x44, 0x8b, 0x40, 0x10 }, 4,
+      { 0, SvMmioMov, 4, 4, 4, 8, FALSE, FALSE, FALSE, FALSE } },
+    { "mov ah, [rax+4]", { 0x8a, 0x60, 0x04 }, 3,
+      { 0, SvMmioMov, 3, 1, 1, 0, TRUE, FALSE, FALSE, FALSE } },
+    { "mov spl, [rax+4]", { 0x40, 0x8a, 0x60, 0x04 }, 4,
+      { 0, SvMmioMov, 4, 1, 1, 4, FALSE, FALSE, FALSE, FALSE } },
+    { "mov [r9], r15b", { 0x45, 0x88, 0x39 }, 3,
+      { 0, SvMmioMov, 3, 1, 1, 15, FALSE, TRUE, FALSE, FALSE } },
+    { "mov [rsp], cx", { 0x66, 0x89, 0x0c, 0x24 }, 4,
+      { 0, SvMmioMov, 4, 2, 2, 1, FALSE, TRUE, FALSE, FALSE } },
+    { "mov eax, [0x1000]", { 0x8b, 0x04, 0x25, 0x00, 0x10, 0x00, 0x00 }, 7,
+      { 0, SvMmioMov, 7, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov eax, [rip+0x12345678]", { 0x8b, 0x05, 0x78, 0x56, 0x34, 0x12 }, 6,
+      { 0, SvMmioMov, 6, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov eax, [rsp+0x100]", { 0x8b, 0x84, 0x24, 0x00, 0x01, 0x00, 0x00 }, 7,
+      { 0, SvMmioMov, 7, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov ebx, [rax+rcx*4+8]", { 0x8b, 0x5c, 0x88, 0x08 }, 4,
+      { 0, SvMmioMov, 4, 4, 4, 3, FALSE, FALSE, FALSE, FALSE } },
+    { "mov eax, gs:[rax]", { 0x65, 0x8b, 0x00 }, 3,
+      { 0, SvMmioMov, 3, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov eax, [eax]", { 0x67, 0x8b, 0x00 }, 3,
+      { 0, SvMmioMov, 3, 4, 4, 0, FALSE, FALSE, FALSE, TRUE } },
+    { "mov dword [rax], 0x12345678", { 0xc7, 0x00, 0x78, 0x56, 0x34, 0x12 }, 6,
+      { 0x12345678, SvMmioMovImmediate, 6, 4, 4, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "mov qword [rax], -1", { 0x48, 0xc7, 0x00, 0xff, 0xff, 0xff, 0xff }, 7,
+      { ~0ULL, SvMmioMovImmediate, 7, 8, 8, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "mov qword [rax], 0x7fffffff", { 0x48, 0xc7, 0x00, 0xff, 0xff, 0xff, 0x7f }, 7,
+      { 0x7fffffff, SvMmioMovImmediate, 7, 8, 8, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "mov word [rax], 0x1234", { 0x66, 0xc7, 0x00, 0x34, 0x12 }, 5,
+      { 0x1234, SvMmioMovImmediate, 5, 2, 2, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "mov byte [rax+8], 0x5a", { 0xc6, 0x40, 0x08, 0x5a }, 4,
+      { 0x5a, SvMmioMovImmediate, 4, 1, 1, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "movzx eax, byte [rax]", { 0x0f, 0xb6, 0x00 }, 3,
+      { 0, SvMmioMovZx, 3, 1, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "movzx esp, byte [rax]", { 0x0f, 0xb6, 0x20 }, 3,
+      { 0, SvMmioMovZx, 3, 1, 4, 4, FALSE, FALSE, FALSE, FALSE } },
+    { "movzx ax, word [rax]", { 0x66, 0x0f, 0xb7, 0x00 }, 4,
+      { 0, SvMmioMovZx, 4, 2, 2, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "movsx rcx, word [rax]", { 0x48, 0x0f, 0xbf, 0x08 }, 4,
+      { 0, SvMmioMovSx, 4, 2, 8, 1, FALSE, FALSE, FALSE, FALSE } },
+    { "movsxd rdx, dword [rax]", { 0x48, 0x63, 0x10 }, 3,
+      { 0, SvMmioMovSx, 3, 4, 8, 2, FALSE, FALSE, FALSE, FALSE } },
+    { "mov eax, [moffs64]", { 0xa1, 0, 0, 0, 0, 0, 0, 0, 0 }, 9,
+      { 0, SvMmioMov, 9, 4, 4, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov rax, [moffs64]", { 0x48, 0xa1, 0, 0, 0, 0, 0, 0, 0, 0 }, 10,
+      { 0, SvMmioMov, 10, 8, 8, 0, FALSE, FALSE, FALSE, FALSE } },
+    { "mov [moffs32], al", { 0x67, 0xa2, 0, 0, 0, 0 }, 6,
+      { 0, SvMmioMov, 6, 1, 1, 0, FALSE, TRUE, FALSE, TRUE } },
+    { "stosb", { 0xaa }, 1,
+      { 0, SvMmioStos, 1, 1, 1, 0, FALSE, TRUE, FALSE, FALSE } },
+    { "rep stosq", { 0xf3, 0x48, 0xab }, 3,
+      { 0, SvMmioStos, 3, 8, 8, 0, FALSE, TRUE, TRUE, FALSE } },
+    { "rep stosd [edi]", { 0xf3, 0x67, 0xab }, 3,
+      { 0, SvMmioStos, 3, 4, 4, 0, FALSE, TRUE, TRUE, TRUE } },
+
+    { "mov eax, eax", { 0x8b, 0xc0 }, 2, {} },
+    { "movsxd edx, dword [rax]", { 0x63, 0x10 }, 2, {} },
+    { "mov dword [rax] with /1", { 0xc7, 0x08, 0, 0, 0, 0 }, 6, {} },
+    { "bsf eax, [rax]", { 0x0f, 0xbc, 0x00 }, 3, {} },
+    { "add eax, [rax]", { 0x03, 0x00 }, 2, {} },
+    { "nop", { 0x90 }, 1, {} },
+    { "empty", {}, 0, {} },
+    { "prefixes only", { 0x66, 0x67, 0xf3 }, 3, {} },
+    { "0f only", { 0x0f }, 1, {} },
+    { "SIB missing", { 0x8b, 0x04 }, 2, {} },
+    { "disp32 truncated", { 0x8b, 0x80, 0x00, 0x00 }, 4, {} },
+    { "disp8 missing", { 0x8b, 0x40 }, 2, {} },
+    { "imm32 truncated", { 0xc7, 0x00, 0x78, 0x56 }, 4, {} },
+    { "moffs64 truncated", { 0xa1, 0, 0, 0 }, 4, {} },
+};
+
+static
+VOID
+TestCorpus (
+    VOID
+    )
+{
+    SV_MMIO_INSTRUCTION instruction;
+    const SV_MMIO_INSTRUCTION* expected;
+    BOOLEAN decoded;
+    int failures;
+
+    for (const TEST_INSTRUCTION& test : k_Corpus)
+    {
+        expected = &test.Expected;
+        decoded = SvDecodeMmioInstruction(test.Bytes, test.BytesLength, &instruction);
+        if (expected->Length == 0)
+        {
+            if (decoded != FALSE)
+            {
+                fprintf(stderr, "%s: decoded\n", test.Text);
+            }
+            SV_CHECK(decoded == FALSE);
+            continue;
+        }
+
+        if (decoded == FALSE)
+        {
+            fprintf(stderr, "%s: not decoded\n", test.Text);
+        }
+        SV_CHECK(decoded != FALSE);
+        if (decoded == FALSE)
+        {
+            continue;
+        }
+        failures = g_Failures;
+        SV_CHECK(instruction.Immediate == expected->Immediate);
+        SV_CHECK(instruction.Kind == expected->Kind);
+        SV_CHECK(instruction.Length == expected->Length);
+        SV_CHECK(instruction.AccessSize == expected->AccessSize);
+        SV_CHECK(instruction.RegisterSize == expected->RegisterSize);
+        SV_CHECK(instruction.Register == expected->Register);
+        SV_CHECK(instruction.HighByteRegister == expected->HighByteRegister);
+        SV_CHECK(instruction.IsWrite == expected->IsWrite);
+        SV_CHECK(instruction.Rep == expected->Rep);
+        SV_CHECK(instruction.AddressSize32 == expected->AddressSize32);
+        if (g_Failures != failures)
+        {
+            fprintf(stderr, "%s: decoded differently\n", test.Text);
+        }
+    }
+}
+
+static
+VOID
+TestInstructionLengthLimit (
+    VOID
+    )
+{
+    UINT8 bytes[20];
+    SV_MMIO_INSTRUCTION instruction;
+
+    //
+    // 13 prefixes and a 2-byte instruction make 15 bytes, the longest
+    // possible.
+    //
+    memset(bytes, 0x2e, sizeof(bytes));
+    bytes[13] = 0x8b;
+    bytes[14] = 0x00;
+    SV_CHECK(SvDecodeMmioInstruction(bytes, sizeof(bytes), &instruction));
+    SV_CHECK(instruction.Length == 15);
+
+    //
+    // Bytes beyond the 15th are never looked at.
+    //
+    bytes[13] = 0x2e;
+    bytes[14] = 0x2e;
+    bytes[15] = 0x8b;
+    bytes[16] = 0x00;
+    SV_CHECK(!SvDecodeMmioInstruction(bytes, sizeof(bytes), &instruction));
+}
+
+static
+VOID
+TestRandomBytes (
+    VOID
+    )
+{
+    UINT8 bytes[SV_MAX_INSTRUCTION_LENGTH];
+    UINT8* copy;
+    UINT32 seed, length;
+    SV_MMIO_INSTRUCTION instruction;
+
+    //
+    // Whatever the bytes are, a decoded instruction fits in them and is
+    // well-formed. Each input is copied to the end of a heap block of its
+    // exact size, so an over-read is caught by memory checkers.
+    //
+    seed = 1;
+    for (UINT32 i = 0; i < 200000; i++)
+    {
+        length = i % (SV_MAX_INSTRUCTION_LENGTH + 1);
+        for (UINT32 j = 0; j < length; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            bytes[j] = static_cast<UINT8>(seed >> 16);
+        }
+
+        copy = new UINT8[length + 1] + 1;
+        memcpy(copy, bytes, length);
+        if (SvDecodeMmioInstruction(copy, length, &instruction) != FALSE)
+        {
+            SV_CHECK(instruction.Length != 0);
+            SV_CHECK(instruction.Length <= length);
+            SV_CHECK((instruction.AccessSize == 1) || (instruction.AccessSize == 2) ||
+                     (instruction.AccessSize == 4) || (instruction.AccessSize == 8));
+            SV_CHECK(instruction.RegisterSize >= instruction.AccessSize);
+            SV_CHECK(instruction.Register < 16);
+        }
+        delete[] (copy - 1);
+    }
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestCorpus();
+    TestInstructionLengthLimit();
+    TestRandomBytes();
+    return g_Failures;
+}
@@ -0,0 +1,99 @@
+/*!
+    @file       MsrPermissionsMapTest.cpp
+
+    @brief      Tests of the MSRPM helpers.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "MsrPermissionsMap.hpp"
+#include "TestCommon.hpp"
+
+//
+// A policy shaped like the ones of SimpleSvm.cpp.
+//
+typedef struct _TEST_POLICY
+{
+    static constexpr UINT32 ReadInterceptedMsrs[] = { SVM_MSR_VM_HSAVE_PA, };
+    static constexpr UINT32 WriteInterceptedMsrs[] = { 0xc0000080, SVM_MSR_VM_HSAVE_PA, };
+} TEST_POLICY;
+
+static
+VOID
+TestGetMsrPermissionsMapOffset (
+    VOID
+    )
+{
+    UINT32 offset;
+
+    //
+    // Each range is 2KB of the map, two bits per MSR. See "MSR Ranges Covered
+    // by MSRPM".
+    //
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0x00000000, &offset) && (offset == 0));
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0x00001fff, &offset) && (offset == 0x3ffe));
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0xc0000000, &offset) && (offset == 0x4000));
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0xc0000080, &offset) && (offset == 0x4100));
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0xc0010000, &offset) && (offset == 0x8000));
+    SV_CHECK(SvGetMsrPermissionsMapOffset(0xc0011fff, &offset) && (offset == 0xbffe));
+
+    SV_CHECK(!SvGetMsrPermissionsMapOffset(0x00002000, &offset) && (offset == 0));
+    SV_CHECK(!SvGetMsrPermissionsMapOffset(0xbfffffff, &offset));
+    SV_CHECK(!SvGetMsrPermissionsMapOffset(0xc0002000, &offset));
+    SV_CHECK(!SvGetMsrPermissionsMapOffset(0xc0012000, &offset));
+    SV_CHECK(!SvGetMsrPermissionsMapOffset(0xffffffff, &offset));
+}
+
+static
+VOID
+TestBuildMsrPermissionsMap (
+    VOID
+    )
+{
+    static UINT8 map[SVM_MSR_PERMISSIONS_MAP_SIZE];
+    UINT32 bits;
+
+    for (UINT32 i = 0; i < sizeof(map); i++)
+    {
+        map[i] = 0xff;
+    }
+    SvBuildMsrPermissionsMap<TEST_POLICY>(map);
+
+    //
+    // Only the three bits of the policy are set.
+    //
+    bits = 0;
+    for (UINT32 i = 0; i < sizeof(map); i++)
+    {
+        for (UINT8 b = map[i]; b != 0; b &= b - 1)
+        {
+            bits++;
+        }
+    }
+    SV_CHECK(bits == 3);
+    SV_CHECK(!SvIsMsrIntercepted(map, 0xc0000080, FALSE));
+    SV_CHECK(SvIsMsrIntercepted(map, 0xc0000080, TRUE));
+    SV_CHECK(SvIsMsrIntercepted(map, SVM_MSR_VM_HSAVE_PA, FALSE));
+    SV_CHECK(SvIsMsrIntercepted(map, SVM_MSR_VM_HSAVE_PA, TRUE));
+    SV_CHECK(!SvIsMsrIntercepted(map, 0xc0000081, TRUE));
+
+    //
+    // MSRs outside the ranges cannot be set, and are always intercepted.
+    //
+    SV_CHECK(SvInterceptMsr(map, 0x00000010, FALSE));
+    SV_CHECK(SvIsMsrIntercepted(map, 0x00000010, FALSE));
+    SV_CHECK(!SvIsMsrIntercepted(map, 0x00000010, TRUE));
+    SV_CHECK(!SvInterceptMsr(map, 0x40000000, TRUE));
+    SV_CHECK(SvIsMsrIntercepted(map, 0x40000000, FALSE));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestGetMsrPermissionsMapOffset();
+    TestBuildMsrPermissionsMap();
+    return g_Failures;
+}
@@ -0,0 +1,81 @@
+/*!
+    @file       NestedPageTablesTest.cpp
+
+    @brief      Tests of building the identity nested page tables.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "NestedPageTables.hpp"
+#include "TestCommon.hpp"
+
+#include <string.h>
+
+#define TEST_NPT_BASE_PA    0x12340000ULL
+
+static SV_NESTED_PAGE_TABLES g_Npt;
+static SV_NESTED_PAGE_TABLES g_NptWithBitFields;
+
+static
+VOID
+TestLayout (
+    VOID
+    )
+{
+    SV_CHECK(offsetof(SV_NESTED_PAGE_TABLES, Root.Pml4Entries) == 0);
+    SV_CHECK(offsetof(SV_NESTED_PAGE_TABLES, Root.PdpEntries) == 0x1000);
+    SV_CHECK(offsetof(SV_NESTED_PAGE_TABLES, PdeEntries) == 0x2000);
+    SV_CHECK(sizeof(SV_NESTED_PAGE_TABLES) == 0x2000 + 512 * 0x1000);
+}
+
+static
+VOID
+TestBuildNestedPageTables (
+    VOID
+    )
+{
+    //
+    // Valid, Write and User, plus LargePage for page directory entries.
+    //
+    static const UINT64 tableBits = 0x7;
+    static const UINT64 largePageBits = 0x87;
+
+    memset(&g_Npt, 0xff, sizeof(g_Npt));
+    SvBuildNestedPageTables(&g_Npt, TEST_NPT_BASE_PA);
+
+    SV_CHECK(g_Npt.Root.Pml4Entries[0].AsUInt64 == ((TEST_NPT_BASE_PA + 0x1000) | tableBits));
+    SV_CHECK(g_Npt.Root.PdpEntries[0].AsUInt64 == ((TEST_NPT_BASE_PA + 0x2000) | tableBits));
+    SV_CHECK(g_Npt.Root.PdpEntries[511].AsUInt64 ==
+             ((TEST_NPT_BASE_PA + 0x2000 + 511 * 0x1000) | tableBits));
+    SV_CHECK(g_Npt.PdeEntries[0][0].AsUInt64 == largePageBits);
+    SV_CHECK(g_Npt.PdeEntries[0][1].AsUInt64 == (SV_LARGE_PAGE_SIZE | largePageBits));
+    SV_CHECK(g_Npt.PdeEntries[1][0].AsUInt64 == ((512 * SV_LARGE_PAGE_SIZE) | largePageBits));
+    SV_CHECK(g_Npt.PdeEntries[511][511].AsUInt64 ==
+             ((512ULL * 512 - 1) * SV_LARGE_PAGE_SIZE | largePageBits));
+
+    //
+    // The raw entries are exactly what the bit fields used to build.
+    //
+    memset(&g_NptWithBitFields, 0xff, sizeof(g_NptWithBitFields));
+    SvBuildNestedPageTablesWithBitFields(&g_NptWithBitFields, TEST_NPT_BASE_PA);
+    SV_CHECK(memcmp(&g_Npt.Root.Pml4Entries,
+                    &g_NptWithBitFields.Root.Pml4Entries,
+                    sizeof(g_Npt.Root.Pml4Entries)) == 0);
+    SV_CHECK(memcmp(&g_Npt.Root.PdpEntries,
+                    &g_NptWithBitFields.Root.PdpEntries,
+                    sizeof(g_Npt.Root.PdpEntries)) == 0);
+    SV_CHECK(memcmp(&g_Npt.PdeEntries,
+                    &g_NptWithBitFields.PdeEntries,
+                    sizeof(g_Npt.PdeEntries)) == 0);
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestLayout();
+    TestBuildNestedPageTables();
+    return g_Failures;
+}
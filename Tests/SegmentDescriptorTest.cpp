@@ -0,0 +1,68 @@
+/*!
+    @file       SegmentDescriptorTest.cpp
+
+    @brief      Tests of extracting segment attributes from a synthetic GDT.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "SegmentDescriptor.hpp"
+#include "TestCommon.hpp"
+
+static
+VOID
+TestGetSegmentAccessRight (
+    VOID
+    )
+{
+    //
+    // The GDT of 64-bit Windows: null, 32-bit code (0x08), 64-bit kernel code
+    // (0x10), kernel data (0x18), 32-bit user code (0x20, DPL 3), user data
+    // (0x28, DPL 3), and 64-bit user code (0x30, DPL 3).
+    //
+    static const UINT64 gdt[] =
+    {
+        0x0000000000000000ULL,
+        0x00cf9b000000ffffULL,
+        0x00209b0000000000ULL,
+        0x00cf93000000ffffULL,
+        0x00cffb000000ffffULL,
+        0x00cff3000000ffffULL,
+        0x0020fb0000000000ULL,
+    };
+    ULONG_PTR gdtBase;
+    SEGMENT_ATTRIBUTE attribute;
+
+    gdtBase = reinterpret_cast<ULONG_PTR>(gdt);
+
+    SV_CHECK(SvGetSegmentAccessRight(0x10, gdtBase) == 0x29b);
+    SV_CHECK(SvGetSegmentAccessRight(0x18, gdtBase) == 0xc93);
+    SV_CHECK(SvGetSegmentAccessRight(0x08, gdtBase) == 0xc9b);
+
+    //
+    // RPL is ignored, so the user selectors locate the same descriptors.
+    //
+    SV_CHECK(SvGetSegmentAccessRight(0x2b, gdtBase) == SvGetSegmentAccessRight(0x28, gdtBase));
+    SV_CHECK(SvGetSegmentAccessRight(0x33, gdtBase) == 0x2fb);
+
+    attribute.AsUInt16 = SvGetSegmentAccessRight(0x2b, gdtBase);
+    SV_CHECK(attribute.Fields.Dpl == 3);
+    SV_CHECK(attribute.Fields.Present == 1);
+    SV_CHECK(attribute.Fields.DefaultBit == 1);
+    SV_CHECK(attribute.Fields.Granularity == 1);
+    attribute.AsUInt16 = SvGetSegmentAccessRight(0x10, gdtBase);
+    SV_CHECK(attribute.Fields.Dpl == DPL_SYSTEM);
+    SV_CHECK(attribute.Fields.LongMode == 1);
+
+    SV_CHECK(SvGetSegmentAccessRight(0, gdtBase) == 0);
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestGetSegmentAccessRight();
+    return g_Failures;
+}
@@ -0,0 +1,134 @@
+/*!
+    @file       SeqlockTest.cpp
+
+    @brief      Tests of the seqlock that protects the statistics region, with
+                a writer and a reader running concurrently.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#include "ControlInterface.hpp"
+#include "TestCommon.hpp"
+
+#include <atomic>
+#include <thread>
+
+//
+// A seqlock protected structure. The writer sets all values to the same
+// number, so a copy with different values is torn.
+//
+#define TEST_VALUES     64
+
+typedef struct _TEST_STRUCTURE
+{
+    volatile UINT32 Sequence;
+    UINT32 Reserved;
+    UINT64 Values[TEST_VALUES];
+} TEST_STRUCTURE;
+
+static
+VOID
+TestSingleThreaded (
+    VOID
+    )
+{
+    static TEST_STRUCTURE shared, copy;
+
+    for (UINT32 i = 0; i < TEST_VALUES; i++)
+    {
+        shared.Values[i] = i;
+    }
+    SV_CHECK(SvReadSeqlockProtected(&shared, &copy, sizeof(copy), 0));
+    SV_CHECK(copy.Values[TEST_VALUES - 1] == TEST_VALUES - 1);
+
+    //
+    // Reading fails while the writer is in the middle of an update.
+    //
+    SvBeginSeqlockWrite(&shared.Sequence);
+    SV_CHECK((shared.Sequence & 1) != 0);
+    SV_CHECK(!SvReadSeqlockProtected(&shared, &copy, sizeof(copy), 16));
+    SvEndSeqlockWrite(&shared.Sequence);
+    SV_CHECK(shared.Sequence == 2);
+    SV_CHECK(SvReadSeqlockProtected(&shared, &copy, sizeof(copy), 0));
+}
+
+static
+VOID
+TestConcurrent (
+    VOID
+    )
+{
+    static TEST_STRUCTURE shared;
+    std::atomic<bool> done(false);
+    UINT64 consistentReads, failedReads, lastValue;
+    TEST_STRUCTURE copy;
+    BOOLEAN torn;
+
+    //
+    // The writer updates the structure as the hypervisor does, through
+    // volatile accesses so that the compiler emits every store.
+    //
+    std::thread writer([&]()
+    {
+        volatile UINT64* values = shared.Values;
+
+        for (UINT64 value = 1; value <= 2000000; value++)
+        {
+            SvBeginSeqlockWrite(&shared.Sequence);
+            for (UINT32 i = 0; i < TEST_VALUES; i++)
+            {
+                values[i] = value;
+            }
+            SvEndSeqlockWrite(&shared.Sequence);
+        }
+        done = true;
+    });
+
+    consistentReads = failedReads = lastValue = 0;
+    torn = FALSE;
+    while (!done)
+    {
+        if (SvReadSeqlockProtected(&shared, &copy, sizeof(copy), 16) == FALSE)
+        {
+            failedReads++;
+            continue;
+        }
+        consistentReads++;
+
+        SV_CHECK((copy.Sequence & 1) == 0);
+        for (UINT32 i = 1; i < TEST_VALUES; i++)
+        {
+            if (copy.Values[i] != copy.Values[0])
+            {
+                torn = TRUE;
+            }
+        }
+
+        //
+        // The writer only moves forward.
+        //
+        SV_CHECK(copy.Values[0] >= lastValue);
+        lastValue = copy.Values[0];
+    }
+    writer.join();
+
+    SV_CHECK(torn == FALSE);
+    SV_CHECK(consistentReads != 0);
+    SV_CHECK(SvReadSeqlockProtected(&shared, &copy, sizeof(copy), 0));
+    SV_CHECK(copy.Values[0] == 2000000);
+    SV_CHECK(copy.Sequence == 2 * 2000000);
+    printf("%llu consistent reads, %llu reads gave up\n",
+           static_cast<unsigned long long>(consistentReads),
+           static_cast<unsigned long long>(failedReads));
+}
+
+int
+main (
+    VOID
+    )
+{
+    TestSingleThreaded();
+    TestConcurrent();
+    return g_Failures;
+}
@@ -0,0 +1,29 @@
+/*!
+    @file       TestCommon.hpp
+
+    @brief      Minimal helpers shared by the tests.
+
+    @author     Satoshi Tanda
+
+    @copyright  Copyright (c) 2017-2020, Satoshi Tanda. All rights reserved.
+ */
+#pragma once
+
+#include <stdio.h>
+
+//
+// The number of failed checks. Each test returns it from main, so ctest fails
+// the test when any check fails.
+//
+inline int g_Failures;
+
+#define SV_CHECK(Condition)                                             \
+    do                                                                  \
+    {                                                                   \
+        if (!(Condition))                                               \
+        {                                                               \
+            fprintf(stderr, "%s(%d): check failed: %s\n",               \
+                    __FILE__, __LINE__, #Condition);                    \
+            g_Failures++;                                               \
+        }                                                               \
+    } while (0)